@@ -53,7 +53,10 @@ LOCAL_SRC_FILES := \
 	$(MY_ROOT)/fitz/image_png.c \
 	$(MY_ROOT)/fitz/image_tiff.c \
 	$(MY_ROOT)/fitz/res_colorspace.c \
+	$(MY_ROOT)/fitz/res_diskcache.c \
 	$(MY_ROOT)/fitz/res_font.c \
+	$(MY_ROOT)/fitz/res_glyph.c \
+	$(MY_ROOT)/fitz/res_image.c \
 	$(MY_ROOT)/fitz/res_path.c \
 	$(MY_ROOT)/fitz/res_pixmap.c \
 	$(MY_ROOT)/fitz/res_shade.c \
@@ -84,8 +87,10 @@ LOCAL_SRC_FILES := \
 	$(MY_ROOT)/pdf/pdf_fontfile.c \
 	$(MY_ROOT)/pdf/pdf_function.c \
 	$(MY_ROOT)/pdf/pdf_image.c \
+	$(MY_ROOT)/pdf/pdf_index.c \
 	$(MY_ROOT)/pdf/pdf_interpret.c \
 	$(MY_ROOT)/pdf/pdf_lex.c \
+	$(MY_ROOT)/pdf/pdf_linear.c \
 	$(MY_ROOT)/pdf/pdf_metrics.c \
 	$(MY_ROOT)/pdf/pdf_nametree.c \
 	$(MY_ROOT)/pdf/pdf_outline.c \
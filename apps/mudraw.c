@@ -46,7 +46,7 @@ static void usage(void)
 		"\t-a\tsave alpha channel (only pam and png)\n"
 		"\t-b -\tnumber of bits of antialiasing (0 to 8)\n"
 		"\t-g\trender in grayscale\n"
-		"\t-m\tshow timing information\n"
+		"\t-m\tshow timing information and cache statistics\n"
 		"\t-t\tshow text (-tt for xml)\n"
 		"\t-x\tshow display list\n"
 		"\t-d\tdisable use of display list\n"
@@ -54,6 +54,7 @@ static void usage(void)
 		"\t-R -\trotate clockwise by given number of degrees\n"
 		"\t-G gamma\tgamma correct output\n"
 		"\t-I\tinvert output\n"
+		"\t-D -\tdirectory for caching decoded images between runs\n"
 		"\t-l\tprint outline\n"
 		"\tpages\tcomma separated list of ranges\n");
 	exit(1);
@@ -363,6 +364,7 @@ int main(int argc, char **argv)
 #endif
 {
 	char *password = "";
+	char *cachedir = NULL;
 	int grayscale = 0;
 	fz_document *doc = NULL;
 	int c;
@@ -370,7 +372,7 @@ int main(int argc, char **argv)
 
 	fz_var(doc);
 
-	while ((c = fz_getopt(argc, argv, "lo:p:r:R:ab:dgmtx5G:I")) != -1)
+	while ((c = fz_getopt(argc, argv, "lo:p:r:R:ab:dgmtx5G:ID:")) != -1)
 	{
 		switch (c)
 		{
@@ -389,6 +391,7 @@ int main(int argc, char **argv)
 		case 'd': uselist = 0; break;
 		case 'G': gamma_value = atof(fz_optarg); break;
 		case 'I': invert++; break;
+		case 'D': cachedir = fz_optarg; break;
 		default: usage(); break;
 		}
 	}
@@ -411,6 +414,18 @@ int main(int argc, char **argv)
 
 	fz_set_aa_level(ctx, alphabits);
 
+	if (cachedir)
+	{
+		fz_try(ctx)
+		{
+			fz_new_disk_cache_context(ctx, cachedir, FZ_DISK_CACHE_DEFAULT);
+		}
+		fz_catch(ctx)
+		{
+			fz_warn(ctx, "cannot use disk cache %s", cachedir);
+		}
+	}
+
 	colorspace = fz_device_rgb;
 	if (grayscale)
 		colorspace = fz_device_gray;
@@ -482,6 +497,8 @@ int main(int argc, char **argv)
 			timing.total, timing.count, timing.total / timing.count);
 		printf("fastest page %d: %dms\n", timing.minpage, timing.min);
 		printf("slowest page %d: %dms\n", timing.maxpage, timing.max);
+		fz_print_store_stats(ctx, stdout);
+		fz_print_glyph_cache_stats(ctx, stdout);
 	}
 
 	fz_free_context(ctx);
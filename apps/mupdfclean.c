@@ -5,6 +5,8 @@
  * Garbage collect unreachable objects.
  * Inflate compressed streams.
  * Create subset documents.
+ * Append changes to the original file as an incremental update.
+ * Pack objects into object streams and write an xref stream.
  *
  * TODO: linearize document for fast web view
  */
@@ -29,6 +31,8 @@ static int *renumbermap = NULL;
 static int dogarbage = 0;
 static int doexpand = 0;
 static int doascii = 0;
+static int doincremental = 0;
+static int doobjstms = 0;
 
 static pdf_document *xref = NULL;
 static fz_context *ctx = NULL;
@@ -45,6 +49,9 @@ static void usage(void)
 		"\t-i\ttoggle decompression of image streams\n"
 		"\t-f\ttoggle decompression of font streams\n"
 		"\t-a\tascii hex encode binary streams\n"
+		"\t-z\tpack objects into object streams and write an xref stream\n"
+		"\t-u\tincremental update: append changed objects to the input\n"
+		"\t\tfile, or to a copy of it if output.pdf is given\n"
 		"\tpages\tcomma separated list of ranges\n");
 	exit(1);
 }
@@ -112,57 +119,111 @@ static void sweepref(fz_obj *obj)
 }
 
 /*
- * Scan for and remove duplicate objects (slow)
+ * Scan for and remove duplicate objects
  */
 
+/* Load an object for comparison; for a stream, its dictionary without
+ * the /Length (which may be an indirect object of its own) and its raw
+ * data. */
+static fz_obj *loaddupobj(int num, fz_buffer **stmbuf)
+{
+	int gen = xref->table[num].gen;
+	fz_obj *obj;
+
+	pdf_cache_object(xref, num, gen);
+	obj = fz_resolve_indirect(xref->table[num].obj);
+	if (!pdf_is_stream(xref, num, gen))
+		return fz_keep_obj(obj);
+
+	obj = fz_copy_dict(ctx, obj);
+	fz_dict_dels(obj, "Length");
+	fz_try(ctx)
+	{
+		*stmbuf = pdf_load_raw_stream(xref, num, gen);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_obj(obj);
+		fz_rethrow(ctx);
+	}
+	return obj;
+}
+
+static int samedupobj(fz_obj *a, fz_buffer *abuf, fz_obj *b, fz_buffer *bbuf)
+{
+	if (fz_objcmp(a, b))
+		return 0;
+	if (!abuf || !bbuf)
+		return !abuf && !bbuf;
+	return abuf->len == bbuf->len && !memcmp(abuf->data, bbuf->data, abuf->len);
+}
+
 static void removeduplicateobjs(void)
 {
-	int num, other;
+	fz_hash_table *table;
+	fz_obj *obj, *otherobj;
+	fz_buffer *buf, *otherbuf;
+	unsigned char digest[16];
+	fz_md5 md5;
+	int num, *found;
+
+	/* Map the digest of each object to the first (lowest numbered)
+	 * object with that digest. Its renumbermap entry holds its number. */
+	table = fz_new_hash_table(ctx, xref->len, sizeof digest);
+
+	fz_var(obj);
+	fz_var(otherobj);
+	fz_var(buf);
+	fz_var(otherbuf);
 
 	for (num = 1; num < xref->len; num++)
 	{
-		/* Only compare an object to objects preceding it */
-		for (other = 1; other < num; other++)
-		{
-			fz_obj *a, *b;
+		if (!uselist[num])
+			continue;
 
-			if (num == other || !uselist[num] || !uselist[other])
-				continue;
+		obj = otherobj = NULL;
+		buf = otherbuf = NULL;
 
-			/*
-			 * Comparing stream objects data contents would take too long.
-			 *
-			 * pdf_is_stream calls pdf_cache_object and ensures
-			 * that the xref table has the objects loaded.
-			 */
-			fz_try(ctx)
-			{
-				if (pdf_is_stream(xref, num, 0) || pdf_is_stream(xref, other, 0))
-					continue;
-			}
-			fz_catch(ctx)
+		fz_try(ctx)
+		{
+			obj = loaddupobj(num, &buf);
+
+			fz_md5_init(&md5);
+			fz_md5_obj(&md5, obj);
+			fz_md5_update(&md5, (unsigned char *)(buf ? "s" : "o"), 1);
+			if (buf)
+				fz_md5_update(&md5, buf->data, buf->len);
+			fz_md5_final(&md5, digest);
+
+			found = fz_hash_find(ctx, table, digest);
+			if (!found)
+				fz_hash_insert(ctx, table, digest, &renumbermap[num]);
+			else
 			{
-				/* Assume different */
+				/* Digests match; make sure the objects do too */
+				otherobj = loaddupobj(*found, &otherbuf);
+				if (samedupobj(obj, buf, otherobj, otherbuf))
+				{
+					/* Keep the lowest numbered object */
+					renumbermap[num] = *found;
+					uselist[num] = 0;
+				}
 			}
-
-			a = xref->table[num].obj;
-			b = xref->table[other].obj;
-
-			a = fz_resolve_indirect(a);
-			b = fz_resolve_indirect(b);
-
-			if (fz_objcmp(a, b))
-				continue;
-
-			/* Keep the lowest numbered object */
-			renumbermap[num] = MIN(num, other);
-			renumbermap[other] = MIN(num, other);
-			uselist[MAX(num, other)] = 0;
-
-			/* One duplicate was found, do not look for another */
-			break;
+		}
+		fz_always(ctx)
+		{
+			fz_drop_obj(obj);
+			fz_drop_obj(otherobj);
+			fz_drop_buffer(ctx, buf);
+			fz_drop_buffer(ctx, otherbuf);
+		}
+		fz_catch(ctx)
+		{
+			/* Assume different */
 		}
 	}
+
+	fz_free_hash(ctx, table);
 }
 
 /*
@@ -304,6 +365,8 @@ static void retainpages(int argc, char **argv)
 {
 	fz_obj *oldroot, *root, *pages, *kids, *countobj, *parent, *olddests;
 
+	pdf_load_page_tree(xref);
+
 	/* Keep only pages/type and (reduced) dest entries to avoid
 	 * references to unretained pages */
 	oldroot = fz_dict_gets(xref->trailer, "Root");
@@ -360,7 +423,11 @@ static void retainpages(int argc, char **argv)
 				fz_obj *pageobj = xref->page_objs[page-1];
 				fz_obj *pageref = xref->page_refs[page-1];
 
-				fz_dict_puts(pageobj, "Parent", parent);
+				if (fz_objcmp(fz_dict_gets(pageobj, "Parent"), parent))
+				{
+					fz_dict_puts(pageobj, "Parent", parent);
+					pdf_update_object(xref, fz_to_num(pageref), fz_to_gen(pageref), pageobj);
+				}
 
 				/* Store page object in new kids array */
 				fz_array_push(kids, pageref);
@@ -380,6 +447,7 @@ static void retainpages(int argc, char **argv)
 	fz_drop_obj(countobj);
 	fz_dict_puts(pages, "Kids", kids);
 	fz_drop_obj(kids);
+	pdf_update_object(xref, fz_to_num(pages), fz_to_gen(pages), fz_resolve_indirect(pages));
 
 	/* Also preserve the (partial) Dests name tree */
 	if (olddests)
@@ -655,28 +723,14 @@ static void writeobject(int num, int gen)
 	fz_drop_obj(obj);
 }
 
-static void writexref(void)
+static fz_obj *newtrailer(int size)
 {
 	fz_obj *trailer;
 	fz_obj *obj;
-	int startxref;
-	int num;
-
-	startxref = ftell(out);
-
-	fprintf(out, "xref\n0 %d\n", xref->len);
-	for (num = 0; num < xref->len; num++)
-	{
-		if (uselist[num])
-			fprintf(out, "%010d %05d n \n", ofslist[num], genlist[num]);
-		else
-			fprintf(out, "%010d %05d f \n", ofslist[num], genlist[num]);
-	}
-	fprintf(out, "\n");
 
 	trailer = fz_new_dict(ctx, 5);
 
-	obj = fz_new_int(ctx, xref->len);
+	obj = fz_new_int(ctx, size);
 	fz_dict_puts(trailer, "Size", obj);
 	fz_drop_obj(obj);
 
@@ -692,6 +746,56 @@ static void writexref(void)
 	if (obj)
 		fz_dict_puts(trailer, "ID", obj);
 
+	return trailer;
+}
+
+static void writexref(void)
+{
+	fz_obj *trailer;
+	fz_obj *obj;
+	int startxref;
+	int num, next;
+
+	startxref = ftell(out);
+
+	if (doincremental)
+	{
+		/* Only list the objects written, in runs of consecutive numbers */
+		fprintf(out, "xref\n");
+		for (num = 0; num < xref->len; num = next)
+		{
+			next = num + 1;
+			if (!uselist[num])
+				continue;
+			while (next < xref->len && uselist[next])
+				next++;
+			fprintf(out, "%d %d\n", num, next - num);
+			for (; num < next; num++)
+				fprintf(out, "%010d %05d n \n", ofslist[num], genlist[num]);
+		}
+	}
+	else
+	{
+		fprintf(out, "xref\n0 %d\n", xref->len);
+		for (num = 0; num < xref->len; num++)
+		{
+			if (uselist[num])
+				fprintf(out, "%010d %05d n \n", ofslist[num], genlist[num]);
+			else
+				fprintf(out, "%010d %05d f \n", ofslist[num], genlist[num]);
+		}
+	}
+	fprintf(out, "\n");
+
+	trailer = newtrailer(xref->len);
+
+	if (doincremental)
+	{
+		obj = fz_new_int(ctx, xref->startxref);
+		fz_dict_puts(trailer, "Prev", obj);
+		fz_drop_obj(obj);
+	}
+
 	fprintf(out, "trailer\n");
 	fz_fprint_obj(out, trailer, doexpand == 0);
 	fprintf(out, "\n");
@@ -701,10 +805,160 @@ static void writexref(void)
 	fprintf(out, "startxref\n%d\n%%%%EOF\n", startxref);
 }
 
+/*
+ * Object streams and xref streams. Objects packed into an object stream
+ * are marked with 2 in uselist, and have the number of the object
+ * stream and their index in it in ofslist and genlist.
+ */
+
+enum { OBJSTM_MAX = 100 };
+
+static int canpack(int num, int gen)
+{
+	/* Streams and objects with a generation cannot go in an object stream */
+	return gen == 0 && !pdf_is_stream(xref, num, gen);
+}
+
+static void bufputs(fz_buffer *buf, char *s, int n)
+{
+	if (buf->len + n > buf->cap)
+		fz_resize_buffer(ctx, buf, MAX(buf->cap * 2, buf->len + n));
+	memcpy(buf->data + buf->len, s, n);
+	buf->len += n;
+}
+
+static void bufputobj(fz_buffer *buf, fz_obj *obj)
+{
+	int n = fz_sprint_obj(NULL, 0, obj, 1);
+	if (buf->len + n + 1 > buf->cap)
+		fz_resize_buffer(ctx, buf, MAX(buf->cap * 2, buf->len + n + 1));
+	fz_sprint_obj((char *)buf->data + buf->len, n + 1, obj, 1);
+	buf->len += n;
+	buf->data[buf->len++] = '\n';
+}
+
+static void writeobjstm(int *list, int n, int stmnum)
+{
+	fz_buffer *head, *body, *zbuf;
+	fz_obj *obj;
+	char num[32];
+	int i, first;
+
+	head = fz_new_buffer(ctx, 1024);
+	body = fz_new_buffer(ctx, 4096);
+
+	for (i = 0; i < n; i++)
+	{
+		sprintf(num, "%d %d ", list[i], body->len);
+		bufputs(head, num, strlen(num));
+
+		obj = pdf_load_object(xref, list[i], 0);
+		bufputobj(body, obj);
+		fz_drop_obj(obj);
+
+		uselist[list[i]] = 2;
+		ofslist[list[i]] = stmnum;
+		genlist[list[i]] = i;
+	}
+
+	first = head->len;
+	bufputs(head, (char *)body->data, body->len);
+	zbuf = fz_deflate_buffer(ctx, head->data, head->len);
+
+	uselist[stmnum] = 1;
+	ofslist[stmnum] = ftell(out);
+	genlist[stmnum] = 0;
+
+	fprintf(out, "%d 0 obj\n<</Type/ObjStm/N %d/First %d/Filter/FlateDecode/Length %d>>\nstream\n",
+		stmnum, n, first, zbuf->len);
+	fwrite(zbuf->data, 1, zbuf->len, out);
+	fprintf(out, "\nendstream\nendobj\n\n");
+
+	fz_drop_buffer(ctx, zbuf);
+	fz_drop_buffer(ctx, body);
+	fz_drop_buffer(ctx, head);
+}
+
+/* The last object number is used for the xref stream itself */
+static void writexrefstm(int size)
+{
+	fz_buffer *buf, *zbuf;
+	fz_obj *trailer;
+	fz_obj *obj, *w;
+	unsigned char *p;
+	int startxref;
+	int num, ofs, gen;
+
+	startxref = ftell(out);
+	uselist[size - 1] = 1;
+	ofslist[size - 1] = startxref;
+	genlist[size - 1] = 0;
+
+	/* Entries are a type byte, four bytes of offset (or object
+	 * stream number) and two of generation (or index) */
+	buf = fz_new_buffer(ctx, size * 7);
+	for (num = 0; num < size; num++)
+	{
+		p = buf->data + num * 7;
+		ofs = ofslist[num];
+		gen = MIN(genlist[num], 65535);
+		p[0] = uselist[num] == 2 ? 2 : uselist[num] ? 1 : 0;
+		p[1] = ofs >> 24;
+		p[2] = ofs >> 16;
+		p[3] = ofs >> 8;
+		p[4] = ofs;
+		p[5] = gen >> 8;
+		p[6] = gen;
+	}
+	buf->len = size * 7;
+	zbuf = fz_deflate_buffer(ctx, buf->data, buf->len);
+	fz_drop_buffer(ctx, buf);
+
+	trailer = newtrailer(size);
+
+	obj = fz_new_name(ctx, "XRef");
+	fz_dict_puts(trailer, "Type", obj);
+	fz_drop_obj(obj);
+
+	w = fz_new_array(ctx, 3);
+	obj = fz_new_int(ctx, 1);
+	fz_array_push(w, obj);
+	fz_drop_obj(obj);
+	obj = fz_new_int(ctx, 4);
+	fz_array_push(w, obj);
+	fz_drop_obj(obj);
+	obj = fz_new_int(ctx, 2);
+	fz_array_push(w, obj);
+	fz_drop_obj(obj);
+	fz_dict_puts(trailer, "W", w);
+	fz_drop_obj(w);
+
+	obj = fz_new_name(ctx, "FlateDecode");
+	fz_dict_puts(trailer, "Filter", obj);
+	fz_drop_obj(obj);
+
+	obj = fz_new_int(ctx, zbuf->len);
+	fz_dict_puts(trailer, "Length", obj);
+	fz_drop_obj(obj);
+
+	fprintf(out, "%d 0 obj\n", size - 1);
+	fz_fprint_obj(out, trailer, doexpand == 0);
+	fprintf(out, "stream\n");
+	fwrite(zbuf->data, 1, zbuf->len, out);
+	fprintf(out, "\nendstream\nendobj\n\n");
+
+	fz_drop_obj(trailer);
+	fz_drop_buffer(ctx, zbuf);
+
+	fprintf(out, "startxref\n%d\n%%%%EOF\n", startxref);
+}
+
 static void writepdf(void)
 {
+	int *packlist = NULL;
+	int npack = 0;
 	int lastfree;
-	int num;
+	int num, size;
 
 	for (num = 0; num < xref->len; num++)
 	{
@@ -721,11 +975,39 @@ static void writepdf(void)
 		if (xref->table[num].type == 'n' || xref->table[num].type == 'o')
 		{
 			uselist[num] = 1;
+			if (doobjstms && canpack(num, genlist[num]))
+			{
+				if (!packlist)
+					packlist = fz_malloc_array(ctx, xref->len, sizeof(int));
+				packlist[npack++] = num;
+				continue;
+			}
 			ofslist[num] = ftell(out);
 			writeobject(num, genlist[num]);
 		}
 	}
 
+	size = xref->len;
+	if (doobjstms)
+	{
+		/* Number the object streams and the xref stream after
+		 * the existing objects */
+		size += (npack + OBJSTM_MAX - 1) / OBJSTM_MAX + 1;
+		uselist = fz_resize_array(ctx, uselist, size, sizeof(char));
+		ofslist = fz_resize_array(ctx, ofslist, size, sizeof(int));
+		genlist = fz_resize_array(ctx, genlist, size, sizeof(int));
+		for (num = xref->len; num < size; num++)
+		{
+			uselist[num] = 1;
+			ofslist[num] = 0;
+			genlist[num] = 0;
+		}
+
+		for (num = 0; num < npack; num += OBJSTM_MAX)
+			writeobjstm(packlist + num, MIN(OBJSTM_MAX, npack - num), xref->len + num / OBJSTM_MAX);
+		fz_free(ctx, packlist);
+	}
+
 	/* Construct linked list of free object slots */
 	lastfree = 0;
 	for (num = 0; num < xref->len; num++)
@@ -738,9 +1020,69 @@ static void writepdf(void)
 		}
 	}
 
+	if (doobjstms)
+		writexrefstm(size);
+	else
+		writexref();
+}
+
+/*
+ * Append the objects changed with pdf_update_object and an xref section
+ * for them, leaving the rest of the file as it is.
+ */
+
+static void writeincremental(void)
+{
+	int num, c;
+
+	for (num = 0; num < xref->len; num++)
+		if (xref->table[num].dirty)
+			break;
+	if (num == xref->len)
+		return;
+
+	/* Start on a new line */
+	fseek(out, -1, SEEK_END);
+	c = fgetc(out);
+	fseek(out, 0, SEEK_END);
+	if (c != '\n' && c != '\r')
+		fprintf(out, "\n");
+
+	for (num = 0; num < xref->len; num++)
+	{
+		if (!xref->table[num].dirty)
+			continue;
+		uselist[num] = 1;
+		genlist[num] = xref->table[num].gen;
+		ofslist[num] = ftell(out);
+		writeobject(num, genlist[num]);
+	}
+
 	writexref();
 }
 
+static void copyfile(char *src, char *dst)
+{
+	unsigned char buf[65536];
+	FILE *in, *cpy;
+	int n;
+
+	in = fopen(src, "rb");
+	if (!in)
+		fz_throw(ctx, "cannot open input file '%s'", src);
+	cpy = fopen(dst, "wb");
+	if (!cpy)
+		fz_throw(ctx, "cannot open output file '%s'", dst);
+	while ((n = fread(buf, 1, sizeof buf, in)) > 0)
+		if (fwrite(buf, 1, n, cpy) != n)
+			fz_throw(ctx, "cannot write output file '%s'", dst);
+	if (ferror(in))
+		fz_throw(ctx, "cannot read input file '%s'", src);
+	fclose(in);
+	if (fclose(cpy))
+		fz_throw(ctx, "cannot close output file '%s'", dst);
+}
+
 #ifdef MUPDF_COMBINED_EXE
 int pdfclean_main(int argc, char **argv)
 #else
@@ -748,12 +1090,13 @@ int main(int argc, char **argv)
 #endif
 {
 	char *infile;
-	char *outfile = "out.pdf";
+	char *outfile = NULL;
 	char *password = "";
 	int c, num;
 	int subset;
+	int version;
 
-	while ((c = fz_getopt(argc, argv, "adfgip:")) != -1)
+	while ((c = fz_getopt(argc, argv, "adfgip:uz")) != -1)
 	{
 		switch (c)
 		{
@@ -763,10 +1106,19 @@ int main(int argc, char **argv)
 		case 'f': doexpand ^= expand_fonts; break;
 		case 'i': doexpand ^= expand_images; break;
 		case 'a': doascii ++; break;
+		case 'u': doincremental ++; break;
+		case 'z': doobjstms ++; break;
 		default: usage(); break;
 		}
 	}
 
+	/* Only objects changed in place can be appended */
+	if (doincremental && (dogarbage || doexpand || doascii || doobjstms))
+	{
+		fprintf(stderr, "pdfclean: -u cannot be combined with -g, -d, -i, -f, -a or -z\n");
+		exit(1);
+	}
+
 	if (argc - fz_optind < 1)
 		usage();
 
@@ -778,6 +1130,9 @@ int main(int argc, char **argv)
 		outfile = argv[fz_optind++];
 	}
 
+	if (!outfile)
+		outfile = doincremental ? infile : "out.pdf";
+
 	subset = 0;
 	if (argc - fz_optind > 0)
 		subset = 1;
@@ -793,13 +1148,35 @@ int main(int argc, char **argv)
 	if (pdf_needs_password(xref))
 		if (!pdf_authenticate_password(xref, password))
 			fz_throw(ctx, "cannot authenticate password: %s\n", infile);
+	pdf_load_main_xref(xref);
 
-	out = fopen(outfile, "wb");
-	if (!out)
-		fz_throw(ctx, "cannot open output file '%s'", outfile);
-
-	fprintf(out, "%%PDF-%d.%d\n", xref->version / 10, xref->version % 10);
-	fprintf(out, "%%\316\274\341\277\246\n\n");
+	if (doincremental)
+	{
+		/* The original objects stay encrypted or broken */
+		if (xref->crypt)
+			fz_throw(ctx, "cannot incrementally update encrypted file '%s'", infile);
+		if (xref->repaired)
+			fz_throw(ctx, "cannot incrementally update broken file '%s'", infile);
+
+		if (strcmp(outfile, infile))
+			copyfile(infile, outfile);
+		out = fopen(outfile, "r+b");
+		if (!out)
+			fz_throw(ctx, "cannot open output file '%s'", outfile);
+	}
+	else
+	{
+		out = fopen(outfile, "wb");
+		if (!out)
+			fz_throw(ctx, "cannot open output file '%s'", outfile);
+
+		/* Object and xref streams need PDF 1.5 */
+		version = xref->version;
+		if (doobjstms && version < 15)
+			version = 15;
+		fprintf(out, "%%PDF-%d.%d\n", version / 10, version % 10);
+		fprintf(out, "%%\316\274\341\277\246\n\n");
+	}
 
 	uselist = fz_malloc_array(ctx, xref->len + 1, sizeof(char));
 	ofslist = fz_malloc_array(ctx, xref->len + 1, sizeof(int));
@@ -815,7 +1192,8 @@ int main(int argc, char **argv)
 	}
 
 	/* Make sure any objects hidden in compressed streams have been loaded */
-	preloadobjstms();
+	if (!doincremental)
+		preloadobjstms();
 
 	/* Only retain the specified subset of the pages */
 	if (subset)
@@ -826,7 +1204,8 @@ int main(int argc, char **argv)
 		sweepobj(xref->trailer);
 
 	/* Coalesce and renumber duplicate objects */
-	if (dogarbage >= 3)
+	/* The merged objects are only dropped from the references by renumbering */
+	if (dogarbage >= 3 && !xref->crypt)
 		removeduplicateobjs();
 
 	/* Compact xref by renumbering and removing unused objects */
@@ -840,7 +1219,10 @@ int main(int argc, char **argv)
 	if (dogarbage >= 2 && !xref->crypt)
 		renumberobjs();
 
-	writepdf();
+	if (doincremental)
+		writeincremental();
+	else
+		writepdf();
 
 	if (fclose(out))
 		fz_throw(ctx, "cannot close output file '%s'", outfile);
@@ -31,6 +31,7 @@ static int isfontdesc(fz_obj *obj)
 
 static void saveimage(int num)
 {
+	fz_image *image;
 	fz_pixmap *img;
 	fz_obj *ref;
 	char name[1024];
@@ -39,7 +40,9 @@ static void saveimage(int num)
 
 	/* TODO: detect DCTD and save as jpeg */
 
-	img = pdf_load_image(doc, ref);
+	image = pdf_load_image(doc, ref);
+	img = fz_image_to_pixmap(ctx, image, 0, 0, NULL);
+	fz_drop_image(ctx, image);
 
 	if (dorgb && img->colorspace && img->colorspace != fz_device_rgb)
 	{
@@ -193,11 +196,15 @@ int main(int argc, char **argv)
 	if (pdf_needs_password(doc))
 		if (!pdf_authenticate_password(doc, password))
 			fz_throw(ctx, "cannot authenticate password: %s\n", infile);
+	pdf_load_main_xref(doc);
 
 	if (fz_optind == argc)
 	{
 		for (o = 0; o < doc->len; o++)
+		{
 			showobject(o);
+			pdf_trim_object_cache(doc);
+		}
 	}
 	else
 	{
@@ -997,6 +997,7 @@ int main(int argc, char **argv)
 			if (pdf_needs_password(xref))
 				if (!pdf_authenticate_password(xref, password))
 					fz_throw(ctx, "cannot authenticate password: %s\n", filename);
+			pdf_load_page_tree(xref);
 			pagecount = pdf_count_pages(xref);
 
 			showglobalinfo();
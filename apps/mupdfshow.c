@@ -46,6 +46,7 @@ static void showpagetree(void)
 	if (!doc)
 		fz_throw(ctx, "no file specified");
 
+	pdf_load_page_tree(doc);
 	count = pdf_count_pages(doc);
 	for (i = 0; i < count; i++)
 	{
@@ -212,6 +213,7 @@ int main(int argc, char **argv)
 		if (pdf_needs_password(doc))
 			if (!pdf_authenticate_password(doc, password))
 				fz_throw(ctx, "cannot authenticate password: %s", filename);
+		pdf_load_main_xref(doc);
 
 		if (fz_optind == argc)
 			showtrailer();
@@ -408,11 +408,25 @@ cbz_bound_page(cbz_document *doc, cbz_page *page)
 void
 cbz_run_page(cbz_document *doc, cbz_page *page, fz_device *dev, fz_matrix ctm, fz_cookie *cookie)
 {
-	fz_pixmap *image = page->image;
-	float w = image->w * DPI / image->xres;
-	float h = image->h * DPI / image->yres;
+	fz_context *ctx = doc->ctx;
+	fz_pixmap *pixmap = page->image;
+	fz_image *image;
+	float w = pixmap->w * DPI / pixmap->xres;
+	float h = pixmap->h * DPI / pixmap->yres;
 	ctm = fz_concat(fz_scale(w, h), ctm);
-	fz_fill_image(dev, image, ctm, 1);
+	image = fz_new_image_from_pixmap(ctx, fz_keep_pixmap(ctx, pixmap), NULL);
+	fz_try(ctx)
+	{
+		fz_fill_image(dev, image, ctm, 1);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_image(ctx, image);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
 }
 
 /* Document interface wrappers */
@@ -26,6 +26,15 @@ static inline byte *sample_nearest(byte *s, int w, int h, int n, int u, int v)
 	return s + (v * w + u) * n;
 }
 
+static inline int sample_bit(byte *s, int w, int h, int stride, int u, int v)
+{
+	if (u < 0) u = 0;
+	if (v < 0) v = 0;
+	if (u >= w) u = w - 1;
+	if (v >= h) v = h - 1;
+	return (s[v * stride + (u >> 3)] >> (7 - (u & 7))) & 1;
+}
+
 /* Blend premultiplied source image in constant alpha over destination */
 
 static inline void
@@ -356,6 +365,211 @@ fz_paint_affine_color_N_near(byte *dp, byte *sp, int sw, int sh, int u, int v, i
 	}
 }
 
+/* Blend packed bilevel source image over destination, looking its bits
+ * up in a palette of two premultiplied colors */
+
+static inline void
+fz_paint_affine_bits_N_lerp(byte *dp, byte *sp, int sw, int sh, int ss, int u, int v, int fa, int fb, int w, int n, byte *pal, byte *hp)
+{
+	int k;
+	int n1 = n-1;
+
+	while (w--)
+	{
+		int ui = u >> 16;
+		int vi = v >> 16;
+		if (ui >= 0 && ui < sw && vi >= 0 && vi < sh)
+		{
+			int uf = u & 0xffff;
+			int vf = v & 0xffff;
+			byte *a = pal + sample_bit(sp, sw, sh, ss, ui, vi) * n;
+			byte *b = pal + sample_bit(sp, sw, sh, ss, ui+1, vi) * n;
+			byte *c = pal + sample_bit(sp, sw, sh, ss, ui, vi+1) * n;
+			byte *d = pal + sample_bit(sp, sw, sh, ss, ui+1, vi+1) * n;
+			int y = bilerp(a[n1], b[n1], c[n1], d[n1], uf, vf);
+			int t = 255 - y;
+			for (k = 0; k < n1; k++)
+			{
+				int x = bilerp(a[k], b[k], c[k], d[k], uf, vf);
+				dp[k] = x + fz_mul255(dp[k], t);
+			}
+			dp[n1] = y + fz_mul255(dp[n1], t);
+			if (hp)
+				hp[0] = y + fz_mul255(hp[0], t);
+		}
+		dp += n;
+		if (hp)
+			hp++;
+		u += fa;
+		v += fb;
+	}
+}
+
+static inline void
+fz_paint_affine_bits_N_near(byte *dp, byte *sp, int sw, int sh, int ss, int u, int v, int fa, int fb, int w, int n, byte *pal, byte *hp)
+{
+	int k;
+	int n1 = n-1;
+
+	while (w--)
+	{
+		int ui = u >> 16;
+		int vi = v >> 16;
+		if (ui >= 0 && ui < sw && vi >= 0 && vi < sh)
+		{
+			byte *sample = pal + ((sp[vi * ss + (ui >> 3)] >> (7 - (ui & 7))) & 1) * n;
+			int a = sample[n1];
+			int t = 255 - a;
+			for (k = 0; k < n1; k++)
+				dp[k] = sample[k] + fz_mul255(dp[k], t);
+			dp[n1] = a + fz_mul255(dp[n1], t);
+			if (hp)
+				hp[0] = a + fz_mul255(hp[0], t);
+		}
+		dp += n;
+		if (hp)
+			hp++;
+		u += fa;
+		v += fb;
+	}
+}
+
+/* Blend source image of 8-bit indices over destination, looking them up
+ * in a palette of premultiplied colors */
+
+static inline void
+fz_paint_affine_index_N_lerp(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, byte *pal, byte *hp)
+{
+	int k;
+	int n1 = n-1;
+
+	while (w--)
+	{
+		int ui = u >> 16;
+		int vi = v >> 16;
+		if (ui >= 0 && ui < sw && vi >= 0 && vi < sh)
+		{
+			int uf = u & 0xffff;
+			int vf = v & 0xffff;
+			byte *a = pal + *sample_nearest(sp, sw, sh, 1, ui, vi) * n;
+			byte *b = pal + *sample_nearest(sp, sw, sh, 1, ui+1, vi) * n;
+			byte *c = pal + *sample_nearest(sp, sw, sh, 1, ui, vi+1) * n;
+			byte *d = pal + *sample_nearest(sp, sw, sh, 1, ui+1, vi+1) * n;
+			int y = bilerp(a[n1], b[n1], c[n1], d[n1], uf, vf);
+			int t = 255 - y;
+			for (k = 0; k < n1; k++)
+			{
+				int x = bilerp(a[k], b[k], c[k], d[k], uf, vf);
+				dp[k] = x + fz_mul255(dp[k], t);
+			}
+			dp[n1] = y + fz_mul255(dp[n1], t);
+			if (hp)
+				hp[0] = y + fz_mul255(hp[0], t);
+		}
+		dp += n;
+		if (hp)
+			hp++;
+		u += fa;
+		v += fb;
+	}
+}
+
+static inline void
+fz_paint_affine_index_N_near(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, byte *pal, byte *hp)
+{
+	int k;
+	int n1 = n-1;
+
+	while (w--)
+	{
+		int ui = u >> 16;
+		int vi = v >> 16;
+		if (ui >= 0 && ui < sw && vi >= 0 && vi < sh)
+		{
+			byte *sample = pal + sp[vi * sw + ui] * n;
+			int a = sample[n1];
+			int t = 255 - a;
+			for (k = 0; k < n1; k++)
+				dp[k] = sample[k] + fz_mul255(dp[k], t);
+			dp[n1] = a + fz_mul255(dp[n1], t);
+			if (hp)
+				hp[0] = a + fz_mul255(hp[0], t);
+		}
+		dp += n;
+		if (hp)
+			hp++;
+		u += fa;
+		v += fb;
+	}
+}
+
+/* Blend non-premultiplied color in packed bilevel source image mask over
+ * destination, with the two levels of coverage */
+
+static inline void
+fz_paint_affine_color_bits_N_lerp(byte *dp, byte *sp, int sw, int sh, int ss, int u, int v, int fa, int fb, int w, int n, byte *levels, byte *color, byte *hp)
+{
+	int n1 = n - 1;
+	int sa = color[n1];
+	int k;
+
+	while (w--)
+	{
+		int ui = u >> 16;
+		int vi = v >> 16;
+		if (ui >= 0 && ui < sw && vi >= 0 && vi < sh)
+		{
+			int uf = u & 0xffff;
+			int vf = v & 0xffff;
+			int a = levels[sample_bit(sp, sw, sh, ss, ui, vi)];
+			int b = levels[sample_bit(sp, sw, sh, ss, ui+1, vi)];
+			int c = levels[sample_bit(sp, sw, sh, ss, ui, vi+1)];
+			int d = levels[sample_bit(sp, sw, sh, ss, ui+1, vi+1)];
+			int ma = bilerp(a, b, c, d, uf, vf);
+			int masa = FZ_COMBINE(FZ_EXPAND(ma), sa);
+			for (k = 0; k < n1; k++)
+				dp[k] = FZ_BLEND(color[k], dp[k], masa);
+			dp[n1] = FZ_BLEND(255, dp[n1], masa);
+			if (hp)
+				hp[0] = FZ_BLEND(255, hp[0], masa);
+		}
+		dp += n;
+		if (hp)
+			hp++;
+		u += fa;
+		v += fb;
+	}
+}
+
+static inline void
+fz_paint_affine_color_bits_N_near(byte *dp, byte *sp, int sw, int sh, int ss, int u, int v, int fa, int fb, int w, int n, byte *levels, byte *color, byte *hp)
+{
+	int n1 = n-1;
+	int sa = color[n1];
+	int k;
+
+	while (w--)
+	{
+		int ui = u >> 16;
+		int vi = v >> 16;
+		if (ui >= 0 && ui < sw && vi >= 0 && vi < sh)
+		{
+			int ma = levels[(sp[vi * ss + (ui >> 3)] >> (7 - (ui & 7))) & 1];
+			int masa = FZ_COMBINE(FZ_EXPAND(ma), sa);
+			for (k = 0; k < n1; k++)
+				dp[k] = FZ_BLEND(color[k], dp[k], masa);
+			dp[n1] = FZ_BLEND(255, dp[n1], masa);
+			if (hp)
+				hp[0] = FZ_BLEND(255, hp[0], masa);
+		}
+		dp += n;
+		if (hp)
+			hp++;
+		u += fa;
+		v += fb;
+	}
+}
+
 static void
 fz_paint_affine_lerp(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha, byte *color/*unused*/, byte *hp)
 {
@@ -454,6 +668,74 @@ fz_paint_affine_color_near(byte *dp, byte *sp, int sw, int sh, int u, int v, int
 	}
 }
 
+static void
+fz_paint_affine_bits_lerp(byte *dp, byte *sp, int sw, int sh, int ss, int u, int v, int fa, int fb, int w, int n, byte *pal, byte *color/*unused*/, byte *hp)
+{
+	switch (n)
+	{
+	case 1: fz_paint_affine_bits_N_lerp(dp, sp, sw, sh, ss, u, v, fa, fb, w, 1, pal, hp); break;
+	case 2: fz_paint_affine_bits_N_lerp(dp, sp, sw, sh, ss, u, v, fa, fb, w, 2, pal, hp); break;
+	case 4: fz_paint_affine_bits_N_lerp(dp, sp, sw, sh, ss, u, v, fa, fb, w, 4, pal, hp); break;
+	default: fz_paint_affine_bits_N_lerp(dp, sp, sw, sh, ss, u, v, fa, fb, w, n, pal, hp); break;
+	}
+}
+
+static void
+fz_paint_affine_bits_near(byte *dp, byte *sp, int sw, int sh, int ss, int u, int v, int fa, int fb, int w, int n, byte *pal, byte *color/*unused*/, byte *hp)
+{
+	switch (n)
+	{
+	case 1: fz_paint_affine_bits_N_near(dp, sp, sw, sh, ss, u, v, fa, fb, w, 1, pal, hp); break;
+	case 2: fz_paint_affine_bits_N_near(dp, sp, sw, sh, ss, u, v, fa, fb, w, 2, pal, hp); break;
+	case 4: fz_paint_affine_bits_N_near(dp, sp, sw, sh, ss, u, v, fa, fb, w, 4, pal, hp); break;
+	default: fz_paint_affine_bits_N_near(dp, sp, sw, sh, ss, u, v, fa, fb, w, n, pal, hp); break;
+	}
+}
+
+static void
+fz_paint_affine_index_lerp(byte *dp, byte *sp, int sw, int sh, int ss/*unused*/, int u, int v, int fa, int fb, int w, int n, byte *pal, byte *color/*unused*/, byte *hp)
+{
+	switch (n)
+	{
+	case 2: fz_paint_affine_index_N_lerp(dp, sp, sw, sh, u, v, fa, fb, w, 2, pal, hp); break;
+	case 4: fz_paint_affine_index_N_lerp(dp, sp, sw, sh, u, v, fa, fb, w, 4, pal, hp); break;
+	default: fz_paint_affine_index_N_lerp(dp, sp, sw, sh, u, v, fa, fb, w, n, pal, hp); break;
+	}
+}
+
+static void
+fz_paint_affine_index_near(byte *dp, byte *sp, int sw, int sh, int ss/*unused*/, int u, int v, int fa, int fb, int w, int n, byte *pal, byte *color/*unused*/, byte *hp)
+{
+	switch (n)
+	{
+	case 2: fz_paint_affine_index_N_near(dp, sp, sw, sh, u, v, fa, fb, w, 2, pal, hp); break;
+	case 4: fz_paint_affine_index_N_near(dp, sp, sw, sh, u, v, fa, fb, w, 4, pal, hp); break;
+	default: fz_paint_affine_index_N_near(dp, sp, sw, sh, u, v, fa, fb, w, n, pal, hp); break;
+	}
+}
+
+static void
+fz_paint_affine_color_bits_lerp(byte *dp, byte *sp, int sw, int sh, int ss, int u, int v, int fa, int fb, int w, int n, byte *levels, byte *color, byte *hp)
+{
+	switch (n)
+	{
+	case 2: fz_paint_affine_color_bits_N_lerp(dp, sp, sw, sh, ss, u, v, fa, fb, w, 2, levels, color, hp); break;
+	case 4: fz_paint_affine_color_bits_N_lerp(dp, sp, sw, sh, ss, u, v, fa, fb, w, 4, levels, color, hp); break;
+	default: fz_paint_affine_color_bits_N_lerp(dp, sp, sw, sh, ss, u, v, fa, fb, w, n, levels, color, hp); break;
+	}
+}
+
+static void
+fz_paint_affine_color_bits_near(byte *dp, byte *sp, int sw, int sh, int ss, int u, int v, int fa, int fb, int w, int n, byte *levels, byte *color, byte *hp)
+{
+	switch (n)
+	{
+	case 2: fz_paint_affine_color_bits_N_near(dp, sp, sw, sh, ss, u, v, fa, fb, w, 2, levels, color, hp); break;
+	case 4: fz_paint_affine_color_bits_N_near(dp, sp, sw, sh, ss, u, v, fa, fb, w, 4, levels, color, hp); break;
+	default: fz_paint_affine_color_bits_N_near(dp, sp, sw, sh, ss, u, v, fa, fb, w, n, levels, color, hp); break;
+	}
+}
+
 /* RJW: The following code was originally written to be sensitive to
  * FLT_EPSILON. Given the way the 'minimum representable difference'
  * between 2 floats changes size as we scale, we now pick a larger
@@ -594,19 +876,25 @@ fz_gridfit_matrix(fz_matrix *m)
 	}
 }
 
-/* Draw an image with an affine transform on destination */
+/* Draw an image, either a pixmap or a packed bitmap, with an affine
+ * transform on destination. With a lut and no color, the samples of the
+ * image are looked up in it as a palette. */
 
 static void
-fz_paint_image_imp(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_pixmap *img, fz_matrix ctm, byte *color, int alpha)
+fz_paint_image_imp(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_pixmap *img, fz_bitmap *bit, int interpolate, fz_matrix ctm, byte *color, byte *lut, int alpha)
 {
 	byte *dp, *sp, *hp;
 	int u, v, fa, fb, fc, fd;
 	int x, y, w, h;
-	int sw, sh, n, hw;
+	int sw, sh, ss, n, hw;
 	fz_matrix inv;
 	fz_bbox bbox;
 	int dolerp;
-	void (*paintfn)(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha, byte *color, byte *hp);
+	void (*paintfn)(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha, byte *color, byte *hp) = NULL;
+	void (*lookupfn)(byte *dp, byte *sp, int sw, int sh, int ss, int u, int v, int fa, int fb, int w, int n, byte *lut, byte *color, byte *hp) = NULL;
+
+	sw = img ? img->w : bit->w;
+	sh = img ? img->h : bit->h;
 
 	/* grid fit the image */
 	fz_gridfit_matrix(&ctm);
@@ -615,17 +903,17 @@ fz_paint_image_imp(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_pixmap
 	dolerp = 0;
 	if (!fz_is_rectilinear(ctm))
 		dolerp = 1;
-	if (sqrtf(ctm.a * ctm.a + ctm.b * ctm.b) > img->w)
+	if (sqrtf(ctm.a * ctm.a + ctm.b * ctm.b) > sw)
 		dolerp = 1;
-	if (sqrtf(ctm.c * ctm.c + ctm.d * ctm.d) > img->h)
+	if (sqrtf(ctm.c * ctm.c + ctm.d * ctm.d) > sh)
 		dolerp = 1;
 
 	/* except when we shouldn't, at large magnifications */
-	if (!img->interpolate)
+	if (!interpolate)
 	{
-		if (sqrtf(ctm.a * ctm.a + ctm.b * ctm.b) > img->w * 2)
+		if (sqrtf(ctm.a * ctm.a + ctm.b * ctm.b) > sw * 2)
 			dolerp = 0;
-		if (sqrtf(ctm.c * ctm.c + ctm.d * ctm.d) > img->h * 2)
+		if (sqrtf(ctm.c * ctm.c + ctm.d * ctm.d) > sh * 2)
 			dolerp = 0;
 	}
 
@@ -647,7 +935,7 @@ fz_paint_image_imp(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_pixmap
 	h -= y;
 
 	/* map from screen space (x,y) to image space (u,v) */
-	inv = fz_scale(1.0f / img->w, 1.0f / img->h);
+	inv = fz_scale(1.0f / sw, 1.0f / sh);
 	inv = fz_concat(inv, ctm);
 	inv = fz_invert_matrix(inv);
 
@@ -670,9 +958,8 @@ fz_paint_image_imp(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_pixmap
 
 	dp = dst->samples + ((y - dst->y) * dst->w + (x - dst->x)) * dst->n;
 	n = dst->n;
-	sp = img->samples;
-	sw = img->w;
-	sh = img->h;
+	sp = img ? img->samples : bit->samples;
+	ss = img ? 0 : bit->stride;
 	if (shape)
 	{
 		hw = shape->w;
@@ -686,7 +973,22 @@ fz_paint_image_imp(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_pixmap
 
 	/* TODO: if (fb == 0 && fa == 1) call fz_paint_span */
 
-	if (dst->n == 4 && img->n == 2)
+	if (bit)
+	{
+		if (dolerp)
+			lookupfn = color ? fz_paint_affine_color_bits_lerp : fz_paint_affine_bits_lerp;
+		else
+			lookupfn = color ? fz_paint_affine_color_bits_near : fz_paint_affine_bits_near;
+	}
+	else if (lut)
+	{
+		assert(!color && img->n == 1);
+		if (dolerp)
+			lookupfn = fz_paint_affine_index_lerp;
+		else
+			lookupfn = fz_paint_affine_index_near;
+	}
+	else if (dst->n == 4 && img->n == 2)
 	{
 		assert(!color);
 		if (dolerp)
@@ -714,7 +1016,10 @@ fz_paint_image_imp(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_pixmap
 
 	while (h--)
 	{
-		paintfn(dp, sp, sw, sh, u, v, fa, fb, w, n, alpha, color, hp);
+		if (lookupfn)
+			lookupfn(dp, sp, sw, sh, ss, u, v, fa, fb, w, n, lut, color, hp);
+		else
+			paintfn(dp, sp, sw, sh, u, v, fa, fb, w, n, alpha, color, hp);
 		dp += dst->w * n;
 		hp += hw;
 		u += fc;
@@ -726,12 +1031,63 @@ void
 fz_paint_image_with_color(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_pixmap *img, fz_matrix ctm, byte *color)
 {
 	assert(img->n == 1);
-	fz_paint_image_imp(dst, scissor, shape, img, ctm, color, 255);
+	fz_paint_image_imp(dst, scissor, shape, img, NULL, img->interpolate, ctm, color, NULL, 255);
 }
 
 void
 fz_paint_image(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_pixmap *img, fz_matrix ctm, int alpha)
 {
 	assert(dst->n == img->n || (dst->n == 4 && img->n == 2));
-	fz_paint_image_imp(dst, scissor, shape, img, ctm, NULL, alpha);
+	fz_paint_image_imp(dst, scissor, shape, img, NULL, img->interpolate, ctm, NULL, NULL, alpha);
+}
+
+/*
+	Paint a packed bilevel bitmap, with its bits looked up in a palette of
+	two premultiplied colors of dst->n components each, in constant alpha.
+*/
+void
+fz_paint_bitmap(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_bitmap *bit, int interpolate, fz_matrix ctm, byte *palette, int alpha)
+{
+	byte pal[2 * (FZ_MAX_COLORS + 1)];
+	int k;
+
+	assert(bit->n == 1 && dst->n <= FZ_MAX_COLORS + 1);
+	if (alpha <= 0)
+		return;
+	for (k = 0; k < 2 * dst->n; k++)
+		pal[k] = fz_mul255(palette[k], alpha);
+	fz_paint_image_imp(dst, scissor, shape, NULL, bit, interpolate, ctm, NULL, pal, 255);
+}
+
+/*
+	Paint a packed bilevel image mask in color, with bits of 0 and 1 giving
+	the coverage levels[0] and levels[1].
+*/
+void
+fz_paint_bitmap_with_color(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_bitmap *bit, int interpolate, fz_matrix ctm, byte *levels, byte *color)
+{
+	assert(bit->n == 1);
+	fz_paint_image_imp(dst, scissor, shape, NULL, bit, interpolate, ctm, color, levels, 255);
+}
+
+/*
+	Paint an image of 8-bit indices, looked up in a palette of 256
+	premultiplied colors of dst->n components each, in constant alpha.
+*/
+void
+fz_paint_indexed_image(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_pixmap *img, fz_matrix ctm, byte *palette, int alpha)
+{
+	byte pal[256 * (FZ_MAX_COLORS + 1)];
+	int k;
+
+	assert(img->n == 1 && dst->n <= FZ_MAX_COLORS + 1);
+	if (alpha <= 0)
+		return;
+	if (alpha < 255)
+	{
+		for (k = 0; k < 256 * dst->n; k++)
+			pal[k] = fz_mul255(palette[k], alpha);
+		palette = pal;
+	}
+	fz_paint_image_imp(dst, scissor, shape, img, NULL, img->interpolate, ctm, NULL, palette, 255);
 }
@@ -420,30 +420,20 @@ fz_draw_clip_stroke_path(fz_device *devp, fz_path *path, fz_rect *rect, fz_strok
 }
 
 static void
-draw_glyph(unsigned char *colorbv, fz_pixmap *dst, fz_pixmap *msk,
-	int xorig, int yorig, fz_bbox scissor)
+draw_packed_glyph(unsigned char *colorbv, fz_pixmap *dst, fz_glyph *glyph,
+	int xorig, int yorig, fz_bbox bbox)
 {
 	unsigned char *dp, *mp;
-	fz_bbox bbox;
 	int x, y, w, h;
 
-	bbox = fz_bound_pixmap(msk);
-	bbox.x0 += xorig;
-	bbox.y0 += yorig;
-	bbox.x1 += xorig;
-	bbox.y1 += yorig;
-
-	bbox = fz_intersect_bbox(bbox, scissor); /* scissor < dst */
 	x = bbox.x0;
 	y = bbox.y0;
 	w = bbox.x1 - bbox.x0;
 	h = bbox.y1 - bbox.y0;
 
-	mp = msk->samples + ((y - msk->y - yorig) * msk->w + (x - msk->x - xorig));
+	mp = glyph->data + ((y - glyph->y - yorig) * glyph->w + (x - glyph->x - xorig));
 	dp = dst->samples + ((y - dst->y) * dst->w + (x - dst->x)) * dst->n;
 
-	assert(msk->n == 1);
-
 	while (h--)
 	{
 		if (dst->colorspace)
@@ -451,10 +441,91 @@ draw_glyph(unsigned char *colorbv, fz_pixmap *dst, fz_pixmap *msk,
 		else
 			fz_paint_span(dp, mp, 1, w, 255);
 		dp += dst->w * dst->n;
-		mp += msk->w;
+		mp += glyph->w;
 	}
 }
 
+static void
+draw_rle_glyph(unsigned char *colorbv, fz_pixmap *dst, fz_glyph *glyph,
+	int xorig, int yorig, fz_bbox bbox)
+{
+	unsigned char *dp, *rp, *end;
+	int x0, x1, gx, y, n, c, skip;
+
+	/* Clip to the glyph's own coordinates */
+	x0 = bbox.x0 - glyph->x - xorig;
+	x1 = bbox.x1 - glyph->x - xorig;
+
+	for (y = bbox.y0; y < bbox.y1; y++)
+	{
+		dp = dst->samples + ((y - dst->y) * dst->w + (bbox.x0 - dst->x)) * dst->n;
+		rp = glyph->data + glyph->rows[y - glyph->y - yorig];
+		end = glyph->data + glyph->rows[y - glyph->y - yorig + 1];
+		gx = 0;
+
+		while (rp < end && gx < x1)
+		{
+			c = *rp++;
+			n = (c & (c < 0x80 ? 0x3f : 0x7f)) + 1;
+			skip = 0;
+			if (gx < x0)
+			{
+				skip = MIN(x0 - gx, n);
+				gx += skip;
+				n -= skip;
+			}
+			if (gx + n > x1)
+				n = x1 - gx;
+
+			if (c >= 0x80)
+			{
+				if (n > 0)
+				{
+					if (dst->colorspace)
+						fz_paint_span_with_color(dp + (gx - x0) * dst->n, rp + skip, dst->n, n, colorbv);
+					else
+						fz_paint_span(dp + (gx - x0), rp + skip, 1, n, 255);
+				}
+				rp += (c & 0x7f) + 1;
+			}
+			else if (c >= 0x40 && n > 0)
+			{
+				if (dst->colorspace)
+					fz_paint_solid_color(dp + (gx - x0) * dst->n, dst->n, n, colorbv);
+				else
+					fz_paint_solid_alpha(dp + (gx - x0), n, 255);
+			}
+			gx += n;
+		}
+	}
+}
+
+static void
+draw_glyph(unsigned char *colorbv, fz_pixmap *dst, fz_glyph *glyph,
+	int xorig, int yorig, fz_bbox scissor)
+{
+	fz_bbox bbox;
+
+	/* Coloured glyphs are painted as images */
+	if (glyph->pixmap)
+		return;
+
+	bbox = fz_glyph_bbox(glyph);
+	bbox.x0 += xorig;
+	bbox.y0 += yorig;
+	bbox.x1 += xorig;
+	bbox.y1 += yorig;
+
+	bbox = fz_intersect_bbox(bbox, scissor); /* scissor < dst */
+	if (fz_is_empty_bbox(bbox))
+		return;
+
+	if (glyph->rows)
+		draw_rle_glyph(colorbv, dst, glyph, xorig, yorig, bbox);
+	else
+		draw_packed_glyph(colorbv, dst, glyph, xorig, yorig, bbox);
+}
+
 static void
 fz_draw_fill_text(fz_device *devp, fz_text *text, fz_matrix ctm,
 	fz_colorspace *colorspace, float *color, float alpha)
@@ -464,7 +535,7 @@ fz_draw_fill_text(fz_device *devp, fz_text *text, fz_matrix ctm,
 	unsigned char shapebv;
 	float colorfv[FZ_MAX_COLORS];
 	fz_matrix tm, trm;
-	fz_pixmap *glyph;
+	fz_glyph *glyph;
 	int i, x, y, gid;
 	fz_draw_state *state = &dev->stack[dev->top];
 	fz_colorspace *model = state->dest->colorspace;
@@ -497,7 +568,7 @@ fz_draw_fill_text(fz_device *devp, fz_text *text, fz_matrix ctm,
 		glyph = fz_render_glyph(dev->ctx, text->font, gid, trm, model);
 		if (glyph)
 		{
-			if (glyph->n == 1)
+			if (!glyph->pixmap)
 			{
 				draw_glyph(colorbv, state->dest, glyph, x, y, state->scissor);
 				if (state->shape)
@@ -506,9 +577,9 @@ fz_draw_fill_text(fz_device *devp, fz_text *text, fz_matrix ctm,
 			else
 			{
 				fz_matrix ctm = {glyph->w, 0.0, 0.0, glyph->h, x + glyph->x, y + glyph->y};
-				fz_paint_image(state->dest, state->scissor, state->shape, glyph, ctm, alpha * 255);
+				fz_paint_image(state->dest, state->scissor, state->shape, glyph->pixmap, ctm, alpha * 255);
 			}
-			fz_drop_pixmap(dev->ctx, glyph);
+			fz_drop_glyph(dev->ctx, glyph);
 		}
 	}
 
@@ -524,7 +595,7 @@ fz_draw_stroke_text(fz_device *devp, fz_text *text, fz_stroke_state *stroke, fz_
 	unsigned char colorbv[FZ_MAX_COLORS + 1];
 	float colorfv[FZ_MAX_COLORS];
 	fz_matrix tm, trm;
-	fz_pixmap *glyph;
+	fz_glyph *glyph;
 	int i, x, y, gid;
 	fz_draw_state *state = &dev->stack[dev->top];
 	fz_colorspace *model = state->dest->colorspace;
@@ -559,7 +630,7 @@ fz_draw_stroke_text(fz_device *devp, fz_text *text, fz_stroke_state *stroke, fz_
 			draw_glyph(colorbv, state->dest, glyph, x, y, state->scissor);
 			if (state->shape)
 				draw_glyph(colorbv, state->shape, glyph, x, y, state->scissor);
-			fz_drop_pixmap(dev->ctx, glyph);
+			fz_drop_glyph(dev->ctx, glyph);
 		}
 	}
 
@@ -574,7 +645,7 @@ fz_draw_clip_text(fz_device *devp, fz_text *text, fz_matrix ctm, int accumulate)
 	fz_bbox bbox;
 	fz_pixmap *mask, *dest, *shape;
 	fz_matrix tm, trm;
-	fz_pixmap *glyph;
+	fz_glyph *glyph;
 	int i, x, y, gid;
 	fz_draw_state *state;
 	fz_colorspace *model;
@@ -651,7 +722,7 @@ fz_draw_clip_text(fz_device *devp, fz_text *text, fz_matrix ctm, int accumulate)
 				draw_glyph(NULL, mask, glyph, x, y, bbox);
 				if (state[1].shape)
 					draw_glyph(NULL, state[1].shape, glyph, x, y, bbox);
-				fz_drop_pixmap(dev->ctx, glyph);
+				fz_drop_glyph(dev->ctx, glyph);
 			}
 		}
 	}
@@ -664,7 +735,7 @@ fz_draw_clip_stroke_text(fz_device *devp, fz_text *text, fz_stroke_state *stroke
 	fz_bbox bbox;
 	fz_pixmap *mask, *dest, *shape;
 	fz_matrix tm, trm;
-	fz_pixmap *glyph;
+	fz_glyph *glyph;
 	int i, x, y, gid;
 	fz_draw_state *state = push_stack(dev);
 	fz_colorspace *model = state->dest->colorspace;
@@ -718,7 +789,7 @@ fz_draw_clip_stroke_text(fz_device *devp, fz_text *text, fz_stroke_state *stroke
 				draw_glyph(NULL, mask, glyph, x, y, bbox);
 				if (shape)
 					draw_glyph(NULL, shape, glyph, x, y, bbox);
-				fz_drop_pixmap(dev->ctx, glyph);
+				fz_drop_glyph(dev->ctx, glyph);
 			}
 		}
 	}
@@ -822,8 +893,9 @@ fz_draw_fill_shade(fz_device *devp, fz_shade *shade, fz_matrix ctm, float alpha)
 		fz_knockout_end(dev);
 }
 
+/* palette, if not NULL, is for an image of indices; see fz_scale_indexed_pixmap */
 static fz_pixmap *
-fz_transform_pixmap(fz_context *ctx, fz_pixmap *image, fz_matrix *ctm, int x, int y, int dx, int dy, int gridfit, fz_bbox *clip)
+fz_transform_pixmap(fz_context *ctx, fz_pixmap *image, fz_pixmap *palette, fz_matrix *ctm, int x, int y, int dx, int dy, int gridfit, fz_bbox *clip)
 {
 	fz_pixmap *scaled;
 
@@ -833,7 +905,7 @@ fz_transform_pixmap(fz_context *ctx, fz_pixmap *image, fz_matrix *ctm, int x, in
 		fz_matrix m = *ctm;
 		if (gridfit)
 			fz_gridfit_matrix(&m);
-		scaled = fz_scale_pixmap(ctx, image, m.e, m.f, m.a, m.d, clip);
+		scaled = fz_scale_indexed_pixmap(ctx, image, palette, m.e, m.f, m.a, m.d, clip);
 		if (!scaled)
 			return NULL;
 		ctm->a = scaled->w;
@@ -857,7 +929,7 @@ fz_transform_pixmap(fz_context *ctx, fz_pixmap *image, fz_matrix *ctm, int x, in
 			rclip.x1 = clip->y1;
 			rclip.y1 = clip->x1;
 		}
-		scaled = fz_scale_pixmap(ctx, image, m.f, m.e, m.b, m.c, (clip ? &rclip : 0));
+		scaled = fz_scale_indexed_pixmap(ctx, image, palette, m.f, m.e, m.b, m.c, (clip ? &rclip : 0));
 		if (!scaled)
 			return NULL;
 		ctm->b = scaled->w;
@@ -870,21 +942,251 @@ fz_transform_pixmap(fz_context *ctx, fz_pixmap *image, fz_matrix *ctm, int x, in
 	/* Downscale, non rectilinear case */
 	if (dx > 0 && dy > 0)
 	{
-		scaled = fz_scale_pixmap(ctx, image, 0, 0, (float)dx, (float)dy, NULL);
+		scaled = fz_scale_indexed_pixmap(ctx, image, palette, 0, 0, (float)dx, (float)dy, NULL);
 		return scaled;
 	}
 
 	return NULL;
 }
 
+/*
+	Get the pixels of an image, or of the area of it, for drawing at w by
+	h. Packed bitmaps are unpacked just for this. If palette is given,
+	the image may come as indices, with *palette set to their colors.
+*/
+static fz_pixmap *
+fz_draw_decode_image(fz_context *ctx, fz_image *image, fz_bitmap *bit, unsigned char levels[2], fz_pixmap **palette, int w, int h, fz_bbox *area)
+{
+	fz_pixmap *pixmap;
+	fz_bbox whole;
+
+	if (!bit)
+	{
+		if (palette)
+		{
+			pixmap = fz_image_to_indexed(ctx, image, w, h, area, palette);
+			if (pixmap)
+				return pixmap;
+		}
+		return fz_image_to_pixmap(ctx, image, w, h, area);
+	}
+
+	whole.x0 = whole.y0 = 0;
+	whole.x1 = image->w;
+	whole.y1 = image->h;
+	pixmap = fz_unpack_bitmap(ctx, bit, image->colorspace, levels, area ? *area : whole);
+	pixmap->interpolate = image->interpolate;
+	return pixmap;
+}
+
+/*
+	Decode an image for drawing, at the size it is drawn at. When it is
+	scaled down without rotation or skew, only the part of it that can
+	show through the clip is decoded, with a margin for the scaler's
+	filter. ctm, dx and dy are then adjusted to draw that part; it is
+	placed using the grid fitted matrix of the whole image, so gridfit
+	is cleared.
+*/
+static fz_pixmap *
+fz_draw_image_area(fz_context *ctx, fz_image *image, fz_bitmap *bit, unsigned char levels[2], fz_pixmap **palette, fz_matrix *ctm, fz_bbox clip, int *gridfit, int *dx, int *dy)
+{
+	fz_pixmap *pixmap;
+	fz_bbox area;
+	fz_matrix m;
+	fz_rect r;
+	int mx, my;
+
+	if (!fz_is_rectilinear(*ctm) || *dx < 1 || *dy < 1 || *dx >= image->w || *dy >= image->h)
+		return fz_draw_decode_image(ctx, image, bit, levels, palette, MAX(*dx, 1), MAX(*dy, 1), NULL);
+
+	m = *ctm;
+	if (*gridfit)
+		fz_gridfit_matrix(&m);
+
+	r.x0 = clip.x0;
+	r.y0 = clip.y0;
+	r.x1 = clip.x1;
+	r.y1 = clip.y1;
+	r = fz_transform_rect(fz_invert_matrix(m), r);
+	r = fz_intersect_rect(r, fz_unit_rect);
+	if (r.x1 <= r.x0 || r.y1 <= r.y0)
+		return fz_draw_decode_image(ctx, image, bit, levels, palette, *dx, *dy, NULL);
+
+	/* two device pixels and one image pixel either side */
+	mx = 2 * image->w / *dx + 1;
+	my = 2 * image->h / *dy + 1;
+	area.x0 = MAX(0, (int)floorf(r.x0 * image->w) - mx);
+	area.y0 = MAX(0, (int)floorf(r.y0 * image->h) - my);
+	area.x1 = MIN(image->w, (int)ceilf(r.x1 * image->w) + mx);
+	area.y1 = MIN(image->h, (int)ceilf(r.y1 * image->h) + my);
+
+	pixmap = fz_draw_decode_image(ctx, image, bit, levels, palette, *dx, *dy, &area);
+
+	if (area.x0 == 0 && area.y0 == 0 && area.x1 == image->w && area.y1 == image->h)
+		return pixmap;
+
+	/* map the unit square onto the part of the image we have */
+	*ctm = fz_concat(fz_concat(
+		fz_scale((float)(area.x1 - area.x0) / image->w, (float)(area.y1 - area.y0) / image->h),
+		fz_translate((float)area.x0 / image->w, (float)area.y0 / image->h)), m);
+	*gridfit = 0;
+	*dx = sqrtf(ctm->a * ctm->a + ctm->b * ctm->b);
+	*dy = sqrtf(ctm->c * ctm->c + ctm->d * ctm->d);
+	return pixmap;
+}
+
+/*
+	Bilevel images drawn at more than half their size are taken packed,
+	at one bit per pixel. When they can be painted as they are, *bitmap
+	is set and NULL returned; when they have to be scaled, the part of
+	them that is needed is unpacked. Other images are taken as palette
+	indices when palette is given and the image can be; *palette is then
+	set to their colors.
+*/
+static fz_pixmap *
+fz_draw_image_pixmap(fz_context *ctx, fz_image *image, fz_matrix *ctm, fz_bbox clip, int *gridfit, int *dx, int *dy, fz_bitmap **bitmap, unsigned char levels[2], fz_pixmap **palette)
+{
+	fz_pixmap *pixmap = NULL;
+	fz_bitmap *bit = NULL;
+
+	*dx = sqrtf(ctm->a * ctm->a + ctm->b * ctm->b);
+	*dy = sqrtf(ctm->c * ctm->c + ctm->d * ctm->d);
+
+	*bitmap = NULL;
+	if (palette)
+		*palette = NULL;
+	if ((image->w >> 1) < *dx || (image->h >> 1) < *dy)
+		bit = fz_image_to_bitmap(ctx, image, levels);
+	if (!bit)
+		return fz_draw_image_area(ctx, image, NULL, NULL, palette, ctm, clip, gridfit, dx, dy);
+	if (*dx >= image->w || *dy >= image->h)
+	{
+		*bitmap = bit;
+		return NULL;
+	}
+
+	fz_try(ctx)
+	{
+		pixmap = fz_draw_image_area(ctx, image, bit, levels, NULL, ctm, clip, gridfit, dx, dy);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_bitmap(ctx, bit);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+
+	return pixmap;
+}
+
+/*
+	Paint a packed bilevel image in the two colors its bits stand for,
+	converted to the destination colorspace.
+*/
 static void
-fz_draw_fill_image(fz_device *devp, fz_pixmap *image, fz_matrix ctm, float alpha)
+fz_draw_paint_bitmap(fz_context *ctx, fz_draw_state *state, fz_image *image, fz_bitmap *bitmap, unsigned char levels[2], fz_matrix ctm, float alpha)
+{
+	fz_colorspace *model = state->dest->colorspace;
+	fz_pixmap *colors;
+	fz_pixmap *converted = NULL;
+
+	fz_var(converted);
+
+	colors = fz_new_pixmap(ctx, image->colorspace, 2, 1);
+	colors->samples[0] = levels[0];
+	colors->samples[1] = 255;
+	colors->samples[2] = levels[1];
+	colors->samples[3] = 255;
+
+	fz_try(ctx)
+	{
+		if (image->colorspace != model)
+		{
+			converted = fz_new_pixmap(ctx, model, 2, 1);
+			fz_convert_pixmap(ctx, colors, converted);
+		}
+		fz_paint_bitmap(state->dest, state->scissor, state->shape, bitmap, image->interpolate, ctm,
+			converted ? converted->samples : colors->samples, alpha * 255);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_pixmap(ctx, converted);
+		fz_drop_pixmap(ctx, colors);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
+/*
+	Paint an image of palette indices. The palette is converted to the
+	destination colorspace once, and the indices are looked up in it as
+	they are scaled or painted.
+*/
+static void
+fz_draw_paint_indexed(fz_context *ctx, fz_draw_state *state, fz_pixmap *pixmap, fz_pixmap *palette, fz_matrix ctm, int dx, int dy, int gridfit, fz_bbox clip, float alpha)
+{
+	fz_colorspace *model = state->dest->colorspace;
+	fz_pixmap *converted = NULL;
+	fz_pixmap *scaled = NULL;
+
+	fz_var(converted);
+	fz_var(scaled);
+
+	fz_try(ctx)
+	{
+		if (palette->colorspace != model)
+		{
+			converted = fz_new_pixmap(ctx, model, palette->w, palette->h);
+			fz_convert_pixmap(ctx, palette, converted);
+			palette = converted;
+		}
+
+		if (dx < pixmap->w && dy < pixmap->h)
+		{
+			scaled = fz_transform_pixmap(ctx, pixmap, palette, &ctm, state->dest->x, state->dest->y, dx, dy, gridfit, &clip);
+			if (!scaled)
+			{
+				if (dx < 1)
+					dx = 1;
+				if (dy < 1)
+					dy = 1;
+				scaled = fz_scale_indexed_pixmap(ctx, pixmap, palette, pixmap->x, pixmap->y, dx, dy, NULL);
+			}
+		}
+
+		if (scaled)
+			fz_paint_image(state->dest, state->scissor, state->shape, scaled, ctm, alpha * 255);
+		else
+			fz_paint_indexed_image(state->dest, state->scissor, state->shape, pixmap, ctm, palette->samples, alpha * 255);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_pixmap(ctx, scaled);
+		fz_drop_pixmap(ctx, converted);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
+static void
+fz_draw_fill_image(fz_device *devp, fz_image *image, fz_matrix ctm, float alpha)
 {
 	fz_draw_device *dev = devp->user;
 	fz_pixmap *converted = NULL;
 	fz_pixmap *scaled = NULL;
+	fz_pixmap *pixmap;
+	fz_pixmap *orig_pixmap;
+	fz_pixmap *palette;
+	fz_bitmap *bitmap;
+	unsigned char levels[2];
 	int after;
-	int dx, dy;
+	int dx, dy, gridfit;
 	fz_context *ctx = dev->ctx;
 	fz_draw_state *state = &dev->stack[dev->top];
 	fz_colorspace *model = state->dest->colorspace;
@@ -893,6 +1195,7 @@ fz_draw_fill_image(fz_device *devp, fz_pixmap *image, fz_matrix ctm, float alpha
 	clip = fz_intersect_bbox(clip, state->scissor);
 
 	fz_var(scaled);
+	fz_var(converted);
 
 	if (!model)
 	{
@@ -903,6 +1206,11 @@ fz_draw_fill_image(fz_device *devp, fz_pixmap *image, fz_matrix ctm, float alpha
 	if (image->w == 0 || image->h == 0)
 		return;
 
+	/* decode no more of the image than we are going to draw */
+	gridfit = alpha == 1.0f && !(dev->flags & FZ_DRAWDEV_FLAGS_TYPE3);
+	pixmap = fz_draw_image_pixmap(ctx, image, &ctm, clip, &gridfit, &dx, &dy, &bitmap, levels, &palette);
+	orig_pixmap = pixmap;
+
 	/* convert images with more components (cmyk->rgb) before scaling */
 	/* convert images with fewer components (gray->rgb after scaling */
 	/* convert images with expensive colorspace transforms after scaling */
@@ -910,126 +1218,160 @@ fz_draw_fill_image(fz_device *devp, fz_pixmap *image, fz_matrix ctm, float alpha
 	if (state->blendmode & FZ_BLEND_KNOCKOUT)
 		state = fz_knockout_begin(dev);
 
-	after = 0;
-	if (image->colorspace == fz_device_gray)
-		after = 1;
-
-	if (image->colorspace != model && !after)
-	{
-		converted = fz_new_pixmap_with_rect(ctx, model, fz_bound_pixmap(image));
-		fz_convert_pixmap(ctx, image, converted);
-		image = converted;
-	}
-
 	fz_try(ctx)
 	{
-		dx = sqrtf(ctm.a * ctm.a + ctm.b * ctm.b);
-		dy = sqrtf(ctm.c * ctm.c + ctm.d * ctm.d);
-		if (dx < image->w && dy < image->h)
+		if (bitmap)
 		{
-			int gridfit = alpha == 1.0f && !(dev->flags & FZ_DRAWDEV_FLAGS_TYPE3);
-			scaled = fz_transform_pixmap(ctx, image, &ctm, state->dest->x, state->dest->y, dx, dy, gridfit, &clip);
-			if (!scaled)
+			fz_draw_paint_bitmap(ctx, state, image, bitmap, levels, ctm, alpha);
+		}
+		else if (palette)
+		{
+			fz_draw_paint_indexed(ctx, state, pixmap, palette, ctm, dx, dy, gridfit, clip, alpha);
+		}
+		else
+		{
+			after = 0;
+			if (pixmap->colorspace == fz_device_gray)
+				after = 1;
+
+			if (pixmap->colorspace != model && !after)
 			{
-				if (dx < 1)
-					dx = 1;
-				if (dy < 1)
-					dy = 1;
-				scaled = fz_scale_pixmap(ctx, image, image->x, image->y, dx, dy, NULL);
+				converted = fz_new_pixmap_with_rect(ctx, model, fz_bound_pixmap(pixmap));
+				fz_convert_pixmap(ctx, pixmap, converted);
+				pixmap = converted;
 			}
-			if (scaled)
-				image = scaled;
-		}
 
-		if (image->colorspace != model)
-		{
-			if ((image->colorspace == fz_device_gray && model == fz_device_rgb) ||
-				(image->colorspace == fz_device_gray && model == fz_device_bgr))
+			if (dx < pixmap->w && dy < pixmap->h)
 			{
-				/* We have special case rendering code for gray -> rgb/bgr */
+				scaled = fz_transform_pixmap(ctx, pixmap, NULL, &ctm, state->dest->x, state->dest->y, dx, dy, gridfit, &clip);
+				if (!scaled)
+				{
+					if (dx < 1)
+						dx = 1;
+					if (dy < 1)
+						dy = 1;
+					scaled = fz_scale_pixmap(ctx, pixmap, pixmap->x, pixmap->y, dx, dy, NULL);
+				}
+				if (scaled)
+					pixmap = scaled;
 			}
-			else
+
+			if (pixmap->colorspace != model)
 			{
-				converted = fz_new_pixmap_with_rect(ctx, model, fz_bound_pixmap(image));
-				fz_convert_pixmap(ctx, image, converted);
-				image = converted;
+				if ((pixmap->colorspace == fz_device_gray && model == fz_device_rgb) ||
+					(pixmap->colorspace == fz_device_gray && model == fz_device_bgr))
+				{
+					/* We have special case rendering code for gray -> rgb/bgr */
+				}
+				else
+				{
+					converted = fz_new_pixmap_with_rect(ctx, model, fz_bound_pixmap(pixmap));
+					fz_convert_pixmap(ctx, pixmap, converted);
+					pixmap = converted;
+				}
 			}
-		}
 
-		fz_paint_image(state->dest, state->scissor, state->shape, image, ctm, alpha * 255);
+			fz_paint_image(state->dest, state->scissor, state->shape, pixmap, ctm, alpha * 255);
+		}
 	}
-	fz_catch(ctx)
+	fz_always(ctx)
 	{
 		fz_drop_pixmap(ctx, scaled);
 		fz_drop_pixmap(ctx, converted);
+		fz_drop_pixmap(ctx, orig_pixmap);
+		fz_drop_pixmap(ctx, palette);
+		fz_drop_bitmap(ctx, bitmap);
+	}
+	fz_catch(ctx)
+	{
 		fz_rethrow(ctx);
 	}
 
-	if (scaled)
-		fz_drop_pixmap(ctx, scaled);
-	if (converted)
-		fz_drop_pixmap(ctx, converted);
-
 	if (state->blendmode & FZ_BLEND_KNOCKOUT)
 		fz_knockout_end(dev);
 }
 
 static void
-fz_draw_fill_image_mask(fz_device *devp, fz_pixmap *image, fz_matrix ctm,
+fz_draw_fill_image_mask(fz_device *devp, fz_image *image, fz_matrix ctm,
 	fz_colorspace *colorspace, float *color, float alpha)
 {
 	fz_draw_device *dev = devp->user;
 	unsigned char colorbv[FZ_MAX_COLORS + 1];
 	float colorfv[FZ_MAX_COLORS];
 	fz_pixmap *scaled = NULL;
-	int dx, dy;
+	fz_pixmap *pixmap;
+	fz_pixmap *orig_pixmap;
+	fz_bitmap *bitmap;
+	unsigned char levels[2];
+	int dx, dy, gridfit;
 	int i;
+	fz_context *ctx = dev->ctx;
 	fz_draw_state *state = &dev->stack[dev->top];
 	fz_colorspace *model = state->dest->colorspace;
 	fz_bbox clip = fz_bound_pixmap(state->dest);
 
 	clip = fz_intersect_bbox(clip, state->scissor);
 
+	fz_var(scaled);
+
 	if (image->w == 0 || image->h == 0)
 		return;
 
+	gridfit = alpha == 1.0f && !(dev->flags & FZ_DRAWDEV_FLAGS_TYPE3);
+	pixmap = fz_draw_image_pixmap(ctx, image, &ctm, clip, &gridfit, &dx, &dy, &bitmap, levels, NULL);
+	orig_pixmap = pixmap;
+
 	if (state->blendmode & FZ_BLEND_KNOCKOUT)
 		state = fz_knockout_begin(dev);
 
-	dx = sqrtf(ctm.a * ctm.a + ctm.b * ctm.b);
-	dy = sqrtf(ctm.c * ctm.c + ctm.d * ctm.d);
-	if (dx < image->w && dy < image->h)
+	fz_try(ctx)
 	{
-		int gridfit = alpha == 1.0f && !(dev->flags & FZ_DRAWDEV_FLAGS_TYPE3);
-		scaled = fz_transform_pixmap(dev->ctx, image, &ctm, state->dest->x, state->dest->y, dx, dy, gridfit, &clip);
-		if (!scaled)
+		fz_convert_color(ctx, colorspace, color, model, colorfv);
+		for (i = 0; i < model->n; i++)
+			colorbv[i] = colorfv[i] * 255;
+		colorbv[i] = alpha * 255;
+
+		if (bitmap)
 		{
-			if (dx < 1)
-				dx = 1;
-			if (dy < 1)
-				dy = 1;
-			scaled = fz_scale_pixmap(dev->ctx, image, image->x, image->y, dx, dy, NULL);
+			fz_paint_bitmap_with_color(state->dest, state->scissor, state->shape, bitmap, image->interpolate, ctm, levels, colorbv);
 		}
-		if (scaled)
-			image = scaled;
-	}
-
-	fz_convert_color(dev->ctx, colorspace, color, model, colorfv);
-	for (i = 0; i < model->n; i++)
-		colorbv[i] = colorfv[i] * 255;
-	colorbv[i] = alpha * 255;
-
-	fz_paint_image_with_color(state->dest, state->scissor, state->shape, image, ctm, colorbv);
+		else
+		{
+			if (dx < pixmap->w && dy < pixmap->h)
+			{
+				scaled = fz_transform_pixmap(ctx, pixmap, NULL, &ctm, state->dest->x, state->dest->y, dx, dy, gridfit, &clip);
+				if (!scaled)
+				{
+					if (dx < 1)
+						dx = 1;
+					if (dy < 1)
+						dy = 1;
+					scaled = fz_scale_pixmap(ctx, pixmap, pixmap->x, pixmap->y, dx, dy, NULL);
+				}
+				if (scaled)
+					pixmap = scaled;
+			}
 
-	if (scaled)
-		fz_drop_pixmap(dev->ctx, scaled);
+			fz_paint_image_with_color(state->dest, state->scissor, state->shape, pixmap, ctm, colorbv);
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_drop_pixmap(ctx, scaled);
+		fz_drop_pixmap(ctx, orig_pixmap);
+		fz_drop_bitmap(ctx, bitmap);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
 
 	if (state->blendmode & FZ_BLEND_KNOCKOUT)
 		fz_knockout_end(dev);
 }
 
 static void
-fz_draw_clip_image_mask(fz_device *devp, fz_pixmap *image, fz_rect *rect, fz_matrix ctm)
+fz_draw_clip_image_mask(fz_device *devp, fz_image *image, fz_rect *rect, fz_matrix ctm)
 {
 	fz_draw_device *dev = devp->user;
 	fz_context *ctx = dev->ctx;
@@ -1038,7 +1380,11 @@ fz_draw_clip_image_mask(fz_device *devp, fz_pixmap *image, fz_rect *rect, fz_mat
 	fz_pixmap *dest = NULL;
 	fz_pixmap *shape = NULL;
 	fz_pixmap *scaled = NULL;
-	int dx, dy;
+	fz_pixmap *pixmap = NULL;
+	fz_pixmap *orig_pixmap = NULL;
+	fz_bitmap *bitmap = NULL;
+	unsigned char levels[2];
+	int dx, dy, gridfit;
 	fz_draw_state *state = push_stack(dev);
 	fz_colorspace *model = state->dest->colorspace;
 	fz_bbox clip = fz_bound_pixmap(state->dest);
@@ -1048,6 +1394,9 @@ fz_draw_clip_image_mask(fz_device *devp, fz_pixmap *image, fz_rect *rect, fz_mat
 	fz_var(mask);
 	fz_var(dest);
 	fz_var(shape);
+	fz_var(scaled);
+	fz_var(orig_pixmap);
+	fz_var(bitmap);
 
 	if (image->w == 0 || image->h == 0)
 	{
@@ -1080,36 +1429,44 @@ fz_draw_clip_image_mask(fz_device *devp, fz_pixmap *image, fz_rect *rect, fz_mat
 			fz_clear_pixmap(dev->ctx, shape);
 		}
 
-		dx = sqrtf(ctm.a * ctm.a + ctm.b * ctm.b);
-		dy = sqrtf(ctm.c * ctm.c + ctm.d * ctm.d);
-		if (dx < image->w && dy < image->h)
+		gridfit = !(dev->flags & FZ_DRAWDEV_FLAGS_TYPE3);
+		pixmap = fz_draw_image_pixmap(ctx, image, &ctm, bbox, &gridfit, &dx, &dy, &bitmap, levels, NULL);
+		orig_pixmap = pixmap;
+		if (pixmap && dx < pixmap->w && dy < pixmap->h)
 		{
-			int gridfit = !(dev->flags & FZ_DRAWDEV_FLAGS_TYPE3);
-			scaled = fz_transform_pixmap(dev->ctx, image, &ctm, state->dest->x, state->dest->y, dx, dy, gridfit, &clip);
+			scaled = fz_transform_pixmap(dev->ctx, pixmap, NULL, &ctm, state->dest->x, state->dest->y, dx, dy, gridfit, &clip);
 			if (!scaled)
 			{
 				if (dx < 1)
 					dx = 1;
 				if (dy < 1)
 					dy = 1;
-				scaled = fz_scale_pixmap(dev->ctx, image, image->x, image->y, dx, dy, NULL);
+				scaled = fz_scale_pixmap(dev->ctx, pixmap, pixmap->x, pixmap->y, dx, dy, NULL);
 			}
 			if (scaled)
-				image = scaled;
+				pixmap = scaled;
 		}
 	}
 	fz_catch(ctx)
 	{
+		fz_drop_pixmap(ctx, scaled);
+		fz_drop_pixmap(ctx, orig_pixmap);
+		fz_drop_bitmap(ctx, bitmap);
 		fz_drop_pixmap(ctx, shape);
 		fz_drop_pixmap(ctx, dest);
 		fz_drop_pixmap(ctx, mask);
 		fz_rethrow(ctx);
 	}
 
-	fz_paint_image(mask, bbox, state->shape, image, ctm, 255);
+	if (bitmap)
+		fz_paint_bitmap(mask, bbox, state->shape, bitmap, image->interpolate, ctm, levels, 255);
+	else
+		fz_paint_image(mask, bbox, state->shape, pixmap, ctm, 255);
 
 	if (scaled)
 		fz_drop_pixmap(dev->ctx, scaled);
+	fz_drop_pixmap(dev->ctx, orig_pixmap);
+	fz_drop_bitmap(dev->ctx, bitmap);
 
 	state[1].blendmode |= FZ_BLEND_ISOLATED;
 	state[1].scissor = bbox;
@@ -2,16 +2,9 @@
 
 #define MAX_FONT_SIZE 1000
 #define MAX_GLYPH_SIZE 256
-#define MAX_CACHE_SIZE (1024*1024)
 
 typedef struct fz_glyph_key_s fz_glyph_key;
-
-struct fz_glyph_cache_s
-{
-	int refs;
-	fz_hash_table *hash;
-	int total;
-};
+typedef struct fz_glyph_cache_entry_s fz_glyph_cache_entry;
 
 struct fz_glyph_key_s
 {
@@ -22,6 +15,33 @@ struct fz_glyph_key_s
 	unsigned char e, f;
 };
 
+/*
+	Cached glyphs are kept on a list in order of use, and the least
+	recently used ones are evicted to make room for new glyphs.
+
+	The cache does not hold references to fonts; instead fz_drop_font
+	purges the glyphs of a font before freeing it.
+*/
+struct fz_glyph_cache_entry_s
+{
+	fz_glyph_key key;
+	fz_glyph *val;
+	unsigned int size;
+	fz_glyph_cache_entry *lru_prev;
+	fz_glyph_cache_entry *lru_next;
+};
+
+struct fz_glyph_cache_s
+{
+	int refs;
+	fz_hash_table *hash;
+	fz_glyph_cache_entry *lru_head;
+	fz_glyph_cache_entry *lru_tail;
+	unsigned int total;
+	unsigned int max;
+	fz_glyph_cache_stats stats;
+};
+
 void
 fz_new_glyph_cache_context(fz_context *ctx)
 {
@@ -38,33 +58,118 @@ fz_new_glyph_cache_context(fz_context *ctx)
 		fz_rethrow(ctx);
 	}
 	cache->total = 0;
+	cache->max = FZ_GLYPH_CACHE_DEFAULT;
 	cache->refs = 1;
 
 	ctx->glyph_cache = cache;
 }
 
-/* The glyph cache lock is always held when this function is called. */
+void
+fz_set_glyph_cache_size(fz_context *ctx, unsigned int max)
+{
+	if (!ctx->glyph_cache)
+		return;
+	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+	ctx->glyph_cache->max = max;
+	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+}
+
+/* The glyph cache lock is held when these functions are called. */
+
+static void
+unlink_entry(fz_glyph_cache *cache, fz_glyph_cache_entry *entry)
+{
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		cache->lru_head = entry->lru_next;
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		cache->lru_tail = entry->lru_prev;
+}
+
 static void
-fz_evict_glyph_cache(fz_context *ctx)
+link_entry(fz_glyph_cache *cache, fz_glyph_cache_entry *entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = cache->lru_head;
+	if (cache->lru_head)
+		cache->lru_head->lru_prev = entry;
+	else
+		cache->lru_tail = entry;
+	cache->lru_head = entry;
+}
+
+static void
+drop_entry(fz_context *ctx, fz_glyph_cache *cache, fz_glyph_cache_entry *entry)
+{
+	unlink_entry(cache, entry);
+	fz_hash_remove(ctx, cache->hash, &entry->key);
+	cache->total -= entry->size;
+	cache->stats.items--;
+	fz_drop_glyph(ctx, entry->val);
+	fz_free(ctx, entry);
+}
+
+/* Inserting into a hash table this full would make it grow */
+static int
+glyph_hash_full(fz_context *ctx, fz_glyph_cache *cache)
+{
+	return cache->stats.items >= (unsigned int)fz_hash_len(ctx, cache->hash) * 8 / 10;
+}
+
+/* Evict least recently used glyphs until there is room for size more
+ * bytes, and for one more entry in the hash table. */
+static void
+fz_evict_glyph_cache(fz_context *ctx, unsigned int size)
 {
 	fz_glyph_cache *cache = ctx->glyph_cache;
-	fz_glyph_key *key;
-	fz_pixmap *pixmap;
-	int i;
 
-	for (i = 0; i < fz_hash_len(ctx, cache->hash); i++)
+	while (cache->lru_tail && (cache->total + size > cache->max || glyph_hash_full(ctx, cache)))
 	{
-		key = fz_hash_get_key(ctx, cache->hash, i);
-		if (key->font)
-			fz_drop_font(ctx, key->font);
-		pixmap = fz_hash_get_val(ctx, cache->hash, i);
-		if (pixmap)
-			fz_drop_pixmap(ctx, pixmap);
+		drop_entry(ctx, cache, cache->lru_tail);
+		cache->stats.evictions++;
 	}
+}
 
-	cache->total = 0;
+static void
+fz_empty_glyph_cache(fz_context *ctx)
+{
+	fz_glyph_cache *cache = ctx->glyph_cache;
+
+	while (cache->lru_head)
+		drop_entry(ctx, cache, cache->lru_head);
+}
+
+void
+fz_purge_glyph_cache(fz_context *ctx)
+{
+	if (!ctx->glyph_cache)
+		return;
+	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+	fz_empty_glyph_cache(ctx);
+	ctx->glyph_cache->stats.flushes++;
+	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+}
+
+/* Called when the last reference to a font goes away. */
+void
+fz_purge_glyph_cache_font(fz_context *ctx, fz_font *font)
+{
+	fz_glyph_cache *cache = ctx->glyph_cache;
+	fz_glyph_cache_entry *entry, *next;
 
-	fz_empty_hash(ctx, cache->hash);
+	if (!cache)
+		return;
+	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+	for (entry = cache->lru_head; entry; entry = next)
+	{
+		next = entry->lru_next;
+		if (entry->key.font == font)
+			drop_entry(ctx, cache, entry);
+	}
+	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
 }
 
 void
@@ -77,7 +182,7 @@ fz_drop_glyph_cache_context(fz_context *ctx)
 	ctx->glyph_cache->refs--;
 	if (ctx->glyph_cache->refs == 0)
 	{
-		fz_evict_glyph_cache(ctx);
+		fz_empty_glyph_cache(ctx);
 		fz_free_hash(ctx, ctx->glyph_cache->hash);
 		fz_free(ctx, ctx->glyph_cache);
 		ctx->glyph_cache = NULL;
@@ -94,22 +199,100 @@ fz_keep_glyph_cache(fz_context *ctx)
 	return ctx->glyph_cache;
 }
 
-fz_pixmap *
+void
+fz_get_glyph_cache_stats(fz_context *ctx, fz_glyph_cache_stats *stats)
+{
+	fz_glyph_cache *cache = ctx->glyph_cache;
+
+	if (!cache)
+	{
+		memset(stats, 0, sizeof *stats);
+		return;
+	}
+
+	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+	*stats = cache->stats;
+	stats->bytes = cache->total;
+	stats->max = cache->max;
+	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+}
+
+void
+fz_print_glyph_cache_stats(fz_context *ctx, FILE *out)
+{
+	fz_glyph_cache_stats stats;
+
+	fz_get_glyph_cache_stats(ctx, &stats);
+	fprintf(out, "glyph cache: %u items, %u bytes, peak %u, max %u\n",
+		stats.items, stats.bytes, stats.peak, stats.max);
+	fprintf(out, "glyph cache: %d hits, %d misses, %d insertions, %d evictions, %d flushes\n",
+		stats.hits, stats.misses, stats.insertions, stats.evictions, stats.flushes);
+}
+
+/* Returns a hash table twice the size of the current one if that is
+ * full, or NULL. Called without the lock held. */
+static fz_hash_table *
+fz_new_glyph_hash(fz_context *ctx, fz_glyph_cache *cache)
+{
+	fz_hash_table *hash = NULL;
+	int full, size;
+
+	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+	full = glyph_hash_full(ctx, cache);
+	size = fz_hash_len(ctx, cache->hash);
+	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+
+	if (full)
+	{
+		fz_try(ctx)
+		{
+			hash = fz_new_hash_table(ctx, size * 2, sizeof(fz_glyph_key));
+		}
+		fz_catch(ctx)
+		{
+			hash = NULL;
+		}
+	}
+	return hash;
+}
+
+/* Move the entries into a larger hash table; returns the one not in use. */
+static fz_hash_table *
+fz_swap_glyph_hash(fz_context *ctx, fz_glyph_cache *cache, fz_hash_table *hash)
+{
+	fz_glyph_cache_entry *entry;
+	fz_hash_table *old;
+
+	if (!hash || fz_hash_len(ctx, hash) <= fz_hash_len(ctx, cache->hash))
+		return hash;
+	for (entry = cache->lru_head; entry; entry = entry->lru_next)
+		fz_hash_insert(ctx, hash, &entry->key, entry);
+	old = cache->hash;
+	cache->hash = hash;
+	return old;
+}
+
+fz_glyph *
 fz_render_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, fz_matrix ctm, fz_stroke_state *stroke)
 {
 	if (font->ft_face)
-		return fz_render_ft_stroked_glyph(ctx, font, gid, trm, ctm, stroke);
+		return fz_new_glyph_from_pixmap(ctx, fz_render_ft_stroked_glyph(ctx, font, gid, trm, ctm, stroke));
 	return fz_render_glyph(ctx, font, gid, trm, NULL);
 }
 
-fz_pixmap *
+fz_glyph *
 fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix ctm, fz_colorspace *model)
 {
 	fz_glyph_cache *cache;
+	fz_glyph_cache_entry *entry, *other;
+	fz_hash_table *hash;
 	fz_glyph_key key;
-	fz_pixmap *val;
+	fz_pixmap *pix;
+	fz_glyph *val;
 	float size = fz_matrix_expansion(ctm);
 
+	fz_var(entry);
+
 	cache = ctx->glyph_cache;
 
 	if (size > MAX_FONT_SIZE)
@@ -130,76 +313,99 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix ctm, fz_color
 	key.f = (ctm.f - floorf(ctm.f)) * 256;
 
 	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-	val = fz_hash_find(ctx, cache->hash, &key);
-	if (val)
+	entry = fz_hash_find(ctx, cache->hash, &key);
+	if (entry)
 	{
-		fz_keep_pixmap(ctx, val);
+		/* Move to the front of the LRU list */
+		unlink_entry(cache, entry);
+		link_entry(cache, entry);
+		val = fz_keep_glyph(ctx, entry->val);
+		cache->stats.hits++;
 		fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
 		return val;
 	}
+	cache->stats.misses++;
 
 	ctm.e = floorf(ctm.e) + key.e / 256.0f;
 	ctm.f = floorf(ctm.f) + key.f / 256.0f;
 
+	/* We drop the glyph cache lock while rendering, so that other
+	 * threads can use the cache (and render glyphs of their own) in
+	 * the meantime. The danger here is that some other thread will
+	 * come along, and want the same glyph too. If it does, we may
+	 * both end up rendering it. We cope with this later on, by
+	 * ensuring that only one gets inserted into the cache. If we
+	 * insert ours to find one already there, we abandon ours, and
+	 * use the one there already.
+	 */
+	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+	if (font->ft_face)
+	{
+		pix = fz_render_ft_glyph(ctx, font, gid, ctm);
+	}
+	else if (font->t3procs)
+	{
+		pix = fz_render_t3_glyph(ctx, font, gid, ctm, model);
+	}
+	else
+	{
+		fz_warn(ctx, "assert: uninitialized font structure");
+		pix = NULL;
+	}
+	val = fz_new_glyph_from_pixmap(ctx, pix);
+
+	if (!val || val->w >= MAX_GLYPH_SIZE || val->h >= MAX_GLYPH_SIZE)
+		return val;
+
+	/* Nothing may be allocated while the lock is held: an allocation
+	 * that fails frees up memory by emptying the store, which can drop
+	 * fonts, and dropping a font purges its glyphs under the lock. So
+	 * the entry, and a larger hash table if needed, are made first. */
+	entry = NULL;
 	fz_try(ctx)
 	{
-		if (font->ft_face)
-		{
-			val = fz_render_ft_glyph(ctx, font, gid, ctm);
-		}
-		else if (font->t3procs)
-		{
-			/* We drop the glyphcache here, and execute the t3
-			 * glyph code. The danger here is that some other
-			 * thread will come along, and want the same glyph
-			 * too. If it does, we may both end up rendering
-			 * pixmaps. We cope with this later on, by ensuring
-			 * that only one gets inserted into the cache. If
-			 * we insert ours to find one already there, we
-			 * abandon ours, and use the one there already.
-			 */
-			fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
-			val = fz_render_t3_glyph(ctx, font, gid, ctm, model);
-			fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-		}
-		else
-		{
-			fz_warn(ctx, "assert: uninitialized font structure");
-			val = NULL;
-		}
+		entry = fz_malloc_struct(ctx, fz_glyph_cache_entry);
 	}
 	fz_catch(ctx)
 	{
-		fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
-		fz_rethrow(ctx);
+		fz_warn(ctx, "Failed to encache glyph - continuing");
+		return val;
 	}
+	hash = fz_new_glyph_hash(ctx, cache);
 
-	if (val)
+	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+	hash = fz_swap_glyph_hash(ctx, cache, hash);
+
+	/* Another thread may have beaten us to it while we
+	 * rendered; if so use theirs. */
+	other = fz_hash_find(ctx, cache->hash, &key);
+	if (other)
 	{
-		if (val->w < MAX_GLYPH_SIZE && val->h < MAX_GLYPH_SIZE)
-		{
-			if (cache->total + val->w * val->h > MAX_CACHE_SIZE)
-				fz_evict_glyph_cache(ctx);
-			fz_try(ctx)
-			{
-				fz_pixmap *pix = fz_hash_insert(ctx, cache->hash, &key, val);
-				if (pix)
-				{
-					fz_drop_pixmap(ctx, val);
-					val = pix;
-				}
-				else
-					fz_keep_font(ctx, key.font);
-				val = fz_keep_pixmap(ctx, val);
-			}
-			fz_catch(ctx)
-			{
-				fz_warn(ctx, "Failed to encache glyph - continuing");
-			}
-			cache->total += val->w * val->h;
-		}
+		fz_drop_glyph(ctx, val);
+		val = fz_keep_glyph(ctx, other->val);
+	}
+	else
+	{
+		unsigned int glyph_size = fz_glyph_size(ctx, val);
+
+		fz_evict_glyph_cache(ctx, glyph_size);
+		entry->key = key;
+		entry->val = fz_keep_glyph(ctx, val);
+		entry->size = glyph_size;
+		fz_hash_insert(ctx, cache->hash, &key, entry);
+		link_entry(cache, entry);
+		entry = NULL;
+		cache->total += glyph_size;
+		cache->stats.insertions++;
+		cache->stats.items++;
+		if (cache->total > cache->stats.peak)
+			cache->stats.peak = cache->total;
 	}
 
 	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+
+	fz_free(ctx, entry);
+	if (hash)
+		fz_free_hash(ctx, hash);
 	return val;
 }
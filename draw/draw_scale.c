@@ -1202,21 +1202,52 @@ scale_single_col(unsigned char *dst, unsigned char *src, fz_weights *weights, in
 }
 #endif /* SINGLE_PIXEL_SPECIALS */
 
+/* Look a run of palette indices up, into premultiplied colors */
+static unsigned char *
+lookup_indices(unsigned char *dst, unsigned char *src, int len, fz_pixmap *palette)
+{
+	unsigned char *d = dst;
+	int n = palette->n;
+
+	while (len--)
+	{
+		memcpy(d, palette->samples + *src++ * n, n);
+		d += n;
+	}
+	return dst;
+}
+
 fz_pixmap *
 fz_scale_pixmap(fz_context *ctx, fz_pixmap *src, float x, float y, float w, float h, fz_bbox *clip)
+{
+	return fz_scale_indexed_pixmap(ctx, src, NULL, x, y, w, h, clip);
+}
+
+/*
+	If palette is not NULL, src holds one byte of index into it per pixel,
+	and has no colorspace; the result is in the palette's colorspace. Each
+	row of indices is looked up as the scaler reads it, so the colors are
+	never held for more than a row of the source.
+*/
+fz_pixmap *
+fz_scale_indexed_pixmap(fz_context *ctx, fz_pixmap *src, fz_pixmap *palette, float x, float y, float w, float h, fz_bbox *clip)
 {
 	fz_scale_filter *filter = &fz_scale_filter_simple;
 	fz_weights *contrib_rows = NULL;
 	fz_weights *contrib_cols = NULL;
 	fz_pixmap *output = NULL;
 	int *temp = NULL;
+	unsigned char *colors = NULL;
+	unsigned char *samples;
 	int max_row, temp_span, temp_rows, row;
 	int dst_w_int, dst_h_int, dst_x_int, dst_y_int;
 	int flip_x, flip_y;
+	int n = palette ? palette->n : src->n;
 	fz_bbox patch;
 
 	fz_var(contrib_cols);
 	fz_var(contrib_rows);
+	fz_var(colors);
 
 	DBUG(("Scale: (%d,%d) to (%g,%g) at (%g,%g)\n",src->w,src->h,w,h,x,y));
 
@@ -1340,18 +1371,24 @@ fz_scale_pixmap(fz_context *ctx, fz_pixmap *src, float x, float y, float w, floa
 			contrib_cols = NULL;
 		else
 #endif /* SINGLE_PIXEL_SPECIALS */
-			contrib_cols = make_weights(ctx, src->w, x, w, filter, 0, dst_w_int, patch.x0, patch.x1, src->n, flip_x);
+			contrib_cols = make_weights(ctx, src->w, x, w, filter, 0, dst_w_int, patch.x0, patch.x1, n, flip_x);
 #ifdef SINGLE_PIXEL_SPECIALS
 		if (src->h == 1)
 			contrib_rows = NULL;
 		else
 #endif /* SINGLE_PIXEL_SPECIALS */
-			contrib_rows = make_weights(ctx, src->h, y, h, filter, 1, dst_h_int, patch.y0, patch.y1, src->n, flip_y);
+			contrib_rows = make_weights(ctx, src->h, y, h, filter, 1, dst_h_int, patch.y0, patch.y1, n, flip_y);
+
+		/* Room for a row of colors, or all of them for a source
+		 * that is a single row or column */
+		if (palette)
+			colors = fz_malloc_array(ctx, src->w == 1 ? src->h : src->w, n);
 
-		output = fz_new_pixmap(ctx, src->colorspace, patch.x1 - patch.x0, patch.y1 - patch.y0);
+		output = fz_new_pixmap(ctx, palette ? palette->colorspace : src->colorspace, patch.x1 - patch.x0, patch.y1 - patch.y0);
 	}
 	fz_catch(ctx)
 	{
+		fz_free(ctx, colors);
 		fz_free(ctx, contrib_cols);
 		fz_free(ctx, contrib_rows);
 		fz_rethrow(ctx);
@@ -1361,31 +1398,34 @@ fz_scale_pixmap(fz_context *ctx, fz_pixmap *src, float x, float y, float w, floa
 
 	/* Step 2: Apply the weights */
 #ifdef SINGLE_PIXEL_SPECIALS
+	samples = src->samples;
+	if (palette && (!contrib_rows || !contrib_cols))
+		samples = lookup_indices(colors, src->samples, src->w * src->h, palette);
 	if (!contrib_rows)
 	{
 		/* Only 1 source pixel high. */
 		if (!contrib_cols)
 		{
 			/* Only 1 pixel in the entire image! */
-			duplicate_single_pixel(output->samples, src->samples, src->n, patch.x1-patch.x0, patch.y1-patch.y0);
+			duplicate_single_pixel(output->samples, samples, n, patch.x1-patch.x0, patch.y1-patch.y0);
 		}
 		else
 		{
 			/* Scale the row once, then copy it. */
-			scale_single_row(output->samples, src->samples, contrib_cols, src->w, patch.y1-patch.y0);
+			scale_single_row(output->samples, samples, contrib_cols, src->w, patch.y1-patch.y0);
 		}
 	}
 	else if (!contrib_cols)
 	{
 		/* Only 1 source pixel wide. Scale the col and duplicate. */
-		scale_single_col(output->samples, src->samples, contrib_rows, src->h, src->n, patch.x1-patch.x0, flip_y);
+		scale_single_col(output->samples, samples, contrib_rows, src->h, n, patch.x1-patch.x0, flip_y);
 	}
 	else
 #endif /* SINGLE_PIXEL_SPECIALS */
 	{
 		void (*row_scale)(int *dst, unsigned char *src, fz_weights *weights);
 
-		temp_span = contrib_cols->count * src->n;
+		temp_span = contrib_cols->count * n;
 		temp_rows = contrib_rows->max_len;
 		if (temp_span <= 0 || temp_rows > INT_MAX / temp_span)
 			goto cleanup;
@@ -1396,11 +1436,12 @@ fz_scale_pixmap(fz_context *ctx, fz_pixmap *src, float x, float y, float w, floa
 		fz_catch(ctx)
 		{
 			fz_drop_pixmap(ctx, output);
+			fz_free(ctx, colors);
 			fz_free(ctx, contrib_cols);
 			fz_free(ctx, contrib_rows);
 			fz_rethrow(ctx);
 		}
-		switch (src->n)
+		switch (n)
 		{
 		default:
 			row_scale = scale_row_to_temp;
@@ -1431,7 +1472,10 @@ fz_scale_pixmap(fz_context *ctx, fz_pixmap *src, float x, float y, float w, floa
 				/* Scale another row */
 				assert(max_row < src->h);
 				DBUG(("scaling row %d to temp\n", max_row));
-				(*row_scale)(&temp[temp_span*(max_row % temp_rows)], &src->samples[(flip_y ? (src->h-1-max_row): max_row)*src->w*src->n], contrib_cols);
+				samples = &src->samples[(flip_y ? (src->h-1-max_row): max_row)*src->w*src->n];
+				if (palette)
+					samples = lookup_indices(colors, samples, src->w, palette);
+				(*row_scale)(&temp[temp_span*(max_row % temp_rows)], samples, contrib_cols);
 				max_row++;
 			}
 
@@ -1442,6 +1486,7 @@ fz_scale_pixmap(fz_context *ctx, fz_pixmap *src, float x, float y, float w, floa
 	}
 
 cleanup:
+	fz_free(ctx, colors);
 	fz_free(ctx, contrib_rows);
 	fz_free(ctx, contrib_cols);
 	return output;
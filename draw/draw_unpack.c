@@ -239,3 +239,38 @@ fz_decode_tile(fz_pixmap *pix, float *decode)
 		p += pix->n;
 	}
 }
+
+/*
+	Unpack the area of a bilevel bitmap into a pixmap, with bits of 0 and
+	1 turned into the samples levels[0] and levels[1], and opaque alpha
+	when there is a colorspace.
+*/
+fz_pixmap *
+fz_unpack_bitmap(fz_context *ctx, fz_bitmap *bit, fz_colorspace *colorspace, unsigned char levels[2], fz_bbox area)
+{
+	fz_pixmap *pix;
+	unsigned char *s, *d;
+	int x, y, k, b;
+
+	assert(bit->n == 1 && (!colorspace || colorspace->n == 1));
+
+	pix = fz_new_pixmap(ctx, colorspace, area.x1 - area.x0, area.y1 - area.y0);
+	d = pix->samples;
+	for (y = area.y0; y < area.y1; y++)
+	{
+		s = bit->samples + y * bit->stride;
+		x = area.x0;
+		while (x < area.x1)
+		{
+			b = s[x >> 3];
+			for (k = x & 7; k < 8 && x < area.x1; k++, x++)
+			{
+				*d++ = levels[(b >> (7 - k)) & 1];
+				if (colorspace)
+					*d++ = 255;
+			}
+		}
+	}
+
+	return pix;
+}
@@ -15,9 +15,11 @@ fz_free_context(fz_context *ctx)
 		return;
 
 	/* Other finalisation calls go here (in reverse order) */
+	fz_drop_disk_cache_context(ctx);
 	fz_drop_glyph_cache_context(ctx);
 	fz_drop_store_context(ctx);
 	fz_free_aa_context(ctx);
+	fz_free_ft_context(ctx);
 	fz_drop_font_context(ctx);
 
 	if (ctx->warn)
@@ -133,5 +135,6 @@ fz_clone_context_internal(fz_context *ctx)
 	new_ctx->store = fz_store_keep(ctx);
 	new_ctx->glyph_cache = fz_keep_glyph_cache(ctx);
 	new_ctx->font = fz_keep_font_context(ctx);
+	new_ctx->disk_cache = fz_keep_disk_cache(ctx);
 	return new_ctx;
 }
@@ -149,6 +149,11 @@ fz_keep_obj(fz_obj *obj)
 	return obj;
 }
 
+int fz_obj_refs(fz_obj *obj)
+{
+	return obj ? obj->refs : 0;
+}
+
 int fz_is_indirect(fz_obj *obj)
 {
 	return obj ? obj->kind == FZ_INDIRECT : 0;
@@ -384,6 +389,150 @@ fz_objcmp(fz_obj *a, fz_obj *b)
 	return 1;
 }
 
+static unsigned int
+fz_hash_bytes(unsigned int h, const unsigned char *s, int len)
+{
+	while (len--)
+		h = (h ^ *s++) * 16777619;
+	return h;
+}
+
+static unsigned int
+fz_hash_int(unsigned int h, int i)
+{
+	return fz_hash_bytes(h, (const unsigned char *)&i, sizeof i);
+}
+
+/* Structural hash of an object, consistent with fz_objcmp: objects that
+ * compare equal always hash the same. Indirect references are hashed on
+ * their number and generation, and are not resolved. */
+unsigned int
+fz_objhash(fz_obj *obj)
+{
+	unsigned int h = 2166136261u;
+	float f;
+	int i;
+
+	if (!obj)
+		return h;
+
+	h = fz_hash_int(h, obj->kind);
+
+	switch (obj->kind)
+	{
+	case FZ_NULL:
+		break;
+
+	case FZ_BOOL:
+		h = fz_hash_int(h, obj->u.b);
+		break;
+
+	case FZ_INT:
+		h = fz_hash_int(h, obj->u.i);
+		break;
+
+	case FZ_REAL:
+		/* 0 and -0 compare equal */
+		f = obj->u.f == 0 ? 0 : obj->u.f;
+		h = fz_hash_bytes(h, (const unsigned char *)&f, sizeof f);
+		break;
+
+	case FZ_STRING:
+		h = fz_hash_bytes(h, (const unsigned char *)obj->u.s.buf, obj->u.s.len);
+		break;
+
+	case FZ_NAME:
+		h = fz_hash_bytes(h, (const unsigned char *)obj->u.n, strlen(obj->u.n));
+		break;
+
+	case FZ_INDIRECT:
+		h = fz_hash_int(h, obj->u.r.num);
+		h = fz_hash_int(h, obj->u.r.gen);
+		break;
+
+	case FZ_ARRAY:
+		for (i = 0; i < obj->u.a.len; i++)
+			h = fz_hash_int(h, fz_objhash(obj->u.a.items[i]));
+		break;
+
+	case FZ_DICT:
+		for (i = 0; i < obj->u.d.len; i++)
+		{
+			h = fz_hash_int(h, fz_objhash(obj->u.d.items[i].k));
+			h = fz_hash_int(h, fz_objhash(obj->u.d.items[i].v));
+		}
+		break;
+	}
+
+	return h;
+}
+
+/* Digest an object for use in persistent keys. Like fz_objhash, equal
+ * objects digest the same and indirect references are not resolved. */
+void
+fz_md5_obj(fz_md5 *state, fz_obj *obj)
+{
+	unsigned char kind = obj ? obj->kind : 0;
+	int i, n[2];
+	float f;
+
+	fz_md5_update(state, &kind, 1);
+	if (!obj)
+		return;
+
+	switch (obj->kind)
+	{
+	case FZ_NULL:
+		break;
+
+	case FZ_BOOL:
+		fz_md5_update(state, (unsigned char *)&obj->u.b, sizeof obj->u.b);
+		break;
+
+	case FZ_INT:
+		fz_md5_update(state, (unsigned char *)&obj->u.i, sizeof obj->u.i);
+		break;
+
+	case FZ_REAL:
+		f = obj->u.f == 0 ? 0 : obj->u.f;
+		fz_md5_update(state, (unsigned char *)&f, sizeof f);
+		break;
+
+	case FZ_STRING:
+		n[0] = obj->u.s.len;
+		fz_md5_update(state, (unsigned char *)n, sizeof n[0]);
+		fz_md5_update(state, (unsigned char *)obj->u.s.buf, obj->u.s.len);
+		break;
+
+	case FZ_NAME:
+		fz_md5_update(state, (unsigned char *)obj->u.n, strlen(obj->u.n) + 1);
+		break;
+
+	case FZ_INDIRECT:
+		n[0] = obj->u.r.num;
+		n[1] = obj->u.r.gen;
+		fz_md5_update(state, (unsigned char *)n, sizeof n);
+		break;
+
+	case FZ_ARRAY:
+		n[0] = obj->u.a.len;
+		fz_md5_update(state, (unsigned char *)n, sizeof n[0]);
+		for (i = 0; i < obj->u.a.len; i++)
+			fz_md5_obj(state, obj->u.a.items[i]);
+		break;
+
+	case FZ_DICT:
+		n[0] = obj->u.d.len;
+		fz_md5_update(state, (unsigned char *)n, sizeof n[0]);
+		for (i = 0; i < obj->u.d.len; i++)
+		{
+			fz_md5_obj(state, obj->u.d.items[i].k);
+			fz_md5_obj(state, obj->u.d.items[i].v);
+		}
+		break;
+	}
+}
+
 static char *
 fz_objkindstr(fz_obj *obj)
 {
@@ -1030,6 +1179,8 @@ static void fmt_str(struct fmt *fmt, fz_obj *obj)
 			fmt_puts(fmt, "\\(");
 		else if (c == ')')
 			fmt_puts(fmt, "\\)");
+		else if (c == '\\')
+			fmt_puts(fmt, "\\\\");
 		else if (c < 32 || c >= 127) {
 			char buf[16];
 			fmt_putc(fmt, '\\');
@@ -1205,7 +1356,7 @@ static void fmt_obj(struct fmt *fmt, fz_obj *obj)
 		fmt_puts(fmt, "<unknown object>");
 }
 
-static int
+int
 fz_sprint_obj(char *s, int n, fz_obj *obj, int tight)
 {
 	struct fmt fmt;
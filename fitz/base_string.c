@@ -246,10 +246,59 @@ runelen(int c)
 	return runetochar(str, &c);
 }
 
+/* Plain decimals, which is what the PDF lexer gives us, are converted
+ * without strtod. With at most 15 significant digits the mantissa and
+ * the power of ten are both exact in a double, so the one division
+ * rounds the same way that strtod would. */
+static int
+fz_atof_decimal(const char *s, double *d)
+{
+	static const double pow10[] =
+	{
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+	double m = 0;
+	int neg = 0, frac = -1, sig = 0, any = 0;
+
+	if (*s == '-')
+		neg = 1, s++;
+	else if (*s == '+')
+		s++;
+
+	for (;; s++)
+	{
+		if (*s >= '0' && *s <= '9')
+		{
+			if ((m != 0 || *s != '0') && ++sig > 15)
+				return 0;
+			m = m * 10 + (*s - '0');
+			if (frac >= 0)
+				frac++;
+			any = 1;
+		}
+		else if (*s == '.' && frac < 0)
+			frac = 0;
+		else
+			break;
+	}
+
+	if (*s || !any || frac > 22)
+		return 0;
+
+	if (frac > 0)
+		m /= pow10[frac];
+	*d = neg ? -m : m;
+	return 1;
+}
+
 float fz_atof(const char *s)
 {
 	double d;
 
+	if (fz_atof_decimal(s, &d))
+		return (float)d;
+
 	/* The errno voodoo here checks for us reading numbers that are too
 	 * big to fit into a double. The checks for FLT_MAX ensure that we
 	 * don't read a number that's OK as a double and then become invalid
@@ -20,8 +20,29 @@ static int
 read_null(fz_stream *stm, unsigned char *buf, int len)
 {
 	struct null_filter *state = stm->state;
+	fz_stream *chain = state->chain;
 	int amount = MIN(len, state->remain);
-	int n = fz_read(state->chain, buf, amount);
+	int n;
+
+	/* When refilling our own buffer, point it straight into the
+	 * buffer of the chain instead of copying. For memory and mapped
+	 * file streams that is the whole of the remaining data. */
+	if (buf == stm->bp && state->remain > 0)
+	{
+		if (chain->rp == chain->wp)
+			fz_fill_buffer(chain);
+		n = MIN(state->remain, chain->wp - chain->rp);
+		if (n > 0)
+		{
+			stm->bp = chain->rp;
+			stm->ep = chain->rp + n;
+			chain->rp += n;
+			state->remain -= n;
+		}
+		return n;
+	}
+
+	n = fz_read(chain, buf, amount);
 	state->remain -= n;
 	return n;
 }
@@ -10,6 +10,7 @@ struct fz_dctd_s
 	fz_stream *chain;
 	fz_context *ctx;
 	int color_transform;
+	int l2factor;
 	int init;
 	int stride;
 	unsigned char *scanline;
@@ -121,6 +122,10 @@ read_dctd(fz_stream *stm, unsigned char *buf, int len)
 		cinfo->dct_method = JDCT_FASTEST;
 		cinfo->do_fancy_upsampling = FALSE;
 
+		/* let the scaled inverse DCT do the subsampling */
+		cinfo->scale_num = 1;
+		cinfo->scale_denom = 1 << state->l2factor;
+
 		/* default value if ColorTransform is not set */
 		if (state->color_transform == -1)
 		{
@@ -198,7 +203,10 @@ close_dctd(fz_context *ctx, void *state_)
 		goto skip;
 	}
 
-	if (state->init)
+	/* A reader may stop before the last scanline, when it only
+	 * wants the top of the image; destroying the decompressor
+	 * aborts it */
+	if (state->init && state->cinfo.output_scanline >= state->cinfo.output_height)
 		jpeg_finish_decompress(&state->cinfo);
 
 skip:
@@ -212,9 +220,13 @@ skip:
 	fz_free(ctx, state);
 }
 
-/* Default: color_transform = -1 (unset) */
+/*
+	Default: color_transform = -1 (unset)
+	The image is scaled down by 2^l2factor (at most 3); the width and
+	height are rounded up.
+*/
 fz_stream *
-fz_open_dctd(fz_stream *chain, int color_transform)
+fz_open_dctd(fz_stream *chain, int color_transform, int l2factor)
 {
 	fz_context *ctx = chain->ctx;
 	fz_dctd *state = NULL;
@@ -227,6 +239,7 @@ fz_open_dctd(fz_stream *chain, int color_transform)
 		state->ctx = ctx;
 		state->chain = chain;
 		state->color_transform = color_transform;
+		state->l2factor = CLAMP(l2factor, 0, 3);
 		state->init = 0;
 	}
 	fz_catch(ctx)
@@ -80,6 +80,46 @@ close_flated(fz_context *ctx, void *state_)
 	fz_free(ctx, state);
 }
 
+/* Compress data in one go, for writing FlateDecode streams */
+fz_buffer *
+fz_deflate_buffer(fz_context *ctx, unsigned char *data, int len)
+{
+	fz_buffer *buf;
+	z_stream z;
+	int code;
+
+	buf = fz_new_buffer(ctx, compressBound(len));
+
+	memset(&z, 0, sizeof z);
+	z.zalloc = zalloc;
+	z.zfree = zfree;
+	z.opaque = ctx;
+
+	code = deflateInit(&z, Z_DEFAULT_COMPRESSION);
+	if (code != Z_OK)
+	{
+		fz_drop_buffer(ctx, buf);
+		fz_throw(ctx, "zlib error: deflateInit: %s", z.msg);
+	}
+
+	z.next_in = data;
+	z.avail_in = len;
+	z.next_out = buf->data;
+	z.avail_out = buf->cap;
+
+	code = deflate(&z, Z_FINISH);
+	buf->len = buf->cap - z.avail_out;
+	deflateEnd(&z);
+
+	if (code != Z_STREAM_END)
+	{
+		fz_drop_buffer(ctx, buf);
+		fz_throw(ctx, "zlib error: deflate: %s", z.msg);
+	}
+
+	return buf;
+}
+
 fz_stream *
 fz_open_flated(fz_stream *chain)
 {
@@ -109,10 +109,12 @@ typedef struct fz_alloc_context_s fz_alloc_context;
 typedef struct fz_error_context_s fz_error_context;
 typedef struct fz_warn_context_s fz_warn_context;
 typedef struct fz_font_context_s fz_font_context;
+typedef struct fz_ft_context_s fz_ft_context;
 typedef struct fz_aa_context_s fz_aa_context;
 typedef struct fz_locks_context_s fz_locks_context;
 typedef struct fz_store_s fz_store;
 typedef struct fz_glyph_cache_s fz_glyph_cache;
+typedef struct fz_disk_cache_s fz_disk_cache;
 typedef struct fz_context_s fz_context;
 
 struct fz_alloc_context_s
@@ -366,9 +368,11 @@ struct fz_context_s
 	fz_error_context *error;
 	fz_warn_context *warn;
 	fz_font_context *font;
+	fz_ft_context *ft;
 	fz_aa_context *aa;
 	fz_store *store;
 	fz_glyph_cache *glyph_cache;
+	fz_disk_cache *disk_cache;
 };
 
 fz_context *fz_new_context(fz_alloc_context *alloc, fz_locks_context *locks, unsigned int max_store);
@@ -396,6 +400,10 @@ void fz_free_aa_context(fz_context *ctx);
  * we use locks: We can never take lock n when we already hold any lock i,
  * where 0 <= i <= n. In order to verify this, we have some debugging code
  * built in, that is enabled by defining FITZ_DEBUG_LOCKING.
+ *
+ * The resource store is split into FZ_STORE_SHARDS shards, each guarded
+ * by its own lock (FZ_LOCK_STORE + n). Reference counts of storable
+ * objects are guarded by another FZ_STORE_SHARDS locks (FZ_LOCK_REFS + n).
  */
 
 #if defined(MEMENTO) || defined(DEBUG)
@@ -409,9 +417,15 @@ struct fz_locks_context_s
 	void (*unlock)(void *, int);
 };
 
+enum {
+	FZ_STORE_SHARDS = 8
+};
+
 enum {
 	FZ_LOCK_ALLOC = 0,
-	FZ_LOCK_FILE,
+	FZ_LOCK_REFS,
+	FZ_LOCK_STORE = FZ_LOCK_REFS + FZ_STORE_SHARDS,
+	FZ_LOCK_FILE = FZ_LOCK_STORE + FZ_STORE_SHARDS,
 	FZ_LOCK_FREETYPE,
 	FZ_LOCK_GLYPHCACHE,
 	FZ_LOCK_MAX
@@ -709,6 +723,7 @@ fz_obj *fz_copy_dict(fz_context *ctx, fz_obj *dict);
 
 fz_obj *fz_keep_obj(fz_obj *obj);
 void fz_drop_obj(fz_obj *obj);
+int fz_obj_refs(fz_obj *obj);
 
 /* type queries */
 int fz_is_null(fz_obj *obj);
@@ -722,6 +737,8 @@ int fz_is_dict(fz_obj *obj);
 int fz_is_indirect(fz_obj *obj);
 
 int fz_objcmp(fz_obj *a, fz_obj *b);
+unsigned int fz_objhash(fz_obj *obj);
+void fz_md5_obj(fz_md5 *state, fz_obj *obj);
 
 /* dict marking and unmarking functions - to avoid infinite recursions */
 int fz_dict_marked(fz_obj *obj);
@@ -758,6 +775,7 @@ void fz_dict_del(fz_obj *dict, fz_obj *key);
 void fz_dict_dels(fz_obj *dict, char *key);
 void fz_sort_dict(fz_obj *dict);
 
+int fz_sprint_obj(char *s, int n, fz_obj *obj, int tight);
 int fz_fprint_obj(FILE *fp, fz_obj *obj, int tight);
 void fz_debug_obj(fz_obj *obj);
 void fz_debug_ref(fz_obj *obj);
@@ -798,11 +816,12 @@ typedef void (fz_store_free_fn)(fz_context *, fz_storable *);
 struct fz_storable_s {
 	int refs;
 	fz_store_free_fn *free;
+	fz_item *item;
 };
 
 #define FZ_INIT_STORABLE(S_,RC,FREE) \
 	do { fz_storable *S = &(S_)->storable; S->refs = (RC); \
-	S->free = (FREE); \
+	S->free = (FREE); S->item = NULL; \
 	} while (0)
 
 enum {
@@ -819,11 +838,87 @@ void *fz_keep_storable(fz_context *, fz_storable *);
 void fz_drop_storable(fz_context *, fz_storable *);
 
 void fz_store_item(fz_context *ctx, fz_obj *key, void *val, unsigned int itemsize);
+void fz_store_item_with_cost(fz_context *ctx, fz_obj *key, void *val, unsigned int itemsize, unsigned int cost);
 void *fz_find_item(fz_context *ctx, fz_store_free_fn *freefn, fz_obj *key);
 void fz_remove_item(fz_context *ctx, fz_store_free_fn *freefn, fz_obj *key);
+
+/*
+	fz_store_keyed_item, fz_find_keyed_item: Store and find items keyed
+	by up to FZ_STORE_KEY_MAX bytes of plain data (which should have no
+	uninitialised padding) instead of an object. The store keeps a copy
+	of the key, so no memory is tied to the context that made it.
+*/
+enum { FZ_STORE_KEY_MAX = 32 };
+
+void fz_store_keyed_item(fz_context *ctx, const void *key, int len, void *val, unsigned int itemsize, unsigned int cost);
+void *fz_find_keyed_item(fz_context *ctx, fz_store_free_fn *freefn, const void *key, int len);
+int fz_new_store_id(fz_context *ctx);
 void fz_empty_store(fz_context *ctx);
 int fz_store_scavenge(fz_context *ctx, unsigned int size, int *phase);
 
+/*
+	fz_store_priority_fn: Eviction policy for the store. Items held by
+	nobody but the store are evicted lowest priority first.
+
+	clock: The priority of the most recently evicted item.
+
+	size, cost: The itemsize and cost the item was stored with. The
+	cost is an estimate of the work needed to recreate the item;
+	fz_store_item uses the size.
+
+	hits: The number of times the item has been stored or found.
+
+	Items of equal priority are evicted least recently used first.
+
+	fz_store_priority_gdsf (GreedyDual-Size-Frequency) is the default.
+	fz_store_priority_lru gives every item the same priority, and so
+	plain least recently used eviction.
+*/
+typedef float (fz_store_priority_fn)(float clock, unsigned int size, unsigned int cost, int hits);
+
+float fz_store_priority_gdsf(float clock, unsigned int size, unsigned int cost, int hits);
+float fz_store_priority_lru(float clock, unsigned int size, unsigned int cost, int hits);
+
+void fz_set_store_policy(fz_context *ctx, fz_store_priority_fn *priority);
+
+/*
+	Store statistics, broken down by type of resource (i.e. by the free
+	function it is stored with). Types beyond the first FZ_STORE_TYPES-1
+	are lumped together as "other".
+
+	fz_set_store_type_name: Give a name to a type of resource for
+	reporting.
+
+	fz_get_store_stats: Take a snapshot of the statistics. Bytes and
+	items are those currently held; peak is the most held at once.
+
+	fz_print_store_stats: Print the statistics in a readable form.
+*/
+enum { FZ_STORE_TYPES = 16 };
+
+typedef struct fz_store_type_stats_s fz_store_type_stats;
+typedef struct fz_store_stats_s fz_store_stats;
+
+struct fz_store_type_stats_s
+{
+	char *name;
+	fz_store_free_fn *free;
+	int hits, misses, insertions, evictions;
+	unsigned int items, bytes, peak;
+};
+
+struct fz_store_stats_s
+{
+	unsigned int max, size, peak;
+	int hits, misses, insertions, evictions;
+	int type_count;
+	fz_store_type_stats type[FZ_STORE_TYPES];
+};
+
+void fz_set_store_type_name(fz_context *ctx, fz_store_free_fn *free, char *name);
+void fz_get_store_stats(fz_context *ctx, fz_store_stats *stats);
+void fz_print_store_stats(fz_context *ctx, FILE *out);
+
 /*
  * Buffered reader.
  * Only the data between rp and wp is valid data.
@@ -849,6 +944,14 @@ struct fz_stream_s
 	unsigned char buf[4096];
 };
 
+/*
+	fz_open_fd: Open a stream on a file descriptor, which is closed
+	with the stream. Regular files are memory mapped where possible
+	(not on win32), so the file must not be truncated while the stream
+	is open: reading a page of the mapping past the new end of file
+	raises SIGBUS. Changes made to the file by others may or may not
+	be seen.
+*/
 fz_stream *fz_open_fd(fz_context *ctx, int file);
 fz_stream *fz_open_file(fz_context *ctx, const char *filename);
 fz_stream *fz_open_file_w(fz_context *ctx, const wchar_t *filename); /* only on win32 */
@@ -857,6 +960,25 @@ fz_stream *fz_open_memory(fz_context *ctx, unsigned char *data, int len);
 void fz_close(fz_stream *stm);
 void fz_lock_stream(fz_stream *stm);
 
+/*
+	fz_reopen_stream: Open a second, independent stream on the data of
+	a seekable stream, positioned at offset and used in the given
+	context. It has its own position and buffer, and reads are
+	positional, so it and the original (and any other reopened
+	streams) do not disturb each other and may be read from different
+	threads. Memory and mapped file streams are shared without
+	copying; file descriptors are read with pread.
+*/
+fz_stream *fz_reopen_stream(fz_context *ctx, fz_stream *stm, int offset);
+
+/*
+	fz_stream_file_id: For a stream that reads a file (directly, or by
+	way of fz_reopen_stream), fill id with values that change when the
+	file is written to or replaced: its modification time, inode and
+	size. Returns 0 for other streams.
+*/
+int fz_stream_file_id(fz_stream *stm, int id[4]);
+
 fz_stream *fz_new_stream(fz_context *ctx, void*, int(*)(fz_stream*, unsigned char*, int), void(*)(fz_context *, void *));
 fz_stream *fz_keep_stream(fz_stream *stm);
 void fz_fill_buffer(fz_stream *stm);
@@ -958,7 +1080,7 @@ fz_stream *fz_open_aesd(fz_stream *chain, unsigned char *key, unsigned keylen);
 fz_stream *fz_open_a85d(fz_stream *chain);
 fz_stream *fz_open_ahxd(fz_stream *chain);
 fz_stream *fz_open_rld(fz_stream *chain);
-fz_stream *fz_open_dctd(fz_stream *chain, int color_transform);
+fz_stream *fz_open_dctd(fz_stream *chain, int color_transform, int l2factor);
 fz_stream *fz_open_faxd(fz_stream *chain,
 	int k, int end_of_line, int encoded_byte_align,
 	int columns, int rows, int end_of_block, int black_is_1);
@@ -967,6 +1089,9 @@ fz_stream *fz_open_lzwd(fz_stream *chain, int early_change);
 fz_stream *fz_open_predict(fz_stream *chain, int predictor, int columns, int colors, int bpc);
 fz_stream *fz_open_jbig2d(fz_stream *chain, fz_buffer *global);
 
+/* Compress data with deflate, as for a FlateDecode stream */
+fz_buffer *fz_deflate_buffer(fz_context *ctx, unsigned char *data, int len);
+
 /*
  * Resources and other graphics related objects.
  */
@@ -994,9 +1119,11 @@ struct fz_pixmap_s
 	int xres, yres;
 	fz_colorspace *colorspace;
 	unsigned char *samples;
-	int free_samples;
+	int free_samples; /* 0, 1 (fz_free), or FZ_SAMPLES_MAPPED */
 };
 
+enum { FZ_SAMPLES_MAPPED = 2 };
+
 fz_bbox fz_bound_pixmap(fz_pixmap *pix);
 
 fz_pixmap *fz_new_pixmap_with_data(fz_context *ctx, fz_colorspace *colorspace, int w, int h, unsigned char *samples);
@@ -1018,27 +1145,102 @@ void fz_gamma_pixmap(fz_context *ctx, fz_pixmap *pix, float gamma);
 unsigned int fz_pixmap_size(fz_context *ctx, fz_pixmap *pix);
 
 fz_pixmap *fz_scale_pixmap(fz_context *ctx, fz_pixmap *src, float x, float y, float w, float h, fz_bbox *clip);
+fz_pixmap *fz_scale_indexed_pixmap(fz_context *ctx, fz_pixmap *src, fz_pixmap *palette, float x, float y, float w, float h, fz_bbox *clip);
 
 void fz_write_pnm(fz_context *ctx, fz_pixmap *pixmap, char *filename);
 void fz_write_pam(fz_context *ctx, fz_pixmap *pixmap, char *filename, int savealpha);
 void fz_write_png(fz_context *ctx, fz_pixmap *pixmap, char *filename, int savealpha);
 
-fz_pixmap *fz_load_jpx(fz_context *ctx, unsigned char *data, int size, fz_colorspace *cs);
+fz_pixmap *fz_load_jpx(fz_context *ctx, unsigned char *data, int size, fz_colorspace *cs, int l2factor);
 fz_pixmap *fz_load_jpeg(fz_context *doc, unsigned char *data, int size);
 fz_pixmap *fz_load_png(fz_context *doc, unsigned char *data, int size);
 fz_pixmap *fz_load_tiff(fz_context *doc, unsigned char *data, int size);
 
 /*
- * Bitmaps have 1 component per bit. Only used for creating halftoned versions
- * of contone buffers, and saving out. Samples are stored msb first, akin to
- * pbms.
+ * Disk cache of decoded pixmaps, shared between processes.
+ *
+ * Entries are keyed by a 16 byte digest formed by the caller from
+ * whatever determines the decoded result (the encoded data and the
+ * decode parameters). Each entry is a file in the cache directory; it
+ * is written atomically and mapped into memory when read back. Entries
+ * may be deleted at any time to prune the cache.
+ *
+ * The cache keeps the directory to about max bytes, deleting the least
+ * recently used entries as it grows past that.
+ *
+ * Entries may instead hold a buffer of other data derived from a
+ * document, such as its xref index; these are read back into memory.
+ */
+
+enum {
+	FZ_DISK_CACHE_DEFAULT = 512 << 20,
+};
+
+void fz_new_disk_cache_context(fz_context *ctx, char *dirname, unsigned int max);
+fz_disk_cache *fz_keep_disk_cache(fz_context *ctx);
+void fz_drop_disk_cache_context(fz_context *ctx);
+fz_pixmap *fz_load_disk_cache_pixmap(fz_context *ctx, unsigned char key[16]);
+void fz_save_disk_cache_pixmap(fz_context *ctx, unsigned char key[16], fz_pixmap *pix);
+fz_buffer *fz_load_disk_cache_buffer(fz_context *ctx, unsigned char key[16]);
+void fz_save_disk_cache_buffer(fz_context *ctx, unsigned char key[16], fz_buffer *buf);
+void fz_unmap_pixmap_samples(fz_context *ctx, fz_pixmap *pix); /* private */
+
+/*
+ * Compressed image data, with what is needed to decode it again.
+ * Images are kept like this until they are drawn.
+ */
+
+enum
+{
+	FZ_IMAGE_UNKNOWN = 0,
+	FZ_IMAGE_RAW, /* decoded samples */
+	FZ_IMAGE_FAX,
+	FZ_IMAGE_DCT,
+	FZ_IMAGE_FLATE,
+	FZ_IMAGE_LZW,
+	FZ_IMAGE_RLD,
+	FZ_IMAGE_JPX /* not a stream; decoded with fz_load_jpx */
+};
+
+typedef struct fz_compression_params_s fz_compression_params;
+typedef struct fz_compressed_buffer_s fz_compressed_buffer;
+
+struct fz_compression_params_s
+{
+	int type;
+	union {
+		struct {
+			int color_transform;
+		} dct;
+		struct {
+			int k, end_of_line, encoded_byte_align, columns, rows, end_of_block, black_is_1;
+		} fax;
+		struct {
+			int predictor, columns, colors, bpc, early_change;
+		} flate; /* and lzw */
+	} u;
+};
+
+struct fz_compressed_buffer_s
+{
+	fz_compression_params params;
+	fz_buffer *buffer;
+};
+
+fz_stream *fz_open_image_decomp_stream(fz_context *ctx, fz_compressed_buffer *buffer, int *l2factor);
+void fz_free_compressed_buffer(fz_context *ctx, fz_compressed_buffer *buffer);
+
+/*
+ * Bitmaps have 1 component per bit. Used for creating halftoned versions
+ * of contone buffers, and saving out, and for holding bilevel images
+ * packed. Samples are stored msb first, akin to pbms.
  */
 
 typedef struct fz_bitmap_s fz_bitmap;
 
 struct fz_bitmap_s
 {
-	int refs;
+	fz_storable storable;
 	int w, h, stride, n;
 	unsigned char *samples;
 };
@@ -1047,9 +1249,58 @@ fz_bitmap *fz_new_bitmap(fz_context *ctx, int w, int h, int n);
 fz_bitmap *fz_keep_bitmap(fz_context *ctx, fz_bitmap *bit);
 void fz_clear_bitmap(fz_context *ctx, fz_bitmap *bit);
 void fz_drop_bitmap(fz_context *ctx, fz_bitmap *bit);
+void fz_free_bitmap_imp(fz_context *ctx, fz_storable *bit);
+unsigned int fz_bitmap_size(fz_context *ctx, fz_bitmap *bit);
 
 void fz_write_pbm(fz_context *ctx, fz_bitmap *bitmap, char *filename);
 
+/*
+ * Images are proxies for pixmaps. They hold the image compressed, or
+ * however else it can be made again, and get_pixmap decodes it when a
+ * device needs the pixels, at no less than w by h pixels (or at full
+ * resolution, given 0 by 0), typically by way of the store.
+ *
+ * area, if not NULL, is the part of the image (in image pixels) that
+ * is needed; an image may decode just that much, or more. On return it
+ * holds the part of the image that the pixmap covers.
+ *
+ * imagemask images are coverage only, painted in the fill color.
+ * Decoded pixmaps do not carry the mask; it is a separate image.
+ *
+ * Bilevel images may also offer get_bitmap, for the whole image packed
+ * at one bit per pixel. Bits of 0 and 1 stand for the samples levels[0]
+ * and levels[1]: coverage for imagemask images, the single component
+ * otherwise. It returns NULL for images that are not bilevel.
+ *
+ * Images with an Indexed colorspace may also offer get_indexed, which
+ * is as get_pixmap but gives a pixmap of one byte of palette index per
+ * pixel, with no colorspace, and sets *palette to a 256 by 1 pixmap of
+ * the colors they stand for, in the base colorspace. It returns NULL
+ * when the image cannot be given so, at this size or at all.
+ */
+
+typedef struct fz_image_s fz_image;
+
+struct fz_image_s
+{
+	fz_storable storable;
+	int w, h;
+	int imagemask;
+	fz_colorspace *colorspace;
+	fz_image *mask;
+	int interpolate;
+	fz_pixmap *(*get_pixmap)(fz_context *ctx, fz_image *image, int w, int h, fz_bbox *area);
+	fz_bitmap *(*get_bitmap)(fz_context *ctx, fz_image *image, unsigned char levels[2]);
+	fz_pixmap *(*get_indexed)(fz_context *ctx, fz_image *image, int w, int h, fz_bbox *area, fz_pixmap **palette);
+};
+
+fz_image *fz_new_image_from_pixmap(fz_context *ctx, fz_pixmap *pixmap, fz_image *mask);
+fz_image *fz_keep_image(fz_context *ctx, fz_image *image);
+void fz_drop_image(fz_context *ctx, fz_image *image);
+fz_pixmap *fz_image_to_pixmap(fz_context *ctx, fz_image *image, int w, int h, fz_bbox *area);
+fz_bitmap *fz_image_to_bitmap(fz_context *ctx, fz_image *image, unsigned char levels[2]);
+fz_pixmap *fz_image_to_indexed(fz_context *ctx, fz_image *image, int w, int h, fz_bbox *area, fz_pixmap **palette);
+
 /*
  * A halftone is a set of threshold tiles, one per component. Each threshold
  * tile is a pixmap, possibly of varying sizes and phases.
@@ -1128,6 +1379,10 @@ struct fz_font_s
 	char *ft_file;
 	unsigned char *ft_data;
 	int ft_size;
+	unsigned char *ft_buffer; /* data the face was opened from */
+	int ft_buffer_len;
+	int ft_index;
+	int ft_id; /* identifies the font to per-context faces */
 
 	fz_matrix t3matrix;
 	fz_obj *t3resources;
@@ -1152,6 +1407,7 @@ struct fz_font_s
 void fz_new_font_context(fz_context *ctx);
 fz_font_context *fz_keep_font_context(fz_context *ctx);
 void fz_drop_font_context(fz_context *ctx);
+void fz_free_ft_context(fz_context *ctx);
 
 fz_font *fz_new_type3_font(fz_context *ctx, char *name, fz_matrix matrix);
 
@@ -1245,20 +1501,77 @@ fz_path *fz_clone_path(fz_context *ctx, fz_path *old);
 fz_rect fz_bound_path(fz_context *ctx, fz_path *path, fz_stroke_state *stroke, fz_matrix ctm);
 void fz_debug_path(fz_context *ctx, fz_path *, int indent);
 
+/*
+ * Glyphs are stored as tightly packed 8-bit coverage, or, for larger
+ * glyphs where it pays, run-length encoded coverage. Each row of an
+ * encoded glyph is a sequence of codes:
+ *
+ *	0x00-0x3f	skip n+1 transparent pixels
+ *	0x40-0x7f	n-0x3f fully covered pixels
+ *	0x80-0xff	n-0x7f literal coverage values follow
+ *
+ * and rows[y] gives the offset of row y in data. Coloured type 3 glyphs
+ * are kept as pixmaps.
+ */
+
+typedef struct fz_glyph_s fz_glyph;
+
+struct fz_glyph_s
+{
+	fz_storable storable;
+	int x, y, w, h;
+	fz_pixmap *pixmap; /* coloured glyphs only */
+	int *rows; /* NULL unless run-length encoded */
+	unsigned int size;
+	unsigned char data[1];
+};
+
+fz_glyph *fz_new_glyph_from_pixmap(fz_context *ctx, fz_pixmap *pix);
+fz_glyph *fz_keep_glyph(fz_context *ctx, fz_glyph *glyph);
+void fz_drop_glyph(fz_context *ctx, fz_glyph *glyph);
+void fz_free_glyph_imp(fz_context *ctx, fz_storable *glyph);
+fz_bbox fz_glyph_bbox(fz_glyph *glyph);
+unsigned int fz_glyph_size(fz_context *ctx, fz_glyph *glyph);
+
 /*
  * Glyph cache
  */
 
+/*
+	The glyph cache evicts least recently used glyphs once it holds more
+	than its byte budget (FZ_GLYPH_CACHE_DEFAULT unless changed with
+	fz_set_glyph_cache_size, which is best done right after creating the
+	context). Glyphs of a font are evicted when the font is freed.
+*/
+enum { FZ_GLYPH_CACHE_DEFAULT = 1 << 20 };
+
 void fz_new_glyph_cache_context(fz_context *ctx);
 fz_glyph_cache *fz_keep_glyph_cache(fz_context *ctx);
 void fz_drop_glyph_cache_context(fz_context *ctx);
+void fz_set_glyph_cache_size(fz_context *ctx, unsigned int max);
 void fz_purge_glyph_cache(fz_context *ctx);
+void fz_purge_glyph_cache_font(fz_context *ctx, fz_font *font);
+
+/*
+	Glyph cache statistics. Bytes are the memory held by cached glyphs;
+	max is the budget.
+*/
+typedef struct fz_glyph_cache_stats_s fz_glyph_cache_stats;
+
+struct fz_glyph_cache_stats_s
+{
+	int hits, misses, insertions, evictions, flushes;
+	unsigned int items, bytes, peak, max;
+};
+
+void fz_get_glyph_cache_stats(fz_context *ctx, fz_glyph_cache_stats *stats);
+void fz_print_glyph_cache_stats(fz_context *ctx, FILE *out);
 
 fz_pixmap *fz_render_ft_glyph(fz_context *ctx, fz_font *font, int cid, fz_matrix trm);
 fz_pixmap *fz_render_t3_glyph(fz_context *ctx, fz_font *font, int cid, fz_matrix trm, fz_colorspace *model);
 fz_pixmap *fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, fz_matrix ctm, fz_stroke_state *state);
-fz_pixmap *fz_render_glyph(fz_context *ctx, fz_font*, int, fz_matrix, fz_colorspace *model);
-fz_pixmap *fz_render_stroked_glyph(fz_context *ctx, fz_font*, int, fz_matrix, fz_matrix, fz_stroke_state *stroke);
+fz_glyph *fz_render_glyph(fz_context *ctx, fz_font*, int, fz_matrix, fz_colorspace *model);
+fz_glyph *fz_render_stroked_glyph(fz_context *ctx, fz_font*, int, fz_matrix, fz_matrix, fz_stroke_state *stroke);
 void fz_render_t3_glyph_direct(fz_context *ctx, fz_device *dev, fz_font *font, int gid, fz_matrix trm, void *gstate);
 
 /*
@@ -1413,9 +1726,9 @@ struct fz_device_s
 	void (*ignore_text)(fz_device *, fz_text *, fz_matrix);
 
 	void (*fill_shade)(fz_device *, fz_shade *shd, fz_matrix ctm, float alpha);
-	void (*fill_image)(fz_device *, fz_pixmap *img, fz_matrix ctm, float alpha);
-	void (*fill_image_mask)(fz_device *, fz_pixmap *img, fz_matrix ctm, fz_colorspace *, float *color, float alpha);
-	void (*clip_image_mask)(fz_device *, fz_pixmap *img, fz_rect *rect, fz_matrix ctm);
+	void (*fill_image)(fz_device *, fz_image *img, fz_matrix ctm, float alpha);
+	void (*fill_image_mask)(fz_device *, fz_image *img, fz_matrix ctm, fz_colorspace *, float *color, float alpha);
+	void (*clip_image_mask)(fz_device *, fz_image *img, fz_rect *rect, fz_matrix ctm);
 
 	void (*pop_clip)(fz_device *);
 
@@ -1439,9 +1752,9 @@ void fz_clip_stroke_text(fz_device *dev, fz_text *text, fz_stroke_state *stroke,
 void fz_ignore_text(fz_device *dev, fz_text *text, fz_matrix ctm);
 void fz_pop_clip(fz_device *dev);
 void fz_fill_shade(fz_device *dev, fz_shade *shade, fz_matrix ctm, float alpha);
-void fz_fill_image(fz_device *dev, fz_pixmap *image, fz_matrix ctm, float alpha);
-void fz_fill_image_mask(fz_device *dev, fz_pixmap *image, fz_matrix ctm, fz_colorspace *colorspace, float *color, float alpha);
-void fz_clip_image_mask(fz_device *dev, fz_pixmap *image, fz_rect *rect, fz_matrix ctm);
+void fz_fill_image(fz_device *dev, fz_image *image, fz_matrix ctm, float alpha);
+void fz_fill_image_mask(fz_device *dev, fz_image *image, fz_matrix ctm, fz_colorspace *colorspace, float *color, float alpha);
+void fz_clip_image_mask(fz_device *dev, fz_image *image, fz_rect *rect, fz_matrix ctm);
 void fz_begin_mask(fz_device *dev, fz_rect area, int luminosity, fz_colorspace *colorspace, float *bc);
 void fz_end_mask(fz_device *dev);
 void fz_begin_group(fz_device *dev, fz_rect area, int isolated, int knockout, int blendmode, float alpha);
@@ -1519,6 +1832,7 @@ void fz_run_display_list(fz_display_list *list, fz_device *dev, fz_matrix ctm, f
 void fz_decode_tile(fz_pixmap *pix, float *decode);
 void fz_decode_indexed_tile(fz_pixmap *pix, float *decode, int maxval);
 void fz_unpack_tile(fz_pixmap *dst, unsigned char * restrict src, int n, int depth, int stride, int scale);
+fz_pixmap *fz_unpack_bitmap(fz_context *ctx, fz_bitmap *bit, fz_colorspace *colorspace, unsigned char levels[2], fz_bbox area);
 
 void fz_paint_solid_alpha(unsigned char * restrict dp, int w, int alpha);
 void fz_paint_solid_color(unsigned char * restrict dp, int n, int w, unsigned char *color);
@@ -1528,6 +1842,9 @@ void fz_paint_span_with_color(unsigned char * restrict dp, unsigned char * restr
 
 void fz_paint_image(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_pixmap *img, fz_matrix ctm, int alpha);
 void fz_paint_image_with_color(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_pixmap *img, fz_matrix ctm, unsigned char *colorbv);
+void fz_paint_bitmap(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_bitmap *bit, int interpolate, fz_matrix ctm, unsigned char *palette, int alpha);
+void fz_paint_indexed_image(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_pixmap *img, fz_matrix ctm, unsigned char *palette, int alpha);
+void fz_paint_bitmap_with_color(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_bitmap *bit, int interpolate, fz_matrix ctm, unsigned char *levels, unsigned char *colorbv);
 
 void fz_paint_pixmap(fz_pixmap *dst, fz_pixmap *src, int alpha);
 void fz_paint_pixmap_with_mask(fz_pixmap *dst, fz_pixmap *src, fz_pixmap *msk);
@@ -20,29 +20,14 @@ static void fz_opj_info_callback(const char *msg, void *client_data)
 	/* fz_warn("openjpeg info: %s", msg); */
 }
 
-fz_pixmap *
-fz_load_jpx(fz_context *ctx, unsigned char *data, int size, fz_colorspace *defcs)
+static opj_image_t *
+fz_opj_decode(fz_context *ctx, int format, unsigned char *data, int size, int reduce)
 {
-	fz_pixmap *img;
 	opj_event_mgr_t evtmgr;
 	opj_dparameters_t params;
 	opj_dinfo_t *info;
 	opj_cio_t *cio;
 	opj_image_t *jpx;
-	fz_colorspace *colorspace;
-	unsigned char *p;
-	int format;
-	int a, n, w, h, depth, sgnd;
-	int x, y, k, v;
-
-	if (size < 2)
-		fz_throw(ctx, "not enough data to determine image format");
-
-	/* Check for SOC marker -- if found we have a bare J2K stream */
-	if (data[0] == 0xFF && data[1] == 0x4F)
-		format = CODEC_J2K;
-	else
-		format = CODEC_JP2;
 
 	memset(&evtmgr, 0, sizeof(evtmgr));
 	evtmgr.error_handler = fz_opj_error_callback;
@@ -50,6 +35,7 @@ fz_load_jpx(fz_context *ctx, unsigned char *data, int size, fz_colorspace *defcs
 	evtmgr.info_handler = fz_opj_info_callback;
 
 	opj_set_default_decoder_parameters(&params);
+	params.cp_reduce = reduce;
 
 	info = opj_create_decompress(format);
 	opj_set_event_mgr((opj_common_ptr)info, &evtmgr, ctx);
@@ -62,6 +48,36 @@ fz_load_jpx(fz_context *ctx, unsigned char *data, int size, fz_colorspace *defcs
 	opj_cio_close(cio);
 	opj_destroy_decompress(info);
 
+	return jpx;
+}
+
+/* Decoding at a reduced resolution level skips the finest wavelet
+ * levels. Each level halves the width and height, rounding up. */
+fz_pixmap *
+fz_load_jpx(fz_context *ctx, unsigned char *data, int size, fz_colorspace *defcs, int l2factor)
+{
+	fz_pixmap *img;
+	opj_image_t *jpx;
+	fz_colorspace *colorspace;
+	unsigned char *p;
+	int format;
+	int a, n, w, h, depth, sgnd;
+	int x, y, k, v;
+
+	if (size < 2)
+		fz_throw(ctx, "not enough data to determine image format");
+
+	/* Check for SOC marker -- if found we have a bare J2K stream */
+	if (data[0] == 0xFF && data[1] == 0x4F)
+		format = CODEC_J2K;
+	else
+		format = CODEC_JP2;
+
+	jpx = fz_opj_decode(ctx, format, data, size, l2factor);
+	/* The image may have fewer resolution levels than we asked to
+	 * skip, so fall back to the full resolution */
+	if (!jpx && l2factor > 0)
+		jpx = fz_opj_decode(ctx, format, data, size, 0);
 	if (!jpx)
 		fz_throw(ctx, "opj_decode failed");
 
@@ -182,7 +182,7 @@ fz_decode_tiff_fax(struct tiff *tiff, int comp, fz_stream *chain, unsigned char
 static void
 fz_decode_tiff_jpeg(struct tiff *tiff, fz_stream *chain, unsigned char *wp, int wlen)
 {
-	fz_stream *stm = fz_open_dctd(chain, -1);
+	fz_stream *stm = fz_open_dctd(chain, -1, 0);
 	fz_read(stm, wp, wlen);
 	fz_close(stm);
 }
@@ -6,7 +6,7 @@ fz_new_bitmap(fz_context *ctx, int w, int h, int n)
 	fz_bitmap *bit;
 
 	bit = fz_malloc_struct(ctx, fz_bitmap);
-	bit->refs = 1;
+	FZ_INIT_STORABLE(bit, 1, fz_free_bitmap_imp);
 	bit->w = w;
 	bit->h = h;
 	bit->n = n;
@@ -14,7 +14,15 @@ fz_new_bitmap(fz_context *ctx, int w, int h, int n)
 	 * use SSE2 etc. */
 	bit->stride = ((n * w + 31) & ~31) >> 3;
 
-	bit->samples = fz_malloc_array(ctx, h, bit->stride);
+	fz_try(ctx)
+	{
+		bit->samples = fz_malloc_array(ctx, h, bit->stride);
+	}
+	fz_catch(ctx)
+	{
+		fz_free(ctx, bit);
+		fz_rethrow(ctx);
+	}
 
 	return bit;
 }
@@ -22,19 +30,30 @@ fz_new_bitmap(fz_context *ctx, int w, int h, int n)
 fz_bitmap *
 fz_keep_bitmap(fz_context *ctx, fz_bitmap *bit)
 {
-	if (bit)
-		bit->refs++;
-	return bit;
+	return (fz_bitmap *)fz_keep_storable(ctx, &bit->storable);
 }
 
 void
 fz_drop_bitmap(fz_context *ctx, fz_bitmap *bit)
 {
-	if (bit && --bit->refs == 0)
-	{
-		fz_free(ctx, bit->samples);
-		fz_free(ctx, bit);
-	}
+	fz_drop_storable(ctx, &bit->storable);
+}
+
+void
+fz_free_bitmap_imp(fz_context *ctx, fz_storable *bit_)
+{
+	fz_bitmap *bit = (fz_bitmap *)bit_;
+
+	fz_free(ctx, bit->samples);
+	fz_free(ctx, bit);
+}
+
+unsigned int
+fz_bitmap_size(fz_context *ctx, fz_bitmap *bit)
+{
+	if (bit == NULL)
+		return 0;
+	return sizeof(*bit) + bit->stride * bit->h;
 }
 
 void
@@ -0,0 +1,671 @@
+#include "fitz.h"
+
+#include <sys/stat.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#include <io.h>
+#include <sys/utime.h>
+#define utime _utime
+#else
+#include <sys/mman.h>
+#include <dirent.h>
+#include <utime.h>
+#endif
+
+/*
+	Each entry is one file, named after the hex digest of its key. It
+	holds one or two sections (the pixmap, and its mask if it has one),
+	each a fixed size header followed by the samples. Sections start on
+	a page boundary so that each can be mapped on its own, and the
+	samples of a mapped pixmap always sit HEADER_SIZE bytes past the
+	start of their mapping.
+
+	Files are written under a temporary name and renamed into place, so
+	a reader (in any process) sees either the whole entry or nothing.
+
+	Entries can also hold a buffer of data whose layout is up to the
+	caller; these have a header of their own.
+
+	Entries are touched when they are read. Once more than an eighth of
+	the size limit has been written, the directory is scanned and the
+	least recently used entries are deleted until it is back under three
+	quarters of the limit; the same is done when the cache is opened.
+	Temporary files left behind by writers that died are deleted once
+	they are an hour old.
+*/
+
+#define MAGIC 0x4d755078
+#define BUFFER_MAGIC 0x4d754278
+#define VERSION 1
+
+enum { HEADER_SIZE = 64 };
+
+/* Small pixmaps are cheaper to decode again than to go to disk for */
+enum { MIN_DISK_PIXMAP = 4096 };
+
+enum { CS_NONE, CS_GRAY, CS_RGB, CS_BGR, CS_CMYK };
+
+typedef struct disk_header_s disk_header;
+
+struct disk_header_s
+{
+	int magic, version;
+	unsigned char key[16];
+	int x, y, w, h, n;
+	int xres, yres, interpolate;
+	int colorspace;
+	int mask_offset;
+};
+
+/* Fails to compile if the header outgrows the room kept for it */
+typedef char disk_header_fits[sizeof(disk_header) <= HEADER_SIZE ? 1 : -1];
+
+typedef struct buffer_header_s buffer_header;
+
+struct buffer_header_s
+{
+	int magic, version;
+	unsigned char key[16];
+	int len;
+};
+
+struct fz_disk_cache_s
+{
+	int refs;
+	unsigned int max;
+	unsigned int written;
+	char dirname[1024];
+};
+
+static void prune_disk_cache(fz_context *ctx, fz_disk_cache *cache);
+
+void
+fz_new_disk_cache_context(fz_context *ctx, char *dirname, unsigned int max)
+{
+	fz_disk_cache *cache;
+
+	if (strlen(dirname) + 64 > sizeof cache->dirname)
+		fz_throw(ctx, "disk cache directory name too long");
+
+#ifdef _WIN32
+	_mkdir(dirname);
+#else
+	mkdir(dirname, 0777);
+#endif
+
+	fz_drop_disk_cache_context(ctx);
+
+	cache = fz_malloc_struct(ctx, fz_disk_cache);
+	cache->refs = 1;
+	cache->max = max;
+	fz_strlcpy(cache->dirname, dirname, sizeof cache->dirname);
+	ctx->disk_cache = cache;
+
+	prune_disk_cache(ctx, cache);
+}
+
+fz_disk_cache *
+fz_keep_disk_cache(fz_context *ctx)
+{
+	if (ctx == NULL || ctx->disk_cache == NULL)
+		return NULL;
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	ctx->disk_cache->refs++;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	return ctx->disk_cache;
+}
+
+void
+fz_drop_disk_cache_context(fz_context *ctx)
+{
+	int refs;
+
+	if (ctx == NULL || ctx->disk_cache == NULL)
+		return;
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	refs = --ctx->disk_cache->refs;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	if (refs == 0)
+		fz_free(ctx, ctx->disk_cache);
+	ctx->disk_cache = NULL;
+}
+
+static int
+page_size(void)
+{
+#ifdef _WIN32
+	return 4096;
+#else
+	return (int)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+/* Returns 0 if the name does not fit in path */
+static int
+entry_name(fz_disk_cache *cache, unsigned char key[16], char *path, int len)
+{
+	static const char hex[] = "0123456789abcdef";
+	char name[33];
+	int i;
+
+	for (i = 0; i < 16; i++)
+	{
+		name[i * 2] = hex[key[i] >> 4];
+		name[i * 2 + 1] = hex[key[i] & 15];
+	}
+	name[32] = 0;
+	i = snprintf(path, len, "%s/%s", cache->dirname, name);
+	return i >= 0 && i < len;
+}
+
+static int
+colorspace_id(fz_colorspace *cs)
+{
+	if (cs == NULL)
+		return CS_NONE;
+	if (cs == fz_device_gray)
+		return CS_GRAY;
+	if (cs == fz_device_rgb)
+		return CS_RGB;
+	if (cs == fz_device_bgr)
+		return CS_BGR;
+	if (cs == fz_device_cmyk)
+		return CS_CMYK;
+	return -1;
+}
+
+static fz_colorspace *
+colorspace_from_id(int id)
+{
+	switch (id)
+	{
+	case CS_GRAY: return fz_device_gray;
+	case CS_RGB: return fz_device_rgb;
+	case CS_BGR: return fz_device_bgr;
+	case CS_CMYK: return fz_device_cmyk;
+	}
+	return NULL;
+}
+
+/* Only pixmaps in device colorspaces can be reconstructed; anything
+ * else would need the document to recreate its colorspace. */
+static int
+is_cacheable(fz_context *ctx, fz_pixmap *pix)
+{
+	if (colorspace_id(pix->colorspace) < 0)
+		return 0;
+	if (pix->mask)
+	{
+		if (pix->mask->mask || colorspace_id(pix->mask->colorspace) < 0)
+			return 0;
+	}
+	return fz_pixmap_size(ctx, pix) >= MIN_DISK_PIXMAP;
+}
+
+/* Loading */
+
+void
+fz_unmap_pixmap_samples(fz_context *ctx, fz_pixmap *pix)
+{
+#ifndef _WIN32
+	size_t len = (size_t)pix->w * pix->h * pix->n;
+	munmap(pix->samples - HEADER_SIZE, HEADER_SIZE + len);
+#endif
+}
+
+static fz_pixmap *
+load_section(fz_context *ctx, int fd, int offset, int file_size, unsigned char key[16], int *mask_offset)
+{
+	disk_header hdr;
+	fz_colorspace *cs;
+	fz_pixmap *pix = NULL;
+	unsigned char *base;
+	int len;
+
+	if (lseek(fd, offset, SEEK_SET) != offset)
+		return NULL;
+	if (read(fd, &hdr, sizeof hdr) != sizeof hdr)
+		return NULL;
+	if (hdr.magic != MAGIC || hdr.version != VERSION || memcmp(hdr.key, key, 16))
+		return NULL;
+	if (hdr.w <= 0 || hdr.h <= 0 || hdr.n <= 0 || hdr.n > FZ_MAX_COLORS + 1)
+		return NULL;
+	cs = colorspace_from_id(hdr.colorspace);
+	if ((cs ? cs->n + 1 : 1) != hdr.n)
+		return NULL;
+	if (hdr.w > (INT_MAX - HEADER_SIZE) / hdr.n / hdr.h)
+		return NULL;
+	len = hdr.w * hdr.h * hdr.n;
+	if (offset > file_size - HEADER_SIZE - len)
+		return NULL;
+
+#ifdef _WIN32
+	base = fz_malloc_no_throw(ctx, HEADER_SIZE + len);
+	if (!base)
+		return NULL;
+	if (read(fd, base + HEADER_SIZE, len) != len)
+	{
+		fz_free(ctx, base);
+		return NULL;
+	}
+#else
+	base = mmap(NULL, HEADER_SIZE + len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, offset);
+	if (base == MAP_FAILED)
+		return NULL;
+#endif
+
+	fz_try(ctx)
+	{
+		pix = fz_new_pixmap_with_data(ctx, cs, hdr.w, hdr.h, base + HEADER_SIZE);
+	}
+	fz_catch(ctx)
+	{
+#ifdef _WIN32
+		fz_free(ctx, base);
+#else
+		munmap(base, HEADER_SIZE + len);
+#endif
+		return NULL;
+	}
+
+#ifdef _WIN32
+	/* Without mappings we read into a buffer; shift the samples down
+	 * so that it can be freed normally. */
+	memmove(base, base + HEADER_SIZE, len);
+	pix->samples = base;
+	pix->free_samples = 1;
+#else
+	pix->free_samples = FZ_SAMPLES_MAPPED;
+#endif
+	pix->x = hdr.x;
+	pix->y = hdr.y;
+	pix->xres = hdr.xres;
+	pix->yres = hdr.yres;
+	pix->interpolate = hdr.interpolate;
+	*mask_offset = hdr.mask_offset;
+	return pix;
+}
+
+fz_pixmap *
+fz_load_disk_cache_pixmap(fz_context *ctx, unsigned char key[16])
+{
+	fz_disk_cache *cache = ctx->disk_cache;
+	fz_pixmap *pix, *mask;
+	char path[1024];
+	struct stat info;
+	int fd, mask_offset, dummy;
+
+	if (!cache)
+		return NULL;
+
+	if (!entry_name(cache, key, path, sizeof path))
+		return NULL;
+	fd = open(path, O_BINARY | O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+
+	pix = NULL;
+	if (fstat(fd, &info) == 0 && info.st_size <= INT_MAX)
+	{
+		pix = load_section(ctx, fd, 0, (int)info.st_size, key, &mask_offset);
+		if (pix && mask_offset)
+		{
+			mask = NULL;
+			if (mask_offset > 0 && mask_offset % page_size() == 0)
+				mask = load_section(ctx, fd, mask_offset, (int)info.st_size, key, &dummy);
+			if (!mask)
+			{
+				fz_drop_pixmap(ctx, pix);
+				pix = NULL;
+			}
+			else
+				pix->mask = mask;
+		}
+	}
+
+	close(fd);
+	if (pix)
+		utime(path, NULL);
+	return pix;
+}
+
+fz_buffer *
+fz_load_disk_cache_buffer(fz_context *ctx, unsigned char key[16])
+{
+	fz_disk_cache *cache = ctx->disk_cache;
+	fz_buffer *buf = NULL;
+	buffer_header hdr;
+	char path[1024];
+	struct stat info;
+	int fd;
+
+	if (!cache)
+		return NULL;
+
+	if (!entry_name(cache, key, path, sizeof path))
+		return NULL;
+	fd = open(path, O_BINARY | O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &info) == 0 && info.st_size <= INT_MAX &&
+		read(fd, &hdr, sizeof hdr) == sizeof hdr &&
+		hdr.magic == BUFFER_MAGIC && hdr.version == VERSION &&
+		!memcmp(hdr.key, key, 16) &&
+		hdr.len >= 0 && hdr.len <= (int)info.st_size - (int)sizeof hdr)
+	{
+		fz_try(ctx)
+		{
+			buf = fz_new_buffer(ctx, hdr.len);
+		}
+		fz_catch(ctx)
+		{
+			buf = NULL;
+		}
+		if (buf)
+		{
+			if (read(fd, buf->data, hdr.len) == hdr.len)
+				buf->len = hdr.len;
+			else
+			{
+				fz_drop_buffer(ctx, buf);
+				buf = NULL;
+			}
+		}
+	}
+
+	close(fd);
+	if (buf)
+		utime(path, NULL);
+	return buf;
+}
+
+/* Saving */
+
+static int
+write_all(int fd, void *data, int len)
+{
+	unsigned char *p = data;
+	int n;
+
+	while (len > 0)
+	{
+		n = write(fd, p, len);
+		if (n <= 0)
+			return 0;
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static int
+write_section(int fd, fz_pixmap *pix, unsigned char key[16], int mask_offset)
+{
+	disk_header hdr;
+	unsigned char pad[HEADER_SIZE - sizeof hdr + 1];
+
+	memset(&hdr, 0, sizeof hdr);
+	hdr.magic = MAGIC;
+	hdr.version = VERSION;
+	memcpy(hdr.key, key, 16);
+	hdr.x = pix->x;
+	hdr.y = pix->y;
+	hdr.w = pix->w;
+	hdr.h = pix->h;
+	hdr.n = pix->n;
+	hdr.xres = pix->xres;
+	hdr.yres = pix->yres;
+	hdr.interpolate = pix->interpolate;
+	hdr.colorspace = colorspace_id(pix->colorspace);
+	hdr.mask_offset = mask_offset;
+
+	memset(pad, 0, sizeof pad);
+	if (!write_all(fd, &hdr, sizeof hdr))
+		return 0;
+	if (!write_all(fd, pad, HEADER_SIZE - sizeof hdr))
+		return 0;
+	return write_all(fd, pix->samples, pix->w * pix->h * pix->n);
+}
+
+/* Create the temporary file for an entry; tag makes its name unique
+ * within the process. */
+static int
+begin_entry(fz_disk_cache *cache, unsigned char key[16], void *tag, char *path, int pathlen, char *tmp, int tmplen)
+{
+	int n;
+
+	if (!entry_name(cache, key, path, pathlen))
+		return -1;
+#ifdef _WIN32
+	n = snprintf(tmp, tmplen, "%s.%d.%p.tmp", path, _getpid(), tag);
+#else
+	n = snprintf(tmp, tmplen, "%s.%d.%p.tmp", path, (int)getpid(), tag);
+#endif
+	if (n < 0 || n >= tmplen)
+		return -1;
+	return open(tmp, O_BINARY | O_WRONLY | O_CREAT | O_EXCL, 0666);
+}
+
+static void
+end_entry(fz_context *ctx, fz_disk_cache *cache, int fd, int ok, char *path, char *tmp, unsigned int len)
+{
+	int prune;
+
+	if (close(fd) != 0)
+		ok = 0;
+
+	if (!ok)
+		fz_warn(ctx, "cannot write disk cache entry %s", path);
+
+	/* If the rename fails, someone else has most likely beaten us to
+	 * it; either way the entry is not ours to worry about. */
+	if (!ok || rename(tmp, path) != 0)
+	{
+		unlink(tmp);
+		return;
+	}
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	cache->written += len;
+	prune = cache->written > cache->max / 8;
+	if (prune)
+		cache->written = 0;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	if (prune)
+		prune_disk_cache(ctx, cache);
+}
+
+void
+fz_save_disk_cache_pixmap(fz_context *ctx, unsigned char key[16], fz_pixmap *pix)
+{
+	fz_disk_cache *cache = ctx->disk_cache;
+	char path[1024], tmp[1100];
+	int fd, ok, len, page, mask_offset = 0;
+
+	if (!cache || !pix || !is_cacheable(ctx, pix))
+		return;
+
+	len = HEADER_SIZE + pix->w * pix->h * pix->n;
+	if (pix->mask)
+	{
+		page = page_size();
+		mask_offset = (len + page - 1) / page * page;
+	}
+
+	fd = begin_entry(cache, key, pix, path, sizeof path, tmp, sizeof tmp);
+	if (fd < 0)
+		return;
+
+	ok = write_section(fd, pix, key, mask_offset);
+	if (ok && pix->mask)
+	{
+		ok = lseek(fd, mask_offset, SEEK_SET) == mask_offset;
+		if (ok)
+			ok = write_section(fd, pix->mask, key, 0);
+	}
+
+	end_entry(ctx, cache, fd, ok, path, tmp, pix->mask ? mask_offset + HEADER_SIZE + pix->mask->w * pix->mask->h * pix->mask->n : len);
+}
+
+void
+fz_save_disk_cache_buffer(fz_context *ctx, unsigned char key[16], fz_buffer *buf)
+{
+	fz_disk_cache *cache = ctx->disk_cache;
+	buffer_header hdr;
+	char path[1024], tmp[1100];
+	int fd, ok;
+
+	if (!cache || !buf)
+		return;
+
+	fd = begin_entry(cache, key, buf, path, sizeof path, tmp, sizeof tmp);
+	if (fd < 0)
+		return;
+
+	memset(&hdr, 0, sizeof hdr);
+	hdr.magic = BUFFER_MAGIC;
+	hdr.version = VERSION;
+	memcpy(hdr.key, key, 16);
+	hdr.len = buf->len;
+
+	ok = write_all(fd, &hdr, sizeof hdr);
+	if (ok)
+		ok = write_all(fd, buf->data, buf->len);
+
+	end_entry(ctx, cache, fd, ok, path, tmp, sizeof hdr + buf->len);
+}
+
+/* Pruning */
+
+typedef struct disk_entry_s disk_entry;
+
+struct disk_entry_s
+{
+	time_t mtime;
+	double size;
+	char name[33];
+};
+
+static int
+cmp_disk_entry(const void *a_, const void *b_)
+{
+	const disk_entry *a = a_, *b = b_;
+	return a->mtime < b->mtime ? -1 : a->mtime > b->mtime;
+}
+
+/* Entry names are 32 hex digits; temporary files add a suffix to one */
+static int
+entry_kind(const char *name)
+{
+	int i;
+
+	for (i = 0; i < 32; i++)
+		if (!strchr("0123456789abcdef", name[i]) || !name[i])
+			return 0;
+	if (name[32] == 0)
+		return 1;
+	if (name[32] == '.' && strlen(name) > 36 && !strcmp(name + strlen(name) - 4, ".tmp"))
+		return 2;
+	return 0;
+}
+
+static void
+prune_disk_cache(fz_context *ctx, fz_disk_cache *cache)
+{
+	disk_entry *list = NULL;
+	int len = 0, cap = 0, i;
+	double total = 0;
+	char path[1100];
+	struct stat info;
+	time_t now = time(NULL);
+	disk_entry *e;
+	int kind;
+#ifdef _WIN32
+	struct _finddata_t found;
+	intptr_t dir;
+#else
+	DIR *dir;
+	struct dirent *found;
+#endif
+
+	fz_var(list);
+
+#ifdef _WIN32
+	snprintf(path, sizeof path, "%s/*", cache->dirname);
+	dir = _findfirst(path, &found);
+	if (dir == -1)
+		return;
+#else
+	dir = opendir(cache->dirname);
+	if (!dir)
+		return;
+#endif
+
+	fz_try(ctx)
+	{
+#ifdef _WIN32
+		do
+		{
+			char *name = found.name;
+#else
+		while ((found = readdir(dir)) != NULL)
+		{
+			char *name = found->d_name;
+#endif
+			kind = entry_kind(name);
+			if (!kind)
+				continue;
+			i = snprintf(path, sizeof path, "%s/%s", cache->dirname, name);
+			if (i < 0 || i >= (int)sizeof path || stat(path, &info) != 0)
+				continue;
+			if (kind == 2)
+			{
+				if (now - info.st_mtime > 3600)
+					unlink(path);
+				continue;
+			}
+			if (len == cap)
+			{
+				cap = cap ? cap * 2 : 256;
+				list = fz_resize_array(ctx, list, cap, sizeof *list);
+			}
+			e = &list[len++];
+			e->mtime = info.st_mtime;
+			e->size = info.st_size;
+			fz_strlcpy(e->name, name, sizeof e->name);
+			total += e->size;
+		}
+#ifdef _WIN32
+		while (_findnext(dir, &found) == 0);
+#endif
+
+		if (total > cache->max)
+		{
+			qsort(list, len, sizeof *list, cmp_disk_entry);
+			for (i = 0; i < len && total > cache->max / 4 * 3; i++)
+			{
+				snprintf(path, sizeof path, "%s/%s", cache->dirname, list[i].name);
+				if (unlink(path) == 0)
+					total -= list[i].size;
+			}
+		}
+	}
+	fz_always(ctx)
+	{
+#ifdef _WIN32
+		_findclose(dir);
+#else
+		closedir(dir);
+#endif
+		fz_free(ctx, list);
+	}
+	fz_catch(ctx)
+	{
+		/* Leave the cache as it is, and try again another time */
+	}
+}
@@ -7,6 +7,7 @@
 #define MAX_BBOX_TABLE_SIZE 4096
 
 static void fz_drop_freetype(fz_context *ctx);
+static void fz_purge_context_faces(fz_context *ctx, fz_font *font);
 
 static fz_font *
 fz_new_font(fz_context *ctx, char *name, int use_glyph_bbox, int glyph_count)
@@ -31,6 +32,10 @@ fz_new_font(fz_context *ctx, char *name, int use_glyph_bbox, int glyph_count)
 	font->ft_file = NULL;
 	font->ft_data = NULL;
 	font->ft_size = 0;
+	font->ft_buffer = NULL;
+	font->ft_buffer_len = 0;
+	font->ft_index = 0;
+	font->ft_id = 0;
 
 	font->t3matrix = fz_identity;
 	font->t3resources = NULL;
@@ -90,6 +95,9 @@ fz_drop_font(fz_context *ctx, fz_font *font)
 	if (!drop)
 		return;
 
+	fz_purge_glyph_cache_font(ctx, font);
+	fz_purge_context_faces(ctx, font);
+
 	if (font->t3procs)
 	{
 		if (font->t3resources)
@@ -136,6 +144,8 @@ struct fz_font_context_s {
 	int ctx_refs;
 	FT_Library ftlib;
 	int ftlib_refs;
+	int next_id;
+	fz_ft_context *ft_contexts; /* under FZ_LOCK_FREETYPE */
 };
 
 #undef __FTERRORS_H__
@@ -155,6 +165,8 @@ void fz_new_font_context(fz_context *ctx)
 	ctx->font->ctx_refs = 1;
 	ctx->font->ftlib = NULL;
 	ctx->font->ftlib_refs = 0;
+	ctx->font->next_id = 0;
+	ctx->font->ft_contexts = NULL;
 }
 
 fz_font_context *
@@ -250,6 +262,260 @@ fz_drop_freetype(fz_context *ctx)
 	fz_unlock(ctx, FZ_LOCK_FREETYPE);
 }
 
+static int
+fz_next_font_id(fz_context *ctx)
+{
+	int id;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	id = ++ctx->font->next_id;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	return id;
+}
+
+/*
+ * Per-context faces
+ *
+ * An FT_Face may only be used by one thread at a time, so rendering with
+ * the shared face of a font means holding FZ_LOCK_FREETYPE for the whole
+ * of loading and rasterizing a glyph. Contexts that can be used from
+ * several threads (those with real locking functions) instead open their
+ * own faces on a private FT_Library, from the same font data, and render
+ * without taking the lock. The most recently used faces are kept.
+ *
+ * When a font is freed, the faces of it in the context freeing it are
+ * closed at once. Those in other contexts can only be closed by the
+ * thread using that context, so the font is put on their lists of dead
+ * fonts, which they check the next time they look for a face.
+ */
+
+#define MAX_CONTEXT_FACES 16
+#define MAX_DEAD_FONTS 16
+
+typedef struct fz_ft_face_s fz_ft_face;
+
+struct fz_ft_face_s
+{
+	int font_id;
+	FT_Face face;
+	fz_ft_face *next;
+};
+
+struct fz_ft_context_s
+{
+	FT_Library ftlib;
+	fz_ft_face *faces;
+	int count;
+
+	/* Fonts freed by other contexts, under FZ_LOCK_FREETYPE. More than
+	 * MAX_DEAD_FONTS means all faces are to be closed. */
+	int dead[MAX_DEAD_FONTS];
+	int dead_count;
+	fz_ft_context *next;
+};
+
+/* Close the faces of a font, or all faces if font_id is 0. */
+static void
+fz_close_context_faces(fz_ft_context *ft, fz_context *ctx, int font_id)
+{
+	fz_ft_face *entry, **prev;
+
+	prev = &ft->faces;
+	while (*prev)
+	{
+		entry = *prev;
+		if (font_id == 0 || entry->font_id == font_id)
+		{
+			*prev = entry->next;
+			FT_Done_Face(entry->face);
+			fz_free(ctx, entry);
+			ft->count--;
+		}
+		else
+			prev = &entry->next;
+	}
+}
+
+/* Close the faces of fonts freed by other contexts */
+static void
+fz_sweep_context_faces(fz_context *ctx, fz_ft_context *ft)
+{
+	int dead[MAX_DEAD_FONTS];
+	int i, n;
+
+	/* Read without the lock; a stale count only delays the sweep */
+	if (ft->dead_count == 0)
+		return;
+
+	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	n = ft->dead_count;
+	memcpy(dead, ft->dead, MIN(n, MAX_DEAD_FONTS) * sizeof(int));
+	ft->dead_count = 0;
+	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+
+	if (n > MAX_DEAD_FONTS)
+		fz_close_context_faces(ft, ctx, 0);
+	else
+		for (i = 0; i < n; i++)
+			fz_close_context_faces(ft, ctx, dead[i]);
+}
+
+/* Called when the last reference to a font goes away. */
+static void
+fz_purge_context_faces(fz_context *ctx, fz_font *font)
+{
+	fz_ft_context *ft;
+
+	if (font->ft_id == 0 || !ctx->font)
+		return;
+
+	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	for (ft = ctx->font->ft_contexts; ft; ft = ft->next)
+	{
+		if (ft == ctx->ft)
+			continue;
+		if (ft->dead_count < MAX_DEAD_FONTS)
+			ft->dead[ft->dead_count] = font->ft_id;
+		if (ft->dead_count <= MAX_DEAD_FONTS)
+			ft->dead_count++;
+	}
+	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+
+	if (ctx->ft)
+		fz_close_context_faces(ctx->ft, ctx, font->ft_id);
+}
+
+void
+fz_free_ft_context(fz_context *ctx)
+{
+	fz_ft_context *ft = ctx->ft;
+	fz_ft_context **prev;
+	fz_ft_face *entry, *next;
+
+	if (!ft)
+		return;
+
+	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	for (prev = &ctx->font->ft_contexts; *prev; prev = &(*prev)->next)
+	{
+		if (*prev == ft)
+		{
+			*prev = ft->next;
+			break;
+		}
+	}
+	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+
+	for (entry = ft->faces; entry; entry = next)
+	{
+		next = entry->next;
+		FT_Done_Face(entry->face);
+		fz_free(ctx, entry);
+	}
+	FT_Done_FreeType(ft->ftlib);
+	fz_free(ctx, ft);
+	ctx->ft = NULL;
+}
+
+/* Returns NULL if the shared face must be used instead. */
+static FT_Face
+fz_find_context_face(fz_context *ctx, fz_font *font)
+{
+	fz_ft_context *ft = ctx->ft;
+	fz_ft_face *entry, **prev;
+	FT_Face face;
+	int fterr;
+
+	if (ctx->locks == &fz_locks_default || font->ft_id == 0)
+		return NULL;
+
+	if (!ft)
+	{
+		ft = fz_malloc_no_throw(ctx, sizeof *ft);
+		if (!ft)
+			return NULL;
+		if (FT_Init_FreeType(&ft->ftlib))
+		{
+			fz_free(ctx, ft);
+			return NULL;
+		}
+		ft->faces = NULL;
+		ft->count = 0;
+		ft->dead_count = 0;
+		ctx->ft = ft;
+
+		fz_lock(ctx, FZ_LOCK_FREETYPE);
+		ft->next = ctx->font->ft_contexts;
+		ctx->font->ft_contexts = ft;
+		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+	}
+
+	fz_sweep_context_faces(ctx, ft);
+
+	for (prev = &ft->faces; *prev; prev = &(*prev)->next)
+	{
+		entry = *prev;
+		if (entry->font_id == font->ft_id)
+		{
+			*prev = entry->next;
+			entry->next = ft->faces;
+			ft->faces = entry;
+			return entry->face;
+		}
+	}
+
+	if (font->ft_file)
+		fterr = FT_New_Face(ft->ftlib, font->ft_file, font->ft_index, &face);
+	else if (font->ft_buffer)
+		fterr = FT_New_Memory_Face(ft->ftlib, font->ft_buffer, font->ft_buffer_len, font->ft_index, &face);
+	else
+		return NULL;
+	if (fterr)
+		return NULL;
+
+	entry = fz_malloc_no_throw(ctx, sizeof *entry);
+	if (!entry)
+	{
+		FT_Done_Face(face);
+		return NULL;
+	}
+	entry->font_id = font->ft_id;
+	entry->face = face;
+	entry->next = ft->faces;
+	ft->faces = entry;
+
+	if (++ft->count > MAX_CONTEXT_FACES)
+	{
+		for (prev = &ft->faces; (*prev)->next; prev = &(*prev)->next)
+			;
+		entry = *prev;
+		*prev = NULL;
+		FT_Done_Face(entry->face);
+		fz_free(ctx, entry);
+		ft->count--;
+	}
+
+	return face;
+}
+
+/* Get a face to render with, locking the shared face if need be. */
+static FT_Face
+fz_lock_ft_face(fz_context *ctx, fz_font *font)
+{
+	FT_Face face = fz_find_context_face(ctx, font);
+	if (face)
+		return face;
+	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	return font->ft_face;
+}
+
+static void
+fz_unlock_ft_face(fz_context *ctx, fz_font *font, FT_Face face)
+{
+	if (face == font->ft_face)
+		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+}
+
 fz_font *
 fz_new_font_from_file(fz_context *ctx, char *path, int index, int use_glyph_bbox)
 {
@@ -270,6 +536,9 @@ fz_new_font_from_file(fz_context *ctx, char *path, int index, int use_glyph_bbox
 
 	font = fz_new_font(ctx, face->family_name, use_glyph_bbox, face->num_glyphs);
 	font->ft_face = face;
+	font->ft_file = fz_strdup(ctx, path);
+	font->ft_index = index;
+	font->ft_id = fz_next_font_id(ctx);
 	font->bbox.x0 = (float) face->bbox.xMin / face->units_per_EM;
 	font->bbox.y0 = (float) face->bbox.yMin / face->units_per_EM;
 	font->bbox.x1 = (float) face->bbox.xMax / face->units_per_EM;
@@ -298,6 +567,10 @@ fz_new_font_from_memory(fz_context *ctx, unsigned char *data, int len, int index
 
 	font = fz_new_font(ctx, face->family_name, use_glyph_bbox, face->num_glyphs);
 	font->ft_face = face;
+	font->ft_buffer = data;
+	font->ft_buffer_len = len;
+	font->ft_index = index;
+	font->ft_id = fz_next_font_id(ctx);
 	font->bbox.x0 = (float) face->bbox.xMin / face->units_per_EM;
 	font->bbox.y0 = (float) face->bbox.yMin / face->units_per_EM;
 	font->bbox.x1 = (float) face->bbox.xMax / face->units_per_EM;
@@ -306,8 +579,9 @@ fz_new_font_from_memory(fz_context *ctx, unsigned char *data, int len, int index
 	return font;
 }
 
+/* Called with face locked. */
 static fz_matrix
-fz_adjust_ft_glyph_width(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
+fz_adjust_ft_glyph_width(fz_context *ctx, fz_font *font, FT_Face face, int gid, fz_matrix trm)
 {
 	/* Fudge the font matrix to stretch the glyph if we've substituted the font. */
 	if (font->ft_substitute && font->width_table && gid < font->width_count)
@@ -317,19 +591,17 @@ fz_adjust_ft_glyph_width(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 		int realw;
 		float scale;
 
-		fz_lock(ctx, FZ_LOCK_FREETYPE);
 		/* TODO: use FT_Get_Advance */
-		fterr = FT_Set_Char_Size(font->ft_face, 1000, 1000, 72, 72);
+		fterr = FT_Set_Char_Size(face, 1000, 1000, 72, 72);
 		if (fterr)
 			fz_warn(ctx, "freetype setting character size: %s", ft_error_string(fterr));
 
-		fterr = FT_Load_Glyph(font->ft_face, gid,
+		fterr = FT_Load_Glyph(face, gid,
 			FT_LOAD_NO_HINTING | FT_LOAD_NO_BITMAP | FT_LOAD_IGNORE_TRANSFORM);
 		if (fterr)
 			fz_warn(ctx, "freetype failed to load glyph: %s", ft_error_string(fterr));
 
-		realw = ((FT_Face)font->ft_face)->glyph->metrics.horiAdvance;
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		realw = face->glyph->metrics.horiAdvance;
 		subw = font->width_table[gid];
 		if (realw)
 			scale = (float) subw / realw;
@@ -385,16 +657,63 @@ fz_copy_ft_bitmap(fz_context *ctx, int left, int top, FT_Bitmap *bitmap)
 	return pixmap;
 }
 
-/* The glyph cache lock is always taken when this is called. */
+/*
+	Copy the glyph rendered in a face, and unlock the face. Nothing of
+	ours may be allocated while the shared face is locked: an allocation
+	that fails empties the store, which can drop fonts, and dropping a
+	font takes FZ_LOCK_FREETYPE. So the bitmap of the shared face is
+	first copied by freetype, whose allocator does not do that.
+*/
+static fz_pixmap *
+fz_copy_ft_glyph_and_unlock(fz_context *ctx, fz_font *font, FT_Face face, int gid)
+{
+	FT_Glyph glyph;
+	FT_BitmapGlyph bitmap;
+	FT_Error fterr;
+	fz_pixmap *pixmap = NULL;
+
+	if (face != font->ft_face)
+	{
+		fz_unlock_ft_face(ctx, font, face);
+		return fz_copy_ft_bitmap(ctx, face->glyph->bitmap_left, face->glyph->bitmap_top, &face->glyph->bitmap);
+	}
+
+	fterr = FT_Get_Glyph(face->glyph, &glyph);
+	fz_unlock_ft_face(ctx, font, face);
+	if (fterr)
+	{
+		fz_warn(ctx, "freetype copy glyph (gid %d): %s", gid, ft_error_string(fterr));
+		return NULL;
+	}
+
+	bitmap = (FT_BitmapGlyph)glyph;
+	fz_try(ctx)
+	{
+		pixmap = fz_copy_ft_bitmap(ctx, bitmap->left, bitmap->top, &bitmap->bitmap);
+	}
+	fz_always(ctx)
+	{
+		FT_Done_Glyph(glyph);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+
+	return pixmap;
+}
+
 fz_pixmap *
 fz_render_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 {
-	FT_Face face = font->ft_face;
+	FT_Face face;
 	FT_Matrix m;
 	FT_Vector v;
 	FT_Error fterr;
 
-	trm = fz_adjust_ft_glyph_width(ctx, font, gid, trm);
+	face = fz_lock_ft_face(ctx, font);
+
+	trm = fz_adjust_ft_glyph_width(ctx, font, face, gid, trm);
 
 	if (font->ft_italic)
 		trm = fz_concat(fz_shear(0.3f, 0), trm);
@@ -414,7 +733,6 @@ fz_render_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 	v.x = trm.e * 64;
 	v.y = trm.f * 64;
 
-	fz_lock(ctx, FZ_LOCK_FREETYPE);
 	fterr = FT_Set_Char_Size(face, 65536, 65536, 72, 72); /* should be 64, 64 */
 	if (fterr)
 		fz_warn(ctx, "freetype setting character size: %s", ft_error_string(fterr));
@@ -458,7 +776,7 @@ fz_render_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 		if (fterr)
 		{
 			fz_warn(ctx, "freetype load glyph (gid %d): %s", gid, ft_error_string(fterr));
-			fz_unlock(ctx, FZ_LOCK_FREETYPE);
+			fz_unlock_ft_face(ctx, font, face);
 			return NULL;
 		}
 	}
@@ -474,18 +792,17 @@ fz_render_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 	if (fterr)
 	{
 		fz_warn(ctx, "freetype render glyph (gid %d): %s", gid, ft_error_string(fterr));
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_unlock_ft_face(ctx, font, face);
 		return NULL;
 	}
-	fz_unlock(ctx, FZ_LOCK_FREETYPE);
 
-	return fz_copy_ft_bitmap(ctx, face->glyph->bitmap_left, face->glyph->bitmap_top, &face->glyph->bitmap);
+	return fz_copy_ft_glyph_and_unlock(ctx, font, face, gid);
 }
 
 fz_pixmap *
 fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, fz_matrix ctm, fz_stroke_state *state)
 {
-	FT_Face face = font->ft_face;
+	FT_Face face;
 	float expansion = fz_matrix_expansion(ctm);
 	int linewidth = state->linewidth * expansion * 64 / 2;
 	FT_Matrix m;
@@ -494,10 +811,12 @@ fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix tr
 	FT_Stroker stroker;
 	FT_Glyph glyph;
 	FT_BitmapGlyph bitmap;
-	fz_pixmap *pixmap;
+	fz_pixmap *pixmap = NULL;
 	FT_Stroker_LineJoin line_join;
 
-	trm = fz_adjust_ft_glyph_width(ctx, font, gid, trm);
+	face = fz_lock_ft_face(ctx, font);
+
+	trm = fz_adjust_ft_glyph_width(ctx, font, face, gid, trm);
 
 	if (font->ft_italic)
 		trm = fz_concat(fz_shear(0.3f, 0), trm);
@@ -509,12 +828,11 @@ fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix tr
 	v.x = trm.e * 64;
 	v.y = trm.f * 64;
 
-	fz_lock(ctx, FZ_LOCK_FREETYPE);
 	fterr = FT_Set_Char_Size(face, 65536, 65536, 72, 72); /* should be 64, 64 */
 	if (fterr)
 	{
 		fz_warn(ctx, "FT_Set_Char_Size: %s", ft_error_string(fterr));
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_unlock_ft_face(ctx, font, face);
 		return NULL;
 	}
 
@@ -524,15 +842,15 @@ fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix tr
 	if (fterr)
 	{
 		fz_warn(ctx, "FT_Load_Glyph(gid %d): %s", gid, ft_error_string(fterr));
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_unlock_ft_face(ctx, font, face);
 		return NULL;
 	}
 
-	fterr = FT_Stroker_New(ctx->font->ftlib, &stroker);
+	fterr = FT_Stroker_New(face->glyph->library, &stroker);
 	if (fterr)
 	{
 		fz_warn(ctx, "FT_Stroker_New: %s", ft_error_string(fterr));
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_unlock_ft_face(ctx, font, face);
 		return NULL;
 	}
 
@@ -557,7 +875,7 @@ fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix tr
 	{
 		fz_warn(ctx, "FT_Get_Glyph: %s", ft_error_string(fterr));
 		FT_Stroker_Done(stroker);
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_unlock_ft_face(ctx, font, face);
 		return NULL;
 	}
 
@@ -567,7 +885,7 @@ fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix tr
 		fz_warn(ctx, "FT_Glyph_Stroke: %s", ft_error_string(fterr));
 		FT_Done_Glyph(glyph);
 		FT_Stroker_Done(stroker);
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_unlock_ft_face(ctx, font, face);
 		return NULL;
 	}
 
@@ -578,14 +896,26 @@ fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix tr
 	{
 		fz_warn(ctx, "FT_Glyph_To_Bitmap: %s", ft_error_string(fterr));
 		FT_Done_Glyph(glyph);
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_unlock_ft_face(ctx, font, face);
 		return NULL;
 	}
 
+	/* The glyph is our own copy; see fz_copy_ft_glyph_and_unlock */
+	fz_unlock_ft_face(ctx, font, face);
+
 	bitmap = (FT_BitmapGlyph)glyph;
-	pixmap = fz_copy_ft_bitmap(ctx, bitmap->left, bitmap->top, &bitmap->bitmap);
-	FT_Done_Glyph(glyph);
-	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+	fz_try(ctx)
+	{
+		pixmap = fz_copy_ft_bitmap(ctx, bitmap->left, bitmap->top, &bitmap->bitmap);
+	}
+	fz_always(ctx)
+	{
+		FT_Done_Glyph(glyph);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
 
 	return pixmap;
 }
@@ -593,7 +923,7 @@ fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix tr
 static fz_rect
 fz_bound_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 {
-	FT_Face face = font->ft_face;
+	FT_Face face;
 	FT_Error fterr;
 	FT_BBox cbox;
 	FT_Matrix m;
@@ -603,7 +933,9 @@ fz_bound_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 	// TODO: refactor loading into fz_load_ft_glyph
 	// TODO: cache results
 
-	trm = fz_adjust_ft_glyph_width(ctx, font, gid, trm);
+	face = fz_lock_ft_face(ctx, font);
+
+	trm = fz_adjust_ft_glyph_width(ctx, font, face, gid, trm);
 
 	if (font->ft_italic)
 		trm = fz_concat(fz_shear(0.3f, 0), trm);
@@ -615,7 +947,6 @@ fz_bound_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 	v.x = trm.e * 64;
 	v.y = trm.f * 64;
 
-	fz_lock(ctx, FZ_LOCK_FREETYPE);
 	fterr = FT_Set_Char_Size(face, 65536, 65536, 72, 72); /* should be 64, 64 */
 	if (fterr)
 		fz_warn(ctx, "freetype setting character size: %s", ft_error_string(fterr));
@@ -625,7 +956,7 @@ fz_bound_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 	if (fterr)
 	{
 		fz_warn(ctx, "freetype load glyph (gid %d): %s", gid, ft_error_string(fterr));
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_unlock_ft_face(ctx, font, face);
 		bounds.x0 = bounds.x1 = trm.e;
 		bounds.y0 = bounds.y1 = trm.f;
 		return bounds;
@@ -639,7 +970,7 @@ fz_bound_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 	}
 
 	FT_Outline_Get_CBox(&face->glyph->outline, &cbox);
-	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+	fz_unlock_ft_face(ctx, font, face);
 	bounds.x0 = cbox.xMin / 64.0f;
 	bounds.y0 = cbox.yMin / 64.0f;
 	bounds.x1 = cbox.xMax / 64.0f;
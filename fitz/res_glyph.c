@@ -0,0 +1,171 @@
+#include "fitz.h"
+
+/* Glyphs smaller than this are always stored packed */
+enum { MIN_RLE_AREA = 256 };
+
+enum { MAX_SKIP = 64, MAX_SOLID = 64, MAX_LITERAL = 128 };
+
+fz_glyph *
+fz_keep_glyph(fz_context *ctx, fz_glyph *glyph)
+{
+	return (fz_glyph *)fz_keep_storable(ctx, &glyph->storable);
+}
+
+void
+fz_drop_glyph(fz_context *ctx, fz_glyph *glyph)
+{
+	fz_drop_storable(ctx, &glyph->storable);
+}
+
+void
+fz_free_glyph_imp(fz_context *ctx, fz_storable *glyph_)
+{
+	fz_glyph *glyph = (fz_glyph *)glyph_;
+
+	fz_drop_pixmap(ctx, glyph->pixmap);
+	fz_free(ctx, glyph);
+}
+
+fz_bbox
+fz_glyph_bbox(fz_glyph *glyph)
+{
+	fz_bbox bbox;
+	bbox.x0 = glyph->x;
+	bbox.y0 = glyph->y;
+	bbox.x1 = glyph->x + glyph->w;
+	bbox.y1 = glyph->y + glyph->h;
+	return bbox;
+}
+
+unsigned int
+fz_glyph_size(fz_context *ctx, fz_glyph *glyph)
+{
+	if (glyph == NULL)
+		return 0;
+	return sizeof(*glyph) + glyph->size + fz_pixmap_size(ctx, glyph->pixmap);
+}
+
+/* Encode one row of coverage; with out == NULL only count the bytes. */
+static int
+encode_row(unsigned char *out, unsigned char *sp, int w)
+{
+	int len = 0;
+	int x = 0;
+	int n;
+
+	/* Trailing transparent pixels need not be stored */
+	while (w > 0 && sp[w - 1] == 0)
+		w--;
+
+	while (x < w)
+	{
+		n = 0;
+		if (sp[x] == 0)
+		{
+			while (x + n < w && n < MAX_SKIP && sp[x + n] == 0)
+				n++;
+			if (out)
+				out[len] = n - 1;
+			len++;
+		}
+		else if (sp[x] == 255)
+		{
+			while (x + n < w && n < MAX_SOLID && sp[x + n] == 255)
+				n++;
+			if (out)
+				out[len] = 0x40 + n - 1;
+			len++;
+		}
+		else
+		{
+			while (x + n < w && n < MAX_LITERAL && sp[x + n] != 0 && sp[x + n] != 255)
+				n++;
+			if (out)
+			{
+				out[len] = 0x80 + n - 1;
+				memcpy(out + len + 1, sp + x, n);
+			}
+			len += 1 + n;
+		}
+		x += n;
+	}
+
+	return len;
+}
+
+/*
+	Takes ownership of pix. Coverage pixmaps are copied into the glyph
+	and dropped; coloured ones are kept as they are.
+*/
+fz_glyph *
+fz_new_glyph_from_pixmap(fz_context *ctx, fz_pixmap *pix)
+{
+	fz_glyph *glyph = NULL;
+	int area, rle_size, table, y;
+	unsigned char *sp, *dp;
+
+	if (pix == NULL)
+		return NULL;
+
+	fz_var(glyph);
+
+	fz_try(ctx)
+	{
+		if (pix->n != 1)
+		{
+			glyph = fz_malloc_struct(ctx, fz_glyph);
+			glyph->pixmap = pix;
+		}
+		else
+		{
+			area = pix->w * pix->h;
+			rle_size = INT_MAX;
+			table = (pix->h + 1) * sizeof(int);
+			if (area >= MIN_RLE_AREA)
+			{
+				rle_size = table;
+				sp = pix->samples;
+				for (y = 0; y < pix->h; y++, sp += pix->w)
+					rle_size += encode_row(NULL, sp, pix->w);
+			}
+
+			if (rle_size < area)
+			{
+				glyph = fz_malloc(ctx, sizeof(fz_glyph) + rle_size);
+				glyph->rows = (int *)glyph->data;
+				glyph->size = rle_size;
+				dp = glyph->data + table;
+				sp = pix->samples;
+				for (y = 0; y < pix->h; y++, sp += pix->w)
+				{
+					glyph->rows[y] = dp - glyph->data;
+					dp += encode_row(dp, sp, pix->w);
+				}
+				glyph->rows[y] = dp - glyph->data;
+			}
+			else
+			{
+				glyph = fz_malloc(ctx, sizeof(fz_glyph) + area);
+				glyph->rows = NULL;
+				glyph->size = area;
+				memcpy(glyph->data, pix->samples, area);
+			}
+			glyph->pixmap = NULL;
+		}
+
+		FZ_INIT_STORABLE(glyph, 1, fz_free_glyph_imp);
+		glyph->x = pix->x;
+		glyph->y = pix->y;
+		glyph->w = pix->w;
+		glyph->h = pix->h;
+		if (!glyph->pixmap)
+			fz_drop_pixmap(ctx, pix);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_pixmap(ctx, pix);
+		fz_rethrow(ctx);
+	}
+
+	return glyph;
+}
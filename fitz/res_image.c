@@ -0,0 +1,175 @@
+#include "fitz.h"
+
+fz_image *
+fz_keep_image(fz_context *ctx, fz_image *image)
+{
+	return (fz_image *)fz_keep_storable(ctx, &image->storable);
+}
+
+void
+fz_drop_image(fz_context *ctx, fz_image *image)
+{
+	fz_drop_storable(ctx, &image->storable);
+}
+
+fz_pixmap *
+fz_image_to_pixmap(fz_context *ctx, fz_image *image, int w, int h, fz_bbox *area)
+{
+	return image->get_pixmap(ctx, image, w, h, area);
+}
+
+fz_bitmap *
+fz_image_to_bitmap(fz_context *ctx, fz_image *image, unsigned char levels[2])
+{
+	if (!image->get_bitmap)
+		return NULL;
+	return image->get_bitmap(ctx, image, levels);
+}
+
+fz_pixmap *
+fz_image_to_indexed(fz_context *ctx, fz_image *image, int w, int h, fz_bbox *area, fz_pixmap **palette)
+{
+	if (!image->get_indexed)
+		return NULL;
+	return image->get_indexed(ctx, image, w, h, area, palette);
+}
+
+/*
+ * Images made from a pixmap that is already decoded.
+ */
+
+typedef struct fz_pixmap_image_s fz_pixmap_image;
+
+struct fz_pixmap_image_s
+{
+	fz_image base;
+	fz_pixmap *tile;
+};
+
+static void
+fz_free_pixmap_image(fz_context *ctx, fz_storable *image_)
+{
+	fz_pixmap_image *image = (fz_pixmap_image *)image_;
+
+	if (image->base.mask)
+		fz_drop_image(ctx, image->base.mask);
+	if (image->base.colorspace)
+		fz_drop_colorspace(ctx, image->base.colorspace);
+	fz_drop_pixmap(ctx, image->tile);
+	fz_free(ctx, image);
+}
+
+static fz_pixmap *
+fz_pixmap_image_get_pixmap(fz_context *ctx, fz_image *image, int w, int h, fz_bbox *area)
+{
+	if (area)
+	{
+		area->x0 = area->y0 = 0;
+		area->x1 = image->w;
+		area->y1 = image->h;
+	}
+	return fz_keep_pixmap(ctx, ((fz_pixmap_image *)image)->tile);
+}
+
+/* Takes ownership of pixmap and mask, even on error */
+fz_image *
+fz_new_image_from_pixmap(fz_context *ctx, fz_pixmap *pixmap, fz_image *mask)
+{
+	fz_pixmap_image *image;
+
+	fz_try(ctx)
+	{
+		image = fz_malloc_struct(ctx, fz_pixmap_image);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_pixmap(ctx, pixmap);
+		if (mask)
+			fz_drop_image(ctx, mask);
+		fz_rethrow(ctx);
+	}
+
+	FZ_INIT_STORABLE(&image->base, 1, fz_free_pixmap_image);
+	image->base.w = pixmap->w;
+	image->base.h = pixmap->h;
+	image->base.imagemask = !pixmap->colorspace;
+	image->base.colorspace = pixmap->colorspace ? fz_keep_colorspace(ctx, pixmap->colorspace) : NULL;
+	image->base.mask = mask;
+	image->base.interpolate = pixmap->interpolate;
+	image->base.get_pixmap = fz_pixmap_image_get_pixmap;
+	image->tile = pixmap;
+	return &image->base;
+}
+
+/*
+ * Compressed image data.
+ */
+
+/*
+	The stream reads the bytes in place rather than taking a reference
+	to the buffer, as buffer reference counts are not thread safe and
+	an image may be drawn from several threads at once.
+
+	As for fz_open_dctd, l2factor, if given, lets the decoder scale the
+	image down by up to 2^*l2factor; *l2factor is reduced by what it did.
+*/
+fz_stream *
+fz_open_image_decomp_stream(fz_context *ctx, fz_compressed_buffer *buffer, int *l2factor)
+{
+	fz_compression_params *params = &buffer->params;
+	fz_stream *chain;
+	int factor;
+
+	chain = fz_open_memory(ctx, buffer->buffer->data, buffer->buffer->len);
+
+	switch (params->type)
+	{
+	case FZ_IMAGE_FAX:
+		return fz_open_faxd(chain,
+			params->u.fax.k,
+			params->u.fax.end_of_line,
+			params->u.fax.encoded_byte_align,
+			params->u.fax.columns,
+			params->u.fax.rows,
+			params->u.fax.end_of_block,
+			params->u.fax.black_is_1);
+
+	case FZ_IMAGE_DCT:
+		factor = 0;
+		if (l2factor)
+		{
+			factor = MIN(*l2factor, 3);
+			*l2factor -= factor;
+		}
+		return fz_open_dctd(chain, params->u.dct.color_transform, factor);
+
+	case FZ_IMAGE_RLD:
+		return fz_open_rld(chain);
+
+	case FZ_IMAGE_FLATE:
+		chain = fz_open_flated(chain);
+		if (params->u.flate.predictor > 1)
+			chain = fz_open_predict(chain, params->u.flate.predictor,
+				params->u.flate.columns, params->u.flate.colors, params->u.flate.bpc);
+		return chain;
+
+	case FZ_IMAGE_LZW:
+		chain = fz_open_lzwd(chain, params->u.flate.early_change);
+		if (params->u.flate.predictor > 1)
+			chain = fz_open_predict(chain, params->u.flate.predictor,
+				params->u.flate.columns, params->u.flate.colors, params->u.flate.bpc);
+		return chain;
+
+	default:
+		return chain;
+	}
+}
+
+void
+fz_free_compressed_buffer(fz_context *ctx, fz_compressed_buffer *buffer)
+{
+	if (!buffer)
+		return;
+	fz_drop_buffer(ctx, buffer->buffer);
+	fz_free(ctx, buffer);
+}
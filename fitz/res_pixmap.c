@@ -21,7 +21,9 @@ fz_free_pixmap_imp(fz_context *ctx, fz_storable *pix_)
 		fz_drop_pixmap(ctx, pix->mask);
 	if (pix->colorspace)
 		fz_drop_colorspace(ctx, pix->colorspace);
-	if (pix->free_samples)
+	if (pix->free_samples == FZ_SAMPLES_MAPPED)
+		fz_unmap_pixmap_samples(ctx, pix);
+	else if (pix->free_samples)
 		fz_free(ctx, pix->samples);
 	fz_free(ctx, pix);
 }
@@ -1,72 +1,551 @@
 #include "fitz.h"
 #include "mupdf.h"
 
+/*
+	The store is split into FZ_STORE_SHARDS independent shards, each with
+	its own hash chains and lock (FZ_LOCK_STORE + n). Items are placed in
+	a shard according to a hash of their key, so lookups from different
+	threads rarely contend with one another.
+
+	Indirect keys are hashed on their object number and generation;
+	direct keys (inline images, colorspace arrays, function dicts) are
+	hashed structurally with fz_objhash, so every lookup is a walk of a
+	single short hash chain. Items may instead be keyed by a few bytes
+	of plain data, copied into the item, for things that have no object
+	of their own and would rather not make one.
+
+	Storable reference counts are protected by a separate set of locks
+	(FZ_LOCK_REFS + n) chosen from the address of the storable, so that
+	keeping and dropping resources does not serialise on FZ_LOCK_ALLOC.
+
+	Items that nobody but the store holds a reference to are evictable.
+	They are kept in a priority heap, one per refs lock, which is updated
+	as references are kept and dropped; eviction pops the item with the
+	lowest priority and never needs to look at items still in use. The
+	priority of an item comes from the store policy, which by default is
+	GreedyDual-Size-Frequency: items that were expensive to make, are
+	small, or are often used stay longer. Items of equal priority go in
+	order of last use, from a tick shared by all shards.
+
+	The total size of the store is still held globally (under
+	FZ_LOCK_ALLOC), and is enforced cooperatively: a thread that needs
+	space evicts until there is enough.
+
+	We never allocate or free memory while holding a shard or refs lock;
+	this lets the scavenging allocator evict from anywhere.
+*/
+
+enum
+{
+	NOT_IN_HEAP = -1,
+	CLAIMED = -2 /* picked for eviction or removal */
+};
+
 struct fz_item_s
 {
-	fz_obj *key;
+	fz_obj *key; /* or NULL, and keyed by data */
+	int keylen;
+	unsigned char keydata[FZ_STORE_KEY_MAX];
 	fz_storable *val;
 	unsigned int size;
-	fz_item *next;
-	fz_item *prev;
+	unsigned int hash;
+	unsigned int cost;
+	int hits;
+	float priority;
+	unsigned int tick;
+	int heap;
+	fz_item *chain;
 	fz_store *store;
 };
 
-struct refkey
+typedef struct fz_store_shard_s fz_store_shard;
+typedef struct fz_store_heap_s fz_store_heap;
+typedef struct fz_store_lookups_s fz_store_lookups;
+
+struct fz_store_lookups_s
 {
 	fz_store_free_fn *free;
-	int num;
-	int gen;
+	int hits, misses;
+};
+
+struct fz_store_shard_s
+{
+	/* Every item is chained into a hash table. The table is only ever
+	 * grown outside the lock. */
+	fz_item **bucket;
+	int bucket_count;
+	int chain_count;
+
+	/* Lookup statistics, by type, kept here so that they do not need
+	 * a global lock. */
+	fz_store_lookups lookups[FZ_STORE_TYPES];
+	int lookup_count;
+};
+
+struct fz_store_heap_s
+{
+	/* Min-heap of evictable items, ordered by priority. Room for every
+	 * stored item is reserved up front, so the heap never needs to
+	 * allocate with its lock held. */
+	fz_item **items;
+	int len;
+	int count;
+	int cap;
 };
 
 struct fz_store_s
 {
 	int refs;
 
-	/* Every item in the store is kept in a doubly linked list, ordered
-	 * by usage (so LRU entries are at the end). */
-	fz_item *head;
-	fz_item *tail;
+	fz_store_shard shard[FZ_STORE_SHARDS];
+	fz_store_heap heap[FZ_STORE_SHARDS];
+
+	fz_store_priority_fn *priority;
 
-	/* We have a hash table that allows to quickly find a subset of the
-	 * entries (those whose keys are indirect objects). */
-	fz_hash_table *hash;
+	/* The priority of the last evicted item. Written under
+	 * FZ_LOCK_ALLOC, but read without it; a stale value only skews new
+	 * priorities a little. */
+	float clock;
 
-	/* We keep track of the size of the store, and keep it below max. */
+	/* Counts insertions and hits, under FZ_LOCK_ALLOC. */
+	unsigned int tick;
+
+	/* We keep track of the size of the store, and keep it below max.
+	 * Both are protected by FZ_LOCK_ALLOC. */
 	unsigned int max;
 	unsigned int size;
+
+	/* The last id handed out by fz_new_store_id, under FZ_LOCK_ALLOC. */
+	int last_id;
+
+	/* Statistics, other than lookups. Also under FZ_LOCK_ALLOC. */
+	unsigned int peak;
+	fz_store_type_stats type[FZ_STORE_TYPES];
+	int type_count;
 };
 
+enum { INITIAL_BUCKETS = 512 };
+
+static inline int
+refs_index(fz_storable *s)
+{
+	return (int)(((size_t)s >> 4) % FZ_STORE_SHARDS);
+}
+
+static unsigned int
+hash_free_fn(fz_store_free_fn *free)
+{
+	unsigned int h = (unsigned int)(size_t)free;
+	h ^= h >> 16;
+	h *= 0x45d9f3b;
+	h ^= h >> 16;
+	return h;
+}
+
+static unsigned int
+hash_ref(fz_store_free_fn *free, int num, int gen)
+{
+	unsigned int h = hash_free_fn(free);
+	h = h * 31 + num;
+	h = h * 31 + gen;
+	h ^= h >> 15;
+	h *= 0x2c1b3c6d;
+	h ^= h >> 12;
+	return h;
+}
+
+static unsigned int
+hash_key(fz_store_free_fn *free, fz_obj *key)
+{
+	unsigned int h;
+
+	if (fz_is_indirect(key))
+		return hash_ref(free, fz_to_num(key), fz_to_gen(key));
+
+	h = hash_free_fn(free) ^ fz_objhash(key);
+	h ^= h >> 15;
+	h *= 0x2c1b3c6d;
+	h ^= h >> 12;
+	return h;
+}
+
+static unsigned int
+hash_data(fz_store_free_fn *free, const unsigned char *data, int len)
+{
+	unsigned int h = hash_free_fn(free);
+	while (len--)
+		h = h * 31 + *data++;
+	h ^= h >> 15;
+	h *= 0x2c1b3c6d;
+	h ^= h >> 12;
+	return h;
+}
+
+#define SHARD_OF(h) ((h) % FZ_STORE_SHARDS)
+#define BUCKET_OF(sh, h) (((h) / FZ_STORE_SHARDS) % (sh)->bucket_count)
+
+/* Eviction policies */
+
+float
+fz_store_priority_lru(float clock, unsigned int size, unsigned int cost, int hits)
+{
+	/* All equal, so that items go in order of last use */
+	return 0;
+}
+
+float
+fz_store_priority_gdsf(float clock, unsigned int size, unsigned int cost, int hits)
+{
+	if (size == 0)
+		size = 1;
+	return clock + (float)hits * cost / size;
+}
+
+void
+fz_set_store_policy(fz_context *ctx, fz_store_priority_fn *priority)
+{
+	if (ctx == NULL || ctx->store == NULL)
+		return;
+	ctx->store->priority = priority ? priority : fz_store_priority_gdsf;
+}
+
+/* Statistics */
+
+/* FZ_LOCK_ALLOC is held. */
+static fz_store_type_stats *
+type_stats(fz_store *store, fz_store_free_fn *free)
+{
+	fz_store_type_stats *t;
+	int i;
+
+	for (i = 0; i < store->type_count; i++)
+		if (store->type[i].free == free)
+			return &store->type[i];
+	if (store->type_count < FZ_STORE_TYPES - 1)
+	{
+		t = &store->type[store->type_count++];
+		t->free = free;
+		return t;
+	}
+	t = &store->type[FZ_STORE_TYPES - 1];
+	t->free = NULL;
+	t->name = "other";
+	store->type_count = FZ_STORE_TYPES;
+	return t;
+}
+
+/* The shard lock is held. */
+static fz_store_lookups *
+shard_lookups(fz_store_shard *shard, fz_store_free_fn *free)
+{
+	int i;
+
+	for (i = 0; i < shard->lookup_count; i++)
+		if (shard->lookups[i].free == free)
+			return &shard->lookups[i];
+	if (shard->lookup_count < FZ_STORE_TYPES - 1)
+	{
+		shard->lookups[i].free = free;
+		shard->lookup_count++;
+		return &shard->lookups[i];
+	}
+	shard->lookup_count = FZ_STORE_TYPES;
+	shard->lookups[FZ_STORE_TYPES - 1].free = NULL;
+	return &shard->lookups[FZ_STORE_TYPES - 1];
+}
+
+void
+fz_set_store_type_name(fz_context *ctx, fz_store_free_fn *free, char *name)
+{
+	fz_store_type_stats *t;
+
+	if (ctx == NULL || ctx->store == NULL)
+		return;
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	t = type_stats(ctx->store, free);
+	if (t->free == free)
+		t->name = name;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+}
+
+/*
+	A number, unique within the store, for keying items that belong to
+	something without an object of its own, such as an image.
+*/
+int
+fz_new_store_id(fz_context *ctx)
+{
+	int id;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	id = ++ctx->store->last_id;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	return id;
+}
+
+void
+fz_get_store_stats(fz_context *ctx, fz_store_stats *stats)
+{
+	fz_store *store = ctx->store;
+	fz_store_shard *shard;
+	fz_store_lookups *l;
+	fz_store_type_stats *t;
+	int i, k, n;
+
+	memset(stats, 0, sizeof *stats);
+	if (store == NULL)
+		return;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	stats->max = store->max;
+	stats->size = store->size;
+	stats->peak = store->peak;
+	stats->type_count = store->type_count;
+	memcpy(stats->type, store->type, sizeof stats->type);
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	for (i = 0; i < FZ_STORE_SHARDS; i++)
+	{
+		shard = &store->shard[i];
+		fz_lock(ctx, FZ_LOCK_STORE + i);
+		for (k = 0; k < shard->lookup_count; k++)
+		{
+			l = &shard->lookups[k];
+			for (n = 0; n < stats->type_count; n++)
+				if (stats->type[n].free == l->free)
+					break;
+			if (n == stats->type_count)
+			{
+				/* Looked for, but never stored */
+				if (n == FZ_STORE_TYPES)
+					n--;
+				else
+					stats->type_count++;
+				stats->type[n].free = l->free;
+				if (!l->free)
+					stats->type[n].name = "other";
+			}
+			stats->type[n].hits += l->hits;
+			stats->type[n].misses += l->misses;
+		}
+		fz_unlock(ctx, FZ_LOCK_STORE + i);
+	}
+
+	for (n = 0; n < stats->type_count; n++)
+	{
+		t = &stats->type[n];
+		stats->hits += t->hits;
+		stats->misses += t->misses;
+		stats->insertions += t->insertions;
+		stats->evictions += t->evictions;
+	}
+}
+
+void
+fz_print_store_stats(fz_context *ctx, FILE *out)
+{
+	fz_store_stats stats;
+	fz_store_type_stats *t;
+	int i;
+
+	fz_get_store_stats(ctx, &stats);
+
+	fprintf(out, "store: %u bytes in use, peak %u, max ", stats.size, stats.peak);
+	if (stats.max == FZ_STORE_UNLIMITED)
+		fprintf(out, "unlimited\n");
+	else
+		fprintf(out, "%u\n", stats.max);
+	fprintf(out, "store: %d hits, %d misses, %d insertions, %d evictions\n",
+		stats.hits, stats.misses, stats.insertions, stats.evictions);
+	for (i = 0; i < stats.type_count; i++)
+	{
+		t = &stats.type[i];
+		if (!t->insertions && !t->hits && !t->misses)
+			continue;
+		if (t->name)
+			fprintf(out, "store %s: ", t->name);
+		else
+			fprintf(out, "store %p: ", t->free);
+		fprintf(out, "%u items, %u bytes, peak %u; %d hits, %d misses, %d insertions, %d evictions\n",
+			t->items, t->bytes, t->peak, t->hits, t->misses, t->insertions, t->evictions);
+	}
+}
+
 void
 fz_new_store_context(fz_context *ctx, unsigned int max)
 {
 	fz_store *store;
+	int i;
+
 	store = fz_malloc_struct(ctx, fz_store);
 	fz_try(ctx)
 	{
-		store->hash = fz_new_hash_table(ctx, 4096, sizeof(struct refkey));
+		for (i = 0; i < FZ_STORE_SHARDS; i++)
+		{
+			store->shard[i].bucket = fz_calloc(ctx, INITIAL_BUCKETS, sizeof(fz_item *));
+			store->shard[i].bucket_count = INITIAL_BUCKETS;
+		}
 	}
 	fz_catch(ctx)
 	{
+		for (i = 0; i < FZ_STORE_SHARDS; i++)
+			fz_free(ctx, store->shard[i].bucket);
 		fz_free(ctx, store);
 		fz_rethrow(ctx);
 	}
 	store->refs = 1;
-	store->head = NULL;
-	store->tail = NULL;
+	store->priority = fz_store_priority_gdsf;
+	store->clock = 0;
+	store->tick = 0;
 	store->size = 0;
+	store->last_id = 0;
 	store->max = max;
 	ctx->store = store;
+
+	fz_set_store_type_name(ctx, fz_free_pixmap_imp, "pixmap");
+	fz_set_store_type_name(ctx, fz_free_bitmap_imp, "bitmap");
+	fz_set_store_type_name(ctx, fz_free_colorspace_imp, "colorspace");
+	fz_set_store_type_name(ctx, fz_free_shade_imp, "shade");
+}
+
+/* Whether a goes before b in eviction order. Ticks are compared as
+ * serial numbers, so that wrapping around does not matter to items used
+ * within 2^31 ticks of each other. */
+static inline int
+item_before(float apri, unsigned int atick, float bpri, unsigned int btick)
+{
+	if (apri != bpri)
+		return apri < bpri;
+	return (int)(atick - btick) < 0;
+}
+
+#define ITEM_BEFORE(a, b) item_before((a)->priority, (a)->tick, (b)->priority, (b)->tick)
+
+/* Heap maintenance. The refs lock for the heap is held. */
+
+static void
+heap_set(fz_store_heap *heap, int i, fz_item *item)
+{
+	heap->items[i] = item;
+	item->heap = i;
+}
+
+static void
+heap_sift_up(fz_store_heap *heap, int i)
+{
+	fz_item *item = heap->items[i];
+	while (i > 0 && ITEM_BEFORE(item, heap->items[(i - 1) / 2]))
+	{
+		heap_set(heap, i, heap->items[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	heap_set(heap, i, item);
+}
+
+static void
+heap_sift_down(fz_store_heap *heap, int i)
+{
+	fz_item *item = heap->items[i];
+	int c;
+	while ((c = 2 * i + 1) < heap->len)
+	{
+		if (c + 1 < heap->len && ITEM_BEFORE(heap->items[c + 1], heap->items[c]))
+			c++;
+		if (!ITEM_BEFORE(heap->items[c], item))
+			break;
+		heap_set(heap, i, heap->items[c]);
+		i = c;
+	}
+	heap_set(heap, i, item);
+}
+
+static void
+heap_insert(fz_store_heap *heap, fz_item *item)
+{
+	assert(heap->len < heap->cap);
+	heap_set(heap, heap->len++, item);
+	heap_sift_up(heap, heap->len - 1);
+}
+
+static void
+heap_remove(fz_store_heap *heap, fz_item *item)
+{
+	int i = item->heap;
+	fz_item *last = heap->items[--heap->len];
+	item->heap = NOT_IN_HEAP;
+	if (last != item)
+	{
+		heap_set(heap, i, last);
+		heap_sift_up(heap, i);
+		heap_sift_down(heap, last->heap);
+	}
+}
+
+/* Make sure there is room in a heap for one more item. No locks held. */
+static int
+reserve_heap(fz_context *ctx, int idx)
+{
+	fz_store_heap *heap = &ctx->store->heap[idx];
+	fz_item **items, **old;
+	int cap;
+
+	while (1)
+	{
+		fz_lock(ctx, FZ_LOCK_REFS + idx);
+		if (heap->count < heap->cap)
+		{
+			heap->count++;
+			fz_unlock(ctx, FZ_LOCK_REFS + idx);
+			return 1;
+		}
+		cap = heap->cap * 2;
+		fz_unlock(ctx, FZ_LOCK_REFS + idx);
+
+		if (cap < 64)
+			cap = 64;
+		items = fz_malloc_array_no_throw(ctx, cap, sizeof(fz_item *));
+		if (!items)
+			return 0;
+
+		old = items;
+		fz_lock(ctx, FZ_LOCK_REFS + idx);
+		if (heap->cap < cap)
+		{
+			if (heap->len)
+				memcpy(items, heap->items, heap->len * sizeof(fz_item *));
+			old = heap->items;
+			heap->items = items;
+			heap->cap = cap;
+		}
+		fz_unlock(ctx, FZ_LOCK_REFS + idx);
+		fz_free(ctx, old);
+	}
+}
+
+static void
+unreserve_heap(fz_context *ctx, int idx)
+{
+	fz_lock(ctx, FZ_LOCK_REFS + idx);
+	ctx->store->heap[idx].count--;
+	fz_unlock(ctx, FZ_LOCK_REFS + idx);
 }
 
 void *
 fz_keep_storable(fz_context *ctx, fz_storable *s)
 {
+	int idx;
+
 	if (s == NULL)
 		return NULL;
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	idx = refs_index(s);
+	fz_lock(ctx, FZ_LOCK_REFS + idx);
 	if (s->refs > 0)
-		s->refs++;
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	{
+		/* An item in use is no longer evictable */
+		if (++s->refs == 2 && s->item && s->item->heap >= 0)
+			heap_remove(&ctx->store->heap[idx], s->item);
+	}
+	fz_unlock(ctx, FZ_LOCK_REFS + idx);
 	return s;
 }
 
@@ -74,10 +553,12 @@ void
 fz_drop_storable(fz_context *ctx, fz_storable *s)
 {
 	int do_free = 0;
+	int idx;
 
 	if (s == NULL)
 		return;
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	idx = refs_index(s);
+	fz_lock(ctx, FZ_LOCK_REFS + idx);
 	if (s->refs < 0)
 	{
 		/* It's a static object. Dropping does nothing. */
@@ -91,132 +572,276 @@ fz_drop_storable(fz_context *ctx, fz_storable *s)
 		 * itself without any operations on the fz_store. */
 		do_free = 1;
 	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	else if (s->refs == 1 && s->item && s->item->heap == NOT_IN_HEAP)
+	{
+		/* Only the store holds it now, so it may be evicted */
+		heap_insert(&ctx->store->heap[idx], s->item);
+	}
+	fz_unlock(ctx, FZ_LOCK_REFS + idx);
 	if (do_free)
 		s->free(ctx, s);
 }
 
+/* The shard lock is held on entry and exit. */
 static void
-evict(fz_context *ctx, fz_item *item)
+unlink_item(fz_store_shard *shard, fz_item *item)
 {
-	fz_store *store = ctx->store;
-	int drop;
+	fz_item **pp;
 
-	store->size -= item->size;
-	/* Unlink from the linked list */
-	if (item->next)
-		item->next->prev = item->prev;
-	else
-		store->tail = item->prev;
-	if (item->prev)
-		item->prev->next = item->next;
-	else
-		store->head = item->next;
-	/* Drop a reference to the value (freeing if required) */
-	drop = (item->val->refs > 0 && --item->val->refs == 0);
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
-	/* Remove from the hash table */
-	if (fz_is_indirect(item->key))
+	pp = &shard->bucket[BUCKET_OF(shard, item->hash)];
+	while (*pp && *pp != item)
+		pp = &(*pp)->chain;
+	if (*pp)
 	{
-		struct refkey refkey;
-		refkey.free = item->val->free;
-		refkey.num = fz_to_num(item->key);
-		refkey.gen = fz_to_gen(item->key);
-		fz_hash_remove(ctx, store->hash, &refkey);
+		*pp = item->chain;
+		shard->chain_count--;
 	}
+}
+
+/* The shard lock is held on entry and exit. */
+static int
+item_has_key(fz_item *item, fz_obj *key, const void *data, int len)
+{
+	if (key)
+		return item->key && !fz_objcmp(item->key, key);
+	return !item->key && item->keylen == len && !memcmp(item->keydata, data, len);
+}
+
+/* The shard lock is held on entry and exit. Items are found either by
+ * object key, or (when key is NULL) by data. */
+static fz_item *
+find_item(fz_store_shard *shard, fz_store_free_fn *free, fz_obj *key, const void *data, int len, unsigned int hash)
+{
+	fz_item *item;
+
+	for (item = shard->bucket[BUCKET_OF(shard, hash)]; item; item = item->chain)
+		if (item->hash == hash && item->val->free == free && item_has_key(item, key, data, len))
+			return item;
+	return NULL;
+}
+
+/* Claim an item for removal from the store, taking it out of the
+ * evictable heap. Fails if somebody else has already claimed it. The
+ * shard lock is held on entry and exit. */
+static int
+claim_item(fz_context *ctx, fz_item *item)
+{
+	int idx = refs_index(item->val);
+	int ok = 0;
+
+	fz_lock(ctx, FZ_LOCK_REFS + idx);
+	if (item->heap != CLAIMED)
+	{
+		if (item->heap >= 0)
+			heap_remove(&ctx->store->heap[idx], item);
+		item->heap = CLAIMED;
+		ok = 1;
+	}
+	fz_unlock(ctx, FZ_LOCK_REFS + idx);
+	return ok;
+}
+
+/* Release the store's reference to the value of a claimed item that has
+ * already been unlinked, and free the item itself. No locks are held. */
+static void
+free_item(fz_context *ctx, fz_item *item)
+{
+	fz_storable *val = item->val;
+	int idx = refs_index(val);
+	int drop;
+
+	fz_lock(ctx, FZ_LOCK_REFS + idx);
+	val->item = NULL;
+	ctx->store->heap[idx].count--;
+	drop = (val->refs > 0 && --val->refs == 0);
+	fz_unlock(ctx, FZ_LOCK_REFS + idx);
 	if (drop)
-		item->val->free(ctx, item->val);
-	/* Always drops the key and free the item */
-	fz_drop_obj(item->key);
+		val->free(ctx, val);
+	if (item->key)
+		fz_drop_obj(item->key);
 	fz_free(ctx, item);
-	fz_lock(ctx, FZ_LOCK_ALLOC);
 }
 
-static int
-ensure_space(fz_context *ctx, unsigned int tofree)
+/* Free a list of claimed items, linked through their chain pointers,
+ * giving their space back to the store. No locks are held. */
+static void
+free_item_list(fz_context *ctx, fz_item *list, unsigned int size, int evicted)
 {
-	fz_item *item, *prev;
-	unsigned int count;
 	fz_store *store = ctx->store;
+	fz_store_type_stats *t;
+	fz_item *next;
 
-	fz_assert_lock_held(ctx, FZ_LOCK_ALLOC);
+	if (list)
+	{
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		store->size -= size;
+		for (next = list; next; next = next->chain)
+		{
+			t = type_stats(store, next->val->free);
+			t->items--;
+			t->bytes -= next->size;
+			t->evictions += evicted;
+		}
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+	}
 
-	/* First check that we *can* free tofree; if not, we'd rather not
-	 * cache this. */
-	count = 0;
-	for (item = store->tail; item; item = item->prev)
+	for (; list; list = next)
 	{
-		if (item->val->refs == 1)
+		next = list->chain;
+		free_item(ctx, list);
+	}
+}
+
+/* Evict the single evictable item with the lowest priority. Returns the
+ * number of bytes freed, or 0 if nothing could be evicted. No locks are
+ * held on entry or exit. */
+static unsigned int
+evict_one(fz_context *ctx)
+{
+	fz_store *store = ctx->store;
+	fz_store_heap *heap;
+	fz_store_shard *shard;
+	fz_item *item = NULL;
+	float best = 0;
+	unsigned int best_tick = 0;
+	unsigned int size;
+	int i, idx = -1;
+
+	/* Find the heap with the cheapest item on top */
+	for (i = 0; i < FZ_STORE_SHARDS; i++)
+	{
+		fz_lock(ctx, FZ_LOCK_REFS + i);
+		heap = &store->heap[i];
+		if (heap->len > 0 && (idx < 0 || item_before(heap->items[0]->priority, heap->items[0]->tick, best, best_tick)))
 		{
-			count += item->size;
-			if (count >= tofree)
-				break;
+			best = heap->items[0]->priority;
+			best_tick = heap->items[0]->tick;
+			idx = i;
 		}
+		fz_unlock(ctx, FZ_LOCK_REFS + i);
 	}
+	if (idx < 0)
+		return 0;
 
-	/* If we ran out of items to search, then we can never free enough */
-	if (item == NULL)
+	/* Claim it (or whatever has replaced it meanwhile). Anything in the
+	 * heap is held only by the store, so nobody can be using it. */
+	heap = &store->heap[idx];
+	fz_lock(ctx, FZ_LOCK_REFS + idx);
+	if (heap->len > 0)
 	{
+		item = heap->items[0];
+		heap_remove(heap, item);
+		item->heap = CLAIMED;
+	}
+	fz_unlock(ctx, FZ_LOCK_REFS + idx);
+	if (!item)
 		return 0;
+
+	/* A claimed item cannot be freed by anyone else, so it is safe to
+	 * unlink it from its shard now. */
+	i = SHARD_OF(item->hash);
+	shard = &store->shard[i];
+	fz_lock(ctx, FZ_LOCK_STORE + i);
+	unlink_item(shard, item);
+	fz_unlock(ctx, FZ_LOCK_STORE + i);
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	if (item->priority > store->clock)
+		store->clock = item->priority;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	size = item->size;
+	item->chain = NULL;
+	free_item_list(ctx, item, size, 1);
+	return size ? size : 1;
+}
+
+/* Evict items until at least tofree bytes have been released. No locks
+ * are held. */
+static unsigned int
+ensure_space(fz_context *ctx, unsigned int tofree)
+{
+	unsigned int count = 0;
+	unsigned int n;
+
+	while (count < tofree)
+	{
+		n = evict_one(ctx);
+		if (n == 0)
+			break;
+		count += n;
 	}
 
-	/* Actually free the items */
-	count = 0;
-	for (item = store->tail; item; item = prev)
+	return count;
+}
+
+/* Double the number of hash chains of a shard once they get long. The
+ * new table is allocated before taking the lock. */
+static void
+grow_shard(fz_context *ctx, int idx)
+{
+	fz_store_shard *shard = &ctx->store->shard[idx];
+	fz_item **bucket, **old = NULL;
+	fz_item *item, *next;
+	int count, i, k;
+
+	count = shard->bucket_count * 2;
+	bucket = fz_calloc_no_throw(ctx, count, sizeof(fz_item *));
+	if (!bucket)
+		return;
+
+	fz_lock(ctx, FZ_LOCK_STORE + idx);
+	if (shard->chain_count > shard->bucket_count * 2 && count > shard->bucket_count)
 	{
-		prev = item->prev;
-		if (item->val->refs == 1)
+		old = shard->bucket;
+		k = shard->bucket_count;
+		shard->bucket = bucket;
+		shard->bucket_count = count;
+		bucket = NULL;
+		for (i = 0; i < k; i++)
 		{
-			/* Free this item. Evict has to drop the lock to
-			 * manage that, which could cause prev to be removed
-			 * in the meantime. To avoid that we bump its reference
-			 * count here. This may cause another simultaneous
-			 * evict process to fail to make enough space as prev is
-			 * pinned - but that will only happen if we're near to
-			 * the limit anyway, and it will only cause something to
-			 * not be cached. */
-			count += item->size;
-			if (prev)
-				prev->val->refs++;
-			evict(ctx, item); /* Drops then retakes lock */
-			/* So the store has 1 reference to prev, as do we, so
-			 * no other evict process can have thrown prev away in
-			 * the meantime. So we are safe to just decrement its
-			 * reference count here. */
-			if (prev)
-				--prev->val->refs;
-
-			if (count >= tofree)
-				return count;
+			for (item = old[i]; item; item = next)
+			{
+				int j = BUCKET_OF(shard, item->hash);
+				next = item->chain;
+				item->chain = shard->bucket[j];
+				shard->bucket[j] = item;
+			}
 		}
 	}
+	fz_unlock(ctx, FZ_LOCK_STORE + idx);
 
-	return count;
+	fz_free(ctx, bucket);
+	fz_free(ctx, old);
 }
 
 void
-fz_store_item(fz_context *ctx, fz_obj *key, void *val_, unsigned int itemsize)
+fz_store_item(fz_context *ctx, fz_obj *key, void *val, unsigned int itemsize)
+{
+	fz_store_item_with_cost(ctx, key, val, itemsize, itemsize);
+}
+
+static void
+store_item(fz_context *ctx, fz_obj *key, const void *data, int len, void *val_, unsigned int itemsize, unsigned int cost)
 {
 	fz_item *item = NULL;
-	unsigned int size;
 	fz_storable *val = (fz_storable *)val_;
 	fz_store *store = ctx->store;
-	int indirect;
-	struct refkey refkey;
+	fz_store_shard *shard;
+	fz_store_type_stats *t;
+	unsigned int hash, tick, over = 0;
+	int idx, ridx, grow, i, stored;
 
 	if (!store)
 		return;
 
 	fz_var(item);
 
-	/* Form the key before we take the lock */ 
-	indirect = fz_is_indirect(key);
-	if (indirect)
-	{
-		refkey.free = val->free;
-		refkey.num = fz_to_num(key);
-		refkey.gen = fz_to_gen(key);
-	}
+	/* Form the key before we take the lock */
+	hash = key ? hash_key(val->free, key) : hash_data(val->free, data, len);
+	idx = SHARD_OF(hash);
+	shard = &store->shard[idx];
+	ridx = refs_index(val);
 
 	/* If we fail for any reason, we swallow the exception and continue.
 	 * All that the above program will see is that we failed to store
@@ -229,199 +854,260 @@ fz_store_item(fz_context *ctx, fz_obj *key, void *val_, unsigned int itemsize)
 	{
 		return;
 	}
+	if (!reserve_heap(ctx, ridx))
+	{
+		fz_free(ctx, item);
+		return;
+	}
 
+	/* Reserve our space in the global budget, then make room for it. */
 	fz_lock(ctx, FZ_LOCK_ALLOC);
-	if (store->max != FZ_STORE_UNLIMITED)
+	tick = ++store->tick;
+	store->size += itemsize;
+	if (store->max != FZ_STORE_UNLIMITED && store->size > store->max)
+		over = store->size - store->max;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	if (over && ensure_space(ctx, over) < over)
 	{
-		size = store->size + itemsize;
-		while (size > store->max)
-		{
-			/* ensure_space may drop, then retake the lock */
-			if (ensure_space(ctx, size - store->max) == 0)
-			{
-				/* Failed to free any space */
-				fz_unlock(ctx, FZ_LOCK_ALLOC);
-				fz_free(ctx, item);
-				return;
-			}
-		}
+		/* Failed to free enough space; we'd rather not cache this */
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		store->size -= itemsize;
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		unreserve_heap(ctx, ridx);
+		fz_free(ctx, item);
+		return;
 	}
-	store->size += itemsize;
 
-	item->key = fz_keep_obj(key);
+	if (key)
+		item->key = fz_keep_obj(key);
+	else
+	{
+		item->keylen = len;
+		memcpy(item->keydata, data, len);
+	}
 	item->val = val;
 	item->size = itemsize;
-	item->next = NULL;
+	item->hash = hash;
+	item->cost = cost;
+	item->hits = 1;
+	item->heap = NOT_IN_HEAP;
 
-	/* If we can index it fast, put it into the hash table */
-	if (indirect)
+	stored = 0;
+	grow = 0;
+	fz_lock(ctx, FZ_LOCK_STORE + idx);
+	/* Someone else may have stored the same resource while we were
+	 * loading ours, in which case we keep theirs. */
+	if (!find_item(shard, val->free, key, data, len, hash))
 	{
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
-		fz_try(ctx)
+		fz_lock(ctx, FZ_LOCK_REFS + ridx);
+		/* A value can only be in the store under one key */
+		if (!val->item)
 		{
-			fz_hash_insert(ctx, store->hash, &refkey, item);
-		}
-		fz_catch(ctx)
-		{
-			fz_free(ctx, item);
-			fz_lock(ctx, FZ_LOCK_ALLOC);
-			store->size -= itemsize;
-			fz_unlock(ctx, FZ_LOCK_ALLOC);
-			return;
+			item->priority = store->priority(store->clock, itemsize, cost, 1);
+			item->tick = tick;
+			val->item = item;
+			/* Now we can never fail, bump the ref */
+			if (val->refs > 0)
+				val->refs++;
+			stored = 1;
 		}
+		fz_unlock(ctx, FZ_LOCK_REFS + ridx);
+	}
+	if (stored)
+	{
+		i = BUCKET_OF(shard, hash);
+		item->chain = shard->bucket[i];
+		shard->bucket[i] = item;
+		shard->chain_count++;
+		grow = shard->chain_count > shard->bucket_count * 2;
+	}
+	fz_unlock(ctx, FZ_LOCK_STORE + idx);
+
+	if (!stored)
+	{
 		fz_lock(ctx, FZ_LOCK_ALLOC);
+		store->size -= itemsize;
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		unreserve_heap(ctx, ridx);
+		if (item->key)
+			fz_drop_obj(item->key);
+		fz_free(ctx, item);
+		return;
 	}
-	/* Now we can never fail, bump the ref */
-	if (val->refs > 0)
-		val->refs++;
-	/* Regardless of whether it's indexed, it goes into the linked list */
-	item->next = store->head;
-	if (item->next)
-		item->next->prev = item;
-	else
-		store->tail = item;
-	store->head = item;
-	item->prev = NULL;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	if (store->size > store->peak)
+		store->peak = store->size;
+	t = type_stats(store, val->free);
+	t->insertions++;
+	t->items++;
+	t->bytes += itemsize;
+	if (t->bytes > t->peak)
+		t->peak = t->bytes;
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	if (grow)
+		grow_shard(ctx, idx);
 }
 
-void *
-fz_find_item(fz_context *ctx, fz_store_free_fn *free, fz_obj *key)
+void
+fz_store_item_with_cost(fz_context *ctx, fz_obj *key, void *val, unsigned int itemsize, unsigned int cost)
+{
+	store_item(ctx, key, NULL, 0, val, itemsize, cost);
+}
+
+void
+fz_store_keyed_item(fz_context *ctx, const void *key, int len, void *val, unsigned int itemsize, unsigned int cost)
+{
+	if (len < 0 || len > FZ_STORE_KEY_MAX)
+	{
+		fz_warn(ctx, "assert: store key too long");
+		return;
+	}
+	store_item(ctx, NULL, key, len, val, itemsize, cost);
+}
+
+static void *
+find(fz_context *ctx, fz_store_free_fn *free, fz_obj *key, const void *data, int len)
 {
-	struct refkey refkey;
 	fz_item *item;
 	fz_store *store = ctx->store;
-	int indirect;
+	fz_store_shard *shard;
+	fz_storable *val = NULL;
+	unsigned int hash;
+	int idx, ridx;
 
 	if (!store)
 		return NULL;
 
-	if (!key)
-		return NULL;
-
 	/* Form the key before we take the lock */
-	indirect = fz_is_indirect(key);
-	if (indirect)
-	{
-		refkey.free = free;
-		refkey.num = fz_to_num(key);
-		refkey.gen = fz_to_gen(key);
-	}
+	hash = key ? hash_key(free, key) : hash_data(free, data, len);
+	idx = SHARD_OF(hash);
+	shard = &store->shard[idx];
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-	if (indirect)
-	{
-		/* We can find objects keyed on indirected objects quickly */
-		item = fz_hash_find(ctx, store->hash, &refkey);
-	}
-	else
+	fz_lock(ctx, FZ_LOCK_STORE + idx);
+	item = find_item(shard, free, key, data, len, hash);
+	if (item)
 	{
-		/* Others we have to hunt for slowly */
-		for (item = store->head; item; item = item->next)
+		ridx = refs_index(item->val);
+		fz_lock(ctx, FZ_LOCK_REFS + ridx);
+		/* An item on its way out counts as a miss */
+		if (item->heap != CLAIMED)
 		{
-			if (item->val->free == free && !fz_objcmp(item->key, key))
-				break;
+			val = item->val;
+			/* Bump the refcount before returning; in use items
+			 * are not evictable. */
+			if (val->refs > 0 && ++val->refs == 2 && item->heap >= 0)
+				heap_remove(&store->heap[ridx], item);
+			item->hits++;
+			item->priority = store->priority(store->clock, item->size, item->cost, item->hits);
+			/* FZ_LOCK_ALLOC is below the refs lock, so may be taken */
+			fz_lock(ctx, FZ_LOCK_ALLOC);
+			item->tick = ++store->tick;
+			fz_unlock(ctx, FZ_LOCK_ALLOC);
 		}
+		fz_unlock(ctx, FZ_LOCK_REFS + ridx);
 	}
-	if (item)
-	{
-		/* LRU: Move the block to the front */
-		/* Unlink from present position */
-		if (item->next)
-			item->next->prev = item->prev;
-		else
-			store->tail = item->prev;
-		if (item->prev)
-			item->prev->next = item->next;
-		else
-			store->head = item->next;
-		/* Insert at head */
-		item->next = store->head;
-		if (item->next)
-			item->next->prev = item;
-		else
-			store->tail = item;
-		item->prev = NULL;
-		store->head = item;
-		/* And bump the refcount before returning */
-		if (item->val->refs > 0)
-			item->val->refs++;
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
-		return (void *)item->val;
-	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	if (val)
+		shard_lookups(shard, free)->hits++;
+	else
+		shard_lookups(shard, free)->misses++;
+	fz_unlock(ctx, FZ_LOCK_STORE + idx);
 
-	return NULL;
+	return val;
+}
+
+void *
+fz_find_item(fz_context *ctx, fz_store_free_fn *free, fz_obj *key)
+{
+	if (!key)
+		return NULL;
+	return find(ctx, free, key, NULL, 0);
+}
+
+void *
+fz_find_keyed_item(fz_context *ctx, fz_store_free_fn *free, const void *key, int len)
+{
+	if (len < 0 || len > FZ_STORE_KEY_MAX)
+		return NULL;
+	return find(ctx, free, NULL, key, len);
 }
 
 void
 fz_remove_item(fz_context *ctx, fz_store_free_fn *free, fz_obj *key)
 {
-	struct refkey refkey;
 	fz_item *item;
 	fz_store *store = ctx->store;
-	int drop, indirect;
+	fz_store_shard *shard;
+	unsigned int hash;
+	int idx;
+
+	if (!store)
+		return;
 
 	/* Form the key before we take the lock */
-	indirect = fz_is_indirect(key);
-	if (indirect)
-	{
-		refkey.free = free;
-		refkey.num = fz_to_num(key);
-		refkey.gen = fz_to_gen(key);
-	}
+	hash = hash_key(free, key);
+	idx = SHARD_OF(hash);
+	shard = &store->shard[idx];
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-	if (indirect)
-	{
-		/* We can find objects keyed on indirect objects quickly */
-		item = fz_hash_find(ctx, store->hash, &refkey);
-		if (item)
-			fz_hash_remove(ctx, store->hash, &refkey);
-	}
+	fz_lock(ctx, FZ_LOCK_STORE + idx);
+	item = find_item(shard, free, key, NULL, 0, hash);
+	if (item && claim_item(ctx, item))
+		unlink_item(shard, item);
 	else
-	{
-		/* Others we have to hunt for slowly */
-		for (item = store->head; item; item = item->next)
-			if (item->val->free == free && !fz_objcmp(item->key, key))
-				break;
-	}
+		item = NULL;
+	fz_unlock(ctx, FZ_LOCK_STORE + idx);
+
 	if (item)
 	{
-		if (item->next)
-			item->next->prev = item->prev;
-		else
-			store->tail = item->prev;
-		if (item->prev)
-			item->prev->next = item->next;
-		else
-			store->head = item->next;
-		drop = (item->val->refs > 0 && --item->val->refs == 0);
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
-		if (drop)
-			item->val->free(ctx, item->val);
-		fz_drop_obj(item->key);
-		fz_free(ctx, item);
+		item->chain = NULL;
+		free_item_list(ctx, item, item->size, 0);
 	}
-	else
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
 }
 
 void
 fz_empty_store(fz_context *ctx)
 {
 	fz_store *store = ctx->store;
+	fz_store_shard *shard;
+	fz_item *item, *next, *list, **pp;
+	unsigned int size;
+	int i, k;
 
 	if (store == NULL)
 		return;
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-	/* Run through all the items in the store */
-	while (store->head)
+	/* Detach the contents of each shard, then free them unlocked. Items
+	 * already claimed by an evictor are left for it to deal with. */
+	for (i = 0; i < FZ_STORE_SHARDS; i++)
 	{
-		evict(ctx, store->head); /* Drops then retakes lock */
+		shard = &store->shard[i];
+		list = NULL;
+		size = 0;
+		fz_lock(ctx, FZ_LOCK_STORE + i);
+		for (k = 0; k < shard->bucket_count; k++)
+		{
+			pp = &shard->bucket[k];
+			for (item = *pp; item; item = next)
+			{
+				next = item->chain;
+				if (claim_item(ctx, item))
+				{
+					*pp = next;
+					shard->chain_count--;
+					item->chain = list;
+					list = item;
+					size += item->size;
+				}
+				else
+					pp = &item->chain;
+			}
+		}
+		fz_unlock(ctx, FZ_LOCK_STORE + i);
+
+		free_item_list(ctx, list, size, 0);
 	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
 }
 
 fz_store *
@@ -438,7 +1124,7 @@ fz_store_keep(fz_context *ctx)
 void
 fz_drop_store_context(fz_context *ctx)
 {
-	int refs;
+	int refs, i;
 	if (ctx == NULL || ctx->store == NULL)
 		return;
 	fz_lock(ctx, FZ_LOCK_ALLOC);
@@ -448,7 +1134,11 @@ fz_drop_store_context(fz_context *ctx)
 		return;
 
 	fz_empty_store(ctx);
-	fz_free_hash(ctx, ctx->store->hash);
+	for (i = 0; i < FZ_STORE_SHARDS; i++)
+	{
+		fz_free(ctx, ctx->store->shard[i].bucket);
+		fz_free(ctx, ctx->store->heap[i].items);
+	}
 	fz_free(ctx, ctx->store);
 	ctx->store = NULL;
 }
@@ -456,57 +1146,71 @@ fz_drop_store_context(fz_context *ctx)
 void
 fz_debug_store(fz_context *ctx)
 {
-	fz_item *item, *next;
+	fz_item *item;
 	fz_store *store = ctx->store;
+	fz_obj *key;
+	void *val;
+	int i, n, b, k, refs;
+	unsigned int size, tick;
+	float priority;
 
 	printf("-- resource store contents --\n");
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-	for (item = store->head; item; item = next)
+	for (i = 0; i < FZ_STORE_SHARDS; i++)
 	{
-		next = item->next;
-		next->val->refs++;
-		printf("store[*][refs=%d][size=%d] ", item->val->refs, item->size);
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
-		if (fz_is_indirect(item->key))
+		/* Printing a key may allocate, which we cannot do with the
+		 * shard locked, so hold on to each key while it's printed. */
+		for (n = 0; ; n++)
 		{
-			printf("(%d %d R) ", fz_to_num(item->key), fz_to_gen(item->key));
-		} else
-			fz_debug_obj(item->key);
-		printf(" = %p\n", item->val);
-		fz_lock(ctx, FZ_LOCK_ALLOC);
-		next->val->refs--;
+			fz_lock(ctx, FZ_LOCK_STORE + i);
+			item = NULL;
+			for (b = 0, k = 0; b < store->shard[i].bucket_count; b++)
+			{
+				for (item = store->shard[i].bucket[b]; item; item = item->chain)
+					if (k++ == n)
+						break;
+				if (item)
+					break;
+			}
+			if (!item)
+			{
+				fz_unlock(ctx, FZ_LOCK_STORE + i);
+				break;
+			}
+			key = item->key ? fz_keep_obj(item->key) : NULL;
+			val = item->val;
+			refs = item->val->refs;
+			size = item->size;
+			priority = item->priority;
+			tick = item->tick;
+			fz_unlock(ctx, FZ_LOCK_STORE + i);
+
+			printf("store[%d][refs=%d][size=%d][pri=%g][tick=%u] ", i, refs, size, priority, tick);
+			if (!key)
+				printf("(keyed) ");
+			else if (fz_is_indirect(key))
+				printf("(%d %d R) ", fz_to_num(key), fz_to_gen(key));
+			else
+				fz_debug_obj(key);
+			printf(" = %p\n", val);
+			if (key)
+				fz_drop_obj(key);
+		}
 	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
 }
 
-/* This is now an n^2 algorithm - not ideal, but it'll only be bad if we are
- * actually managing to scavenge lots of blocks back. */
+/* Evict anything we can, cheapest first, until tofree bytes have been
+ * released. FZ_LOCK_ALLOC is held on entry and exit, but dropped in the
+ * middle. */
 static int
 scavenge(fz_context *ctx, unsigned int tofree)
 {
-	fz_store *store = ctx->store;
-	unsigned int count = 0;
-	fz_item *item, *prev;
-
-	/* Free the items */
-	for (item = store->tail; item; item = prev)
-	{
-		prev = item->prev;
-		if (item->val->refs == 1)
-		{
-			/* Free this item */
-			count += item->size;
-			evict(ctx, item); /* Drops then retakes lock */
+	unsigned int count;
 
-			if (count >= tofree)
-				break;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	count = ensure_space(ctx, tofree);
+	fz_lock(ctx, FZ_LOCK_ALLOC);
 
-			/* Have to restart search again, as prev may no longer
-			 * be valid due to release of lock in evict. */
-			prev = store->tail;
-		}
-	}
 	/* Success is managing to evict any blocks */
 	return count != 0;
 }
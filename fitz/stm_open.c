@@ -1,5 +1,11 @@
 #include "fitz.h"
 
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
 fz_stream *
 fz_new_stream(fz_context *ctx, void *state,
 	int(*read)(fz_stream *stm, unsigned char *buf, int len),
@@ -53,17 +59,23 @@ fz_lock_stream(fz_stream *stm)
 fz_stream *
 fz_keep_stream(fz_stream *stm)
 {
+	fz_lock(stm->ctx, FZ_LOCK_ALLOC);
 	stm->refs ++;
+	fz_unlock(stm->ctx, FZ_LOCK_ALLOC);
 	return stm;
 }
 
 void
 fz_close(fz_stream *stm)
 {
+	int drop;
+
 	if (!stm)
 		return;
-	stm->refs --;
-	if (stm->refs == 0)
+	fz_lock(stm->ctx, FZ_LOCK_ALLOC);
+	drop = --stm->refs == 0;
+	fz_unlock(stm->ctx, FZ_LOCK_ALLOC);
+	if (drop)
 	{
 		if (stm->close)
 			stm->close(stm->ctx, stm->state);
@@ -103,12 +115,96 @@ static void close_file(fz_context *ctx, void *state)
 	fz_free(ctx, state);
 }
 
+/* Mapped file stream */
+
+#ifndef _WIN32
+
+/*
+	Regular files are mapped whole, with the stream buffer pointing
+	straight at the mapping, so reading and seeking never copy data or
+	make system calls. Like a memory stream, its buffer is always full
+	and pos is the length of the file.
+
+	The mapping is private, but that does not protect us from another
+	process truncating the file: touching a page past the new end of
+	the file raises SIGBUS. See fz_open_fd.
+*/
+
+struct mapped_file
+{
+	int fd;
+	unsigned char *data;
+	int len;
+};
+
+static int read_buffer(fz_stream *stm, unsigned char *buf, int len);
+static void seek_buffer(fz_stream *stm, int offset, int whence);
+
+static void close_mapped_file(fz_context *ctx, void *state_)
+{
+	struct mapped_file *state = (struct mapped_file *)state_;
+	munmap(state->data, state->len);
+	if (close(state->fd) < 0)
+		fz_warn(ctx, "close error: %s", strerror(errno));
+	fz_free(ctx, state);
+}
+
+static fz_stream *
+fz_open_mapped_file(fz_context *ctx, int fd)
+{
+	struct mapped_file *state;
+	struct stat info;
+	unsigned char *data;
+	fz_stream *stm;
+	int len;
+
+	if (fstat(fd, &info) < 0 || !S_ISREG(info.st_mode))
+		return NULL;
+	if (info.st_size <= 0 || info.st_size > INT_MAX)
+		return NULL;
+	len = (int)info.st_size;
+
+	data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	state = fz_malloc_no_throw(ctx, sizeof *state);
+	if (!state)
+	{
+		munmap(data, len);
+		return NULL;
+	}
+	state->fd = fd;
+	state->data = data;
+	state->len = len;
+
+	stm = fz_new_stream(ctx, state, read_buffer, close_mapped_file);
+	stm->seek = seek_buffer;
+
+	stm->bp = data;
+	stm->rp = data;
+	stm->wp = data + len;
+	stm->ep = data + len;
+
+	stm->pos = len;
+
+	return stm;
+}
+
+#endif
+
 fz_stream *
 fz_open_fd(fz_context *ctx, int fd)
 {
 	fz_stream *stm;
 	int *state;
 
+#ifndef _WIN32
+	stm = fz_open_mapped_file(ctx, fd);
+	if (stm)
+		return stm;
+#endif
+
 	state = fz_malloc_struct(ctx, int);
 	*state = fd;
 
@@ -208,3 +304,154 @@ fz_open_memory(fz_context *ctx, unsigned char *data, int len)
 
 	return stm;
 }
+
+/* Reopened streams */
+
+struct reopened
+{
+	fz_stream *file;
+	int offset;
+};
+
+static void close_reopened(fz_context *ctx, void *state_)
+{
+	struct reopened *state = (struct reopened *)state_;
+	fz_close(state->file);
+	fz_free(ctx, state);
+}
+
+#ifndef _WIN32
+static int read_positional(fz_stream *stm, unsigned char *buf, int len)
+{
+	struct reopened *state = stm->state;
+	int n = pread(*(int*)state->file->state, buf, len, state->offset);
+	if (n < 0)
+		fz_throw(stm->ctx, "read error: %s", strerror(errno));
+	state->offset += n;
+	return n;
+}
+#endif
+
+/* Anything else seekable is read under the file lock */
+static int read_locked(fz_stream *stm, unsigned char *buf, int len)
+{
+	struct reopened *state = stm->state;
+	fz_stream *file = state->file;
+	int n = 0;
+
+	fz_lock(file->ctx, FZ_LOCK_FILE);
+	fz_try(stm->ctx)
+	{
+		fz_seek(file, state->offset, 0);
+		n = fz_read(file, buf, len);
+	}
+	fz_always(stm->ctx)
+	{
+		fz_unlock(file->ctx, FZ_LOCK_FILE);
+	}
+	fz_catch(stm->ctx)
+	{
+		fz_rethrow(stm->ctx);
+	}
+	state->offset += n;
+	return n;
+}
+
+static void seek_reopened(fz_stream *stm, int offset, int whence)
+{
+	struct reopened *state = stm->state;
+	fz_stream *file = state->file;
+
+	if (whence == 2)
+	{
+		fz_lock(file->ctx, FZ_LOCK_FILE);
+		fz_try(stm->ctx)
+		{
+			fz_seek(file, 0, 2);
+			offset = fz_tell(file) - offset;
+		}
+		fz_always(stm->ctx)
+		{
+			fz_unlock(file->ctx, FZ_LOCK_FILE);
+		}
+		fz_catch(stm->ctx)
+		{
+			fz_rethrow(stm->ctx);
+		}
+	}
+	if (offset < 0)
+		fz_throw(stm->ctx, "cannot seek before start of file");
+	state->offset = offset;
+	stm->pos = offset;
+	stm->rp = stm->bp;
+	stm->wp = stm->bp;
+}
+
+fz_stream *
+fz_reopen_stream(fz_context *ctx, fz_stream *file, int offset)
+{
+	struct reopened *state;
+	fz_stream *stm;
+
+	if (!file->seek)
+		fz_throw(ctx, "cannot reopen unseekable stream");
+
+	state = fz_malloc_struct(ctx, struct reopened);
+	state->file = fz_keep_stream(file);
+	state->offset = 0;
+
+	if (file->read == read_buffer)
+	{
+		/* All the data is in memory already; share it */
+		stm = fz_new_stream(ctx, state, read_buffer, close_reopened);
+		stm->seek = seek_buffer;
+		stm->bp = file->bp;
+		stm->rp = file->bp;
+		stm->wp = file->ep;
+		stm->ep = file->ep;
+		stm->pos = file->ep - file->bp;
+	}
+	else
+	{
+#ifndef _WIN32
+		if (file->read == read_file)
+			stm = fz_new_stream(ctx, state, read_positional, close_reopened);
+		else
+#endif
+			stm = fz_new_stream(ctx, state, read_locked, close_reopened);
+		stm->seek = seek_reopened;
+	}
+
+	fz_seek(stm, offset, 0);
+	return stm;
+}
+
+/* The descriptor of the file a stream reads, or -1 */
+static int
+stream_fd(fz_stream *stm)
+{
+	if (stm->close == close_reopened)
+		return stream_fd(((struct reopened *)stm->state)->file);
+	if (stm->read == read_file)
+		return *(int *)stm->state;
+#ifndef _WIN32
+	if (stm->close == close_mapped_file)
+		return ((struct mapped_file *)stm->state)->fd;
+#endif
+	return -1;
+}
+
+int
+fz_stream_file_id(fz_stream *stm, int id[4])
+{
+	struct stat info;
+	int fd = stream_fd(stm);
+
+	if (fd < 0 || fstat(fd, &info) < 0)
+		return 0;
+	id[0] = (int)info.st_mtime;
+	id[1] = (int)((long long)info.st_mtime >> 32);
+	id[2] = (int)info.st_ino;
+	id[3] = (int)info.st_size;
+	return 1;
+}
@@ -41,6 +41,8 @@ fz_read(fz_stream *stm, unsigned char *buf, int len)
 	}
 	else
 	{
+		/* The buffer no longer holds the bytes before the position */
+		stm->rp = stm->wp = stm->bp;
 		n = stm->read(stm, buf + count, len - count);
 		if (n == 0)
 		{
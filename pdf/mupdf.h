@@ -47,6 +47,7 @@ typedef struct pdf_xref_entry_s pdf_xref_entry;
 typedef struct pdf_crypt_s pdf_crypt;
 typedef struct pdf_ocg_descriptor_s pdf_ocg_descriptor;
 typedef struct pdf_ocg_entry_s pdf_ocg_entry;
+typedef struct pdf_hint_page_s pdf_hint_page;
 
 struct pdf_xref_entry_s
 {
@@ -55,6 +56,8 @@ struct pdf_xref_entry_s
 	int stm_ofs;	/* on-disk stream */
 	fz_obj *obj;	/* stored/cached object */
 	int type;	/* 0=unset (f)ree i(n)use (o)bjstm */
+	char used;	/* looked up since the last eviction sweep */
+	char dirty;	/* changed in memory; can not be reloaded */
 };
 
 struct pdf_ocg_entry_s
@@ -71,6 +74,15 @@ struct pdf_ocg_descriptor_s
 	fz_obj *intent;
 };
 
+/* Where a page of a linearized file lives, from the page offset hint table */
+struct pdf_hint_page_s
+{
+	int num;	/* object number of the page object */
+	int ofs;	/* file offset of the page's objects */
+	int len;	/* length in bytes of the page's objects */
+	int count;	/* number of objects, numbered from num on */
+};
+
 struct pdf_document_s
 {
 	fz_document super;
@@ -81,6 +93,7 @@ struct pdf_document_s
 	int version;
 	int startxref;
 	int file_size;
+	int repaired;	/* the xref was rebuilt by scanning the file */
 	pdf_crypt *crypt;
 	fz_obj *trailer;
 	pdf_ocg_descriptor *ocg;
@@ -93,22 +106,89 @@ struct pdf_document_s
 	fz_obj **page_objs;
 	fz_obj **page_refs;
 
+	/* Linearized files are opened through their first-page xref;
+	 * main_xref is the offset of the rest until it has been read. */
+	int main_xref;
+	int linear_page_count;
+	int linear_page1;
+	int linear_hint_ofs;
+	int linear_hint_len;
+	int hints_loaded;	/* 1 when loaded, -1 when unusable */
+	pdf_hint_page *hint_pages;
+
+	/* Clean cached objects beyond the budget are evicted by
+	 * pdf_trim_object_cache and reloaded when next needed. */
+	int obj_cache_count;
+	int obj_cache_max;
+	int obj_cache_hand;
+
+	/* Reader and lexer buffer kept for loading objects; taken while
+	 * in use, so that nested loads get their own. Not locked: see
+	 * pdf_open_document. */
+	fz_stream *obj_reader;
+	char *obj_lexbuf;
+
 	char scratch[65536];
 };
 
 fz_obj *pdf_resolve_indirect(fz_obj *ref);
 void pdf_cache_object(pdf_document *doc, int num, int gen);
 fz_obj *pdf_load_object(pdf_document *doc, int num, int gen);
+
+/*
+	pdf_update_object: Replace an object. An object changed in place
+	can be passed again to mark it as changed, so that incremental
+	updates write it out.
+*/
 void pdf_update_object(pdf_document *doc, int num, int gen, fz_obj *newobj);
 
+/*
+	Objects parsed from the file stay cached in the xref table. Once
+	there are more than the budget (PDF_OBJECT_CACHE_DEFAULT unless
+	changed with pdf_set_object_cache_size; 0 for no limit),
+	pdf_trim_object_cache drops the least recently used ones that
+	nobody holds a reference to. Objects changed with pdf_update_object
+	are never dropped.
+
+	pdf_load_page trims the cache before it starts, so pointers
+	returned by pdf_resolve_indirect or fz_dict_gets must not be kept
+	across loading a page without taking a reference.
+*/
+enum { PDF_OBJECT_CACHE_DEFAULT = 100000 };
+
+void pdf_set_object_cache_size(pdf_document *doc, int max);
+void pdf_trim_object_cache(pdf_document *doc);
+
+/*
+	pdf_load_main_xref: Read the rest of the xref of a linearized file
+	opened through its first-page xref; does nothing otherwise. Objects
+	missing from the first-page xref are loaded this way on demand, but
+	anything walking the whole xref table must call this first.
+*/
+void pdf_load_main_xref(pdf_document *doc);
+
 int pdf_is_stream(pdf_document *doc, int num, int gen);
 fz_stream *pdf_open_inline_stream(pdf_document *doc, fz_obj *stmobj, int length, fz_stream *chain);
 fz_buffer *pdf_load_raw_stream(pdf_document *doc, int num, int gen);
 fz_buffer *pdf_load_stream(pdf_document *doc, int num, int gen);
+fz_compressed_buffer *pdf_load_compressed_stream(pdf_document *doc, int num, int gen);
 fz_stream *pdf_open_raw_stream(pdf_document *doc, int num, int gen);
 fz_stream *pdf_open_stream(pdf_document *doc, int num, int gen);
 fz_stream *pdf_open_stream_with_offset(pdf_document *doc, int num, int gen, fz_obj *dict, int stm_ofs);
 
+/*
+	A pdf_document, and everything loaded from it (objects, pages,
+	resources), must be used by one thread at a time: the object cache,
+	the reader kept for loading objects and fz_obj reference counts are
+	not synchronized. Callers that load or run pages of one document
+	from several threads must serialize those calls themselves.
+
+	Objects and streams are read through readers of their own
+	(fz_reopen_stream), not by seeking doc->file, so any number of
+	streams opened from the document may be read interleaved with one
+	another and with object loads, and a display list made from a page
+	can be run in another thread with a cloned context.
+*/
 pdf_document *pdf_open_document_with_stream(fz_stream *file);
 pdf_document *pdf_open_document(fz_context *ctx, const char *filename);
 void pdf_close_document(pdf_document *doc);
@@ -118,6 +198,14 @@ void pdf_repair_xref(pdf_document *doc, char *buf, int bufsize);
 void pdf_repair_obj_stms(pdf_document *doc);
 void pdf_debug_xref(pdf_document *);
 void pdf_resize_xref(pdf_document *doc, int newcap);
+void pdf_check_xref(pdf_document *doc);
+void pdf_set_object_dirty(pdf_document *doc, int num);
+void pdf_load_hints(pdf_document *doc);
+fz_obj *pdf_load_linear_page(pdf_document *doc, int number);
+int pdf_find_linear_page_number(pdf_document *doc, int num);
+int pdf_xref_index_key(pdf_document *doc, unsigned char key[16]);
+int pdf_load_xref_index(pdf_document *doc, unsigned char key[16]);
+void pdf_save_xref_index(pdf_document *doc, unsigned char key[16]);
 
 /*
  * Encryption
@@ -164,6 +252,7 @@ pdf_function *pdf_load_function(pdf_document *doc, fz_obj *ref);
 void pdf_eval_function(fz_context *ctx, pdf_function *func, float *in, int inlen, float *out, int outlen);
 pdf_function *pdf_keep_function(fz_context *ctx, pdf_function *func);
 void pdf_drop_function(fz_context *ctx, pdf_function *func);
+void pdf_free_function_imp(fz_context *ctx, fz_storable *func);
 unsigned int pdf_function_size(pdf_function *func);
 
 fz_colorspace *pdf_load_colorspace(pdf_document *doc, fz_obj *obj);
@@ -171,8 +260,14 @@ fz_pixmap *pdf_expand_indexed_pixmap(fz_context *ctx, fz_pixmap *src);
 
 fz_shade *pdf_load_shading(pdf_document *doc, fz_obj *obj);
 
-fz_pixmap *pdf_load_inline_image(pdf_document *doc, fz_obj *rdb, fz_obj *dict, fz_stream *file);
-fz_pixmap *pdf_load_image(pdf_document *doc, fz_obj *obj);
+/*
+	pdf_load_image: Load an image as an fz_image that holds it
+	compressed; it is decoded, at the size it is drawn at, when a
+	device asks for its pixels.
+*/
+fz_image *pdf_load_inline_image(pdf_document *doc, fz_obj *rdb, fz_obj *dict, fz_stream *file);
+fz_image *pdf_load_image(pdf_document *doc, fz_obj *obj);
+void pdf_free_image_imp(fz_context *ctx, fz_storable *image);
 int pdf_is_jpx_image(fz_context *ctx, fz_obj *dict);
 
 /*
@@ -196,6 +291,7 @@ struct pdf_pattern_s
 pdf_pattern *pdf_load_pattern(pdf_document *doc, fz_obj *obj);
 pdf_pattern *pdf_keep_pattern(fz_context *ctx, pdf_pattern *pat);
 void pdf_drop_pattern(fz_context *ctx, pdf_pattern *pat);
+void pdf_free_pattern_imp(fz_context *ctx, fz_storable *pat);
 
 /*
  * XObject
@@ -220,6 +316,12 @@ struct pdf_xobject_s
 pdf_xobject *pdf_load_xobject(pdf_document *doc, fz_obj *obj);
 pdf_xobject *pdf_keep_xobject(fz_context *ctx, pdf_xobject *xobj);
 void pdf_drop_xobject(fz_context *ctx, pdf_xobject *xobj);
+void pdf_free_xobject_imp(fz_context *ctx, fz_storable *xobj);
+
+/* Compiled form content streams are stored under the form's dictionary */
+typedef struct pdf_compiled_stream_s pdf_compiled_stream;
+
+void pdf_free_compiled_stream_imp(fz_context *ctx, fz_storable *prog);
 
 /*
  * CMap
@@ -406,6 +508,7 @@ pdf_font_desc *pdf_load_font(pdf_document *doc, fz_obj *rdb, fz_obj *obj);
 pdf_font_desc *pdf_new_font_desc(fz_context *ctx);
 pdf_font_desc *pdf_keep_font(fz_context *ctx, pdf_font_desc *fontdesc);
 void pdf_drop_font(fz_context *ctx, pdf_font_desc *font);
+void pdf_free_font_imp(fz_context *ctx, fz_storable *font);
 
 void pdf_debug_font(fz_context *ctx, pdf_font_desc *fontdesc);
 
@@ -458,6 +561,13 @@ struct pdf_page_s
 int pdf_find_page_number(pdf_document *doc, fz_obj *pageobj);
 int pdf_count_pages(pdf_document *doc);
 
+/*
+	pdf_load_page_tree: Flatten the page tree into doc->page_refs and
+	doc->page_objs. pdf_count_pages and pdf_load_page may avoid this
+	for linearized files, so call it before using those arrays.
+*/
+void pdf_load_page_tree(pdf_document *doc);
+
 pdf_page *pdf_load_page(pdf_document *doc, int number);
 fz_link *pdf_load_links(pdf_document *doc, pdf_page *page);
 fz_rect pdf_bound_page(pdf_document *doc, pdf_page *page);
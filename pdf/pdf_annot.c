@@ -57,7 +57,8 @@ pdf_parse_link_dest(pdf_document *xref, fz_obj *dest)
 		return ld;
 	}
 	obj = fz_array_get(dest, 0);
-	if (fz_is_int(obj))
+	/* don't load the page object just to find it is not a number */
+	if (!fz_is_indirect(obj) && fz_is_int(obj))
 		ld.ld.gotor.page = fz_to_int(obj);
 	else
 		ld.ld.gotor.page = pdf_find_page_number(xref, obj);
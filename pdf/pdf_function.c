@@ -1321,7 +1321,7 @@ pdf_drop_function(fz_context *ctx, pdf_function *func)
 	fz_drop_storable(ctx, &func->storable);
 }
 
-static void
+void
 pdf_free_function_imp(fz_context *ctx, fz_storable *func_)
 {
 	pdf_function *func = (pdf_function *)func_;
@@ -1,10 +1,36 @@
 #include "fitz.h"
 #include "mupdf.h"
 
-/* TODO: store JPEG compressed samples */
-/* TODO: store flate compressed samples */
+/* Images are decoded at down to 1/2^MAX_L2FACTOR of their size */
+#define MAX_L2FACTOR 6
 
-static fz_pixmap *pdf_load_jpx(pdf_document *xref, fz_obj *dict);
+/*
+	Images are held with their samples compressed, and decoded when
+	drawn. Decoded pixmaps are stored under the image id and the number
+	of times they were halved; they are left for the store to evict
+	when the image itself goes.
+*/
+
+typedef struct pdf_image_s pdf_image;
+
+struct pdf_image_s
+{
+	fz_image base;
+	fz_compressed_buffer *buffer;
+	int id;
+	int num;
+	int n, bpc;
+	int stencil; /* /ImageMask, where 0 paints */
+	int forcemask;
+	int indexed;
+	int usecolorkey;
+	int colorkey[FZ_MAX_COLORS * 2];
+	int has_decode;
+	float decode[FZ_MAX_COLORS * 2];
+	unsigned int weight;
+	int has_digest;
+	unsigned char digest[16];
+};
 
 static void
 pdf_mask_color_key(fz_pixmap *pix, int n, int *colorkey)
@@ -25,362 +51,964 @@ pdf_mask_color_key(fz_pixmap *pix, int n, int *colorkey)
 	}
 }
 
-static fz_pixmap *
-pdf_load_image_imp(pdf_document *xref, fz_obj *rdb, fz_obj *dict, fz_stream *cstm, int forcemask)
+/*
+	The number of times a w by h image can be halved in both directions
+	and still have at least dw by dh pixels. The image is not going to be
+	drawn any larger than that. dw or dh of 0 means full resolution.
+*/
+static int
+pdf_image_l2factor(int w, int h, int dw, int dh)
 {
-	fz_stream *stm = NULL;
-	fz_pixmap *tile = NULL;
-	fz_obj *obj, *res;
+	int l2factor = 0;
 
-	int w, h, bpc, n;
-	int imagemask;
-	int interpolate;
-	int indexed;
-	fz_colorspace *colorspace = NULL;
-	fz_pixmap *mask = NULL; /* explicit mask/softmask image */
-	int usecolorkey;
-	int colorkey[FZ_MAX_COLORS * 2];
-	float decode[FZ_MAX_COLORS * 2];
-
-	int stride;
-	unsigned char *samples = NULL;
-	int i, len;
-	fz_context *ctx = xref->ctx;
+	if (dw <= 0 || dh <= 0)
+		return 0;
+	while (l2factor < MAX_L2FACTOR && (w >> (l2factor + 1)) >= dw && (h >> (l2factor + 1)) >= dh)
+		l2factor++;
+	return l2factor;
+}
 
-	fz_var(stm);
-	fz_var(tile);
-	fz_var(colorspace);
-	fz_var(mask);
-	fz_var(samples);
+/*
+	Reduce a band of 2^l2factor rows of src into row y of dst, averaging
+	blocks of 2^l2factor by 2^l2factor pixels. Only columns x0 to x1 of
+	src are used. The last row and column of blocks may be short.
+*/
+static void
+pdf_subsample_band(fz_pixmap *dst, int y, fz_pixmap *src, int x0, int x1, int l2factor)
+{
+	unsigned char *s, *d;
+	int n = src->n;
+	int rows = src->h;
+	int x, k, u, v, cols, sum, count;
 
-	fz_try(ctx)
+	d = dst->samples + y * dst->w * n;
+	for (x = 0; x < dst->w; x++)
 	{
-		/* special case for JPEG2000 images */
-		if (pdf_is_jpx_image(ctx, dict))
+		s = src->samples + (x0 + (x << l2factor)) * n;
+		cols = MIN(1 << l2factor, x1 - x0 - (x << l2factor));
+		count = rows * cols;
+		for (k = 0; k < n; k++)
 		{
-			tile = pdf_load_jpx(xref, dict);
-			/* RJW: "cannot load jpx image" */
-			if (forcemask)
-			{
-				if (tile->n != 2)
-					fz_throw(ctx, "softmask must be grayscale");
-				mask = fz_alpha_from_gray(ctx, tile, 1);
-				fz_drop_pixmap(ctx, tile);
-				tile = mask;
-				mask = NULL;
-			}
-			break; /* Out of fz_try */
+			sum = 0;
+			for (v = 0; v < rows; v++)
+				for (u = 0; u < cols; u++)
+					sum += s[(v * src->w + u) * n + k];
+			*d++ = (sum + count / 2) / count;
 		}
+	}
+}
 
-		w = fz_to_int(fz_dict_getsa(dict, "Width", "W"));
-		h = fz_to_int(fz_dict_getsa(dict, "Height", "H"));
-		bpc = fz_to_int(fz_dict_getsa(dict, "BitsPerComponent", "BPC"));
-		imagemask = fz_to_bool(fz_dict_getsa(dict, "ImageMask", "IM"));
-		interpolate = fz_to_bool(fz_dict_getsa(dict, "Interpolate", "I"));
-
-		indexed = 0;
-		usecolorkey = 0;
-		mask = NULL;
-
-		if (imagemask)
-			bpc = 1;
-
-		if (w == 0)
-			fz_throw(ctx, "image width is zero");
-		if (h == 0)
-			fz_throw(ctx, "image height is zero");
-		if (bpc == 0)
-			fz_throw(ctx, "image depth is zero");
-		if (bpc > 16)
-			fz_throw(ctx, "image depth is too large: %d", bpc);
-		if (w > (1 << 16))
-			fz_throw(ctx, "image is too wide");
-		if (h > (1 << 16))
-			fz_throw(ctx, "image is too high");
-
-		obj = fz_dict_getsa(dict, "ColorSpace", "CS");
-		if (obj && !imagemask && !forcemask)
-		{
-			/* colorspace resource lookup is only done for inline images */
-			if (fz_is_name(obj))
-			{
-				res = fz_dict_get(fz_dict_gets(rdb, "ColorSpace"), obj);
-				if (res)
-					obj = res;
-			}
+/* Copy a band of src, from column x0 on, into dst from row y on */
+static void
+pdf_crop_band(fz_pixmap *dst, int y, fz_pixmap *src, int x0)
+{
+	int v;
 
-			colorspace = pdf_load_colorspace(xref, obj);
-			/* RJW: "cannot load image colorspace" */
+	for (v = 0; v < src->h; v++)
+		memcpy(dst->samples + (y + v) * dst->w * dst->n,
+			src->samples + (v * src->w + x0) * src->n,
+			dst->w * dst->n);
+}
 
-			if (!strcmp(colorspace->name, "Indexed"))
-				indexed = 1;
+void
+pdf_free_image_imp(fz_context *ctx, fz_storable *image_)
+{
+	pdf_image *image = (pdf_image *)image_;
+
+	if (image->base.mask)
+		fz_drop_image(ctx, image->base.mask);
+	if (image->base.colorspace)
+		fz_drop_colorspace(ctx, image->base.colorspace);
+	fz_free_compressed_buffer(ctx, image->buffer);
+	fz_free(ctx, image);
+}
 
-			n = colorspace->n;
-		}
-		else
-		{
-			n = 1;
-		}
+static unsigned int
+pdf_image_size(pdf_image *image)
+{
+	unsigned int size = sizeof(pdf_image) + image->buffer->buffer->len;
+	if (image->base.mask)
+		size += pdf_image_size((pdf_image *)image->base.mask);
+	return size;
+}
 
-		obj = fz_dict_getsa(dict, "Decode", "D");
-		if (obj)
-		{
-			for (i = 0; i < n * 2; i++)
-				decode[i] = fz_to_real(fz_array_get(obj, i));
-		}
-		else
-		{
-			float maxval = indexed ? (1 << bpc) - 1 : 1;
-			for (i = 0; i < n * 2; i++)
-				decode[i] = i & 1 ? maxval : 0;
-		}
+static fz_pixmap *
+pdf_decode_jpx(fz_context *ctx, pdf_image *image, int l2factor)
+{
+	fz_buffer *buf = image->buffer->buffer;
+	fz_pixmap *img, *mask;
 
-		obj = fz_dict_getsa(dict, "SMask", "Mask");
-		if (fz_is_dict(obj))
-		{
-			/* Not allowed for inline images */
-			if (!cstm)
-			{
-				mask = pdf_load_image_imp(xref, rdb, obj, NULL, 1);
-				/* RJW: "cannot load image mask/softmask" */
-			}
-		}
-		else if (fz_is_array(obj))
-		{
-			usecolorkey = 1;
-			for (i = 0; i < n * 2; i++)
-			{
-				if (!fz_is_int(fz_array_get(obj, i)))
-				{
-					fz_warn(ctx, "invalid value in color key mask");
-					usecolorkey = 0;
-				}
-				colorkey[i] = fz_to_int(fz_array_get(obj, i));
-			}
-		}
+	img = fz_load_jpx(ctx, buf->data, buf->len, image->base.colorspace, l2factor);
+	/* RJW: "cannot load jpx image" */
 
-		/* Allocate now, to fail early if we run out of memory */
+	if (image->forcemask)
+	{
 		fz_try(ctx)
 		{
-			tile = fz_new_pixmap(ctx, colorspace, w, h);
+			if (img->n != 2)
+				fz_throw(ctx, "softmask must be grayscale");
+			mask = fz_alpha_from_gray(ctx, img, 1);
+		}
+		fz_always(ctx)
+		{
+			fz_drop_pixmap(ctx, img);
 		}
 		fz_catch(ctx)
 		{
-			fz_drop_colorspace(ctx, colorspace);
 			fz_rethrow(ctx);
 		}
+		return mask;
+	}
 
-		if (colorspace)
-		{
-			fz_drop_colorspace(ctx, colorspace);
-			colorspace = NULL;
-		}
+	/* FIXME: We can't handle decode arrays for indexed images currently */
+	if (image->has_decode && !image->indexed)
+		fz_decode_tile(img, image->decode);
 
-		tile->mask = mask;
-		mask = NULL;
-		tile->interpolate = interpolate;
+	return img;
+}
 
-		stride = (w * n * bpc + 7) / 8;
+/*
+	Decode an image, halved l2factor times. If area is given, only the
+	rows and columns in it are kept, and the rows below it are not
+	decoded at all. Its corners must lie on the 2^l2factor grid, or the
+	edges of the image. If indices is set, an Indexed image is left as
+	its palette indices, one byte per pixel with no colorspace; Decode
+	and the color key are left for its palette.
+*/
+static fz_pixmap *
+pdf_decode_image(fz_context *ctx, pdf_image *image, int l2factor, fz_bbox *area, int indices)
+{
+	fz_stream *stm = NULL;
+	fz_pixmap *tile = NULL;
+	fz_pixmap *band = NULL;
+	unsigned char *samples = NULL;
+	int w, h, n, bpc, stride;
+	int x0, y0, x1, y1;
+	int left, rows, y, skip;
+	int truncated = 0;
+	int i, len;
 
-		if (cstm)
+	if (image->buffer->params.type == FZ_IMAGE_JPX)
+		return pdf_decode_jpx(ctx, image, l2factor);
+
+	fz_var(stm);
+	fz_var(tile);
+	fz_var(band);
+	fz_var(samples);
+
+	w = image->base.w;
+	h = image->base.h;
+	n = image->n;
+	bpc = image->bpc;
+	stride = (w * n * bpc + 7) / 8;
+
+	fz_try(ctx)
+	{
+		/* The decoder may scale the image down for us; we subsample
+		 * the rest of the way ourselves */
+		left = l2factor;
+		stm = fz_open_image_decomp_stream(ctx, image->buffer, &left);
+		if (left < l2factor)
 		{
-			stm = pdf_open_inline_stream(xref, dict, stride * h, cstm);
+			w = (w + (1 << (l2factor - left)) - 1) >> (l2factor - left);
+			h = (h + (1 << (l2factor - left)) - 1) >> (l2factor - left);
+			stride = (w * n * bpc + 7) / 8;
 		}
-		else
+
+		x0 = y0 = 0;
+		x1 = w;
+		y1 = h;
+		if (area)
 		{
-			stm = pdf_open_stream(xref, fz_to_num(dict), fz_to_gen(dict));
-			/* RJW: "cannot open image data stream (%d 0 R)", fz_to_num(dict) */
+			x0 = area->x0 >> (l2factor - left);
+			y0 = area->y0 >> (l2factor - left);
+			x1 = MIN(w, (area->x1 + (1 << (l2factor - left)) - 1) >> (l2factor - left));
+			y1 = MIN(h, (area->y1 + (1 << (l2factor - left)) - 1) >> (l2factor - left));
 		}
+		l2factor = left;
 
-		samples = fz_malloc_array(ctx, h, stride);
+		/* Allocate now, to fail early if we run out of memory */
+		tile = fz_new_pixmap(ctx, indices ? NULL : image->base.colorspace,
+			(x1 - x0 + (1 << l2factor) - 1) >> l2factor,
+			(y1 - y0 + (1 << l2factor) - 1) >> l2factor);
+		tile->interpolate = image->base.interpolate;
+
+		/* Read the whole image at once, or when subsampling or
+		 * cropping, one band of rows at a time so that we never hold
+		 * it all */
+		if (l2factor)
+			rows = 1 << l2factor;
+		else if (x0 > 0 || x1 < w)
+			rows = MIN(16, y1 - y0);
+		else
+			rows = y1 - y0;
+		samples = fz_malloc_array(ctx, rows, stride);
+		if (l2factor || x0 > 0 || x1 < w)
+			band = fz_new_pixmap(ctx, tile->colorspace, w, rows);
+		else
+			band = fz_keep_pixmap(ctx, tile);
 
-		len = fz_read(stm, samples, h * stride);
-		if (len < 0)
+		/* Skip the rows above the area */
+		skip = y0 * stride;
+		while (skip > 0)
 		{
-			fz_throw(ctx, "cannot read image data");
+			len = fz_read(stm, samples, MIN(skip, rows * stride));
+			if (len <= 0)
+				break;
+			skip -= len;
 		}
 
-		/* Make sure we read the EOF marker (for inline images only) */
-		if (cstm)
+		for (y = y0; y < y1; y += rows)
 		{
-			unsigned char tbuf[512];
-			fz_try(ctx)
+			rows = MIN(rows, y1 - y);
+
+			len = fz_read(stm, samples, rows * stride);
+			if (len < 0)
 			{
-				int tlen = fz_read(stm, tbuf, sizeof tbuf);
-				if (tlen > 0)
-					fz_warn(ctx, "ignoring garbage at end of image");
+				fz_throw(ctx, "cannot read image data");
 			}
-			fz_catch(ctx)
+
+			/* Pad truncated images */
+			if (len < stride * rows)
 			{
-				fz_warn(ctx, "ignoring error at end of image");
+				if (!truncated)
+					fz_warn(ctx, "padding truncated image (%d 0 R)", image->num);
+				truncated = 1;
+				memset(samples + len, 0, stride * rows - len);
 			}
-		}
 
-		fz_close(stm);
-		stm = NULL;
+			/* Invert 1-bit image masks */
+			if (image->stencil && !indices)
+			{
+				/* 0=opaque and 1=transparent so we need to invert */
+				unsigned char *p = samples;
+				len = rows * stride;
+				for (i = 0; i < len; i++)
+					p[i] = ~p[i];
+			}
 
-		/* Pad truncated images */
-		if (len < stride * h)
-		{
-			fz_warn(ctx, "padding truncated image (%d 0 R)", fz_to_num(dict));
-			memset(samples + len, 0, stride * h - len);
+			/* The last band may be short */
+			band->h = rows;
+			fz_unpack_tile(band, samples, n, bpc, stride, image->indexed);
+
+			if (image->usecolorkey && !indices)
+				pdf_mask_color_key(band, n, image->colorkey);
+
+			if (l2factor)
+				pdf_subsample_band(tile, (y - y0) >> l2factor, band, x0, x1, l2factor);
+			else if (band != tile)
+				pdf_crop_band(tile, y - y0, band, x0);
 		}
 
-		/* Invert 1-bit image masks */
-		if (imagemask)
+		if (indices)
 		{
-			/* 0=opaque and 1=transparent so we need to invert */
-			unsigned char *p = samples;
-			len = h * stride;
-			for (i = 0; i < len; i++)
-				p[i] = ~p[i];
+			/* left for the palette */
 		}
-
-		fz_unpack_tile(tile, samples, n, bpc, stride, indexed);
-
-		fz_free(ctx, samples);
-		samples = NULL;
-
-		if (usecolorkey)
-			pdf_mask_color_key(tile, n, colorkey);
-
-		if (indexed)
+		else if (image->indexed)
 		{
 			fz_pixmap *conv;
-			fz_decode_indexed_tile(tile, decode, (1 << bpc) - 1);
+			fz_decode_indexed_tile(tile, image->decode, (1 << bpc) - 1);
 			conv = pdf_expand_indexed_pixmap(ctx, tile);
 			fz_drop_pixmap(ctx, tile);
 			tile = conv;
 		}
 		else
 		{
-			fz_decode_tile(tile, decode);
+			fz_decode_tile(tile, image->decode);
 		}
 	}
-	fz_catch(ctx)
+	fz_always(ctx)
 	{
-		if (colorspace)
-			fz_drop_colorspace(ctx, colorspace);
-		if (mask)
-			fz_drop_pixmap(ctx, mask);
-		if (tile)
-			fz_drop_pixmap(ctx, tile);
+		fz_drop_pixmap(ctx, band);
 		fz_close(stm);
 		fz_free(ctx, samples);
-
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_pixmap(ctx, tile);
 		fz_rethrow(ctx);
 	}
 
 	return tile;
 }
 
-fz_pixmap *
-pdf_load_inline_image(pdf_document *xref, fz_obj *rdb, fz_obj *dict, fz_stream *file)
+/* Key for the store: the image, whether it was left as palette indices,
+ * the number of times it was halved, and the area of it that was
+ * decoded, if not all of it (an empty area). It is plain data, since
+ * images are decoded at draw time in whatever context is drawing. */
+typedef struct pdf_image_key_s pdf_image_key;
+
+struct pdf_image_key_s
 {
-	return pdf_load_image_imp(xref, rdb, dict, file, 0);
-	/* RJW: "cannot load inline image" */
+	int id;
+	int indices;
+	int l2factor;
+	fz_bbox area;
+};
+
+static void
+pdf_make_image_key(pdf_image_key *key, int id, int indices, int l2factor, fz_bbox *area)
+{
+	memset(key, 0, sizeof *key);
+	key->id = id;
+	key->indices = indices;
+	key->l2factor = l2factor;
+	if (area)
+		key->area = *area;
 }
 
-int
-pdf_is_jpx_image(fz_context *ctx, fz_obj *dict)
+/* Key for the disk cache: the digest of the image, and the resolution
+ * it was decoded at. */
+static void
+pdf_image_disk_key(pdf_image *image, int l2factor, unsigned char key[16])
 {
-	fz_obj *filter;
-	int i, n;
+	fz_md5 md5;
 
-	filter = fz_dict_gets(dict, "Filter");
-	if (!strcmp(fz_to_name(filter), "JPXDecode"))
-		return 1;
-	n = fz_array_len(filter);
-	for (i = 0; i < n; i++)
-		if (!strcmp(fz_to_name(fz_array_get(filter, i)), "JPXDecode"))
-			return 1;
-	return 0;
+	fz_md5_init(&md5);
+	fz_md5_update(&md5, image->digest, 16);
+	fz_md5_update(&md5, (unsigned char *)&l2factor, sizeof l2factor);
+	fz_md5_final(&md5, key);
+}
+
+static void
+pdf_image_store(fz_context *ctx, pdf_image *image, int indices, int l2factor, fz_bbox *crop, void *val, unsigned int size)
+{
+	pdf_image_key key;
+
+	pdf_make_image_key(&key, image->id, indices, l2factor, crop);
+	if (size > UINT_MAX / image->weight)
+		fz_store_keyed_item(ctx, &key, sizeof key, val, size, UINT_MAX);
+	else
+		fz_store_keyed_item(ctx, &key, sizeof key, val, size, size * image->weight);
+}
+
+/*
+	Decode just the area of an image that is asked for when the image is
+	this large (in pixels, at the resolution it is decoded at) and the
+	area is less than half of it. Smaller images are decoded whole, so
+	that one copy serves every view of them.
+*/
+#define MIN_CROP_SIZE (1 << 20)
+
+static fz_bbox *
+pdf_image_crop(pdf_image *image, int l2factor, fz_bbox *area, fz_bbox *crop)
+{
+	int w = image->base.w;
+	int h = image->base.h;
+	int mask = (1 << l2factor) - 1;
+
+	if (!area || image->buffer->params.type == FZ_IMAGE_JPX)
+		return NULL;
+
+	/* Round out to whole blocks of subsampled pixels */
+	crop->x0 = MAX(0, area->x0) & ~mask;
+	crop->y0 = MAX(0, area->y0) & ~mask;
+	crop->x1 = MIN(w, (area->x1 + mask) & ~mask);
+	crop->y1 = MIN(h, (area->y1 + mask) & ~mask);
+	if (crop->x1 <= crop->x0 || crop->y1 <= crop->y0)
+		return NULL;
+
+	if ((float)(w >> l2factor) * (h >> l2factor) < MIN_CROP_SIZE)
+		return NULL;
+	if ((float)(crop->x1 - crop->x0) * (crop->y1 - crop->y0) * 2 > (float)w * h)
+		return NULL;
+
+	return crop;
 }
 
 static fz_pixmap *
-pdf_load_jpx(pdf_document *xref, fz_obj *dict)
+pdf_image_get_tile(fz_context *ctx, pdf_image *image, int w, int h, fz_bbox *area, int indices)
 {
-	fz_buffer *buf = NULL;
-	fz_colorspace *colorspace = NULL;
-	fz_pixmap *img = NULL;
-	fz_obj *obj;
-	fz_context *ctx = xref->ctx;
-	int indexed = 0;
+	fz_pixmap *pix = NULL;
+	pdf_image_key key;
+	fz_bbox cropbox, *crop;
+	unsigned char digest[16];
+	int l2factor, i;
+
+	/* Palette indices can only be picked, not averaged, so Indexed
+	 * images are decoded at full size. Bilevel ones lose fine lines to
+	 * the box filter, so they are kept at twice the size they are drawn
+	 * at for the scaler to filter properly. */
+	if (image->indexed)
+		l2factor = 0;
+	else if (image->bpc == 1)
+		l2factor = pdf_image_l2factor(image->base.w, image->base.h, w * 2, h * 2);
+	else
+		l2factor = pdf_image_l2factor(image->base.w, image->base.h, w, h);
+
+	/* Any whole copy at this or a higher resolution will do */
+	for (i = l2factor; i >= 0 && !pix; i--)
+	{
+		pdf_make_image_key(&key, image->id, indices, i, NULL);
+		pix = fz_find_keyed_item(ctx, fz_free_pixmap_imp, &key, sizeof key);
+	}
+
+	crop = pix ? NULL : pdf_image_crop(image, l2factor, area, &cropbox);
+
+	if (crop)
+	{
+		pdf_make_image_key(&key, image->id, indices, l2factor, crop);
+		pix = fz_find_keyed_item(ctx, fz_free_pixmap_imp, &key, sizeof key);
+	}
+	else if (!pix && !indices && image->has_digest)
+	{
+		pdf_image_disk_key(image, l2factor, digest);
+		pix = fz_load_disk_cache_pixmap(ctx, digest);
+		if (pix)
+			pdf_image_store(ctx, image, 0, l2factor, NULL, pix, fz_pixmap_size(ctx, pix));
+	}
 
-	fz_var(img);
-	fz_var(buf);
-	fz_var(colorspace);
+	if (!pix)
+	{
+		pix = pdf_decode_image(ctx, image, l2factor, crop, indices);
+		/* RJW: "cannot load image (%d 0 R)", image->num */
 
-	buf = pdf_load_stream(xref, fz_to_num(dict), fz_to_gen(dict));
-	/* RJW: "cannot load jpx image data" */
+		if (!crop && !indices && image->has_digest)
+			fz_save_disk_cache_pixmap(ctx, digest, pix);
 
-	/* FIXME: We can't handle decode arrays for indexed images currently */
-	fz_try(ctx)
+		pdf_image_store(ctx, image, indices, l2factor, crop, pix, fz_pixmap_size(ctx, pix));
+	}
+
+	if (area)
 	{
-		obj = fz_dict_gets(dict, "ColorSpace");
-		if (obj)
+		if (crop)
+			*area = *crop;
+		else
 		{
-			colorspace = pdf_load_colorspace(xref, obj);
-			/* RJW: "cannot load image colorspace" */
-			indexed = !strcmp(colorspace->name, "Indexed");
+			area->x0 = area->y0 = 0;
+			area->x1 = image->base.w;
+			area->y1 = image->base.h;
 		}
+	}
 
-		img = fz_load_jpx(ctx, buf->data, buf->len, colorspace);
-		/* RJW: "cannot load jpx image" */
+	return pix;
+}
 
-		if (colorspace)
+static fz_pixmap *
+pdf_image_get_pixmap(fz_context *ctx, fz_image *image_, int w, int h, fz_bbox *area)
+{
+	return pdf_image_get_tile(ctx, (pdf_image *)image_, w, h, area, 0);
+}
+
+/*
+	Indexed images are kept as their palette indices, a quarter or less
+	of the size of the pixmap they expand to. The palette takes each
+	index through the same color key, Decode and lookup that the pixels
+	of an expanded pixmap go through.
+*/
+static fz_pixmap *
+pdf_image_palette(fz_context *ctx, pdf_image *image)
+{
+	fz_pixmap *idx, *pal = NULL;
+	int i;
+
+	fz_var(pal);
+
+	idx = fz_new_pixmap(ctx, image->base.colorspace, 256, 1);
+	for (i = 0; i < 256; i++)
+	{
+		idx->samples[i * 2] = i;
+		idx->samples[i * 2 + 1] = 255;
+	}
+
+	fz_try(ctx)
+	{
+		if (image->usecolorkey)
+			pdf_mask_color_key(idx, 1, image->colorkey);
+		fz_decode_indexed_tile(idx, image->decode, (1 << image->bpc) - 1);
+		pal = pdf_expand_indexed_pixmap(ctx, idx);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_pixmap(ctx, idx);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+
+	return pal;
+}
+
+static fz_pixmap *
+pdf_image_get_indexed(fz_context *ctx, fz_image *image_, int w, int h, fz_bbox *area, fz_pixmap **palette)
+{
+	pdf_image *image = (pdf_image *)image_;
+	fz_pixmap *pix = NULL;
+
+	fz_var(pix);
+
+	if (!image->indexed || image->bpc > 8 || image->buffer->params.type == FZ_IMAGE_JPX)
+		return NULL;
+
+	*palette = pdf_image_palette(ctx, image);
+	fz_try(ctx)
+	{
+		pix = pdf_image_get_tile(ctx, image, w, h, area, 1);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_pixmap(ctx, *palette);
+		*palette = NULL;
+		fz_rethrow(ctx);
+	}
+
+	return pix;
+}
+
+/*
+	Image masks and other images of one 1 bit component are bilevel, and
+	are kept packed when drawn at full resolution: 1/8 of the size of a
+	pixmap. The bits are the samples as they are in the file; Decode, and
+	the inversion of image masks, only change what they stand for.
+*/
+static int
+pdf_image_is_bilevel(pdf_image *image)
+{
+	return image->bpc == 1 && image->n == 1 && !image->indexed && !image->usecolorkey &&
+		image->buffer->params.type != FZ_IMAGE_JPX;
+}
+
+static fz_bitmap *
+pdf_decode_bitmap(fz_context *ctx, pdf_image *image)
+{
+	fz_stream *stm;
+	fz_bitmap *bit = NULL;
+	int w = image->base.w;
+	int h = image->base.h;
+	int stride = (w + 7) / 8;
+	int truncated = 0;
+	int y, len;
+
+	fz_var(bit);
+
+	stm = fz_open_image_decomp_stream(ctx, image->buffer, NULL);
+	fz_try(ctx)
+	{
+		bit = fz_new_bitmap(ctx, w, h, 1);
+		for (y = 0; y < h; y++)
 		{
-			fz_drop_colorspace(ctx, colorspace);
-			colorspace = NULL;
+			unsigned char *p = bit->samples + y * bit->stride;
+			len = fz_read(stm, p, stride);
+			if (len < 0)
+				fz_throw(ctx, "cannot read image data");
+			if (len < stride)
+			{
+				if (!truncated)
+					fz_warn(ctx, "padding truncated image (%d 0 R)", image->num);
+				truncated = 1;
+				memset(p + len, 0, stride - len);
+			}
 		}
+	}
+	fz_always(ctx)
+	{
+		fz_close(stm);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_bitmap(ctx, bit);
+		fz_rethrow(ctx);
+	}
+
+	return bit;
+}
+
+static fz_bitmap *
+pdf_image_get_bitmap(fz_context *ctx, fz_image *image_, unsigned char levels[2])
+{
+	pdf_image *image = (pdf_image *)image_;
+	fz_bitmap *bit;
+	pdf_image_key key;
+	int min, max, i, v;
+
+	if (!pdf_image_is_bilevel(image))
+		return NULL;
+
+	/* As fz_unpack_tile and fz_decode_tile would make them */
+	min = image->decode[0] * 255;
+	max = image->decode[1] * 255;
+	for (i = 0; i < 2; i++)
+	{
+		v = (image->stencil ? !i : i) ? 255 : 0;
+		if (min != 0 || max != 255)
+			v = CLAMP(min + fz_mul255(v, max - min), 0, 255);
+		levels[i] = v;
+	}
+
+	pdf_make_image_key(&key, image->id, 0, 0, NULL);
+	bit = fz_find_keyed_item(ctx, fz_free_bitmap_imp, &key, sizeof key);
+	if (bit)
+		return bit;
+
+	bit = pdf_decode_bitmap(ctx, image);
+	/* RJW: "cannot load image (%d 0 R)", image->num */
+
+	pdf_image_store(ctx, image, 0, 0, NULL, bit, fz_bitmap_size(ctx, bit));
+
+	return bit;
+}
+
+/* Rough relative cost of decoding an image, used to weigh it in the
+ * store. Wavelet and arithmetic coded images are much slower to decode
+ * than their size suggests; flate and uncompressed ones are cheap. */
+static unsigned int
+pdf_image_weight(fz_obj *dict)
+{
+	fz_obj *filter = fz_dict_getsa(dict, "Filter", "F");
+	fz_obj *f;
+	int i, n, weight = 1;
+
+	n = fz_is_array(filter) ? fz_array_len(filter) : 1;
+	for (i = 0; i < n; i++)
+	{
+		f = fz_is_array(filter) ? fz_array_get(filter, i) : filter;
+		if (!fz_is_name(f))
+			continue;
+		if (!strcmp(fz_to_name(f), "JPXDecode"))
+			weight += 7;
+		else if (!strcmp(fz_to_name(f), "JBIG2Decode"))
+			weight += 3;
+		else if (!strcmp(fz_to_name(f), "DCTDecode") || !strcmp(fz_to_name(f), "DCT") ||
+			!strcmp(fz_to_name(f), "CCITTFaxDecode") || !strcmp(fz_to_name(f), "CCF"))
+			weight += 1;
+	}
+
+	return weight;
+}
+
+/*
+	Digest the objects an image dictionary refers to by their content, not
+	by their object numbers, so that a palette or ICC profile that differs
+	between files (or between versions of one file) gives another key.
+	Streams are digested by their raw bytes.
+*/
+#define MAX_DIGEST_DEPTH 8
+
+static void
+pdf_md5_resolved(pdf_document *xref, fz_md5 *md5, fz_obj *obj, int depth)
+{
+	fz_context *ctx = xref->ctx;
+	fz_buffer *buf;
+	unsigned char kind;
+	int i, n;
+
+	if (depth > MAX_DIGEST_DEPTH)
+		fz_throw(ctx, "image dictionary too deep to digest");
+
+	if (fz_is_indirect(obj) && pdf_is_stream(xref, fz_to_num(obj), fz_to_gen(obj)))
+	{
+		buf = pdf_load_raw_stream(xref, fz_to_num(obj), fz_to_gen(obj));
+		fz_md5_update(md5, (unsigned char *)&buf->len, sizeof buf->len);
+		fz_md5_update(md5, buf->data, buf->len);
 		fz_drop_buffer(ctx, buf);
-		buf = NULL;
+	}
 
-		obj = fz_dict_getsa(dict, "SMask", "Mask");
-		if (fz_is_dict(obj))
+	obj = fz_resolve_indirect(obj);
+	if (fz_is_array(obj))
+	{
+		kind = 'a';
+		n = fz_array_len(obj);
+		fz_md5_update(md5, &kind, 1);
+		fz_md5_update(md5, (unsigned char *)&n, sizeof n);
+		for (i = 0; i < n; i++)
+			pdf_md5_resolved(xref, md5, fz_array_get(obj, i), depth + 1);
+	}
+	else if (fz_is_dict(obj))
+	{
+		kind = 'd';
+		n = fz_dict_len(obj);
+		fz_md5_update(md5, &kind, 1);
+		fz_md5_update(md5, (unsigned char *)&n, sizeof n);
+		for (i = 0; i < n; i++)
 		{
-			img->mask = pdf_load_image_imp(xref, NULL, obj, NULL, 1);
-			/* RJW: "cannot load image mask/softmask" */
+			fz_md5_obj(md5, fz_dict_get_key(obj, i));
+			pdf_md5_resolved(xref, md5, fz_dict_get_val(obj, i), depth + 1);
 		}
+	}
+	else
+		fz_md5_obj(md5, obj);
+}
 
-		obj = fz_dict_getsa(dict, "Decode", "D");
-		if (obj && !indexed)
-		{
-			float decode[FZ_MAX_COLORS * 2];
-			int i;
+/* Digest for the disk cache: whether the image is used as a mask, its
+ * dictionary, which holds all of its decode parameters, with what it
+ * refers to, and the bytes of its data. */
+static void
+pdf_image_digest(pdf_document *xref, pdf_image *image, fz_obj *dict)
+{
+	fz_context *ctx = xref->ctx;
+	fz_buffer *data = image->buffer->buffer;
+	fz_md5 md5;
+	int v[3];
+
+	v[0] = image->forcemask;
+	v[1] = image->buffer->params.type;
+	v[2] = data->len;
+	fz_md5_init(&md5);
+	fz_md5_update(&md5, (unsigned char *)v, sizeof v);
+	fz_try(ctx)
+	{
+		pdf_md5_resolved(xref, &md5, fz_resolve_indirect(dict), 0);
+	}
+	fz_catch(ctx)
+	{
+		/* Without a digest the image is simply not cached on disk */
+		return;
+	}
+	fz_md5_update(&md5, data->data, data->len);
+	fz_md5_final(&md5, image->digest);
+	image->has_digest = 1;
+}
 
-			for (i = 0; i < img->n * 2; i++)
-				decode[i] = fz_to_real(fz_array_get(obj, i));
+/* Read the samples of an inline image out of the content stream */
+static fz_compressed_buffer *
+pdf_load_inline_samples(pdf_document *xref, fz_obj *dict, int len, fz_stream *cstm)
+{
+	fz_context *ctx = xref->ctx;
+	fz_compressed_buffer *bc = NULL;
+	fz_stream *stm = NULL;
+	unsigned char tbuf[512];
+	int tlen;
 
-			fz_decode_tile(img, decode);
+	fz_var(bc);
+	fz_var(stm);
+
+	fz_try(ctx)
+	{
+		stm = pdf_open_inline_stream(xref, dict, len, cstm);
+
+		bc = fz_malloc_struct(ctx, fz_compressed_buffer);
+		bc->params.type = FZ_IMAGE_RAW;
+		bc->buffer = fz_new_buffer(ctx, len);
+		tlen = fz_read(stm, bc->buffer->data, len);
+		if (tlen < 0)
+			fz_throw(ctx, "cannot read image data");
+		bc->buffer->len = tlen;
+
+		/* Make sure we read the EOF marker */
+		fz_try(ctx)
+		{
+			tlen = fz_read(stm, tbuf, sizeof tbuf);
+			if (tlen > 0)
+				fz_warn(ctx, "ignoring garbage at end of image");
 		}
+		fz_catch(ctx)
+		{
+			fz_warn(ctx, "ignoring error at end of image");
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_close(stm);
 	}
 	fz_catch(ctx)
 	{
-		if (colorspace)
-			fz_drop_colorspace(ctx, colorspace);
-		fz_drop_buffer(ctx, buf);
-		fz_drop_pixmap(ctx, img);
+		fz_free_compressed_buffer(ctx, bc);
 		fz_rethrow(ctx);
 	}
-	return img;
+
+	return bc;
 }
 
-fz_pixmap *
-pdf_load_image(pdf_document *xref, fz_obj *dict)
+static fz_image *
+pdf_load_image_imp(pdf_document *xref, fz_obj *rdb, fz_obj *dict, fz_stream *cstm, int forcemask)
 {
 	fz_context *ctx = xref->ctx;
-	fz_pixmap *pix;
+	pdf_image *image;
+	fz_obj *obj, *res;
+	int w, h, bpc, n;
+	int i;
+
+	image = fz_malloc_struct(ctx, pdf_image);
+	FZ_INIT_STORABLE(&image->base, 1, pdf_free_image_imp);
+	image->base.get_pixmap = pdf_image_get_pixmap;
+	image->base.get_bitmap = pdf_image_get_bitmap;
+	image->base.get_indexed = pdf_image_get_indexed;
+	image->id = fz_new_store_id(ctx);
+	image->num = fz_to_num(dict);
+	image->forcemask = forcemask;
 
-	if ((pix = fz_find_item(ctx, fz_free_pixmap_imp, dict)))
+	fz_try(ctx)
 	{
-		return pix;
+		image->weight = pdf_image_weight(dict);
+		image->base.interpolate = fz_to_bool(fz_dict_getsa(dict, "Interpolate", "I"));
+
+		/* special case for JPEG2000 images */
+		if (pdf_is_jpx_image(ctx, dict))
+		{
+			image->base.w = fz_to_int(fz_dict_getsa(dict, "Width", "W"));
+			image->base.h = fz_to_int(fz_dict_getsa(dict, "Height", "H"));
+
+			image->buffer = fz_malloc_struct(ctx, fz_compressed_buffer);
+			image->buffer->params.type = FZ_IMAGE_JPX;
+			image->buffer->buffer = pdf_load_stream(xref, fz_to_num(dict), fz_to_gen(dict));
+			/* RJW: "cannot load jpx image data" */
+
+			obj = fz_dict_gets(dict, "ColorSpace");
+			if (obj && !forcemask)
+			{
+				image->base.colorspace = pdf_load_colorspace(xref, obj);
+				/* RJW: "cannot load image colorspace" */
+				image->indexed = !strcmp(image->base.colorspace->name, "Indexed");
+			}
+
+			obj = fz_dict_getsa(dict, "Decode", "D");
+			if (obj)
+			{
+				image->has_decode = 1;
+				for (i = 0; i < FZ_MAX_COLORS * 2; i++)
+					image->decode[i] = fz_to_real(fz_array_get(obj, i));
+			}
+		}
+		else
+		{
+			w = fz_to_int(fz_dict_getsa(dict, "Width", "W"));
+			h = fz_to_int(fz_dict_getsa(dict, "Height", "H"));
+			bpc = fz_to_int(fz_dict_getsa(dict, "BitsPerComponent", "BPC"));
+			image->stencil = fz_to_bool(fz_dict_getsa(dict, "ImageMask", "IM"));
+
+			if (image->stencil)
+				bpc = 1;
+
+			if (w == 0)
+				fz_throw(ctx, "image width is zero");
+			if (h == 0)
+				fz_throw(ctx, "image height is zero");
+			if (bpc == 0)
+				fz_throw(ctx, "image depth is zero");
+			if (bpc > 16)
+				fz_throw(ctx, "image depth is too large: %d", bpc);
+			if (w > (1 << 16))
+				fz_throw(ctx, "image is too wide");
+			if (h > (1 << 16))
+				fz_throw(ctx, "image is too high");
+
+			obj = fz_dict_getsa(dict, "ColorSpace", "CS");
+			if (obj && !image->stencil && !forcemask)
+			{
+				/* colorspace resource lookup is only done for inline images */
+				if (fz_is_name(obj))
+				{
+					res = fz_dict_get(fz_dict_gets(rdb, "ColorSpace"), obj);
+					if (res)
+						obj = res;
+				}
+
+				image->base.colorspace = pdf_load_colorspace(xref, obj);
+				/* RJW: "cannot load image colorspace" */
+
+				if (!strcmp(image->base.colorspace->name, "Indexed"))
+					image->indexed = 1;
+
+				n = image->base.colorspace->n;
+			}
+			else
+			{
+				n = 1;
+			}
+
+			image->base.w = w;
+			image->base.h = h;
+			image->base.imagemask = !image->base.colorspace;
+			image->n = n;
+			image->bpc = bpc;
+
+			obj = fz_dict_getsa(dict, "Decode", "D");
+			if (obj)
+			{
+				for (i = 0; i < n * 2; i++)
+					image->decode[i] = fz_to_real(fz_array_get(obj, i));
+			}
+			else
+			{
+				float maxval = image->indexed ? (1 << bpc) - 1 : 1;
+				for (i = 0; i < n * 2; i++)
+					image->decode[i] = i & 1 ? maxval : 0;
+			}
+
+			obj = fz_dict_getsa(dict, "SMask", "Mask");
+			if (fz_is_array(obj))
+			{
+				image->usecolorkey = 1;
+				for (i = 0; i < n * 2; i++)
+				{
+					if (!fz_is_int(fz_array_get(obj, i)))
+					{
+						fz_warn(ctx, "invalid value in color key mask");
+						image->usecolorkey = 0;
+					}
+					image->colorkey[i] = fz_to_int(fz_array_get(obj, i));
+				}
+			}
+
+			if (cstm)
+			{
+				image->buffer = pdf_load_inline_samples(xref, dict, (w * n * bpc + 7) / 8 * h, cstm);
+			}
+			else
+			{
+				image->buffer = pdf_load_compressed_stream(xref, fz_to_num(dict), fz_to_gen(dict));
+				/* RJW: "cannot open image data stream (%d 0 R)", fz_to_num(dict) */
+			}
+		}
+
+		/* Not allowed for inline images */
+		obj = fz_dict_getsa(dict, "SMask", "Mask");
+		if (fz_is_dict(obj) && !cstm)
+		{
+			image->base.mask = pdf_load_image_imp(xref, rdb, obj, NULL, 1);
+			/* RJW: "cannot load image mask/softmask" */
+		}
+
+		/* Never spill decrypted data to disk */
+		if (!cstm && ctx->disk_cache && !xref->crypt)
+			pdf_image_digest(xref, image, dict);
 	}
+	fz_catch(ctx)
+	{
+		pdf_free_image_imp(ctx, &image->base.storable);
+		fz_rethrow(ctx);
+	}
+
+	return &image->base;
+}
+
+fz_image *
+pdf_load_inline_image(pdf_document *xref, fz_obj *rdb, fz_obj *dict, fz_stream *file)
+{
+	return pdf_load_image_imp(xref, rdb, dict, file, 0);
+	/* RJW: "cannot load inline image" */
+}
+
+int
+pdf_is_jpx_image(fz_context *ctx, fz_obj *dict)
+{
+	fz_obj *filter;
+	int i, n;
 
-	pix = pdf_load_image_imp(xref, NULL, dict, NULL, 0);
+	filter = fz_dict_gets(dict, "Filter");
+	if (!strcmp(fz_to_name(filter), "JPXDecode"))
+		return 1;
+	n = fz_array_len(filter);
+	for (i = 0; i < n; i++)
+		if (!strcmp(fz_to_name(fz_array_get(filter, i)), "JPXDecode"))
+			return 1;
+	return 0;
+}
+
+fz_image *
+pdf_load_image(pdf_document *xref, fz_obj *dict)
+{
+	fz_context *ctx = xref->ctx;
+	pdf_image *image;
+
+	if ((image = fz_find_item(ctx, pdf_free_image_imp, dict)))
+		return &image->base;
+
+	image = (pdf_image *)pdf_load_image_imp(xref, NULL, dict, NULL, 0);
 	/* RJW: "cannot load image (%d 0 R)", fz_to_num(dict) */
 
-	fz_store_item(ctx, dict, pix, fz_pixmap_size(ctx, pix));
+	fz_store_item(ctx, dict, image, pdf_image_size(image));
 
-	return pix;
+	return &image->base;
 }
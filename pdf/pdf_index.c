@@ -0,0 +1,355 @@
+#include "fitz.h"
+#include "mupdf.h"
+
+/*
+ * Xref index
+ *
+ * When the context has a disk cache, the xref of a large or broken
+ * file is saved there once it has been read (or repaired), so that the
+ * next open of the same file can load the table in one read instead of
+ * parsing every xref section or scanning the whole file again.
+ *
+ * The index is keyed by the size, modification time and inode of the
+ * file, and a digest of its first and last kilobytes, where the header,
+ * the trailer and the last xref section live; an incremental update
+ * changes the end of the file. Documents that are not read from a file
+ * are not indexed.
+ *
+ * Since a file can be rewritten in place without its key changing, a
+ * sample of the objects is checked to start where the index says when
+ * it is loaded; if any does not, the index is thrown away.
+ */
+
+#define INDEX_MAGIC 0x4d755869
+#define INDEX_VERSION 3
+
+enum { INDEX_SAMPLE = 1024 };
+
+/* Reading the xref of smaller files is as quick as reading an index */
+enum { MIN_INDEX_LEN = 4096 };
+
+/* Number of object offsets checked when an index is loaded */
+enum { INDEX_CHECKS = 32 };
+
+/*
+	Layout, in native byte order:
+	header: magic, version, file size, pdf version, startxref,
+		repaired, xref length, number of length fixes, trailer length
+	entries: type, ofs, gen, stm_ofs for each object
+	fixes: num, gen, length for each stream whose /Length was repaired
+	trailer: printed tight
+*/
+enum { HEADER_LEN = 9, ENTRY_LEN = 4, FIX_LEN = 3 };
+
+static void
+pdf_digest_range(pdf_document *xref, fz_md5 *md5, int ofs, int len)
+{
+	fz_context *ctx = xref->ctx;
+	fz_stream *stm = NULL;
+	unsigned char buf[INDEX_SAMPLE];
+	int n;
+
+	fz_var(stm);
+
+	fz_try(ctx)
+	{
+		stm = fz_reopen_stream(ctx, xref->file, ofs);
+		n = fz_read(stm, buf, len);
+		if (n < 0)
+			fz_throw(ctx, "cannot read file");
+		fz_md5_update(md5, buf, n);
+	}
+	fz_always(ctx)
+	{
+		fz_close(stm);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
+/* Returns 0 if the file can not be read. */
+int
+pdf_xref_index_key(pdf_document *xref, unsigned char key[16])
+{
+	fz_context *ctx = xref->ctx;
+	fz_stream *stm = NULL;
+	fz_md5 md5;
+	int v[2], id[4];
+
+	fz_var(stm);
+
+	if (!fz_stream_file_id(xref->file, id))
+		return 0;
+
+	fz_try(ctx)
+	{
+		stm = fz_reopen_stream(ctx, xref->file, 0);
+		fz_seek(stm, 0, 2);
+		v[0] = INDEX_VERSION;
+		v[1] = fz_tell(stm);
+
+		fz_md5_init(&md5);
+		fz_md5_update(&md5, (unsigned char *)"xref index", 10);
+		fz_md5_update(&md5, (unsigned char *)v, sizeof v);
+		fz_md5_update(&md5, (unsigned char *)id, sizeof id);
+		pdf_digest_range(xref, &md5, 0, MIN(v[1], INDEX_SAMPLE));
+		pdf_digest_range(xref, &md5, MAX(v[1] - INDEX_SAMPLE, 0), MIN(v[1], INDEX_SAMPLE));
+		fz_md5_final(&md5, key);
+	}
+	fz_always(ctx)
+	{
+		fz_close(stm);
+	}
+	fz_catch(ctx)
+	{
+		return 0;
+	}
+
+	return 1;
+}
+
+static void
+pdf_apply_index_fixes(pdf_document *xref, int *fix, int nfix)
+{
+	fz_context *ctx = xref->ctx;
+	fz_obj *dict, *length;
+	int i;
+
+	for (i = 0; i < nfix; i++, fix += FIX_LEN)
+	{
+		if (fix[0] <= 0 || fix[0] >= xref->len || xref->table[fix[0]].type != 'n')
+			fz_throw(ctx, "corrupt xref index");
+		dict = pdf_load_object(xref, fix[0], fix[1]);
+		length = fz_new_int(ctx, fix[2]);
+		fz_dict_puts(dict, "Length", length);
+		fz_drop_obj(length);
+		fz_drop_obj(dict);
+		pdf_set_object_dirty(xref, fix[0]);
+	}
+}
+
+/* Check that an object starts with "num gen obj" at its offset */
+static int
+pdf_check_index_entry(pdf_document *xref, fz_stream *stm, int num)
+{
+	pdf_xref_entry *x = &xref->table[num];
+	char buf[64];
+	int len;
+
+	fz_seek(stm, x->ofs, 0);
+	if (pdf_lex(stm, buf, sizeof buf, &len) != PDF_TOK_INT || atoi(buf) != num)
+		return 0;
+	if (pdf_lex(stm, buf, sizeof buf, &len) != PDF_TOK_INT || atoi(buf) != x->gen)
+		return 0;
+	return pdf_lex(stm, buf, sizeof buf, &len) == PDF_TOK_OBJ;
+}
+
+/* Check a sample of the objects in the file, spread across the table */
+static void
+pdf_check_index(pdf_document *xref)
+{
+	fz_context *ctx = xref->ctx;
+	fz_stream *stm = NULL;
+	int i, step;
+
+	fz_var(stm);
+
+	step = MAX(1, xref->len / INDEX_CHECKS);
+	fz_try(ctx)
+	{
+		stm = fz_reopen_stream(ctx, xref->file, 0);
+		for (i = xref->len - 1; i > 0; i -= step)
+		{
+			/* Check the nearest object at or below i that is in use */
+			int k = i;
+			while (k > 0 && (xref->table[k].type != 'n' || xref->table[k].ofs <= 0))
+				k--;
+			if (k > 0 && !pdf_check_index_entry(xref, stm, k))
+				fz_throw(ctx, "stale xref index (object %d)", k);
+			i = MIN(i, k);
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_close(stm);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
+/*
+	Load the xref table and trailer from the index, if there is one for
+	this file. Returns 0 (leaving the document untouched) otherwise.
+*/
+int
+pdf_load_xref_index(pdf_document *xref, unsigned char key[16])
+{
+	fz_context *ctx = xref->ctx;
+	fz_buffer *buf;
+	fz_stream *stm = NULL;
+	pdf_xref_entry *x;
+	int *h, *e;
+	int i, len, nfix, tlen, size;
+
+	buf = fz_load_disk_cache_buffer(ctx, key);
+	if (!buf)
+		return 0;
+
+	fz_var(stm);
+
+	fz_try(ctx)
+	{
+		if (buf->len < HEADER_LEN * (int)sizeof(int))
+			fz_throw(ctx, "corrupt xref index");
+		h = (int *)buf->data;
+		len = h[6];
+		nfix = h[7];
+		tlen = h[8];
+		if (h[0] != INDEX_MAGIC || h[1] != INDEX_VERSION || len <= 0 || nfix < 0 || tlen <= 0 ||
+			len > (buf->len / (int)sizeof(int) - HEADER_LEN) / ENTRY_LEN)
+			fz_throw(ctx, "corrupt xref index");
+		size = (HEADER_LEN + len * ENTRY_LEN) * sizeof(int);
+		if (nfix > (buf->len - size) / (int)sizeof(int) / FIX_LEN)
+			fz_throw(ctx, "corrupt xref index");
+		size += nfix * FIX_LEN * sizeof(int);
+		if (tlen != buf->len - size)
+			fz_throw(ctx, "corrupt xref index");
+
+		xref->file_size = h[2];
+		xref->version = h[3];
+		xref->startxref = h[4];
+		xref->repaired = h[5];
+
+		pdf_resize_xref(xref, len);
+		e = h + HEADER_LEN;
+		for (i = 0; i < len; i++, e += ENTRY_LEN)
+		{
+			x = &xref->table[i];
+			x->type = e[0];
+			x->ofs = e[1];
+			x->gen = e[2];
+			x->stm_ofs = e[3];
+			if (x->type != 0 && x->type != 'f' && x->type != 'n' && x->type != 'o')
+				fz_throw(ctx, "corrupt xref index");
+		}
+
+		/* As for an xref read from the file: offsets in range, and
+		 * objects in object streams only in ones that exist */
+		pdf_check_xref(xref);
+
+		stm = fz_open_memory(ctx, buf->data + size, tlen);
+		xref->trailer = pdf_parse_stm_obj(xref, stm, xref->scratch, sizeof xref->scratch);
+		if (!fz_is_dict(xref->trailer))
+			fz_throw(ctx, "corrupt xref index");
+
+		pdf_check_index(xref);
+
+		pdf_apply_index_fixes(xref, e, nfix);
+	}
+	fz_always(ctx)
+	{
+		fz_close(stm);
+		fz_drop_buffer(ctx, buf);
+	}
+	fz_catch(ctx)
+	{
+		if (xref->table)
+		{
+			for (i = 0; i < xref->len; i++)
+				fz_drop_obj(xref->table[i].obj);
+			fz_free(ctx, xref->table);
+			xref->table = NULL;
+			xref->len = 0;
+		}
+		fz_drop_obj(xref->trailer);
+		xref->trailer = NULL;
+		xref->repaired = 0;
+		fz_warn(ctx, "ignoring broken xref index");
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+	Save the xref table and trailer of a fully loaded document. Only the
+	repairs made when opening it may have changed objects so far; those
+	are the corrected stream lengths.
+*/
+void
+pdf_save_xref_index(pdf_document *xref, unsigned char key[16])
+{
+	fz_context *ctx = xref->ctx;
+	fz_buffer *buf = NULL;
+	pdf_xref_entry *x;
+	int *h, *e;
+	int i, nfix, tlen, size;
+
+	if (!ctx->disk_cache || xref->main_xref || !xref->trailer)
+		return;
+	if (!xref->repaired && xref->len < MIN_INDEX_LEN)
+		return;
+
+	nfix = 0;
+	for (i = 0; i < xref->len; i++)
+		if (xref->table[i].dirty)
+			nfix++;
+
+	tlen = fz_sprint_obj(NULL, 0, xref->trailer, 1);
+	size = (HEADER_LEN + xref->len * ENTRY_LEN + nfix * FIX_LEN) * sizeof(int);
+
+	fz_var(buf);
+
+	fz_try(ctx)
+	{
+		buf = fz_new_buffer(ctx, size + tlen + 1);
+		h = (int *)buf->data;
+		h[0] = INDEX_MAGIC;
+		h[1] = INDEX_VERSION;
+		h[2] = xref->file_size;
+		h[3] = xref->version;
+		h[4] = xref->startxref;
+		h[5] = xref->repaired;
+		h[6] = xref->len;
+		h[7] = nfix;
+		h[8] = tlen;
+
+		e = h + HEADER_LEN;
+		for (i = 0; i < xref->len; i++, e += ENTRY_LEN)
+		{
+			x = &xref->table[i];
+			e[0] = x->type;
+			e[1] = x->ofs;
+			e[2] = x->gen;
+			e[3] = x->stm_ofs;
+		}
+
+		for (i = 0; i < xref->len; i++)
+		{
+			x = &xref->table[i];
+			if (!x->dirty)
+				continue;
+			e[0] = i;
+			e[1] = x->gen;
+			e[2] = fz_to_int(fz_dict_gets(x->obj, "Length"));
+			e += FIX_LEN;
+		}
+
+		fz_sprint_obj((char *)buf->data + size, tlen + 1, xref->trailer, 1);
+		buf->len = size + tlen;
+
+		fz_save_disk_cache_buffer(ctx, key, buf);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_buffer(ctx, buf);
+	}
+	fz_catch(ctx)
+	{
+		fz_warn(ctx, "cannot save xref index");
+	}
+}
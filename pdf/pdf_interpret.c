@@ -6,6 +6,7 @@
 typedef struct pdf_material_s pdf_material;
 typedef struct pdf_gstate_s pdf_gstate;
 typedef struct pdf_csi_s pdf_csi;
+typedef struct pdf_op_s pdf_op;
 
 enum
 {
@@ -104,7 +105,46 @@ struct pdf_csi_s
 	fz_cookie *cookie;
 };
 
+/*
+ * Form XObjects are drawn from a compiled copy of their content
+ * stream: the tokens are lexed once, with numbers converted, operators
+ * looked up and arrays and dictionaries parsed, so that drawing the
+ * same form again only has to run the operators.
+ */
+
+enum
+{
+	PDF_OP_NUMBER,
+	PDF_OP_NAME,
+	PDF_OP_STRING,
+	PDF_OP_OBJ,
+	PDF_OP_KEYWORD,
+	PDF_OP_SHOW_SPACE,	/* number in a TJ array in a text object */
+	PDF_OP_SHOW_STRING,	/* string in a TJ array in a text object */
+	PDF_OP_ARRAY_KEYWORD,	/* ignored keyword in a TJ array */
+};
+
+struct pdf_op_s
+{
+	int type;
+	int key;
+	float f;
+	int ofs, len;	/* text of names, strings and keywords */
+	fz_obj *obj;
+};
+
+struct pdf_compiled_stream_s
+{
+	fz_storable storable;
+	int failed;	/* run the content stream itself */
+	int len, cap;
+	pdf_op *ops;
+	int text_len, text_cap;
+	char *text;
+};
+
 static void pdf_run_buffer(pdf_csi *csi, fz_obj *rdb, fz_buffer *contents);
+static void pdf_run_xobject_contents(pdf_csi *csi, fz_obj *rdb, pdf_xobject *xobj);
 static void pdf_run_xobject(pdf_csi *csi, fz_obj *resources, pdf_xobject *xobj, fz_matrix transform);
 static void pdf_show_pattern(pdf_csi *csi, pdf_pattern *pat, fz_rect area, int what);
 
@@ -362,7 +402,7 @@ pdf_show_shade(pdf_csi *csi, fz_shade *shd)
 }
 
 static void
-pdf_show_image(pdf_csi *csi, fz_pixmap *image)
+pdf_show_image(pdf_csi *csi, fz_image *image)
 {
 	pdf_gstate *gstate = csi->gstate + csi->gtop;
 	fz_matrix image_ctm;
@@ -387,7 +427,7 @@ pdf_show_image(pdf_csi *csi, fz_pixmap *image)
 	else
 		pdf_begin_group(csi, bbox);
 
-	if (!image->colorspace)
+	if (image->imagemask)
 	{
 
 		switch (gstate->fill.kind)
@@ -1409,7 +1449,7 @@ pdf_run_xobject(pdf_csi *csi, fz_obj *resources, pdf_xobject *xobj, fz_matrix tr
 		if (xobj->resources)
 			resources = xobj->resources;
 
-		pdf_run_buffer(csi, resources, xobj->contents);
+		pdf_run_xobject_contents(csi, resources, xobj);
 		/* RJW: "cannot interpret XObject stream" */
 	}
 	fz_always(ctx)
@@ -1621,13 +1661,11 @@ static void pdf_run_BDC(pdf_csi *csi, fz_obj *rdb)
 		csi->in_hidden_ocg++;
 }
 
-static void pdf_run_BI(pdf_csi *csi, fz_obj *rdb, fz_stream *file)
+static void pdf_run_BI(pdf_csi *csi, fz_obj *rdb, fz_stream *file, char *buf, int buflen)
 {
 	fz_context *ctx = csi->dev->ctx;
 	int ch;
-	char *buf = csi->xref->scratch;
-	int buflen = sizeof(csi->xref->scratch);
-	fz_pixmap *img;
+	fz_image *img;
 	fz_obj *obj;
 
 	obj = pdf_parse_dict(csi->xref, file, buf, buflen);
@@ -1645,7 +1683,7 @@ static void pdf_run_BI(pdf_csi *csi, fz_obj *rdb, fz_stream *file)
 
 	pdf_show_image(csi, img);
 
-	fz_drop_pixmap(ctx, img);
+	fz_drop_image(ctx, img);
 
 	/* find EI */
 	ch = fz_read_byte(file);
@@ -1798,7 +1836,7 @@ static void pdf_run_Do(pdf_csi *csi, fz_obj *rdb)
 	{
 		if ((csi->dev->hints & FZ_IGNORE_IMAGE) == 0)
 		{
-			fz_pixmap *img;
+			fz_image *img;
 			img = pdf_load_image(csi->xref, obj);
 			/* RJW: "cannot load image (%d %d R)", fz_to_num(obj), fz_to_gen(obj) */
 			fz_try(ctx)
@@ -1807,10 +1845,10 @@ static void pdf_run_Do(pdf_csi *csi, fz_obj *rdb)
 			}
 			fz_catch(ctx)
 			{
-				fz_drop_pixmap(ctx, img);
+				fz_drop_image(ctx, img);
 				fz_rethrow(ctx);
 			}
-			fz_drop_pixmap(ctx, img);
+			fz_drop_image(ctx, img);
 		}
 	}
 
@@ -2383,10 +2421,9 @@ static void pdf_run_dquote(pdf_csi *csi)
 #define B(a,b) (a | b << 8)
 #define C(a,b,c) (a | b << 8 | c << 16)
 
-static void
-pdf_run_keyword(pdf_csi *csi, fz_obj *rdb, fz_stream *file, char *buf)
+static int
+pdf_keyword_code(char *buf)
 {
-	fz_context *ctx = csi->dev->ctx;
 	int key;
 
 	key = buf[0];
@@ -2401,6 +2438,14 @@ pdf_run_keyword(pdf_csi *csi, fz_obj *rdb, fz_stream *file, char *buf)
 		}
 	}
 
+	return key;
+}
+
+static void
+pdf_run_keyword(pdf_csi *csi, fz_obj *rdb, int key, fz_stream *file, char *buf, int buflen)
+{
+	fz_context *ctx = csi->dev->ctx;
+
 	switch (key)
 	{
 	case A('"'): pdf_run_dquote(csi); break;
@@ -2409,7 +2454,7 @@ pdf_run_keyword(pdf_csi *csi, fz_obj *rdb, fz_stream *file, char *buf)
 	case B('B','*'): pdf_run_Bstar(csi); break;
 	case C('B','D','C'): pdf_run_BDC(csi, rdb); break;
 	case B('B','I'):
-		pdf_run_BI(csi, rdb, file);
+		pdf_run_BI(csi, rdb, file, buf, buflen);
 		/* RJW: "cannot draw inline image" */
 		break;
 	case C('B','M','C'): pdf_run_BMC(csi); break;
@@ -2631,7 +2676,7 @@ pdf_run_stream(pdf_csi *csi, fz_obj *rdb, fz_stream *file, char *buf, int buflen
 			break;
 
 		case PDF_TOK_KEYWORD:
-			pdf_run_keyword(csi, rdb, file, buf);
+			pdf_run_keyword(csi, rdb, pdf_keyword_code(buf), file, buf, buflen);
 			/* RJW: "cannot run keyword" */
 			pdf_clear_stack(csi);
 			break;
@@ -2642,6 +2687,338 @@ pdf_run_stream(pdf_csi *csi, fz_obj *rdb, fz_stream *file, char *buf, int buflen
 	}
 }
 
+/*
+ * Compiled content streams
+ */
+
+void
+pdf_free_compiled_stream_imp(fz_context *ctx, fz_storable *prog_)
+{
+	pdf_compiled_stream *prog = (pdf_compiled_stream *)prog_;
+	int i;
+
+	for (i = 0; i < prog->len; i++)
+		if (prog->ops[i].obj)
+			fz_drop_obj(prog->ops[i].obj);
+	fz_free(ctx, prog->ops);
+	fz_free(ctx, prog->text);
+	fz_free(ctx, prog);
+}
+
+static void
+pdf_drop_compiled_stream(fz_context *ctx, pdf_compiled_stream *prog)
+{
+	fz_drop_storable(ctx, &prog->storable);
+}
+
+static unsigned int
+pdf_compiled_stream_size(pdf_compiled_stream *prog)
+{
+	return sizeof(*prog) + prog->cap * sizeof(pdf_op) + prog->text_cap;
+}
+
+static pdf_op *
+pdf_add_op(fz_context *ctx, pdf_compiled_stream *prog, int type)
+{
+	pdf_op *op;
+
+	if (prog->len == prog->cap)
+	{
+		int cap = prog->cap ? prog->cap * 2 : 64;
+		prog->ops = fz_resize_array(ctx, prog->ops, cap, sizeof(pdf_op));
+		prog->cap = cap;
+	}
+	op = &prog->ops[prog->len++];
+	memset(op, 0, sizeof *op);
+	op->type = type;
+	return op;
+}
+
+/* Keep a copy of the text of a token, zero terminated. */
+static void
+pdf_add_op_text(fz_context *ctx, pdf_compiled_stream *prog, pdf_op *op, char *buf, int len)
+{
+	if (prog->text_len + len + 1 > prog->text_cap)
+	{
+		int cap = MAX(prog->text_cap * 2, prog->text_len + len + 1);
+		prog->text = fz_resize_array(ctx, prog->text, cap, 1);
+		prog->text_cap = cap;
+	}
+	op->ofs = prog->text_len;
+	op->len = len;
+	memcpy(prog->text + prog->text_len, buf, len);
+	prog->text[prog->text_len + len] = 0;
+	prog->text_len += len + 1;
+}
+
+/* Follows pdf_run_stream, except that nothing is run. Returns 0 for
+ * streams with syntax errors, so that running them gives the same
+ * warnings as ever, and for streams with inline images, which are read
+ * by their operator. */
+static int
+pdf_compile_tokens(pdf_document *xref, pdf_compiled_stream *prog, fz_stream *file, char *buf, int buflen)
+{
+	fz_context *ctx = xref->ctx;
+	int tok, len, key, in_array, in_text;
+	pdf_op *op;
+
+	in_array = 0;
+	in_text = 0;
+
+	while (1)
+	{
+		tok = pdf_lex(file, buf, buflen, &len);
+
+		if (in_array)
+		{
+			if (tok == PDF_TOK_CLOSE_ARRAY)
+			{
+				in_array = 0;
+			}
+			else if (tok == PDF_TOK_INT || tok == PDF_TOK_REAL)
+			{
+				op = pdf_add_op(ctx, prog, PDF_OP_SHOW_SPACE);
+				op->f = fz_atof(buf);
+			}
+			else if (tok == PDF_TOK_STRING)
+			{
+				op = pdf_add_op(ctx, prog, PDF_OP_SHOW_STRING);
+				pdf_add_op_text(ctx, prog, op, buf, len);
+			}
+			else if (tok == PDF_TOK_KEYWORD)
+			{
+				if (!strcmp(buf, "Tw") || !strcmp(buf, "Tc"))
+				{
+					op = pdf_add_op(ctx, prog, PDF_OP_ARRAY_KEYWORD);
+					pdf_add_op_text(ctx, prog, op, buf, len);
+				}
+				else
+					return 0;
+			}
+			else if (tok == PDF_TOK_EOF)
+				return 1;
+			else
+				return 0;
+		}
+
+		else switch (tok)
+		{
+		case PDF_TOK_ENDSTREAM:
+		case PDF_TOK_EOF:
+			return 1;
+
+		case PDF_TOK_OPEN_ARRAY:
+			if (!in_text)
+			{
+				op = pdf_add_op(ctx, prog, PDF_OP_OBJ);
+				op->obj = pdf_parse_array(xref, file, buf, buflen);
+			}
+			else
+			{
+				in_array = 1;
+			}
+			break;
+
+		case PDF_TOK_OPEN_DICT:
+			op = pdf_add_op(ctx, prog, PDF_OP_OBJ);
+			op->obj = pdf_parse_dict(xref, file, buf, buflen);
+			break;
+
+		case PDF_TOK_NAME:
+			op = pdf_add_op(ctx, prog, PDF_OP_NAME);
+			pdf_add_op_text(ctx, prog, op, buf, len);
+			break;
+
+		case PDF_TOK_INT:
+			op = pdf_add_op(ctx, prog, PDF_OP_NUMBER);
+			op->f = atoi(buf);
+			break;
+
+		case PDF_TOK_REAL:
+			op = pdf_add_op(ctx, prog, PDF_OP_NUMBER);
+			op->f = fz_atof(buf);
+			break;
+
+		case PDF_TOK_STRING:
+			if (len <= sizeof(((pdf_csi *)0)->string))
+			{
+				op = pdf_add_op(ctx, prog, PDF_OP_STRING);
+				pdf_add_op_text(ctx, prog, op, buf, len);
+			}
+			else
+			{
+				op = pdf_add_op(ctx, prog, PDF_OP_OBJ);
+				op->obj = fz_new_string(ctx, buf, len);
+			}
+			break;
+
+		case PDF_TOK_KEYWORD:
+			key = pdf_keyword_code(buf);
+			if (key == B('B','I'))
+				return 0;
+			if (key == B('B','T'))
+				in_text = 1;
+			if (key == B('E','T'))
+				in_text = 0;
+			op = pdf_add_op(ctx, prog, PDF_OP_KEYWORD);
+			op->key = key;
+			pdf_add_op_text(ctx, prog, op, buf, len);
+			break;
+
+		default:
+			return 0;
+		}
+	}
+}
+
+/* A stream that can not be compiled is marked as failed, and is run
+ * from its contents instead. */
+static pdf_compiled_stream *
+pdf_compile_stream(pdf_document *xref, fz_buffer *contents)
+{
+	fz_context *ctx = xref->ctx;
+	pdf_compiled_stream *prog;
+	int len = sizeof xref->scratch;
+	char *buf = NULL;
+	fz_stream *file = NULL;
+
+	fz_var(buf);
+	fz_var(file);
+
+	prog = fz_malloc_struct(ctx, pdf_compiled_stream);
+	FZ_INIT_STORABLE(prog, 1, pdf_free_compiled_stream_imp);
+
+	fz_try(ctx)
+	{
+		buf = fz_malloc(ctx, len);
+		file = fz_open_buffer(ctx, contents);
+		if (!pdf_compile_tokens(xref, prog, file, buf, len))
+			prog->failed = 1;
+	}
+	fz_always(ctx)
+	{
+		fz_close(file);
+		fz_free(ctx, buf);
+	}
+	fz_catch(ctx)
+	{
+		prog->failed = 1;
+	}
+
+	return prog;
+}
+
+static void
+pdf_run_compiled_stream(pdf_csi *csi, fz_obj *rdb, pdf_compiled_stream *prog)
+{
+	fz_context *ctx = csi->dev->ctx;
+	pdf_gstate *gstate;
+	pdf_op *op;
+	int i;
+
+	pdf_clear_stack(csi);
+
+	if (csi->cookie)
+	{
+		csi->cookie->progress_max = -1;
+		csi->cookie->progress = 0;
+	}
+
+	for (i = 0; i < prog->len; i++)
+	{
+		if (csi->top == nelem(csi->stack) - 1)
+			fz_throw(ctx, "stack overflow");
+
+		if (csi->cookie)
+		{
+			if (csi->cookie->abort)
+				break;
+			csi->cookie->progress++;
+		}
+
+		op = &prog->ops[i];
+		switch (op->type)
+		{
+		case PDF_OP_NUMBER:
+			csi->stack[csi->top] = op->f;
+			csi->top ++;
+			break;
+
+		case PDF_OP_NAME:
+			fz_strlcpy(csi->name, prog->text + op->ofs, sizeof(csi->name));
+			break;
+
+		case PDF_OP_STRING:
+			memcpy(csi->string, prog->text + op->ofs, op->len);
+			csi->string_len = op->len;
+			break;
+
+		case PDF_OP_OBJ:
+			if (csi->obj)
+				fz_drop_obj(csi->obj);
+			csi->obj = fz_keep_obj(op->obj);
+			break;
+
+		case PDF_OP_KEYWORD:
+			pdf_run_keyword(csi, rdb, op->key, NULL, prog->text + op->ofs, op->len + 1);
+			pdf_clear_stack(csi);
+			break;
+
+		case PDF_OP_SHOW_SPACE:
+			gstate = csi->gstate + csi->gtop;
+			pdf_show_space(csi, -op->f * gstate->size * 0.001f);
+			break;
+
+		case PDF_OP_SHOW_STRING:
+			pdf_show_string(csi, (unsigned char *)prog->text + op->ofs, op->len);
+			break;
+
+		case PDF_OP_ARRAY_KEYWORD:
+			fz_warn(ctx, "ignoring keyword '%s' inside array", prog->text + op->ofs);
+			break;
+		}
+	}
+}
+
+/* Run the contents of a form, compiling them the first time. */
+static void
+pdf_run_xobject_contents(pdf_csi *csi, fz_obj *rdb, pdf_xobject *xobj)
+{
+	fz_context *ctx = csi->dev->ctx;
+	pdf_compiled_stream *prog;
+	int save_in_text;
+
+	if (xobj->contents == NULL)
+		return;
+
+	prog = fz_find_item(ctx, pdf_free_compiled_stream_imp, xobj->me);
+	if (!prog)
+	{
+		prog = pdf_compile_stream(csi->xref, xobj->contents);
+		fz_store_item(ctx, xobj->me, prog, pdf_compiled_stream_size(prog));
+	}
+
+	if (prog->failed)
+	{
+		pdf_drop_compiled_stream(ctx, prog);
+		pdf_run_buffer(csi, rdb, xobj->contents);
+		return;
+	}
+
+	save_in_text = csi->in_text;
+	csi->in_text = 0;
+	fz_try(ctx)
+	{
+		pdf_run_compiled_stream(csi, rdb, prog);
+	}
+	fz_catch(ctx)
+	{
+		fz_warn(ctx, "Content stream parsing error - rendering truncated");
+	}
+	csi->in_text = save_in_text;
+	pdf_drop_compiled_stream(ctx, prog);
+}
+
 /*
  * Entry points
  */
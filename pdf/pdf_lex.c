@@ -23,16 +23,33 @@
 #define RANGE_A_F \
 	'A':case'B':case'C':case'D':case'E':case'F'
 
-static inline int iswhite(int ch)
+/*
+ * Character classes, so that runs of white space and of name, keyword
+ * and number characters can be scanned straight out of the stream
+ * buffer. The byte at a time code below only sees the characters
+ * that end a run, and those at the ends of the buffer.
+ */
+
+enum
 {
-	return
-		ch == '\000' ||
-		ch == '\011' ||
-		ch == '\012' ||
-		ch == '\014' ||
-		ch == '\015' ||
-		ch == '\040';
-}
+	LEX_WHITE = 1,
+	LEX_DELIM = 2,
+	LEX_HASH = 4,
+	LEX_DIGIT = 8,
+	LEX_NAME_END = LEX_WHITE | LEX_DELIM | LEX_HASH
+};
+
+static const unsigned char lex_class[256] =
+{
+	1,0,0,0,0,0,0,0,0,1,1,0,1,1,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	1,0,0,4,0,2,0,0,2,2,0,0,0,0,0,2,
+	8,8,8,8,8,8,8,8,8,8,0,0,2,0,2,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,2,0,2,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,2,0,2,0,0,
+};
 
 static inline int unhex(int ch)
 {
@@ -45,21 +62,54 @@ static inline int unhex(int ch)
 static void
 lex_white(fz_stream *f)
 {
-	int c;
-	do {
-		c = fz_read_byte(f);
-	} while ((c <= 32) && (iswhite(c)));
-	if (c != EOF)
-		fz_unread_byte(f);
+	unsigned char *p;
+
+	do
+	{
+		for (p = f->rp; p < f->wp && (lex_class[*p] & LEX_WHITE); p++)
+			;
+		f->rp = p;
+		if (p < f->wp)
+			return;
+	}
+	while (fz_peek_byte(f) != EOF);
 }
 
 static void
 lex_comment(fz_stream *f)
 {
-	int c;
-	do {
-		c = fz_read_byte(f);
-	} while ((c != '\012') && (c != '\015') && (c != EOF));
+	unsigned char *p;
+
+	do
+	{
+		for (p = f->rp; p < f->wp; p++)
+		{
+			if (*p == '\012' || *p == '\015')
+			{
+				f->rp = p + 1;
+				return;
+			}
+		}
+		f->rp = p;
+	}
+	while (fz_peek_byte(f) != EOF);
+}
+
+/* Copy a run of digits from the stream buffer, leaving room for the
+ * terminating zero. */
+static inline char *
+lex_digits(fz_stream *f, char *s, int *n)
+{
+	unsigned char *p = f->rp;
+	unsigned char *e = f->wp;
+
+	if (e - p > *n - 1)
+		e = p + *n - 1;
+	while (p < e && (lex_class[*p] & LEX_DIGIT))
+		*s++ = *p++;
+	*n -= p - f->rp;
+	f->rp = p;
+	return s;
 }
 
 static int
@@ -97,7 +147,11 @@ lex_number(fz_stream *f, char *s, int n, int *tok)
 loop_after_sign:
 	while (n > 1)
 	{
-		int c = fz_read_byte(f);
+		int c;
+		s = lex_digits(f, s, &n);
+		if (n <= 1)
+			break;
+		c = fz_read_byte(f);
 		switch (c)
 		{
 		case '.':
@@ -121,7 +175,11 @@ loop_after_sign:
 loop_after_dot:
 	while (n > 1)
 	{
-		int c = fz_read_byte(f);
+		int c;
+		s = lex_digits(f, s, &n);
+		if (n <= 1)
+			break;
+		c = fz_read_byte(f);
 		switch (c)
 		{
 		case RANGE_0_9:
@@ -144,9 +202,24 @@ end:
 static void
 lex_name(fz_stream *f, char *s, int n)
 {
+	unsigned char *p, *e;
+
 	while (n > 1)
 	{
-		int c = fz_read_byte(f);
+		int c;
+
+		p = f->rp;
+		e = f->wp;
+		if (e - p > n - 1)
+			e = p + n - 1;
+		while (p < e && !(lex_class[*p] & LEX_NAME_END))
+			*s++ = *p++;
+		n -= p - f->rp;
+		f->rp = p;
+		if (n <= 1)
+			break;
+
+		c = fz_read_byte(f);
 		switch (c)
 		{
 		case IS_WHITE:
@@ -221,6 +294,17 @@ lex_string(fz_stream *f, char *buf, int n)
 
 	while (s < e)
 	{
+		unsigned char *p = f->rp;
+		unsigned char *q = f->wp;
+
+		if (q - p > e - s)
+			q = p + (e - s);
+		while (p < q && *p != '(' && *p != ')' && *p != '\\')
+			*s++ = *p++;
+		f->rp = p;
+		if (s == e)
+			break;
+
 		c = fz_read_byte(f);
 		switch (c)
 		{
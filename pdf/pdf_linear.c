@@ -0,0 +1,299 @@
+#include "fitz.h"
+#include "mupdf.h"
+
+/*
+ * Linearized files
+ *
+ * The page offset hint table tells us where the objects of each page
+ * live, so that a page can be shown without reading the main xref or
+ * walking the page tree.
+ */
+
+static fz_obj *
+pdf_parse_obj_at(pdf_document *xref, int ofs, int *num, int *gen, int *stm_ofs)
+{
+	fz_context *ctx = xref->ctx;
+	fz_stream *stm = NULL;
+	fz_obj *obj = NULL;
+	char *buf = NULL;
+	int cap = sizeof xref->scratch;
+
+	fz_var(stm);
+	fz_var(buf);
+
+	fz_try(ctx)
+	{
+		buf = fz_malloc(ctx, cap);
+		stm = fz_reopen_stream(ctx, xref->file, ofs);
+		obj = pdf_parse_ind_obj(xref, stm, buf, cap, num, gen, stm_ofs);
+	}
+	fz_always(ctx)
+	{
+		fz_close(stm);
+		fz_free(ctx, buf);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+
+	return obj;
+}
+
+/* Offsets in hint tables are given as if the hint stream were absent */
+static int
+pdf_hint_offset(pdf_document *xref, int ofs)
+{
+	if (ofs >= xref->linear_hint_ofs)
+		ofs += xref->linear_hint_len;
+	return ofs;
+}
+
+void
+pdf_load_hints(pdf_document *xref)
+{
+	fz_context *ctx = xref->ctx;
+	fz_stream *stm = NULL;
+	fz_obj *dict = NULL;
+	fz_obj *obj;
+	pdf_hint_page *pages = NULL;
+	int n = xref->linear_page_count;
+	int least_count, least_len, count_bits, len_bits;
+	int num, gen, stm_ofs;
+	int i, ofs;
+
+	if (xref->hints_loaded || n <= 0)
+		return;
+	xref->hints_loaded = -1;
+
+	fz_var(stm);
+	fz_var(dict);
+	fz_var(pages);
+
+	fz_try(ctx)
+	{
+		dict = pdf_parse_obj_at(xref, xref->linear_hint_ofs, &num, &gen, &stm_ofs);
+		if (!stm_ofs)
+			fz_throw(ctx, "hint stream is not a stream");
+		stm = pdf_open_stream_with_offset(xref, num, gen, dict, stm_ofs);
+
+		/* Page offset hint table header; we only need the object
+		 * counts and page lengths. */
+		least_count = fz_read_bits(stm, 32);
+		ofs = fz_read_bits(stm, 32);
+		count_bits = fz_read_bits(stm, 16);
+		least_len = fz_read_bits(stm, 32);
+		len_bits = fz_read_bits(stm, 16);
+		fz_read_bits(stm, 32);
+		fz_read_bits(stm, 16);
+		fz_read_bits(stm, 32);
+		fz_read_bits(stm, 16);
+		fz_read_bits(stm, 16);
+		fz_read_bits(stm, 16);
+		fz_read_bits(stm, 16);
+		fz_read_bits(stm, 16);
+		if (count_bits > 32 || len_bits > 32)
+			fz_throw(ctx, "corrupt page offset hint table");
+
+		pages = fz_malloc_array(ctx, n, sizeof(pdf_hint_page));
+		for (i = 0; i < n; i++)
+			pages[i].count = least_count + fz_read_bits(stm, count_bits);
+		fz_sync_bits(stm);
+		for (i = 0; i < n; i++)
+			pages[i].len = least_len + fz_read_bits(stm, len_bits);
+		/* The shared object hint table always follows */
+		if (fz_is_eof_bits(stm))
+			fz_throw(ctx, "truncated page offset hint table");
+
+		for (i = 0; i < n; i++)
+		{
+			pages[i].ofs = pdf_hint_offset(xref, ofs);
+			ofs += pages[i].len;
+			if (pages[i].count < 1 || pages[i].len < 1 || pages[i].ofs <= 0 ||
+				pages[i].ofs + pages[i].len > xref->file_size)
+				fz_throw(ctx, "page %d out of range in page offset hint table", i + 1);
+		}
+
+		/* The page object comes first and the objects of each page
+		 * are numbered consecutively; the first page is numbered
+		 * apart from the rest. */
+		pages[0].num = xref->linear_page1;
+		if (n > 1)
+		{
+			obj = pdf_parse_obj_at(xref, pages[1].ofs, &pages[1].num, &gen, &stm_ofs);
+			fz_drop_obj(obj);
+		}
+		for (i = 2; i < n; i++)
+			pages[i].num = pages[i - 1].num + pages[i - 1].count;
+	}
+	fz_always(ctx)
+	{
+		fz_close(stm);
+		fz_drop_obj(dict);
+	}
+	fz_catch(ctx)
+	{
+		fz_free(ctx, pages);
+		fz_warn(ctx, "ignoring broken hint tables");
+		return;
+	}
+
+	xref->hint_pages = pages;
+	xref->hints_loaded = 1;
+}
+
+/* Find the objects of a page so that they can be loaded before the main
+ * xref has been read. Object headers are only looked for between
+ * objects, never inside streams. */
+static void
+pdf_scan_hint_page(pdf_document *xref, pdf_hint_page *page)
+{
+	fz_context *ctx = xref->ctx;
+	fz_stream *stm = NULL;
+	char *buf = NULL;
+	int cap = sizeof xref->scratch;
+	int end = page->ofs + page->len;
+	int num = -1, gen = -1, numofs = 0, genofs = 0;
+	int tok, ofs, len, c;
+
+	fz_var(stm);
+	fz_var(buf);
+
+	fz_try(ctx)
+	{
+		buf = fz_malloc(ctx, cap);
+		stm = fz_reopen_stream(ctx, xref->file, page->ofs);
+		while ((ofs = fz_tell(stm)) < end)
+		{
+			tok = pdf_lex(stm, buf, cap, &len);
+			if (tok == PDF_TOK_INT)
+			{
+				num = gen;
+				numofs = genofs;
+				gen = atoi(buf);
+				genofs = ofs;
+				continue;
+			}
+			if (tok == PDF_TOK_OBJ && num >= page->num && num < page->num + page->count &&
+				num < xref->len && xref->table[num].type == 0)
+			{
+				xref->table[num].type = 'n';
+				xref->table[num].ofs = numofs;
+				xref->table[num].gen = gen;
+			}
+			else if (tok == PDF_TOK_STREAM)
+			{
+				len = fz_read(stm, (unsigned char *)buf, 9);
+				while (len == 9 && memcmp(buf, "endstream", 9) != 0)
+				{
+					c = fz_read_byte(stm);
+					if (c == EOF)
+						break;
+					memmove(buf, buf + 1, 8);
+					buf[8] = c;
+				}
+			}
+			else if (tok == PDF_TOK_EOF || tok == PDF_TOK_ERROR)
+				break;
+			num = gen = -1;
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_close(stm);
+		fz_free(ctx, buf);
+	}
+	fz_catch(ctx)
+	{
+		fz_warn(ctx, "cannot scan objects of linearized page");
+	}
+}
+
+/*
+	Returns an indirect reference to the page object of the given page,
+	found with the help of the linearization dictionary and hint tables,
+	or NULL if they cannot tell us.
+*/
+fz_obj *
+pdf_load_linear_page(pdf_document *xref, int number)
+{
+	fz_context *ctx = xref->ctx;
+	fz_obj *pageobj = NULL;
+	pdf_hint_page *page;
+	int num, ispage;
+
+	if (number < 0 || number >= xref->linear_page_count)
+		return NULL;
+
+	if (number == 0)
+	{
+		num = xref->linear_page1;
+		if (num <= 0 || num >= xref->len)
+			return NULL;
+	}
+	else
+	{
+		pdf_load_hints(xref);
+		if (xref->hints_loaded < 0)
+			return NULL;
+		page = &xref->hint_pages[number];
+		num = page->num;
+		if (num <= 0 || num >= xref->len)
+			return NULL;
+		if (xref->table[num].type == 0 && xref->main_xref)
+			pdf_scan_hint_page(xref, page);
+		/* Make sure the hint tables are describing this page */
+		if (xref->table[num].type != 'n' || xref->table[num].ofs < page->ofs ||
+			xref->table[num].ofs >= page->ofs + page->len)
+			return NULL;
+	}
+
+	fz_try(ctx)
+	{
+		pageobj = pdf_load_object(xref, num, xref->table[num].gen);
+	}
+	fz_catch(ctx)
+	{
+		fz_warn(ctx, "cannot load linearized page %d", number + 1);
+		return NULL;
+	}
+
+	ispage = fz_is_name(fz_dict_gets(pageobj, "Type")) &&
+		!strcmp(fz_to_name(fz_dict_gets(pageobj, "Type")), "Page");
+	fz_drop_obj(pageobj);
+	if (!ispage)
+		return NULL;
+
+	return fz_new_indirect(ctx, num, xref->table[num].gen, xref);
+}
+
+int
+pdf_find_linear_page_number(pdf_document *xref, int num)
+{
+	fz_obj *pageref;
+	int i;
+
+	if (xref->linear_page_count <= 0)
+		return -1;
+
+	if (num == xref->linear_page1)
+		return 0;
+
+	pdf_load_hints(xref);
+	if (xref->hints_loaded < 0)
+		return -1;
+
+	for (i = 1; i < xref->linear_page_count; i++)
+	{
+		if (xref->hint_pages[i].num == num)
+		{
+			pageref = pdf_load_linear_page(xref, i);
+			if (!pageref)
+				return -1;
+			fz_drop_obj(pageref);
+			return i;
+		}
+	}
+
+	return -1;
+}
@@ -27,6 +27,25 @@ put_marker_bool(fz_context *ctx, fz_obj *rdb, char *marker, int val)
 	fz_drop_obj(tmp);
 }
 
+static void
+pdf_get_inherited(fz_obj *node, struct info *info)
+{
+	fz_obj *obj;
+
+	obj = fz_dict_gets(node, "Resources");
+	if (obj)
+		info->resources = obj;
+	obj = fz_dict_gets(node, "MediaBox");
+	if (obj)
+		info->mediabox = obj;
+	obj = fz_dict_gets(node, "CropBox");
+	if (obj)
+		info->cropbox = obj;
+	obj = fz_dict_gets(node, "Rotate");
+	if (obj)
+		info->rotate = obj;
+}
+
 static void
 pdf_load_page_tree_node(pdf_document *xref, fz_obj *node, struct info info)
 {
@@ -46,18 +65,7 @@ pdf_load_page_tree_node(pdf_document *xref, fz_obj *node, struct info info)
 
 		if (fz_is_array(kids) && fz_is_int(count))
 		{
-			obj = fz_dict_gets(node, "Resources");
-			if (obj)
-				info.resources = obj;
-			obj = fz_dict_gets(node, "MediaBox");
-			if (obj)
-				info.mediabox = obj;
-			obj = fz_dict_gets(node, "CropBox");
-			if (obj)
-				info.cropbox = obj;
-			obj = fz_dict_gets(node, "Rotate");
-			if (obj)
-				info.rotate = obj;
+			pdf_get_inherited(node, &info);
 
 			n = fz_array_len(kids);
 			for (i = 0; i < n; i++)
@@ -98,7 +106,7 @@ pdf_load_page_tree_node(pdf_document *xref, fz_obj *node, struct info info)
 	fz_dict_unmark(node);
 }
 
-static void
+void
 pdf_load_page_tree(pdf_document *xref)
 {
 	fz_context *ctx = xref->ctx;
@@ -132,9 +140,201 @@ pdf_load_page_tree(pdf_document *xref)
 	pdf_load_page_tree_node(xref, pages, info);
 }
 
+/* Pages found without walking the page tree are left as they are in
+ * the object cache; their inherited attributes are looked up in their
+ * ancestors when the page is loaded. */
+static fz_obj *
+pdf_lookup_inherited_page_item(fz_obj *pageobj, char *key)
+{
+	fz_obj *node, *obj;
+	int sanity = 100; /* guard against cycles in the parent chain */
+
+	for (node = pageobj; node && --sanity; node = fz_dict_gets(node, "Parent"))
+	{
+		obj = fz_dict_gets(node, key);
+		if (obj)
+			return obj;
+	}
+	return NULL;
+}
+
+/*
+ * Finding a single page need not visit the whole page tree: the /Count
+ * of each node tells us which branch to descend. The nodes we pass
+ * through stay in the object cache for next time.
+ *
+ * The counts are checked against the kids of each node we pass through;
+ * if they do not add up, or lead nowhere, we fall back to loading the
+ * whole page tree, which does not rely on them.
+ */
+
+enum { MAX_PAGE_TREE_DEPTH = 64 };
+
+static int
+pdf_is_page_tree_node(fz_obj *node)
+{
+	return fz_is_array(fz_dict_gets(node, "Kids")) && fz_is_int(fz_dict_gets(node, "Count"));
+}
+
+/* Do the counts of the kids of a node add up to its own? */
+static int
+pdf_page_tree_node_adds_up(fz_obj *node)
+{
+	fz_obj *kids, *kid;
+	int i, n, count, total = 0;
+
+	kids = fz_dict_gets(node, "Kids");
+	n = fz_array_len(kids);
+	for (i = 0; i < n; i++)
+	{
+		kid = fz_array_get(kids, i);
+		if (pdf_is_page_tree_node(kid))
+		{
+			count = fz_to_int(fz_dict_gets(kid, "Count"));
+			if (count < 0 || count > INT_MAX - total)
+				return 0;
+			total += count;
+		}
+		else if (fz_is_dict(kid))
+			total++;
+	}
+	return total == fz_to_int(fz_dict_gets(node, "Count"));
+}
+
+/* Returns a new reference to the page, or NULL if the counts in the
+ * page tree lead us astray. */
+static fz_obj *
+pdf_lookup_page_in_tree(pdf_document *xref, int needle)
+{
+	fz_obj *node, *next, *kids, *kid;
+	int i, n, count, depth;
+
+	node = fz_dict_gets(fz_dict_gets(xref->trailer, "Root"), "Pages");
+	if (!pdf_is_page_tree_node(node))
+		return NULL;
+
+	for (depth = 0; depth < MAX_PAGE_TREE_DEPTH; depth++)
+	{
+		if (!pdf_page_tree_node_adds_up(node))
+			return NULL;
+
+		next = NULL;
+		kids = fz_dict_gets(node, "Kids");
+		n = fz_array_len(kids);
+		for (i = 0; i < n && !next; i++)
+		{
+			kid = fz_array_get(kids, i);
+			if (pdf_is_page_tree_node(kid))
+			{
+				count = fz_to_int(fz_dict_gets(kid, "Count"));
+				if (needle < count)
+					next = kid;
+				else
+					needle -= count;
+			}
+			else if (fz_is_dict(kid))
+			{
+				if (needle == 0)
+					return fz_keep_obj(kid);
+				needle--;
+			}
+		}
+		if (!next)
+			return NULL;
+		node = next;
+	}
+
+	return NULL;
+}
+
+/* Work out the number of a page by counting the pages before it on the
+ * way up to the root, or -1 if the page tree does not add up. */
+static int
+pdf_find_page_number_in_tree(pdf_document *xref, fz_obj *page)
+{
+	fz_obj *node, *parent, *kids, *kid, *root;
+	int i, n, depth, total = 0;
+
+	root = fz_dict_gets(fz_dict_gets(xref->trailer, "Root"), "Pages");
+	if (!fz_is_indirect(page) || !fz_is_dict(page) || pdf_is_page_tree_node(page))
+		return -1;
+
+	node = page;
+	for (depth = 0; depth < MAX_PAGE_TREE_DEPTH; depth++)
+	{
+		if (fz_to_num(node) == fz_to_num(root))
+			return total;
+
+		parent = fz_dict_gets(node, "Parent");
+		if (!fz_is_indirect(parent) || !pdf_is_page_tree_node(parent))
+			return -1;
+		if (!pdf_page_tree_node_adds_up(parent))
+			return -1;
+
+		kids = fz_dict_gets(parent, "Kids");
+		n = fz_array_len(kids);
+		for (i = 0; i < n; i++)
+		{
+			kid = fz_array_get(kids, i);
+			if (fz_to_num(kid) == fz_to_num(node))
+				break;
+			if (pdf_is_page_tree_node(kid))
+				total += fz_to_int(fz_dict_gets(kid, "Count"));
+			else if (fz_is_dict(kid))
+				total++;
+		}
+		if (i == n)
+			return -1;
+
+		node = parent;
+	}
+
+	return -1;
+}
+
+/* Returns a new reference to the page object of the given page */
+static fz_obj *
+pdf_lookup_page_ref(pdf_document *xref, int number)
+{
+	fz_context *ctx = xref->ctx;
+	fz_obj *pageref = NULL;
+
+	if (!xref->page_len)
+	{
+		/* Linearized files can tell us where a page is */
+		pageref = pdf_load_linear_page(xref, number);
+		if (pageref)
+			return pageref;
+
+		if (number >= 0 && number < pdf_count_pages(xref))
+			pageref = pdf_lookup_page_in_tree(xref, number);
+		if (pageref)
+			return pageref;
+	}
+
+	pdf_load_page_tree(xref);
+	if (number < 0 || number >= xref->page_len)
+		fz_throw(ctx, "cannot find page %d", number + 1);
+	return fz_keep_obj(xref->page_refs[number]);
+}
+
+/* The /Count of the root is trusted if its kids add up to it; deeper
+ * nodes are checked as pages are looked up. */
 int
 pdf_count_pages(pdf_document *xref)
 {
+	fz_obj *pages, *count;
+
+	if (!xref->page_len)
+	{
+		if (xref->linear_page_count)
+			return xref->linear_page_count;
+		pages = fz_dict_gets(fz_dict_gets(xref->trailer, "Root"), "Pages");
+		count = fz_dict_gets(pages, "Count");
+		if (fz_is_int(count) && fz_to_int(count) >= 0 && pdf_page_tree_node_adds_up(pages))
+			return fz_to_int(count);
+	}
+
 	pdf_load_page_tree(xref);
 	return xref->page_len;
 }
@@ -144,6 +344,15 @@ pdf_find_page_number(pdf_document *xref, fz_obj *page)
 {
 	int i, num = fz_to_num(page);
 
+	if (!xref->page_len)
+	{
+		i = pdf_find_linear_page_number(xref, num);
+		if (i < 0)
+			i = pdf_find_page_number_in_tree(xref, page);
+		if (i >= 0)
+			return i;
+	}
+
 	pdf_load_page_tree(xref);
 	for (i = 0; i < xref->page_len; i++)
 		if (num == fz_to_num(xref->page_refs[i]))
@@ -311,12 +520,10 @@ pdf_load_page(pdf_document *xref, int number)
 	fz_rect mediabox, cropbox, realbox;
 	fz_matrix ctm;
 
-	pdf_load_page_tree(xref);
-	if (number < 0 || number >= xref->page_len)
-		fz_throw(ctx, "cannot find page %d", number + 1);
+	pdf_trim_object_cache(xref);
 
-	pageobj = xref->page_objs[number];
-	pageref = xref->page_refs[number];
+	pageref = pdf_lookup_page_ref(xref, number);
+	pageobj = fz_resolve_indirect(pageref);
 
 	page = fz_malloc_struct(ctx, pdf_page);
 	page->resources = NULL;
@@ -325,7 +532,7 @@ pdf_load_page(pdf_document *xref, int number)
 	page->links = NULL;
 	page->annots = NULL;
 
-	mediabox = pdf_to_rect(ctx, fz_dict_gets(pageobj, "MediaBox"));
+	mediabox = pdf_to_rect(ctx, pdf_lookup_inherited_page_item(pageobj, "MediaBox"));
 	if (fz_is_empty_rect(mediabox))
 	{
 		fz_warn(ctx, "cannot find page size for page %d", number + 1);
@@ -335,7 +542,7 @@ pdf_load_page(pdf_document *xref, int number)
 		mediabox.y1 = 792;
 	}
 
-	cropbox = pdf_to_rect(ctx, fz_dict_gets(pageobj, "CropBox"));
+	cropbox = pdf_to_rect(ctx, pdf_lookup_inherited_page_item(pageobj, "CropBox"));
 	if (!fz_is_empty_rect(cropbox))
 		mediabox = fz_intersect_rect(mediabox, cropbox);
 
@@ -350,7 +557,7 @@ pdf_load_page(pdf_document *xref, int number)
 		page->mediabox = fz_unit_rect;
 	}
 
-	page->rotate = fz_to_int(fz_dict_gets(pageobj, "Rotate"));
+	page->rotate = fz_to_int(pdf_lookup_inherited_page_item(pageobj, "Rotate"));
 
 	ctm = fz_concat(fz_rotate(-page->rotate), fz_scale(1, -1));
 	realbox = fz_transform_rect(ctm, page->mediabox);
@@ -363,7 +570,7 @@ pdf_load_page(pdf_document *xref, int number)
 		page->annots = pdf_load_annots(xref, obj);
 	}
 
-	page->resources = fz_dict_gets(pageobj, "Resources");
+	page->resources = pdf_lookup_inherited_page_item(pageobj, "Resources");
 	if (page->resources)
 		fz_keep_obj(page->resources);
 
@@ -381,10 +588,13 @@ pdf_load_page(pdf_document *xref, int number)
 	}
 	fz_catch(ctx)
 	{
+		int num = fz_to_num(pageref);
 		pdf_free_page(xref, page);
-		fz_throw(ctx, "cannot load page %d contents (%d 0 R)", number + 1, fz_to_num(pageref));
+		fz_drop_obj(pageref);
+		fz_throw(ctx, "cannot load page %d contents (%d 0 R)", number + 1, num);
 	}
 
+	fz_drop_obj(pageref);
 	return page;
 }
 
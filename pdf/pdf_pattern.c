@@ -13,7 +13,7 @@ pdf_drop_pattern(fz_context *ctx, pdf_pattern *pat)
 	fz_drop_storable(ctx, &pat->storable);
 }
 
-static void
+void
 pdf_free_pattern_imp(fz_context *ctx, fz_storable *pat_)
 {
 	pdf_pattern *pat = (pdf_pattern *)pat_;
@@ -12,13 +12,183 @@ struct entry
 	int stm_len;
 };
 
+/*
+ * Rather than tokenizing the whole file, the raw bytes are searched for
+ * candidate "obj" keywords and dictionaries, and the lexer is only run
+ * on what is found. Objects are then parsed as before, which skips over
+ * their streams, so hits inside stream data are never looked at.
+ */
+
+enum { REPAIR_WINDOW = 65536 };
+
+/* How far back from an "obj" keyword its numbers may start */
+enum { REPAIR_BEHIND = 64 };
+
+struct window
+{
+	unsigned char *data;
+	int base;
+	int len;
+};
+
+static inline int iswhite(int ch)
+{
+	return
+		ch == '\000' || ch == '\011' || ch == '\012' ||
+		ch == '\014' || ch == '\015' || ch == '\040';
+}
+
+static inline int isdelim(int ch)
+{
+	return
+		ch == '(' || ch == ')' || ch == '<' || ch == '>' ||
+		ch == '[' || ch == ']' || ch == '{' || ch == '}' ||
+		ch == '/' || ch == '%';
+}
+
+static inline int isdec(int ch)
+{
+	return ch >= '0' && ch <= '9';
+}
+
+/* Check for "num gen obj" with the keyword at p */
+static int
+pdf_repair_header(struct window *win, unsigned char *p, int *num, int *gen, int *numofs)
+{
+	unsigned char *s = win->data;
+	unsigned char *q = p;
+	unsigned char *end;
+
+	while (q > s && iswhite(q[-1]))
+		q--;
+	end = q;
+	while (q > s && isdec(q[-1]))
+		q--;
+	if (q == end || q == s)
+		return 0;
+	*gen = atoi((char *)q);
+
+	end = q;
+	while (q > s && iswhite(q[-1]))
+		q--;
+	if (q == end)
+		return 0;
+	end = q;
+	while (q > s && isdec(q[-1]))
+		q--;
+	if (q == end)
+		return 0;
+	if (q == s ? win->base > 0 : !iswhite(q[-1]) && !isdelim(q[-1]))
+		return 0;
+	*num = atoi((char *)q);
+	*numofs = win->base + (q - s);
+	return 1;
+}
+
+/*
+	Find the next object header or dictionary at or after ofs. Returns
+	PDF_TOK_OBJ with the file positioned after the "obj" keyword,
+	PDF_TOK_OPEN_DICT with the file positioned after the "<<", or
+	PDF_TOK_EOF. The window is kept between calls, so that the file is
+	only read again once the scan has moved past it.
+*/
+static int
+pdf_repair_scan(fz_stream *file, struct window *win, int ofs, int *num, int *gen, int *numofs)
+{
+	unsigned char *s, *p, *o, *d, *e;
+
+	while (1)
+	{
+		/* Leave room to look at the byte after a keyword, unless
+		 * the window reaches the end of the file. */
+		s = win->data;
+		e = s + win->len;
+		if (win->len == REPAIR_WINDOW)
+			e -= 3;
+
+		if (ofs < win->base + (win->base > 0 ? REPAIR_BEHIND : 0) || ofs >= win->base + (e - s))
+		{
+			if (win->len > 0 && win->len < REPAIR_WINDOW && ofs >= win->base + win->len)
+				return PDF_TOK_EOF;
+			win->base = MAX(ofs - REPAIR_BEHIND, 0);
+			fz_seek(file, win->base, 0);
+			win->len = fz_read(file, s, REPAIR_WINDOW);
+			if (win->len < 0)
+				fz_throw(file->ctx, "cannot read from file");
+			if (win->len <= ofs - win->base)
+				return PDF_TOK_EOF;
+			continue;
+		}
+
+		p = s + (ofs - win->base);
+		o = memchr(p, 'o', e - p);
+		d = memchr(p, '<', e - p);
+		while (o || d)
+		{
+			if (o && (!d || o < d))
+			{
+				if (o + 3 <= s + win->len && o[1] == 'b' && o[2] == 'j' &&
+					(o + 3 == s + win->len || iswhite(o[3]) || isdelim(o[3])) &&
+					pdf_repair_header(win, o, num, gen, numofs))
+				{
+					fz_seek(file, win->base + (o - s) + 3, 0);
+					return PDF_TOK_OBJ;
+				}
+				o = memchr(o + 1, 'o', e - o - 1);
+			}
+			else
+			{
+				if (d + 1 < s + win->len && d[1] == '<')
+				{
+					fz_seek(file, win->base + (d - s) + 2, 0);
+					return PDF_TOK_OPEN_DICT;
+				}
+				d = memchr(d + 1, '<', e - d - 1);
+			}
+		}
+
+		ofs = win->base + (e - s);
+	}
+}
+
+/* Position the file after the next "endstream", or at the end of the file */
+static void
+pdf_repair_endstream(fz_stream *file, unsigned char *buf, int cap)
+{
+	unsigned char *p, *e;
+	int ofs, n;
+
+	ofs = fz_tell(file);
+	while (1)
+	{
+		n = fz_read(file, buf, cap);
+		if (n < 0)
+			fz_throw(file->ctx, "cannot read from file");
+		e = buf + n - 8;
+		for (p = buf; p < e; p++)
+		{
+			p = memchr(p, 'e', e - p);
+			if (!p)
+				break;
+			if (!memcmp(p, "endstream", 9))
+			{
+				fz_seek(file, ofs + (p - buf) + 9, 0);
+				return;
+			}
+		}
+		if (n < cap)
+			return;
+		ofs += n - 8;
+		fz_seek(file, ofs, 0);
+	}
+}
+
 static void
 pdf_repair_obj(fz_stream *file, char *buf, int cap, int *stmofsp, int *stmlenp, fz_obj **encrypt, fz_obj **id)
 {
 	int tok;
 	int stm_len;
 	int len;
-	int n;
 	fz_context *ctx = file->ctx;
 
 	*stmofsp = 0;
@@ -117,19 +287,7 @@ pdf_repair_obj(fz_stream *file, char *buf, int cap, int *stmofsp, int *stmlenp,
 			fz_seek(file, *stmofsp, 0);
 		}
 
-		n = fz_read(file, (unsigned char *) buf, 9);
-		if (n < 0)
-			fz_throw(ctx, "cannot read from file");
-
-		while (memcmp(buf, "endstream", 9) != 0)
-		{
-			c = fz_read_byte(file);
-			if (c == EOF)
-				break;
-			memmove(buf, buf + 1, 8);
-			buf[8] = c;
-		}
-
+		pdf_repair_endstream(file, (unsigned char *)buf, cap);
 		*stmlenp = fz_tell(file) - *stmofsp - 9;
 
 atobjend:
@@ -175,8 +333,11 @@ pdf_repair_obj_stm(pdf_document *xref, int num, int gen)
 			xref->table[n].ofs = num;
 			xref->table[n].gen = i;
 			xref->table[n].stm_ofs = 0;
+			if (xref->table[n].obj && !xref->table[n].dirty)
+				xref->obj_cache_count--;
 			fz_drop_obj(xref->table[n].obj);
 			xref->table[n].obj = NULL;
+			xref->table[n].dirty = 0;
 			xref->table[n].type = 'o';
 
 			tok = pdf_lex(stm, buf, sizeof buf, &n);
@@ -210,9 +371,10 @@ pdf_repair_xref(pdf_document *xref, char *buf, int bufsize)
 	int listcap;
 	int maxnum = 0;
 
+	struct window win = { NULL, 0, 0 };
 	int num = 0;
 	int gen = 0;
-	int tmpofs, numofs = 0, genofs = 0;
+	int ofs, numofs = 0;
 	int stm_len, stm_ofs = 0;
 	int tok;
 	int next;
@@ -224,6 +386,7 @@ pdf_repair_xref(pdf_document *xref, char *buf, int bufsize)
 	fz_var(root);
 	fz_var(info);
 	fz_var(list);
+	fz_var(win.data);
 
 	fz_seek(xref->file, 0, 0);
 
@@ -232,6 +395,7 @@ pdf_repair_xref(pdf_document *xref, char *buf, int bufsize)
 		listlen = 0;
 		listcap = 1024;
 		list = fz_malloc_array(ctx, listcap, sizeof(struct entry));
+		win.data = fz_malloc(ctx, REPAIR_WINDOW);
 
 		/* look for '%PDF' version marker within first kilobyte of file */
 		n = fz_read(xref->file, (unsigned char *)buf, MIN(bufsize, 1024));
@@ -255,15 +419,12 @@ pdf_repair_xref(pdf_document *xref, char *buf, int bufsize)
 			c = fz_read_byte(xref->file);
 		fz_unread_byte(xref->file);
 
+		ofs = fz_tell(xref->file);
 		while (1)
 		{
-			tmpofs = fz_tell(xref->file);
-			if (tmpofs < 0)
-				fz_throw(ctx, "cannot tell in file");
-
 			fz_try(ctx)
 			{
-				tok = pdf_lex(xref->file, buf, bufsize, &n);
+				tok = pdf_repair_scan(xref->file, &win, ofs, &num, &gen, &numofs);
 			}
 			fz_catch(ctx)
 			{
@@ -271,15 +432,7 @@ pdf_repair_xref(pdf_document *xref, char *buf, int bufsize)
 				break;
 			}
 
-			if (tok == PDF_TOK_INT)
-			{
-				numofs = genofs;
-				num = gen;
-				genofs = tmpofs;
-				gen = atoi(buf);
-			}
-
-			else if (tok == PDF_TOK_OBJ)
+			if (tok == PDF_TOK_OBJ)
 			{
 				fz_try(ctx)
 				{
@@ -316,19 +469,17 @@ pdf_repair_xref(pdf_document *xref, char *buf, int bufsize)
 			/* trailer dictionary */
 			else if (tok == PDF_TOK_OPEN_DICT)
 			{
+				ofs = fz_tell(xref->file);
 				fz_try(ctx)
 				{
 					dict = pdf_parse_dict(xref, xref->file, buf, bufsize);
 				}
 				fz_catch(ctx)
 				{
-					/* If we haven't seen a root yet, there is nothing
-					 * we can do, but give up. Otherwise, we'll make
-					 * do. */
-					if (!root)
-						fz_rethrow(ctx);
-					fz_warn(ctx, "cannot parse trailer dictionary - ignoring rest of file");
-					break;
+					/* The scan may find dictionaries in damaged data
+					 * between objects; carry on after this one. */
+					fz_warn(ctx, "ignoring broken trailer dictionary");
+					continue;
 				}
 
 				obj = fz_dict_gets(dict, "Encrypt");
@@ -366,16 +517,18 @@ pdf_repair_xref(pdf_document *xref, char *buf, int bufsize)
 				fz_drop_obj(dict);
 			}
 
-			else if (tok == PDF_TOK_ERROR)
-				fz_read_byte(xref->file);
-
 			else if (tok == PDF_TOK_EOF)
 				break;
+
+			ofs = fz_tell(xref->file);
 		}
 
 		/* make xref reasonable */
 
-		pdf_resize_xref(xref, maxnum + 1);
+		/* the table may already hold objects when a linearized
+		 * file's main xref is repaired; keep them */
+		if (maxnum + 1 > xref->len)
+			pdf_resize_xref(xref, maxnum + 1);
 
 		for (i = 0; i < listlen; i++)
 		{
@@ -396,6 +549,7 @@ pdf_repair_xref(pdf_document *xref, char *buf, int bufsize)
 				length = fz_new_int(ctx, list[i].stm_len);
 				fz_dict_puts(dict, "Length", length);
 				fz_drop_obj(length);
+				pdf_set_object_dirty(xref, list[i].num);
 
 				fz_drop_obj(dict);
 			}
@@ -406,7 +560,6 @@ pdf_repair_xref(pdf_document *xref, char *buf, int bufsize)
 		xref->table[0].ofs = 0;
 		xref->table[0].gen = 65535;
 		xref->table[0].stm_ofs = 0;
-		xref->table[0].obj = NULL;
 
 		next = 0;
 		for (i = xref->len - 1; i >= 0; i--)
@@ -466,6 +619,7 @@ pdf_repair_xref(pdf_document *xref, char *buf, int bufsize)
 		}
 
 		fz_free(ctx, list);
+		fz_free(ctx, win.data);
 	}
 	fz_catch(ctx)
 	{
@@ -474,6 +628,7 @@ pdf_repair_xref(pdf_document *xref, char *buf, int bufsize)
 		if (root) fz_drop_obj(root);
 		if (info) fz_drop_obj(info);
 		fz_free(ctx, list);
+		fz_free(ctx, win.data);
 		fz_rethrow(ctx);
 	}
 }
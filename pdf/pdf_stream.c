@@ -92,7 +92,7 @@ build_filter(fz_stream *chain, pdf_document * xref, fz_obj * f, fz_obj * p, int
 	else if (!strcmp(s, "DCTDecode") || !strcmp(s, "DCT"))
 	{
 		fz_obj *ct = fz_dict_gets(p, "ColorTransform");
-		return fz_open_dctd(chain, ct ? fz_to_int(ct) : -1);
+		return fz_open_dctd(chain, ct ? fz_to_int(ct) : -1, 0);
 	}
 
 	else if (!strcmp(s, "RunLengthDecode") || !strcmp(s, "RL"))
@@ -176,6 +176,7 @@ build_filter_chain(fz_stream *chain, pdf_document *xref, fz_obj *fs, fz_obj *ps,
  * Build a filter for reading raw stream data.
  * This is a null filter to constrain reading to the
  * stream length, followed by a decryption filter.
+ * The filter takes ownership of chain.
  */
 static fz_stream *
 pdf_open_raw_filter(fz_stream *chain, pdf_document *xref, fz_obj *stmobj, int num, int gen)
@@ -184,9 +185,6 @@ pdf_open_raw_filter(fz_stream *chain, pdf_document *xref, fz_obj *stmobj, int nu
 	int len;
 	fz_context *ctx = chain->ctx;
 
-	/* don't close chain when we close this filter */
-	fz_keep_stream(chain);
-
 	len = fz_to_int(fz_dict_gets(stmobj, "Length"));
 	chain = fz_open_null(chain, len);
 
@@ -225,7 +223,6 @@ pdf_open_filter(fz_stream *chain, pdf_document *xref, fz_obj *stmobj, int num, i
 	else if (fz_array_len(filters) > 0)
 		chain = build_filter_chain(chain, xref, filters, params, num, gen);
 
-	fz_lock_stream(chain);
 	return chain;
 }
 
@@ -255,7 +252,8 @@ pdf_open_inline_stream(pdf_document *xref, fz_obj *stmobj, int length, fz_stream
 
 /*
  * Open a stream for reading the raw (compressed but decrypted) data.
- * Using xref->file while this is open is a bad idea.
+ * Streams read from a reader of their own, so any number may be open
+ * at once alongside other use of the document.
  */
 fz_stream *
 pdf_open_raw_stream(pdf_document *xref, int num, int gen)
@@ -268,24 +266,20 @@ pdf_open_raw_stream(pdf_document *xref, int num, int gen)
 	if (num < 0 || num >= xref->len)
 		fz_throw(xref->ctx, "object id out of range (%d %d R)", num, gen);
 
-	x = xref->table + num;
-
 	pdf_cache_object(xref, num, gen);
 	/* RJW: "cannot load stream object (%d %d R)", num, gen */
 
+	x = xref->table + num;
+
 	if (x->stm_ofs == 0)
 		fz_throw(xref->ctx, "object is not a stream");
 
-	stm = pdf_open_raw_filter(xref->file, xref, x->obj, num, gen);
-	fz_lock_stream(stm);
-	fz_seek(xref->file, x->stm_ofs, 0);
-	return stm;
+	stm = fz_reopen_stream(xref->ctx, xref->file, x->stm_ofs);
+	return pdf_open_raw_filter(stm, xref, x->obj, num, gen);
 }
 
 /*
  * Open a stream for reading uncompressed data.
- * Put the opened file in xref->stream.
- * Using xref->file while a stream is open is a Bad idea.
  */
 fz_stream *
 pdf_open_stream(pdf_document *xref, int num, int gen)
@@ -296,17 +290,16 @@ pdf_open_stream(pdf_document *xref, int num, int gen)
 	if (num < 0 || num >= xref->len)
 		fz_throw(xref->ctx, "object id out of range (%d %d R)", num, gen);
 
-	x = xref->table + num;
-
 	pdf_cache_object(xref, num, gen);
 	/* RJW: "cannot load stream object (%d %d R)", num, gen */
 
+	x = xref->table + num;
+
 	if (x->stm_ofs == 0)
 		fz_throw(xref->ctx, "object is not a stream");
 
-	stm = pdf_open_filter(xref->file, xref, x->obj, num, gen);
-	fz_seek(xref->file, x->stm_ofs, 0);
-	return stm;
+	stm = fz_reopen_stream(xref->ctx, xref->file, x->stm_ofs);
+	return pdf_open_filter(stm, xref, x->obj, num, gen);
 }
 
 fz_stream *
@@ -317,9 +310,8 @@ pdf_open_stream_with_offset(pdf_document *xref, int num, int gen, fz_obj *dict,
 	if (stm_ofs == 0)
 		fz_throw(xref->ctx, "object is not a stream");
 
-	stm = pdf_open_filter(xref->file, xref, dict, num, gen);
-	fz_seek(xref->file, stm_ofs, 0);
-	return stm;
+	stm = fz_reopen_stream(xref->ctx, xref->file, stm_ofs);
+	return pdf_open_filter(stm, xref, dict, num, gen);
 }
 
 /*
@@ -350,6 +342,156 @@ pdf_load_raw_stream(pdf_document *xref, int num, int gen)
 	return buf;
 }
 
+/*
+ * Parse the parameters of an image decoding filter that we can run
+ * later, away from the document. Returns 0 for any other filter.
+ */
+static int
+build_compression_params(fz_obj *f, fz_obj *p, fz_compression_params *params)
+{
+	char *s = fz_to_name(f);
+
+	int predictor = fz_to_int(fz_dict_gets(p, "Predictor"));
+	int columns = fz_to_int(fz_dict_gets(p, "Columns"));
+	int colors = fz_to_int(fz_dict_gets(p, "Colors"));
+	int bpc = fz_to_int(fz_dict_gets(p, "BitsPerComponent"));
+
+	if (predictor == 0) predictor = 1;
+	if (columns == 0) columns = 1;
+	if (colors == 0) colors = 1;
+	if (bpc == 0) bpc = 8;
+
+	params->type = FZ_IMAGE_UNKNOWN;
+
+	if (!strcmp(s, "CCITTFaxDecode") || !strcmp(s, "CCF"))
+	{
+		fz_obj *k = fz_dict_gets(p, "K");
+		fz_obj *eol = fz_dict_gets(p, "EndOfLine");
+		fz_obj *eba = fz_dict_gets(p, "EncodedByteAlign");
+		fz_obj *columns = fz_dict_gets(p, "Columns");
+		fz_obj *rows = fz_dict_gets(p, "Rows");
+		fz_obj *eob = fz_dict_gets(p, "EndOfBlock");
+		fz_obj *bi1 = fz_dict_gets(p, "BlackIs1");
+
+		params->type = FZ_IMAGE_FAX;
+		params->u.fax.k = k ? fz_to_int(k) : 0;
+		params->u.fax.end_of_line = eol ? fz_to_bool(eol) : 0;
+		params->u.fax.encoded_byte_align = eba ? fz_to_bool(eba) : 0;
+		params->u.fax.columns = columns ? fz_to_int(columns) : 1728;
+		params->u.fax.rows = rows ? fz_to_int(rows) : 0;
+		params->u.fax.end_of_block = eob ? fz_to_bool(eob) : 1;
+		params->u.fax.black_is_1 = bi1 ? fz_to_bool(bi1) : 0;
+	}
+
+	else if (!strcmp(s, "DCTDecode") || !strcmp(s, "DCT"))
+	{
+		fz_obj *ct = fz_dict_gets(p, "ColorTransform");
+		params->type = FZ_IMAGE_DCT;
+		params->u.dct.color_transform = ct ? fz_to_int(ct) : -1;
+	}
+
+	else if (!strcmp(s, "RunLengthDecode") || !strcmp(s, "RL"))
+		params->type = FZ_IMAGE_RLD;
+
+	else if (!strcmp(s, "FlateDecode") || !strcmp(s, "Fl"))
+		params->type = FZ_IMAGE_FLATE;
+
+	else if (!strcmp(s, "LZWDecode") || !strcmp(s, "LZW"))
+	{
+		fz_obj *ec = fz_dict_gets(p, "EarlyChange");
+		params->type = FZ_IMAGE_LZW;
+		params->u.flate.early_change = ec ? fz_to_int(ec) : 1;
+	}
+
+	else if (!strcmp(s, "JPXDecode"))
+		params->type = FZ_IMAGE_JPX;
+
+	if (params->type == FZ_IMAGE_FLATE || params->type == FZ_IMAGE_LZW)
+	{
+		params->u.flate.predictor = predictor;
+		params->u.flate.columns = columns;
+		params->u.flate.colors = colors;
+		params->u.flate.bpc = bpc;
+	}
+
+	return params->type != FZ_IMAGE_UNKNOWN;
+}
+
+/*
+ * Load an image stream to be decoded when it is drawn. Every filter
+ * but the last is applied now. If we cannot run the last one later,
+ * the stream is loaded fully decoded instead, as FZ_IMAGE_RAW.
+ */
+fz_compressed_buffer *
+pdf_load_compressed_stream(pdf_document *xref, int num, int gen)
+{
+	fz_context *ctx = xref->ctx;
+	fz_compressed_buffer *bc;
+	fz_obj *dict, *filters, *params, *f, *p;
+	fz_stream *stm = NULL;
+	int i, n, len;
+
+	fz_var(stm);
+
+	dict = pdf_load_object(xref, num, gen);
+	/* RJW: "cannot load stream dictionary (%d %d R)", num, gen */
+
+	fz_try(ctx)
+	{
+		bc = fz_malloc_struct(ctx, fz_compressed_buffer);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_obj(dict);
+		fz_rethrow(ctx);
+	}
+
+	fz_try(ctx)
+	{
+		filters = fz_dict_getsa(dict, "Filter", "F");
+		params = fz_dict_getsa(dict, "DecodeParms", "DP");
+		len = fz_to_int(fz_dict_gets(dict, "Length"));
+
+		if (fz_is_name(filters))
+		{
+			n = 1;
+			f = filters;
+			p = params;
+		}
+		else
+		{
+			n = fz_array_len(filters);
+			f = fz_array_get(filters, n - 1);
+			p = fz_array_get(params, n - 1);
+		}
+
+		if (n > 0 && build_compression_params(f, p, &bc->params))
+		{
+			stm = pdf_open_raw_stream(xref, num, gen);
+			for (i = 0; i < n - 1; i++)
+				stm = build_filter(stm, xref, fz_array_get(filters, i), fz_array_get(params, i), num, gen);
+			bc->buffer = fz_read_all(stm, len);
+		}
+		else
+		{
+			bc->params.type = FZ_IMAGE_RAW;
+			bc->buffer = pdf_load_stream(xref, num, gen);
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_close(stm);
+		fz_drop_obj(dict);
+	}
+	fz_catch(ctx)
+	{
+		fz_free_compressed_buffer(ctx, bc);
+		fz_throw(ctx, "cannot load image stream (%d %d R)", num, gen);
+	}
+
+	return bc;
+}
+
 static int
 pdf_guess_filter_length(int len, char *filter)
 {
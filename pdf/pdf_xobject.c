@@ -13,7 +13,7 @@ pdf_drop_xobject(fz_context *ctx, pdf_xobject *xobj)
 	fz_drop_storable(ctx, &xobj->storable);
 }
 
-static void
+void
 pdf_free_xobject_imp(fz_context *ctx, fz_storable *xobj_)
 {
 	pdf_xobject *xobj = (pdf_xobject *)xobj_;
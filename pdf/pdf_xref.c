@@ -174,6 +174,8 @@ pdf_resize_xref(pdf_document *xref, int newlen)
 		xref->table[i].gen = 0;
 		xref->table[i].stm_ofs = 0;
 		xref->table[i].obj = NULL;
+		xref->table[i].used = 0;
+		xref->table[i].dirty = 0;
 	}
 	xref->len = newlen;
 }
@@ -437,29 +439,69 @@ pdf_read_xref_sections(pdf_document *xref, int ofs, char *buf, int cap)
 }
 
 /*
- * load xref tables from pdf
+ * linearized files
  */
 
-static void
-pdf_load_xref(pdf_document *xref, char *buf, int bufsize)
+/* Look for a linearization dictionary at the start of the file. If the
+ * file has not been updated since it was linearized, start reading the
+ * xref at the first-page xref that follows the dictionary. */
+static int
+pdf_read_linearization(pdf_document *xref, char *buf, int cap)
 {
-	fz_obj *size;
-	int i;
 	fz_context *ctx = xref->ctx;
+	fz_obj *dict = NULL;
+	fz_obj *hint;
+	int num, gen, stm_ofs, ofs;
 
-	pdf_load_version(xref);
+	fz_var(dict);
 
-	pdf_read_start_xref(xref);
+	fz_seek(xref->file, 0, 2);
+	xref->file_size = fz_tell(xref->file);
 
-	pdf_read_trailer(xref, buf, bufsize);
+	fz_try(ctx)
+	{
+		fz_seek(xref->file, 0, 0);
+		fz_read_line(xref->file, buf, cap);
 
-	size = fz_dict_gets(xref->trailer, "Size");
-	if (!size)
-		fz_throw(ctx, "trailer missing Size entry");
+		/* Send NULL xref so we don't try to resolve references */
+		dict = pdf_parse_ind_obj(NULL, xref->file, buf, cap, &num, &gen, &stm_ofs);
+		while (iswhite(fz_peek_byte(xref->file)))
+			fz_read_byte(xref->file);
+		ofs = fz_tell(xref->file);
+
+		hint = fz_dict_gets(dict, "H");
+		if (ofs < 1024 && stm_ofs == 0 &&
+			fz_dict_gets(dict, "Linearized") &&
+			fz_to_int(fz_dict_gets(dict, "L")) == xref->file_size &&
+			fz_to_int(fz_dict_gets(dict, "N")) > 0 &&
+			fz_to_int(fz_dict_gets(dict, "O")) > 0 &&
+			fz_array_len(hint) >= 2)
+		{
+			xref->startxref = ofs;
+			xref->linear_page_count = fz_to_int(fz_dict_gets(dict, "N"));
+			xref->linear_page1 = fz_to_int(fz_dict_gets(dict, "O"));
+			xref->linear_hint_ofs = fz_to_int(fz_array_get(hint, 0));
+			xref->linear_hint_len = fz_to_int(fz_array_get(hint, 1));
+		}
+	}
+	fz_catch(ctx)
+	{
+		/* Not linearized, or not usefully so */
+	}
 
-	pdf_resize_xref(xref, fz_to_int(size));
+	fz_drop_obj(dict);
+	return xref->linear_page_count > 0;
+}
+
+/*
+ * load xref tables from pdf
+ */
 
-	pdf_read_xref_sections(xref, xref->startxref, buf, bufsize);
+void
+pdf_check_xref(pdf_document *xref)
+{
+	int i;
+	fz_context *ctx = xref->ctx;
 
 	/* broken pdfs where first object is not free */
 	if (xref->table[0].type != 'f')
@@ -478,8 +520,155 @@ pdf_load_xref(pdf_document *xref, char *buf, int bufsize)
 				fz_throw(ctx, "object offset out of range: %d (%d 0 R)", xref->table[i].ofs, i);
 		}
 		if (xref->table[i].type == 'o')
+		{
+			/* the object stream may be listed in the main xref */
+			if (xref->main_xref && xref->table[i].ofs > 0 && xref->table[i].ofs < xref->len &&
+				xref->table[xref->table[i].ofs].type == 0)
+				continue;
 			if (xref->table[i].ofs <= 0 || xref->table[i].ofs >= xref->len || xref->table[xref->table[i].ofs].type != 'n')
 				fz_throw(ctx, "invalid reference to an objstm that does not exist: %d (%d 0 R)", xref->table[i].ofs, i);
+		}
+	}
+}
+
+static void
+pdf_load_xref(pdf_document *xref, char *buf, int bufsize)
+{
+	fz_obj *size;
+	fz_obj *prev;
+	fz_context *ctx = xref->ctx;
+
+	pdf_load_version(xref);
+
+	if (!pdf_read_linearization(xref, buf, bufsize))
+		pdf_read_start_xref(xref);
+
+	pdf_read_trailer(xref, buf, bufsize);
+
+	size = fz_dict_gets(xref->trailer, "Size");
+	if (!size)
+		fz_throw(ctx, "trailer missing Size entry");
+
+	pdf_resize_xref(xref, fz_to_int(size));
+
+	/* The first-page xref is enough to show the first page; the rest
+	 * is read when an object it does not list is wanted. */
+	prev = fz_dict_gets(xref->trailer, "Prev");
+	if (xref->linear_page_count && fz_to_int(prev) > 0 && !fz_dict_gets(xref->trailer, "XRefStm"))
+	{
+		fz_drop_obj(pdf_read_xref(xref, xref->startxref, buf, bufsize));
+		xref->main_xref = fz_to_int(prev);
+
+		/* the main xref lists object 0, which is always free */
+		if (xref->table[0].type == 0)
+		{
+			xref->table[0].type = 'f';
+			xref->table[0].gen = 65535;
+		}
+	}
+	else
+	{
+		pdf_read_xref_sections(xref, xref->startxref, buf, bufsize);
+	}
+
+	pdf_check_xref(xref);
+}
+
+/*
+	Rebuild the xref of a linearized file whose main xref is broken.
+	The first-page trailer stays in use, since pointers into it may be
+	held, and the linearization data is no longer trusted. Called with
+	the file lock held.
+*/
+static void
+pdf_repair_main_xref(pdf_document *xref, char *buf, int cap)
+{
+	fz_context *ctx = xref->ctx;
+	fz_obj *trailer = xref->trailer;
+	fz_obj *repaired;
+
+	xref->linear_page_count = 0;
+	xref->hints_loaded = -1;
+	xref->repaired = 1;
+
+	xref->trailer = NULL;
+	fz_try(ctx)
+	{
+		pdf_repair_xref(xref, buf, cap);
+	}
+	fz_always(ctx)
+	{
+		repaired = xref->trailer;
+		xref->trailer = trailer;
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_obj(repaired);
+		fz_rethrow(ctx);
+	}
+
+	fz_dict_puts(trailer, "Size", fz_dict_gets(repaired, "Size"));
+	if (!fz_dict_gets(trailer, "Info") && fz_dict_gets(repaired, "Info"))
+		fz_dict_puts(trailer, "Info", fz_dict_gets(repaired, "Info"));
+	fz_drop_obj(repaired);
+}
+
+void
+pdf_load_main_xref(pdf_document *xref)
+{
+	fz_context *ctx = xref->ctx;
+	char *buf = NULL;
+	int cap = sizeof xref->scratch;
+	int ofs = xref->main_xref;
+	int repaired = 0;
+
+	if (!ofs)
+		return;
+
+	fz_var(buf);
+	fz_var(repaired);
+
+	/* Only try once; on failure we make do with what we have */
+	xref->main_xref = 0;
+
+	fz_lock(ctx, FZ_LOCK_FILE);
+	fz_try(ctx)
+	{
+		buf = fz_malloc(ctx, cap);
+		fz_try(ctx)
+		{
+			pdf_read_xref_sections(xref, ofs, buf, cap);
+			pdf_check_xref(xref);
+		}
+		fz_catch(ctx)
+		{
+			fz_warn(ctx, "cannot read main xref (ofs=%d); trying to repair", ofs);
+			repaired = 1;
+			pdf_repair_main_xref(xref, buf, cap);
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_unlock(ctx, FZ_LOCK_FILE);
+		fz_free(ctx, buf);
+	}
+	fz_catch(ctx)
+	{
+		fz_warn(ctx, "cannot repair xref; some objects may be missing");
+		repaired = 0;
+	}
+
+	/* Objects in object streams are found by loading the streams */
+	if (repaired)
+	{
+		fz_try(ctx)
+		{
+			pdf_repair_obj_stms(xref);
+		}
+		fz_catch(ctx)
+		{
+			fz_warn(ctx, "cannot repair object streams; some objects may be missing");
+		}
 	}
 }
 
@@ -659,7 +848,8 @@ pdf_open_document_with_stream(fz_stream *file)
 	fz_obj *dict = NULL;
 	fz_obj *obj;
 	fz_obj *nobj = NULL;
-	int i, repaired = 0;
+	int i, repaired = 0, indexed = 0;
+	unsigned char index_key[16];
 	int locked;
 	fz_context *ctx = file->ctx;
 
@@ -670,18 +860,31 @@ pdf_open_document_with_stream(fz_stream *file)
 	/* install pdf specific callback */
 	fz_resolve_indirect = pdf_resolve_indirect;
 
+	fz_set_store_type_name(ctx, pdf_free_font_imp, "font");
+	fz_set_store_type_name(ctx, pdf_free_cmap_imp, "cmap");
+	fz_set_store_type_name(ctx, pdf_free_function_imp, "function");
+	fz_set_store_type_name(ctx, pdf_free_pattern_imp, "pattern");
+	fz_set_store_type_name(ctx, pdf_free_xobject_imp, "xobject");
+	fz_set_store_type_name(ctx, pdf_free_image_imp, "image");
+	fz_set_store_type_name(ctx, pdf_free_compiled_stream_imp, "compiled stream");
+
 	xref = fz_malloc_struct(ctx, pdf_document);
 	pdf_init_document(xref);
 
 	xref->file = fz_keep_stream(file);
 	xref->ctx = ctx;
+	xref->obj_cache_max = PDF_OBJECT_CACHE_DEFAULT;
+
+	if (ctx->disk_cache && pdf_xref_index_key(xref, index_key))
+		indexed = pdf_load_xref_index(xref, index_key);
 
 	fz_lock(ctx, FZ_LOCK_FILE);
 	locked = 1;
 
 	fz_try(ctx)
 	{
-		pdf_load_xref(xref, xref->scratch, sizeof xref->scratch);
+		if (!indexed)
+			pdf_load_xref(xref, xref->scratch, sizeof xref->scratch);
 	}
 	fz_catch(ctx)
 	{
@@ -696,8 +899,11 @@ pdf_open_document_with_stream(fz_stream *file)
 			fz_drop_obj(xref->trailer);
 			xref->trailer = NULL;
 		}
+		xref->main_xref = 0;
+		xref->linear_page_count = 0;
 		fz_warn(xref->ctx, "trying to repair broken xref");
 		repaired = 1;
+		xref->repaired = 1;
 	}
 
 	fz_try(ctx)
@@ -790,6 +996,9 @@ pdf_open_document_with_stream(fz_stream *file)
 		fz_warn(ctx, "Ignoring Broken Optional Content");
 	}
 
+	if (ctx->disk_cache && !indexed && pdf_xref_index_key(xref, index_key))
+		pdf_save_xref_index(xref, index_key);
+
 	return xref;
 }
 
@@ -830,6 +1039,11 @@ pdf_close_document(pdf_document *xref)
 		fz_free(ctx, xref->page_refs);
 	}
 
+	fz_free(ctx, xref->hint_pages);
+
+	fz_close(xref->obj_reader);
+	fz_free(ctx, xref->obj_lexbuf);
+
 	if (xref->file)
 		fz_close(xref->file);
 	if (xref->trailer)
@@ -922,11 +1136,14 @@ pdf_load_obj_stm(pdf_document *xref, int num, int gen, char *buf, int cap)
 				fz_throw(ctx, "object id (%d 0 R) out of range (0..%d)", numbuf[i], xref->len - 1);
 			}
 
-			if (xref->table[numbuf[i]].type == 'o' && xref->table[numbuf[i]].ofs == num)
+			/* Objects still cached from an earlier load of the
+			 * stream may be in use; keep those. */
+			if (xref->table[numbuf[i]].type == 'o' && xref->table[numbuf[i]].ofs == num &&
+				!xref->table[numbuf[i]].obj)
 			{
-				if (xref->table[numbuf[i]].obj)
-					fz_drop_obj(xref->table[numbuf[i]].obj);
 				xref->table[numbuf[i]].obj = obj;
+				xref->table[numbuf[i]].used = 1;
+				xref->obj_cache_count++;
 			}
 			else
 			{
@@ -951,12 +1168,76 @@ pdf_load_obj_stm(pdf_document *xref, int num, int gen, char *buf, int cap)
  * object loading
  */
 
+/*
+	Objects are read through a reader and lexer buffer of their own,
+	rather than xref->file and xref->scratch, so that loading one does
+	not disturb streams open on the file or other loads in progress.
+	The document keeps one of each for reuse; only a load nested in
+	another (through an object stream) makes new ones. They are taken
+	and given back without a lock, since a document may only be used
+	by one thread at a time.
+*/
+static fz_stream *
+pdf_take_obj_reader(pdf_document *xref, int ofs)
+{
+	fz_stream *file = xref->obj_reader;
+
+	if (!file)
+		return fz_reopen_stream(xref->ctx, xref->file, ofs);
+	xref->obj_reader = NULL;
+	fz_try(xref->ctx)
+	{
+		fz_seek(file, ofs, 0);
+	}
+	fz_catch(xref->ctx)
+	{
+		fz_close(file);
+		fz_rethrow(xref->ctx);
+	}
+	return file;
+}
+
+static void
+pdf_give_obj_reader(pdf_document *xref, fz_stream *file)
+{
+	if (file && !xref->obj_reader)
+		xref->obj_reader = file;
+	else
+		fz_close(file);
+}
+
+static char *
+pdf_take_obj_lexbuf(pdf_document *xref)
+{
+	char *buf = xref->obj_lexbuf;
+
+	if (!buf)
+		return fz_malloc(xref->ctx, sizeof xref->scratch);
+	xref->obj_lexbuf = NULL;
+	return buf;
+}
+
+static void
+pdf_give_obj_lexbuf(pdf_document *xref, char *buf)
+{
+	if (buf && !xref->obj_lexbuf)
+		xref->obj_lexbuf = buf;
+	else
+		fz_free(xref->ctx, buf);
+}
+
 void
 pdf_cache_object(pdf_document *xref, int num, int gen)
 {
 	pdf_xref_entry *x;
 	int rnum, rgen;
 	fz_context *ctx = xref->ctx;
+	fz_stream *file = NULL;
+	char *buf = NULL;
+	int cap = sizeof xref->scratch;
+
+	if (xref->main_xref && (num >= xref->len || (num >= 0 && xref->table[num].type == 0)))
+		pdf_load_main_xref(xref);
 
 	if (num < 0 || num >= xref->len)
 		fz_throw(ctx, "object out of range (%d %d R); xref size %d", num, gen, xref->len);
@@ -964,26 +1245,36 @@ pdf_cache_object(pdf_document *xref, int num, int gen)
 	x = &xref->table[num];
 
 	if (x->obj)
+	{
+		x->used = 1;
 		return;
+	}
 
 	if (x->type == 'f')
 	{
 		x->obj = fz_new_null(ctx);
+		x->used = 1;
+		xref->obj_cache_count++;
 		return;
 	}
 	else if (x->type == 'n')
 	{
-		fz_lock(ctx, FZ_LOCK_FILE);
-		fz_seek(xref->file, x->ofs, 0);
+		fz_var(file);
+		fz_var(buf);
 
 		fz_try(ctx)
 		{
-			x->obj = pdf_parse_ind_obj(xref, xref->file, xref->scratch, sizeof xref->scratch,
-					&rnum, &rgen, &x->stm_ofs);
+			buf = pdf_take_obj_lexbuf(xref);
+			file = pdf_take_obj_reader(xref, x->ofs);
+			x->obj = pdf_parse_ind_obj(xref, file, buf, cap, &rnum, &rgen, &x->stm_ofs);
+		}
+		fz_always(ctx)
+		{
+			pdf_give_obj_reader(xref, file);
+			pdf_give_obj_lexbuf(xref, buf);
 		}
 		fz_catch(ctx)
 		{
-			fz_unlock(ctx, FZ_LOCK_FILE);
 			fz_throw(ctx, "cannot parse object (%d %d R)", num, gen);
 		}
 
@@ -991,21 +1282,29 @@ pdf_cache_object(pdf_document *xref, int num, int gen)
 		{
 			fz_drop_obj(x->obj);
 			x->obj = NULL;
-			fz_unlock(ctx, FZ_LOCK_FILE);
 			fz_throw(ctx, "found object (%d %d R) instead of (%d %d R)", rnum, rgen, num, gen);
 		}
 
 		if (xref->crypt)
 			pdf_crypt_obj(ctx, xref->crypt, x->obj, num, gen);
-		fz_unlock(ctx, FZ_LOCK_FILE);
+
+		x->used = 1;
+		xref->obj_cache_count++;
 	}
 	else if (x->type == 'o')
 	{
 		if (!x->obj)
 		{
+			fz_var(buf);
+
 			fz_try(ctx)
 			{
-				pdf_load_obj_stm(xref, x->ofs, 0, xref->scratch, sizeof xref->scratch);
+				buf = pdf_take_obj_lexbuf(xref);
+				pdf_load_obj_stm(xref, x->ofs, 0, buf, cap);
+			}
+			fz_always(ctx)
+			{
+				pdf_give_obj_lexbuf(xref, buf);
 			}
 			fz_catch(ctx)
 			{
@@ -1090,12 +1389,78 @@ pdf_update_object(pdf_document *xref, int num, int gen, fz_obj *newobj)
 
 	x = &xref->table[num];
 
+	/* newobj may be the object already there, changed in place */
+	fz_keep_obj(newobj);
 	if (x->obj)
+	{
+		if (!x->dirty)
+			xref->obj_cache_count--;
 		fz_drop_obj(x->obj);
+	}
 
-	x->obj = fz_keep_obj(newobj);
+	x->obj = newobj;
 	x->type = 'n';
 	x->ofs = 0;
+	x->gen = gen;
+	x->dirty = 1;
+}
+
+/* Mark a cached object as changed in place. It then no longer counts
+ * against the cache budget, since it can never be dropped. */
+void
+pdf_set_object_dirty(pdf_document *xref, int num)
+{
+	pdf_xref_entry *x = &xref->table[num];
+
+	if (x->obj && !x->dirty)
+		xref->obj_cache_count--;
+	x->dirty = 1;
+}
+
+void
+pdf_set_object_cache_size(pdf_document *xref, int max)
+{
+	xref->obj_cache_max = max;
+}
+
+/*
+	Sweep the table like a clock, giving objects that have been looked
+	up since the last pass a second chance. Objects with references
+	other than the table's own are in use and stay, as do changed ones.
+	Trimming goes down to three quarters of the budget so that we do
+	not sweep again on the next page.
+*/
+void
+pdf_trim_object_cache(pdf_document *xref)
+{
+	pdf_xref_entry *x;
+	int target, i;
+
+	if (xref->obj_cache_max <= 0 || xref->obj_cache_count <= xref->obj_cache_max)
+		return;
+
+	target = xref->obj_cache_max - xref->obj_cache_max / 4;
+
+	for (i = 0; i < 2 * xref->len && xref->obj_cache_count > target; i++)
+	{
+		if (xref->obj_cache_hand >= xref->len)
+			xref->obj_cache_hand = 0;
+		x = &xref->table[xref->obj_cache_hand++];
+
+		if (!x->obj || x->dirty)
+			continue;
+		if (x->used)
+		{
+			x->used = 0;
+			continue;
+		}
+		if (fz_obj_refs(x->obj) > 1)
+			continue;
+
+		fz_drop_obj(x->obj);
+		x->obj = NULL;
+		xref->obj_cache_count--;
+	}
 }
 
 /*
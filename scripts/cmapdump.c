@@ -220,3 +220,16 @@ fz_glyph_cache *fz_keep_glyph_cache(fz_context *ctx)
 {
 	return NULL;
 }
+
+void fz_drop_disk_cache_context(fz_context *ctx)
+{
+}
+
+fz_disk_cache *fz_keep_disk_cache(fz_context *ctx)
+{
+	return NULL;
+}
+
+void fz_free_ft_context(fz_context *ctx)
+{
+}
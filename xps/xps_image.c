@@ -28,6 +28,7 @@ xps_paint_image_brush(xps_document *doc, fz_matrix ctm, fz_rect area, char *base
 	xml_element *root, void *vimage)
 {
 	fz_pixmap *pixmap = vimage;
+	fz_image *image;
 	float xs, ys;
 
 	if (pixmap->xres == 0 || pixmap->yres == 0)
@@ -35,7 +36,19 @@ xps_paint_image_brush(xps_document *doc, fz_matrix ctm, fz_rect area, char *base
 	xs = pixmap->w * 96 / pixmap->xres;
 	ys = pixmap->h * 96 / pixmap->yres;
 	ctm = fz_concat(fz_scale(xs, ys), ctm);
-	fz_fill_image(doc->dev, pixmap, ctm, doc->opacity[doc->opacity_top]);
+	image = fz_new_image_from_pixmap(doc->ctx, fz_keep_pixmap(doc->ctx, pixmap), NULL);
+	fz_try(doc->ctx)
+	{
+		fz_fill_image(doc->dev, image, ctm, doc->opacity[doc->opacity_top]);
+	}
+	fz_always(doc->ctx)
+	{
+		fz_drop_image(doc->ctx, image);
+	}
+	fz_catch(doc->ctx)
+	{
+		fz_rethrow(doc->ctx);
+	}
 }
 
 static xps_part *